@@ -90,6 +90,7 @@ percpu_per_cpu_init (void)
     if (ad[i].fPresent == 0)
       break;
   if (i == 256) panic ("out of GDT");
+  if (global_pcpu_id >= MAX_CPUS) panic ("too many CPUs");
 
   uint start_frame = alloc_phys_frames (pages);
   if (start_frame == -1) panic ("out of physical RAM");
@@ -0,0 +1,69 @@
+/*                    The Quest Operating System
+ *  Copyright (C) 2005-2012  Richard West, Boston University
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "kernel.h"
+#include "arch/i386.h"
+#include "arch/i386-sysenter.h"
+#include "util/cpuid.h"
+#include "util/debug.h"
+
+//#define DEBUG_SYSENTER
+
+#ifdef DEBUG_SYSENTER
+#define DLOG(fmt,...) DLOG_PREFIX("sysenter",fmt,##__VA_ARGS__)
+#else
+#define DLOG(fmt,...) ;
+#endif
+
+bool sysenter_enabled = FALSE;
+
+/* Program the SYSENTER MSRs of this CPU.  The BSP decides whether the
+ * fast entry is used at all; every CPU runs this after its per-CPU TSS
+ * has been set up.
+ *
+ * SYSENTER loads %esp from IA32_SYSENTER_ESP, which must be the
+ * kernel stack of whichever task is running.  update_CPU_TSS () keeps
+ * it equal to ESP0 of the per-CPU TSS. */
+void
+sysenter_init (void)
+{
+  extern void sysenter_entry (void);
+  int cpu = get_pcpu_id ();
+
+  if (cpu == 0)
+    sysenter_enabled = cpuid_sep_support ();
+  if (!sysenter_enabled)
+    return;
+
+  wrmsr (IA32_SYSENTER_CS, 0x08);
+  wrmsr (IA32_SYSENTER_EIP, (u32) sysenter_entry);
+  wrmsr (IA32_SYSENTER_ESP, cpuTSS[cpu].ulESP0);
+  DLOG ("CPU %d: entry=0x%p esp=0x%X", cpu, sysenter_entry,
+        cpuTSS[cpu].ulESP0);
+}
+
+
+/*
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * mode: C
+ * c-file-style: "gnu"
+ * c-basic-offset: 2
+ * End:
+ */
+
+/* vi: set et sw=2 sts=2: */
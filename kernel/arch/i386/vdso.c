@@ -0,0 +1,191 @@
+/*                    The Quest Operating System
+ *  Copyright (C) 2005-2012  Richard West, Boston University
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "kernel.h"
+#include "arch/i386.h"
+#include "arch/i386-div64.h"
+#include "arch/i386-sysenter.h"
+#include "arch/i386-vdso.h"
+#include "mem/physical.h"
+#include "mem/virtual.h"
+#include "smp/smp.h"
+#include "util/printf.h"
+#include "util/debug.h"
+
+//#define DEBUG_VDSO
+
+#ifdef DEBUG_VDSO
+#define DLOG(fmt,...) DLOG_PREFIX("vdso",fmt,##__VA_ARGS__)
+#else
+#define DLOG(fmt,...) ;
+#endif
+
+/* The vDSO frame is shared by every address space.  User page tables
+ * map it marked PTE_PCACHE, like a page cache frame: fork shares it,
+ * and exit and exec leave the frame alone.  Exec builds a new address
+ * space, so it maps the page again. */
+static frame_t vdso_frame = -1;
+
+/* Kernel copy of the page, for the get_time syscall */
+static struct vdso_data vdso_kern;
+
+/* CMOS real-time clock */
+#define RTC_INDEX 0x70
+#define RTC_DATA  0x71
+
+static u32
+rtc_read (u8 reg)
+{
+  outb (reg, RTC_INDEX);
+  return inb (RTC_DATA);
+}
+
+static u32
+bcd_to_bin (u32 v)
+{
+  return (v & 0xF) + (v >> 4) * 10;
+}
+
+/* Wall-clock seconds since the epoch, from the real-time clock.
+ * Assumes the clock keeps UTC, in the 21st century. */
+static u32
+rtc_epoch (void)
+{
+  u32 sec, min, hour, day, mon, year, regb, doy, doe;
+  bool pm;
+  int i;
+
+  /* Wait out an update in progress */
+  for (i = 0; i < 1000000 && (rtc_read (0x0A) & 0x80); i++);
+
+  sec = rtc_read (0x00);
+  min = rtc_read (0x02);
+  hour = rtc_read (0x04);
+  day = rtc_read (0x07);
+  mon = rtc_read (0x08);
+  year = rtc_read (0x09);
+  regb = rtc_read (0x0B);
+
+  pm = hour & 0x80;
+  hour &= 0x7F;
+  if (!(regb & 0x04)) {         /* BCD */
+    sec = bcd_to_bin (sec);
+    min = bcd_to_bin (min);
+    hour = bcd_to_bin (hour);
+    day = bcd_to_bin (day);
+    mon = bcd_to_bin (mon);
+    year = bcd_to_bin (year);
+  }
+  if (!(regb & 0x02)) {         /* 12-hour clock */
+    hour %= 12;
+    if (pm)
+      hour += 12;
+  }
+  if (mon < 1 || mon > 12 || day < 1 || day > 31)
+    return 0;
+  year += 2000;
+
+  /* Days since 1970-01-01, counting years from March so that the
+   * leap day comes last */
+  if (mon <= 2)
+    year--;
+  doy = (153 * (mon > 2 ? mon - 3 : mon + 9) + 2) / 5 + day - 1;
+  doe = (year % 400) * 365 + (year % 400) / 4 - (year % 400) / 100 + doy;
+  return ((year / 400) * 146097 + doe - 719468) * 86400
+    + hour * 3600 + min * 60 + sec;
+}
+
+/* Fill in the vDSO page.  Runs on the BSP once the TSC is calibrated
+ * and SYSENTER is set up, before the first user address space is
+ * built. */
+void
+vdso_init (void)
+{
+  struct vdso_data *page;
+  u64 now;
+
+  vdso_frame = alloc_phys_frame ();
+  if (vdso_frame == -1)
+    panic ("vdso_init: out of memory");
+
+  vdso_kern.sysenter = sysenter_enabled;
+  vdso_kern.tsc_freq = tsc_freq;
+  vdso_kern.boot_sec = rtc_epoch ();
+  RDTSC (now);
+  vdso_kern.tsc_base = now;
+
+  page = map_virtual_page (vdso_frame | 3);
+  memset (page, 0, 0x1000);
+  memcpy (page, &vdso_kern, sizeof (vdso_kern));
+  unmap_virtual_page (page);
+
+  DLOG ("frame=0x%X sysenter=%d boot_sec=%d", vdso_frame,
+        vdso_kern.sysenter, vdso_kern.boot_sec);
+}
+
+/* Map the vDSO page, read-only, into the address space whose page
+ * directory is mapped at pgdir. */
+bool
+vdso_map (u32 *pgdir)
+{
+  u32 pde = VDSO_ADDR >> 22, pte = (VDSO_ADDR >> 12) & 0x3FF;
+  frame_t tbl_frame;
+  u32 *tbl;
+
+  if (vdso_frame == -1)
+    return FALSE;
+
+  if (!pgdir[pde]) {
+    tbl_frame = alloc_phys_frame ();
+    if (tbl_frame == -1)
+      return FALSE;
+    tbl = map_virtual_page (tbl_frame | 3);
+    memset (tbl, 0, 0x1000);
+    pgdir[pde] = tbl_frame | 7;
+  } else
+    tbl = map_virtual_page ((pgdir[pde] & 0xFFFFF000) | 3);
+
+  tbl[pte] = vdso_frame | PTE_PCACHE | 5;
+  unmap_virtual_page (tbl);
+  return TRUE;
+}
+
+/* Time of day, computed as user-level does from the vDSO page */
+void
+vdso_get_time (u32 *sec, u32 *usec)
+{
+  u64 now, s;
+
+  RDTSC (now);
+  now -= vdso_kern.tsc_base;
+  s = div64_64 (now, vdso_kern.tsc_freq);
+  *sec = vdso_kern.boot_sec + (u32) s;
+  *usec = (u32) div64_64 ((now - s * vdso_kern.tsc_freq) * 1000000LL,
+                          vdso_kern.tsc_freq);
+}
+
+
+/*
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * mode: C
+ * c-file-style: "gnu"
+ * c-basic-offset: 2
+ * End:
+ */
+
+/* vi: set et sw=2 sts=2: */
@@ -18,6 +18,8 @@
 #include "boot/multiboot.h"
 #include "arch/i386.h"
 #include "arch/i386-percpu.h"
+#include "arch/i386-sysenter.h"
+#include "arch/i386-vdso.h"
 #include "util/cpuid.h"
 #include "kernel.h"
 #include "fs/filesys.h"
@@ -86,6 +88,21 @@ alloc_CPU_TSS (tss *tssp)
 
 }
 
+/* Zeroed, page-aligned memory for a table with one entry per CPU */
+static void *
+alloc_cpu_table (uint32 size)
+{
+  uint32 pages = (size + 0xFFF) >> 12;
+  uint32 frame = alloc_phys_frames (pages);
+  void *table;
+
+  if (frame == -1) panic ("out of physical RAM");
+  table = map_contiguous_virtual_pages (frame | 3, pages);
+  if (table == NULL) panic ("out of virtual RAM");
+  memset (table, 0, pages << 12);
+  return table;
+}
+
 /* Create an address space for boot modules */
 static quest_tss *
 load_module (multiboot_module * pmm, int mod_num)
@@ -149,6 +166,9 @@ load_module (multiboot_module * pmm, int mod_num)
 #endif
   map_malloc_paging_structures((pgdir_entry_t*)plPageDirectory, 0);
   map_dma_page_tables((pgdir_entry_t*)plPageDirectory, 0);
+  physmap_map (plPageDirectory);
+  if (!vdso_map (plPageDirectory))
+    panic ("load_module: vdso_map failed");
 
   /* Populate ring 3 page directory with entries for its private address
      space */
@@ -577,6 +597,10 @@ init (multiboot * pmb)
    *  marked in the mm_table
    */
 
+  /* Permanent mapping of low physical memory, before any address
+   * space is built from this one */
+  physmap_init ();
+
   init_interrupt_handlers ();
 
   /* Initialise the programmable interrupt controller (PIC) */
@@ -604,6 +628,9 @@ init (multiboot * pmb)
 #else
   initialise_fpu_and_mmx();
 #endif
+
+  /* Copy-on-write pages are read-only to the kernel too */
+  enable_write_protect ();
   
   /* Setup per-CPU area for bootstrap CPU */
   percpu_per_cpu_init ();
@@ -619,11 +646,22 @@ init (multiboot * pmb)
   }
 
   /* Create CPU and IDLE TSSes */
+  cpuTSS = alloc_cpu_table (num_cpus * sizeof (tss));
+  cpuTSS_selector = alloc_cpu_table (num_cpus * sizeof (uint16));
+  idleTSS = alloc_cpu_table (num_cpus * sizeof (quest_tss));
+  idleTSS_selector = alloc_cpu_table (num_cpus * sizeof (quest_tss *));
   for (i = 0; i < num_cpus; i++) {
     cpuTSS_selector[i] = alloc_CPU_TSS (&cpuTSS[i]);
     idleTSS_selector[i] = alloc_idle_TSS (i);
   }
 
+  /* Fast syscall entry and the vDSO page, before any user address
+   * space is built */
+  sysenter_init ();
+  vdso_init ();
+  tlb_cpu_init ();
+  kmap_cpu_init ();
+
   /* Load modules from GRUB */
   if (!pmb->mods_count)
     panic ("No modules available");
@@ -672,6 +710,7 @@ init (multiboot * pmb)
   /* Release physical memory region occupied by modules. They are already relocated. */
   com1_printf ("Releasing module memory...\n");
   mm_module (pmb, MM_MODULE_UNMASK);
+  phys_frames_resync ();
 
 #ifdef SERIAL_MMIO32
   com1_printf ("Remapping MMIO32 serial base...\n");
@@ -796,6 +835,7 @@ init (multiboot * pmb)
    * necessary. */
 
   ltr (tss[0]);
+  tlb_note_cr3 (tss[0]->CR3);
   /* task-switch to shell module */
 
   asm volatile ("jmp _sw_init_user_task"::"D" (tss[0]));
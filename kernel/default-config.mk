@@ -9,12 +9,18 @@ OPT = 0
 # Disable "logger" thread
 CFG += -DNO_LOGGER
 
+# Also copy logger output to shared memory for other sandboxes (USE_VMX)
+# CFG += -DLOGGER_SHM
+
 # Disable ACPI support
 # CFG += -DNO_ACPI
 
 # Disable Intel Multiprocessor Specification parsing
 # CFG += -DNO_INTEL_MPS
 
+# Keep the local APICs in xAPIC mode even if x2APIC is available
+# CFG += -DNO_X2APIC
+
 # Use VMX-based virtual machines for isolation
 # CFG += -DUSE_VMX
 
@@ -34,11 +40,6 @@ CFG += -DNO_LOGGER
 KMALLOC = tlsf
 #KMALLOC = pow2
 
-# Read the entire file into memory on the call to open, makes
-# subsequent read calls much faster but must store the entire file in
-# the kernel heap
-#CFG += -DONE_FILE_READ
-
 # Enable Linux sandbox
 # CFG += -DUSE_LINUX_SANDBOX
 
@@ -23,6 +23,8 @@
 #include "smp/apic.h"
 #include "sched/sched.h"
 #include "sched/vcpu.h"
+#include "drivers/pci/pci.h"
+#include "mem/mem.h"
 #include "kernel.h"
 
 //#define DEBUG_ATA
@@ -92,8 +94,32 @@ static quest_tss *ata_current_task = NULL;
 /* waitqueue of tasks that want to use ATA. */
 static quest_tss *ata_waitqueue = NULL;
 
-/* technically I think there could be separate queues for each bus,
- * but, whatever. */
+/* ATA (disk) transfers do not take exclusive access.  They go through
+ * a request queue per bus, which is only dispatched while there is no
+ * ata_current_task, and ata_grab () waits for both buses to go idle.
+ * ATAPI keeps the exclusive protocol above. */
+typedef struct
+{
+  uint32 bus;                   /* ATA_BUS_PRIMARY or ATA_BUS_SECONDARY */
+  uint32 bm;                    /* bus-master registers, 0 if no DMA */
+  uint32 *prd, prd_phys;        /* PRD table, one page */
+  ata_req *queue;               /* waiting, sorted by lba */
+  ata_req *active;              /* being served, with its merged chain */
+  uint32 head;                  /* lba following the last dispatch */
+  bool dma;                     /* active command uses DMA */
+  bool flushing;                /* active write waits for FLUSH CACHE */
+  /* PIO position within the active chain */
+  ata_req *pio_req;
+  uint32 pio_off, pio_left, pio_block;
+} ata_channel;
+
+static ata_channel ata_channels[2] = {
+  { .bus = ATA_BUS_PRIMARY },
+  { .bus = ATA_BUS_SECONDARY }
+};
+
+#define ATA_CHANNEL(bus) \
+  (&ata_channels[(bus) == ATA_BUS_PRIMARY ? 0 : 1])
 
 /* Kernel lock should be held while using ATA */
 
@@ -103,13 +129,16 @@ ata_grab (void)
 {
   DLOG ("ata_grab() ata_current_task=%x ata_waitqueue=%x tr=%x",
         ata_current_task->tid, ata_waitqueue->tid, str ()->tid);
-  while (ata_current_task) {
+  while (ata_current_task || ata_channels[0].active ||
+         ata_channels[1].active) {
     queue_append (&ata_waitqueue, str ());
     schedule ();
   }
   ata_current_task = str ();
 }
 
+static void ata_dispatch (ata_channel *);
+
 static void
 ata_release (void)
 {
@@ -118,6 +147,9 @@ ata_release (void)
   wakeup_queue (&ata_waitqueue);
   ata_waitqueue = NULL;
   ata_current_task = NULL;
+  /* Restart requests queued in the meantime */
+  ata_dispatch (&ata_channels[0]);
+  ata_dispatch (&ata_channels[1]);
 }
 
 /* ATA specifies a 400ns delay after drive switching -- often
@@ -143,9 +175,10 @@ ata_drive_select (uint32 bus, uint32 drive)
 }
 
 /* Use the ATA IDENTIFY command to find out what kind of drive is
- * attached to the given bus/slot. */
+ * attached to the given bus/slot.  The capabilities of an ATA drive
+ * are recorded in info. */
 uint32
-ata_identify (uint32 bus, uint32 drive)
+ata_identify (uint32 bus, uint32 drive, ata_info *info)
 {
   uint8 status;
   uint16 buffer[256];
@@ -200,10 +233,22 @@ ata_identify (uint32 bus, uint32 drive)
   }
 #endif
 
-  if (buffer[83] & (1 << 10))
+  if (buffer[83] & (1 << 10)) {
     logger_printf ("LBA48 mode supported.\n");
+    info->lba48 = TRUE;
+  }
   logger_printf ("LBA48 addressable sectors: %.4X %.4X %.4X %.4X\n",
                  buffer[100], buffer[101], buffer[102], buffer[103]);
+  if (info->lba48 && (buffer[102] || buffer[103]))
+    info->sectors = 0xFFFFFFFF;
+  else if (info->lba48)
+    info->sectors = buffer[100] | ((uint32) buffer[101] << 16);
+  else
+    info->sectors = buffer[60] | ((uint32) buffer[61] << 16);
+  /* Word 49 bit 8: DMA supported.  Word 47 low byte: the largest
+   * block for READ/WRITE MULTIPLE. */
+  info->dma = (buffer[49] & (1 << 8)) != 0;
+  info->multiple = buffer[47] & 0xFF;
   return ATA_TYPE_PATA;
 
 guess_identity:{
@@ -232,82 +277,515 @@ guess_identity:{
 
 static void ata_poll_for_irq (uint32);
 
-/* Read a sector from the bus/drive using LBA into the given buffer
- * and return bytes read. */
-int
-ata_drive_read_sector (uint32 bus, uint32 drive, uint32 lba, uint8 * buffer)
+/* Status register */
+#define ATA_SR_BSY  0x80
+#define ATA_SR_DF   0x20
+#define ATA_SR_DRQ  0x08
+#define ATA_SR_ERR  0x01
+
+/* Bus-master command and status registers */
+#define ATA_BM_START      0x01
+#define ATA_BM_READ       0x08  /* device to memory */
+#define ATA_BM_SR_ACTIVE  0x01
+#define ATA_BM_SR_ERR     0x02
+#define ATA_BM_SR_IRQ     0x04
+
+/* A PRD entry is a physical address and a byte count (0 meaning
+ * 64KiB), and may not cross a 64KiB boundary. */
+#define ATA_PRD_ENTRIES   (0x1000 / 8)
+#define ATA_PRD_EOT       0x80000000
+
+/* Request layer counters */
+u32 ata_requests = 0, ata_merges = 0, ata_commands = 0;
+u32 ata_dma_commands = 0, ata_sectors = 0;
+
+static ata_info *
+ata_drive_info (uint32 bus, uint32 drive)
 {
-  uint8 status;
-  int ret;
-  ata_grab ();
-  outb (drive | 0x40 /* LBA */  | ((lba >> 24) & 0x0F),
-        ATA_DRIVE_SELECT (bus));
-  ATA_SELECT_DELAY (bus);
-  outb (0x1, ATA_SECTOR_COUNT (bus));
+  return &pata_drives[(bus == ATA_BUS_PRIMARY ? 0 : 2) +
+                      (drive == ATA_DRIVE_SLAVE ? 1 : 0)];
+}
+
+/* The IRQ handler serves a request under whatever address space is
+ * current, so the request and its buffer must lie in the kernel
+ * memory that every page directory shares: above user space, and not
+ * in the per-process kernel stack. */
+static bool
+ata_shared (void *p, uint32 len)
+{
+  uint32 first = (uint32) p >> BIGPAGE_SIZE_BITS;
+  uint32 last = ((uint32) p + len - 1) >> BIGPAGE_SIZE_BITS;
+
+  return len > 0 && first >= PGDIR_KERNEL_BEGIN && last >= first &&
+    (first > PGDIR_KERNEL_STACK || last < PGDIR_KERNEL_STACK);
+}
+
+/* Describe the buffers of the chain starting at r in the channel's PRD
+ * table.  Returns FALSE if they cannot be used for DMA. */
+static bool
+ata_build_prd (ata_channel *c, ata_req *r)
+{
+  uint32 n = 0, va, pa, len, chunk, *e = NULL;
+
+  for (; r; r = r->merged) {
+    va = (uint32) r->buf;
+    len = r->count * 512;
+    if (va & 1)
+      return FALSE;
+    while (len > 0) {
+      chunk = 0x1000 - (va & 0xFFF);
+      if (chunk > len)
+        chunk = len;
+      pa = (uint32) get_phys_addr ((void *) va);
+      if (e && e[0] + e[1] == pa &&
+          (e[0] & ~0xFFFF) == ((pa + chunk - 1) & ~0xFFFF))
+        /* physically contiguous: extend the previous entry */
+        e[1] += chunk;
+      else {
+        if (n == ATA_PRD_ENTRIES)
+          return FALSE;
+        e = &c->prd[2 * n++];
+        e[0] = pa;
+        e[1] = chunk;
+      }
+      va += chunk;
+      len -= chunk;
+    }
+  }
+  if (!e)
+    return FALSE;
+  e[1] |= ATA_PRD_EOT;
+  for (e = c->prd; n > 0; n--, e += 2)
+    e[1] &= ATA_PRD_EOT | 0xFFFF;
+  return TRUE;
+}
+
+/* Load the task file and issue cmd.  The EXT (48-bit) commands take
+ * the high bytes first through the same registers. */
+static void
+ata_issue (uint32 bus, uint32 drive, uint32 lba, uint32 count, bool ext,
+           uint8 cmd)
+{
+  if (ext) {
+    outb (drive | 0x40 /* LBA */ , ATA_DRIVE_SELECT (bus));
+    ATA_SELECT_DELAY (bus);
+    outb ((uint8) (count >> 8), ATA_SECTOR_COUNT (bus));
+    outb ((uint8) (lba >> 24), ATA_ADDRESS1 (bus));
+    outb (0, ATA_ADDRESS2 (bus));
+    outb (0, ATA_ADDRESS3 (bus));
+  } else {
+    outb (drive | 0x40 /* LBA */  | ((lba >> 24) & 0x0F),
+          ATA_DRIVE_SELECT (bus));
+    ATA_SELECT_DELAY (bus);
+  }
+  outb ((uint8) count, ATA_SECTOR_COUNT (bus));       /* 256 is 0 */
   outb ((uint8) lba, ATA_ADDRESS1 (bus));
   outb ((uint8) (lba >> 8), ATA_ADDRESS2 (bus));
   outb ((uint8) (lba >> 16), ATA_ADDRESS3 (bus));
-  outb (0x20, ATA_COMMAND (bus));       /* READ SECTORS (28-bit LBA) */
+  outb (cmd, ATA_COMMAND (bus));
+}
 
-  if (sched_enabled)
-    schedule ();
-  else
-    ata_poll_for_irq (bus);
+/* Move the next DRQ block of the active PIO command */
+static void
+ata_pio_block (ata_channel *c)
+{
+  uint32 n = c->pio_block < c->pio_left ? c->pio_block : c->pio_left, i;
+  ata_req *r;
+  uint8 *p;
+
+  for (; n > 0; n--, c->pio_left--) {
+    r = c->pio_req;
+    p = r->buf + c->pio_off * 512;
+    if (r->write)
+      /* ``Do not use REP OUTSW to transfer data. There must be a tiny
+       * delay between each OUTSW output word.'' */
+      for (i = 0; i < 256; i++)
+        outw (((uint16 *) p)[i], ATA_DATA (c->bus));
+    else
+      insw (ATA_DATA (c->bus), p, 256);
+    if (++c->pio_off == r->count) {
+      c->pio_req = r->merged;
+      c->pio_off = 0;
+    }
+  }
+}
 
-  while (!(status = inb (ATA_COMMAND (bus)) & 0x8) && !(status & 0x1))
-    asm volatile ("pause");
-  if (status & 0x1) {
-    ret = -1;
-    goto cleanup;
+/* Complete the active chain with the given status, wake its waiters
+ * and start the next command. */
+static void
+ata_finish (ata_channel *c, int status)
+{
+  ata_req *r = c->active, *next;
+  quest_tss *waiter;
+
+  c->active = NULL;
+  for (; r; r = next) {
+    next = r->merged;
+    waiter = r->waiter;
+    r->merged = NULL;
+    r->waiter = NULL;
+    /* r may be gone once its status is set */
+    r->status = status;
+    if (waiter)
+      wakeup (waiter);
   }
-  insw (ATA_DATA (bus), buffer, 256);
+  ata_dispatch (c);
+}
 
-  ret = 512;
+/* Data transfer is over; writes still need the drive's cache flushed */
+static void
+ata_done (ata_channel *c)
+{
+  if (c->active->write && !c->flushing) {
+    /* ``Make sure to do a Cache Flush (ATA command 0xE7) after each
+     * write command completes.'' */
+    c->flushing = TRUE;
+    outb (0xE7, ATA_COMMAND (c->bus));
+    return;
+  }
+  ata_finish (c, 0);
+}
 
- cleanup:
-  ata_release ();
-  return ret;
+/* Start a command for the chain at r, count sectors in total */
+static void
+ata_start (ata_channel *c, ata_req *r, uint32 count)
+{
+  ata_info *d = ata_drive_info (c->bus, r->drive);
+  uint32 bus = c->bus;
+  bool ext = (r->lba + count > 0x0FFFFFFF);
+  uint8 cmd, status;
+
+  if (ext && !d->lba48) {
+    ata_finish (c, -1);
+    return;
+  }
+
+  ata_commands++;
+  ata_sectors += count;
+  c->flushing = FALSE;
+  c->dma = c->bm && d->dma && ata_build_prd (c, r);
+
+  /* Until the scheduler runs, completion is polled: keep the drive
+   * from raising interrupts (nIEN). */
+  outb (sched_enabled ? 0x00 : 0x02, ATA_DCR (bus));
+
+  if (c->dma) {
+    ata_dma_commands++;
+    outb (0, ATA_BM_COMMAND (c->bm));
+    outl (c->prd_phys, ATA_BM_PRD (c->bm));
+    /* IRQ and error bits are cleared by writing 1 */
+    outb (inb (ATA_BM_STATUS (c->bm)) | ATA_BM_SR_IRQ | ATA_BM_SR_ERR,
+          ATA_BM_STATUS (c->bm));
+    outb (r->write ? 0 : ATA_BM_READ, ATA_BM_COMMAND (c->bm));
+    if (r->write)
+      cmd = ext ? 0x35 : 0xCA;  /* WRITE DMA (EXT) */
+    else
+      cmd = ext ? 0x25 : 0xC8;  /* READ DMA (EXT) */
+    ata_issue (bus, r->drive, r->lba, count, ext, cmd);
+    outb ((r->write ? 0 : ATA_BM_READ) | ATA_BM_START,
+          ATA_BM_COMMAND (c->bm));
+    return;
+  }
+
+  if (d->multiple) {
+    if (r->write)
+      cmd = ext ? 0x39 : 0xC5;  /* WRITE MULTIPLE (EXT) */
+    else
+      cmd = ext ? 0x29 : 0xC4;  /* READ MULTIPLE (EXT) */
+  } else {
+    if (r->write)
+      cmd = ext ? 0x34 : 0x30;  /* WRITE SECTORS (EXT) */
+    else
+      cmd = ext ? 0x24 : 0x20;  /* READ SECTORS (EXT) */
+  }
+  c->pio_req = r;
+  c->pio_off = 0;
+  c->pio_left = count;
+  c->pio_block = d->multiple ? d->multiple : 1;
+  ata_issue (bus, r->drive, r->lba, count, ext, cmd);
+
+  if (r->write) {
+    /* The first block is sent without waiting for an interrupt */
+    ATA_SELECT_DELAY (bus);
+    while ((status = inb (ATA_COMMAND (bus))) & ATA_SR_BSY)
+      asm volatile ("pause");
+    if (!(status & ATA_SR_DRQ) || (status & (ATA_SR_ERR | ATA_SR_DF))) {
+      ata_finish (c, -1);
+      return;
+    }
+    ata_pio_block (c);
+  }
 }
 
-/* Write a sector to the bus/drive using LBA from the given buffer
- * and return bytes written. */
+/* Start the next request of an idle channel in C-LOOK order: the
+ * lowest lba at or past the head, or else the lowest overall.  The
+ * requests that continue it on the same drive, in the same direction,
+ * are merged into the same command. */
+static void
+ata_dispatch (ata_channel *c)
+{
+  ata_req **pp, *r, *last;
+  uint32 count;
+
+  if (c->active || ata_current_task)
+    return;
+  if (!c->queue) {
+    /* Let ATAPI in once both buses are idle */
+    if (!ata_channels[0].active && !ata_channels[1].active)
+      wakeup_queue (&ata_waitqueue);
+    return;
+  }
+
+  for (pp = &c->queue; *pp && (*pp)->lba < c->head; pp = &(*pp)->next);
+  if (!*pp)
+    pp = &c->queue;
+  r = last = *pp;
+  *pp = r->next;
+  count = r->count;
+
+  while (*pp && (*pp)->drive == r->drive && (*pp)->write == r->write &&
+         (*pp)->lba == r->lba + count &&
+         count + (*pp)->count <= ATA_MAX_SECTORS) {
+    last->merged = *pp;
+    last = *pp;
+    *pp = last->next;
+    count += last->count;
+    ata_merges++;
+  }
+  last->merged = NULL;
+
+  DLOG ("dispatch bus=%X drive=%X lba=%X count=%d%s", c->bus, r->drive,
+        r->lba, count, r->write ? " write" : "");
+  c->active = r;
+  c->head = r->lba + count;
+  ata_start (c, r, count);
+}
+
+/* Advance the active command after an interrupt, or when polled.
+ * Returns FALSE if there was nothing for it to do. */
+static bool
+ata_service (ata_channel *c)
+{
+  uint8 status, bm;
+
+  if (!c->active)
+    return FALSE;
+
+  if (c->dma && !c->flushing) {
+    bm = inb (ATA_BM_STATUS (c->bm));
+    if (!(bm & ATA_BM_SR_IRQ) &&
+        ((bm & ATA_BM_SR_ACTIVE) || (inb (ATA_DCR (c->bus)) & ATA_SR_BSY)))
+      return FALSE;
+    outb (0, ATA_BM_COMMAND (c->bm));
+    outb (bm | ATA_BM_SR_IRQ | ATA_BM_SR_ERR, ATA_BM_STATUS (c->bm));
+    status = inb (ATA_COMMAND (c->bus));        /* acknowledges the IRQ */
+    if ((bm & ATA_BM_SR_ERR) || (status & (ATA_SR_ERR | ATA_SR_DF)))
+      ata_finish (c, -1);
+    else
+      ata_done (c);
+    return TRUE;
+  }
+
+  status = inb (ATA_COMMAND (c->bus));  /* acknowledges the IRQ */
+  if (status & ATA_SR_BSY)
+    return FALSE;
+  if (status & (ATA_SR_ERR | ATA_SR_DF)) {
+    ata_finish (c, -1);
+    return TRUE;
+  }
+  if (!c->flushing && c->pio_left > 0) {
+    if (!(status & ATA_SR_DRQ))
+      return FALSE;
+    ata_pio_block (c);
+    /* a write completes with one more interrupt */
+    if (c->active->write || c->pio_left > 0)
+      return TRUE;
+  }
+  ata_done (c);
+  return TRUE;
+}
+
+/* Queue r on its bus without starting it, so that a batch can be
+ * merged before the first command goes out. */
+static void
+ata_enqueue (ata_req *r)
+{
+  ata_channel *c = ATA_CHANNEL (r->bus);
+  ata_req **pp;
+
+  r->waiter = NULL;
+  r->merged = NULL;
+  if (!ata_shared (r, sizeof (ata_req)) ||
+      !ata_shared (r->buf, r->count * 512)) {
+    logger_printf ("ATA request %p buffer %p not in shared memory\n",
+                   r, r->buf);
+    r->status = -1;
+    return;
+  }
+  r->status = ATA_REQ_PENDING;
+  for (pp = &c->queue; *pp && (*pp)->lba <= r->lba; pp = &(*pp)->next);
+  r->next = *pp;
+  *pp = r;
+  ata_requests++;
+}
+
+/* Queue a request and start its bus if idle.  The caller fills in
+ * bus, drive, lba, count (1 to ATA_MAX_SECTORS), buf and write, and
+ * collects the result with ata_wait ().  r and buf must come from
+ * kmalloc or other shared kernel memory; a request on the stack or
+ * with a user buffer fails with -1. */
+void
+ata_submit (ata_req *r)
+{
+  ata_enqueue (r);
+  ata_dispatch (ATA_CHANNEL (r->bus));
+}
+
+/* Block until r completes and return its status.  The task waits on
+ * the ATA IO-VCPU, whose budget pays for serving the interrupt, and
+ * returns to its main VCPU afterwards.  As on the ATAPI path, the
+ * IO-VCPU takes the period of the caller's main VCPU.  Before the
+ * scheduler runs the bus is polled instead. */
 int
-ata_drive_write_sector (uint32 bus, uint32 drive, uint32 lba, uint8 * buffer)
+ata_wait (ata_req *r)
 {
-  uint8 status;
-  int i, ret;
-  outb (drive | 0x40 /* LBA */  | ((lba >> 24) & 0x0F),
-        ATA_DRIVE_SELECT (bus));
-  ATA_SELECT_DELAY (bus);
-  outb (0x1, ATA_SECTOR_COUNT (bus));
-  outb ((uint8) lba, ATA_ADDRESS1 (bus));
-  outb ((uint8) (lba >> 8), ATA_ADDRESS2 (bus));
-  outb ((uint8) (lba >> 16), ATA_ADDRESS3 (bus));
-  outb (0x30, ATA_COMMAND (bus));       /* WRITE SECTORS (28-bit LBA) */
-  while (!(status = inb (ATA_COMMAND (bus)) & 0x8) && !(status & 0x1))
-    asm volatile ("pause");
-  if (status & 0x1) {
-    ret = -1;
-    goto cleanup;
+  ata_channel *c = ATA_CHANNEL (r->bus);
+  task_id cpu;
+
+  if (!sched_enabled) {
+    while (r->status == ATA_REQ_PENDING) {
+      ATA_SELECT_DELAY (c->bus);
+      ata_service (c);
+    }
+    return r->status;
   }
 
-  /* ``Do not use REP OUTSW to transfer data. There must be a tiny
-   * delay between each OUTSW output word. A jmp $+2 size of
-   * delay. Make sure to do a Cache Flush (ATA command 0xE7) after
-   * each write command completes.'' */
+  cpu = str ()->cpu;
+  set_iovcpu (str (), IOVCPU_CLASS_ATA);
+  vcpu_lookup (str ()->cpu)->T = vcpu_lookup (cpu)->T;
+  while (r->status == ATA_REQ_PENDING) {
+    r->waiter = str ();
+    schedule ();
+  }
+  str ()->cpu = cpu;
+  return r->status;
+}
 
-  for (i = 0; i < 256; i++)
-    outw (((uint16 *) buffer)[i], ATA_DATA (bus));
+/* Transfer count sectors at lba, in requests of up to
+ * ATA_MAX_SECTORS, and return bytes transferred or -1.  A buffer
+ * outside shared kernel memory is copied through a bounce buffer. */
+static int
+ata_drive_rw (uint32 bus, uint32 drive, uint32 lba, uint32 count,
+              uint8 * buffer, bool write)
+{
+  ata_req *r;
+  uint8 *bounce = NULL;
+  uint32 done;
+  int ret = count * 512;
+
+  if (count == 0)
+    return 0;
+  r = kmalloc (sizeof (ata_req));
+  if (!r)
+    return -1;
+  if (!ata_shared (buffer, count * 512)) {
+    bounce = kmalloc ((count < ATA_MAX_SECTORS ? count : ATA_MAX_SECTORS)
+                      * 512);
+    if (!bounce) {
+      kfree (r);
+      return -1;
+    }
+  }
 
-  outb (0xE7, ATA_COMMAND (bus));       /* FLUSH */
+  for (done = 0; done < count; done += r->count) {
+    r->bus = bus;
+    r->drive = drive;
+    r->lba = lba + done;
+    r->count = count - done;
+    if (r->count > ATA_MAX_SECTORS)
+      r->count = ATA_MAX_SECTORS;
+    r->buf = bounce ? bounce : buffer + done * 512;
+    r->write = write;
+    if (bounce && write)
+      memcpy (bounce, buffer + done * 512, r->count * 512);
+    ata_submit (r);
+    if (ata_wait (r) < 0) {
+      ret = -1;
+      break;
+    }
+    if (bounce && !write)
+      memcpy (buffer + done * 512, bounce, r->count * 512);
+  }
 
-  ret = 512;
+  if (bounce)
+    kfree (bounce);
+  kfree (r);
+  return ret;
+}
 
- cleanup:
-  ata_release ();
+int
+ata_drive_read (uint32 bus, uint32 drive, uint32 lba, uint32 count,
+                uint8 * buffer)
+{
+  return ata_drive_rw (bus, drive, lba, count, buffer, FALSE);
+}
+
+int
+ata_drive_write (uint32 bus, uint32 drive, uint32 lba, uint32 count,
+                 uint8 * buffer)
+{
+  return ata_drive_rw (bus, drive, lba, count, buffer, TRUE);
+}
+
+/* Read count sectors (at most ATA_MAX_SECTORS) at each of lba[0..n-1]
+ * into buffers[0..n-1].  The requests are queued together, so
+ * adjacent ones become a single command.  Returns 0 or -1. */
+int
+ata_drive_read_blocks (uint32 bus, uint32 drive, uint32 * lba,
+                       uint32 count, uint8 ** buffers, uint32 n)
+{
+  ata_req *r;
+  uint32 i;
+  int ret = 0;
+
+  if (count == 0 || count > ATA_MAX_SECTORS)
+    return -1;
+  r = kmalloc (n * sizeof (ata_req));
+  if (!r)
+    return -1;
+  for (i = 0; i < n; i++) {
+    r[i].bus = bus;
+    r[i].drive = drive;
+    r[i].lba = lba[i];
+    r[i].count = count;
+    r[i].buf = buffers[i];
+    r[i].write = FALSE;
+    ata_enqueue (&r[i]);
+  }
+  ata_dispatch (ATA_CHANNEL (bus));
+  for (i = 0; i < n; i++)
+    if (ata_wait (&r[i]) < 0)
+      ret = -1;
+  kfree (r);
   return ret;
 }
 
+/* Read a sector from the bus/drive using LBA into the given buffer
+ * and return bytes read. */
+int
+ata_drive_read_sector (uint32 bus, uint32 drive, uint32 lba, uint8 * buffer)
+{
+  return ata_drive_read (bus, drive, lba, 1, buffer);
+}
+
+/* Write a sector to the bus/drive using LBA from the given buffer
+ * and return bytes written. */
+int
+ata_drive_write_sector (uint32 bus, uint32 drive, uint32 lba, uint8 * buffer)
+{
+  return ata_drive_write (bus, drive, lba, 1, buffer);
+}
+
 /* Count number of times IRQs are triggered. */
 uint32 ata_primary_irq_count = 0, ata_secondary_irq_count = 0;
 uint32 ata_irq_count = 0;
@@ -318,13 +796,19 @@ u64 irq_resp_min = ~0LL;
 static uint32
 ata_irq_handler (uint8 vec)
 {
+  ata_channel *c;
+
   lock_kernel ();
   DLOG ("ata_irq_handler(%x) ata_current_task=%x", vec,
         ata_current_task->tid);
-  if (vec == ATA_VECTOR_PRIMARY)
+  if (vec == ATA_VECTOR_PRIMARY ||
+      vec == (ATA_IRQ_PRIMARY - 8) + PIC2_BASE_IRQ) {
     ata_primary_irq_count++;
-  else
+    c = &ata_channels[0];
+  } else {
     ata_secondary_irq_count++;
+    c = &ata_channels[1];
+  }
 
   if (irq_start != 0)
     ata_irq_count++;
@@ -339,8 +823,11 @@ ata_irq_handler (uint8 vec)
       irq_resp_min = finish - irq_start;
   }
 
-  /* Unblock the task waiting for the IRQ. */
-  if (ata_current_task)
+  /* A queued command takes the IRQ; otherwise unblock the task
+   * waiting for it. */
+  if (c->active)
+    ata_service (c);
+  else if (ata_current_task)
     wakeup (ata_current_task);
 
   unlock_kernel ();
@@ -387,6 +874,89 @@ ata_poll_for_irq (uint32 bus)
   tsc_delay_usec (50000);      /* wait 50 milliseconds */
 }
 
+/* Enable READ/WRITE MULTIPLE with the largest block the drive
+ * reported, polled.  Leaves info->multiple 0 if it is refused. */
+static void
+ata_set_multiple (ata_info *info)
+{
+  uint32 bus = info->ata_bus;
+  uint8 status;
+
+  if (info->multiple == 0)
+    return;
+  outb (0x02, ATA_DCR (bus));   /* nIEN */
+  ata_drive_select (bus, info->ata_drive);
+  outb (info->multiple, ATA_SECTOR_COUNT (bus));
+  outb (0xC6, ATA_COMMAND (bus));       /* SET MULTIPLE MODE */
+  ATA_SELECT_DELAY (bus);
+  while ((status = inb (ATA_COMMAND (bus))) & ATA_SR_BSY)
+    asm volatile ("pause");
+  if (status & (ATA_SR_ERR | ATA_SR_DF))
+    info->multiple = 0;
+  logger_printf ("ATA bus %X drive %X: %d sectors, %s%s%d sector blocks\n",
+                 bus, info->ata_drive, info->sectors,
+                 info->lba48 ? "LBA48, " : "", info->dma ? "DMA, " : "",
+                 info->multiple);
+}
+
+/* Set up bus-master DMA for the legacy channels, if a PCI IDE
+ * controller in compatibility mode provides it.  Not in a sandbox
+ * (USE_VMX), where buffer addresses are not host-physical: requests
+ * use PIO there. */
+static void
+ata_probe_busmaster (void)
+{
+#ifndef USE_VMX
+  uint i, device_index, io, ch;
+  uint32 frame;
+  pci_device dev;
+  uint16 cmd;
+
+  if (mp_ISA_PC)
+    return;
+
+  device_index = ~0;
+  i = 0;
+  while (pci_find_device (0xFFFF, 0xFFFF, 0x01, 0x01, i, &i)) {
+    if (pci_get_device (i, &dev)) {
+      /* bit 7: bus master; bits 0 and 2: native-mode channels */
+      if ((dev.progIF & 0x80) && !(dev.progIF & 0x05)) {
+        device_index = i;
+        break;
+      }
+      i++;
+    } else break;
+  }
+
+  if (device_index == ~0) {
+    DLOG ("No bus-master IDE controller");
+    return;
+  }
+
+  if (!pci_decode_bar (device_index, 4, NULL, &io, NULL) || io == 0) {
+    DLOG ("Bus-master IDE registers not found");
+    return;
+  }
+
+  /* Enable I/O space and bus mastering */
+  cmd = READ (dev.bus, dev.slot, dev.func, 0x04, word);
+  WRITE (dev.bus, dev.slot, dev.func, 0x04, word, cmd | 0x05);
+
+  for (ch = 0; ch < 2; ch++) {
+    if ((frame = alloc_phys_frame ()) == (uint32) -1)
+      return;
+    if (!(ata_channels[ch].prd = map_virtual_page (frame | 3))) {
+      free_phys_frame (frame);
+      return;
+    }
+    ata_channels[ch].prd_phys = frame;
+    ata_channels[ch].bm = io + ch * 8;
+    logger_printf ("ATA bus %X: bus-master DMA at I/O %X\n",
+                   ata_channels[ch].bus, ata_channels[ch].bm);
+  }
+#endif
+}
+
 /* Initialize and identify the ATA drives in the system. */
 bool
 ata_init (void)
@@ -396,31 +966,39 @@ ata_init (void)
   i = 0;
   bus = ATA_BUS_PRIMARY;
   drive = ATA_DRIVE_MASTER;
-  pata_drives[i].ata_type = ata_identify (bus, drive);
+  pata_drives[i].ata_type = ata_identify (bus, drive, &pata_drives[i]);
   pata_drives[i].ata_bus = bus;
   pata_drives[i].ata_drive = drive;
 
   i = 1;
   bus = ATA_BUS_PRIMARY;
   drive = ATA_DRIVE_SLAVE;
-  pata_drives[i].ata_type = ata_identify (bus, drive);
+  pata_drives[i].ata_type = ata_identify (bus, drive, &pata_drives[i]);
   pata_drives[i].ata_bus = bus;
   pata_drives[i].ata_drive = drive;
 
   i = 2;
   bus = ATA_BUS_SECONDARY;
   drive = ATA_DRIVE_MASTER;
-  pata_drives[i].ata_type = ata_identify (bus, drive);
+  pata_drives[i].ata_type = ata_identify (bus, drive, &pata_drives[i]);
   pata_drives[i].ata_bus = bus;
   pata_drives[i].ata_drive = drive;
 
   i = 3;
   bus = ATA_BUS_SECONDARY;
   drive = ATA_DRIVE_SLAVE;
-  pata_drives[i].ata_type = ata_identify (bus, drive);
+  pata_drives[i].ata_type = ata_identify (bus, drive, &pata_drives[i]);
   pata_drives[i].ata_bus = bus;
   pata_drives[i].ata_drive = drive;
 
+  for (i = 0; i < 4; i++)
+    if (pata_drives[i].ata_type == ATA_TYPE_PATA)
+      ata_set_multiple (&pata_drives[i]);
+    else
+      pata_drives[i].multiple = 0;
+
+  ata_probe_busmaster ();
+
   if (mp_ISA_PC) {
     set_vector_handler ((ATA_IRQ_PRIMARY - 8) + PIC2_BASE_IRQ,
                         ata_irq_handler);
@@ -671,7 +1249,7 @@ static const struct module_ops mod_ops = {
   .init = ata_init
 };
 
-DEF_MODULE (storage___ata, "ATA/ATAPI driver", &mod_ops, {});
+DEF_MODULE (storage___ata, "ATA/ATAPI driver", &mod_ops, {"pci"});
 
 /*
  * Local Variables:
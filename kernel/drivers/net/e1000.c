@@ -28,6 +28,7 @@
 #include "mem/virtual.h"
 #include "kernel.h"
 #include "sched/vcpu.h"
+#include "smp/klock.h"
 
 #define EEPROM_MICROWIRE
 //#define DEBUG_E1000
@@ -51,15 +52,14 @@ nvm_info_t *nvm = &i82543_nvm;
 #define DLOG(fmt,...) ;
 #endif
 
-#define RDESC_COUNT 8           /* must be multiple of 8 */
+#define RDESC_COUNT 64          /* must be multiple of 8, power of 2 */
 #define RDESC_COUNT_MOD_MASK (RDESC_COUNT - 1)
 #define RBUF_SIZE   2048        /* configured in RCTL.BSIZE */
 #define RBUF_SIZE_MASK 0        /* 0 = 2048 bytes */
+#define RBUF_SPARE  64          /* buffers lwIP may hold on to */
 
-#define TDESC_COUNT 8           /* must be multiple of 8 */
-#define TDESC_COUNT_MOD_MASK (RDESC_COUNT - 1)
-#define TBUF_SIZE   2048        /* configured in TCTL.BSIZE */
-#define TBUF_SIZE_MASK 0        /* 0 = 2048 bytes */
+#define TDESC_COUNT 64          /* must be multiple of 8, power of 2 */
+#define TDESC_COUNT_MOD_MASK (TDESC_COUNT - 1)
 #define TCTL_CT_MASK   0x100
 #define TCTL_COLD_MASK 0x40000
 #define TIPG_MASK (10 | (10 << 10) | (10 << 20))
@@ -118,6 +118,8 @@ static volatile uint32 *mmio_base;
 #define IMS_RXT (0x80)          /* RX Timer Int. */
 #define IMS_RXO (0x40)          /* RX Overrun Int. */
 #define IMS_TXQE (0x02)         /* TX Queue Empty Int. */
+#define ITR    (REG (0x31))     /* Interrupt Throttling, 256ns units */
+#define IMC    (REG (0x36))     /* Interrupt Mask Clear */
 #define RCTL   (REG (0x40))     /* Receive Control */
 #define RCTL_EN (0x02)          /* RX Enable */
 #define RCTL_BAM (1<<15)        /* Accept Broadcast packets */
@@ -184,12 +186,15 @@ struct e1000_tdesc {
 static struct e1000_interface {
   struct e1000_rdesc rdescs[RDESC_COUNT] ALIGNED(0x10);
   struct e1000_tdesc tdescs[TDESC_COUNT] ALIGNED(0x10);
-  uint8 rbufs[RDESC_COUNT][RBUF_SIZE];
-  uint8 tbufs[TDESC_COUNT][TBUF_SIZE];
+  net_rxbuf *rx_buf[RDESC_COUNT]; /* buffer behind each RX descriptor */
+  struct pbuf *tx_pbuf[TDESC_COUNT]; /* frame, on its last descriptor */
   uint  rx_idx;                 /* current RX descriptor */
   uint  tx_cnt;                 /* number of pending TX descriptors */
+  uint  tx_clean;               /* oldest pending TX descriptor */
 } *e1000;
 
+static net_rxpool e1000_rxpool;
+
 /* Virtual-to-Physical */
 #define V2P(ty,p) ((ty)((((uint) (p)) - ((uint) e1000))+e1000_phys))
 /* Physical-to-Virtual */
@@ -209,50 +214,85 @@ e1000_get_hwaddr (uint8 a[ETH_ADDR_LEN])
   return TRUE;
 }
 
+/* Release the frames of up to budget descriptors the hardware has
+ * finished with, oldest first, and return how many.  tx_clean is the
+ * head of the pending descriptors, so only those are looked at.
+ * Must hold net_lock. */
+static uint
+tx_reclaim (uint budget)
+{
+  uint i = e1000->tx_clean, done = 0;
+
+  while (done < budget && e1000->tx_cnt > 0 &&
+         (e1000->tdescs[i].sta & TDESC_STA_DD)) {
+    if (e1000->tx_pbuf[i]) {
+      pbuf_free (e1000->tx_pbuf[i]);
+      e1000->tx_pbuf[i] = NULL;
+    }
+    e1000->tdescs[i].cmd = 0;
+    e1000->tdescs[i].sta = 0;
+    e1000->tx_cnt--;
+    done++;
+    i = (i + 1) & TDESC_COUNT_MOD_MASK;
+  }
+  e1000->tx_clean = i;
+  return done;
+}
+
+/* Scatter-gather transmit: one descriptor per physically contiguous
+ * piece of the pbuf chain, so the frame is never copied. */
 extern sint
-e1000_transmit (uint8* buffer, sint len)
+e1000_transmit_pbuf (struct pbuf *p)
 {
-  struct e1000_tdesc *td;
-  uint32 tdt = TDT;
-  DLOG ("TX: (%p, %d) TDH=%d TDT=%d", buffer, len, TDH, tdt);
-  DLOG ("TX:   %.02X %.02X %.02X %.02X %.02X %.02X %.02X %.02X",
-        buffer[0], buffer[1], buffer[2], buffer[3],
-        buffer[4], buffer[5], buffer[6], buffer[7]);
-  DLOG ("TX:   %.02X %.02X %.02X %.02X %.02X %.02X %.02X %.02X",
-        buffer[8], buffer[9], buffer[10], buffer[11],
-        buffer[12], buffer[13], buffer[14], buffer[15]);
-
-  if (len > TBUF_SIZE)
+  net_dma_seg segs[NET_TX_MAX_SEGS];
+  uint32 tdt = TDT, last = tdt;
+  int i, n;
+
+  DLOG ("TX: (%p, %d) TDH=%d TDT=%d", p, p->tot_len, TDH, tdt);
+
+  if (p->tot_len > MAX_FRAME_SIZE)
     return 0;
 
-  if (e1000->tx_cnt >= TDESC_COUNT - 1) /* overrun */
+  n = net_pbuf_dma_map (p, segs, NET_TX_MAX_SEGS);
+  if (n < 0)
+    return -1;
+
+  tx_reclaim (TDESC_COUNT);
+  if (e1000->tx_cnt + n > TDESC_COUNT - 1) /* overrun */
     return 0;
 
-  /* set up the first available descriptor */
-  memcpy (e1000->tbufs[tdt], buffer, len);
-  e1000->tdescs[tdt].length = len;
-  e1000->tdescs[tdt].cmd = TDESC_CMD_IFCS | TDESC_CMD_RS | TDESC_CMD_EOP;
-  td = &e1000->tdescs[tdt];
+  for (i = 0; i < n; i++) {
+    e1000->tdescs[tdt].address = segs[i].phys;
+    e1000->tdescs[tdt].length = segs[i].len;
+    e1000->tdescs[tdt].sta = 0;
+    e1000->tdescs[tdt].cmd = TDESC_CMD_IFCS | TDESC_CMD_RS |
+      (i == n - 1 ? TDESC_CMD_EOP : 0);
+    last = tdt;
+    tdt = (tdt + 1) & TDESC_COUNT_MOD_MASK;
+  }
+
+  /* hold the frame until its last descriptor is done */
+  pbuf_ref (p);
+  e1000->tx_pbuf[last] = p;
+  e1000->tx_cnt += n;
 
   /* advance the TDT, notifying hardware */
-  tdt++;
-  if (tdt >= TDESC_COUNT)
-    tdt = 0;
   TDT = tdt;
 
-  e1000->tx_cnt++;
-
-  return len;
+  return p->tot_len;
 }
 
 u32 e1000_packet_count = 0;
 u64 e1000_packet_bytes = 0;
 
-extern void
-e1000_rx_poll (void)
+/* Pass up to budget received frames up the stack, and return how
+ * many. */
+extern uint
+e1000_rx_poll (uint budget)
 {
-  uint32 entry, rdt;
+  uint32 entry;
   uint8 *ptr;
+  uint done = 0;
 
   DLOG ("RX: %d %d %d %d %d %d %d %d",
         e1000->rdescs[0].status & RDESC_STATUS_DD,
@@ -265,18 +305,21 @@ e1000_rx_poll (void)
         e1000->rdescs[7].status & RDESC_STATUS_DD);
 
   entry = e1000->rx_idx & RDESC_COUNT_MOD_MASK;
-  while (e1000->rdescs[entry].status & RDESC_STATUS_DD) {
+  while (done < budget && (e1000->rdescs[entry].status & RDESC_STATUS_DD)) {
     if (e1000->rdescs[entry].status & RDESC_STATUS_EOP) {
       uint16 len;
       /* full packet */
-      ptr = e1000->rbufs[entry];
+      ptr = e1000->rx_buf[entry]->data;
       len = e1000->rdescs[entry].length;
       DLOG ("RX: full packet@%p len=%d", ptr, len);
       e1000_packet_count++;
       e1000_packet_bytes += len;
-      if (e1000_ethdev.recv_func)
-        e1000_ethdev.recv_func (&e1000_ethdev, ptr, len);
-      else                      /* drop it */
+      if (e1000_ethdev.recv_func) {
+        /* may swap in a fresh buffer */
+        net_rx_deliver (&e1000_ethdev, &e1000_rxpool,
+                        &e1000->rx_buf[entry], len);
+        e1000->rdescs[entry].address = e1000->rx_buf[entry]->phys;
+      } else                    /* drop it */
         DLOG ("recv_func is null");
     } else {
       /* error */
@@ -285,40 +328,48 @@ e1000_rx_poll (void)
 
     /* clear status */
     e1000->rdescs[entry].status = 0;
-
-    /* advance "tail" to notify hardware */
-    rdt = RDT;
-    rdt++;
-    if (rdt >= RDESC_COUNT)
-      rdt = 0;
-    RDT = rdt;
+    done++;
 
     /* check next entry */
     entry = (++e1000->rx_idx) & RDESC_COUNT_MOD_MASK;
   }
+
+  if (done > 0)
+    /* advance "tail" to notify hardware, once for the whole batch */
+    RDT = (e1000->rx_idx - 1) & RDESC_COUNT_MOD_MASK;
+
+  return done;
 }
 
-static void
-handle_tx (uint32 icr)
+static uint
+e1000_tx_clean (uint budget)
 {
-  uint i;
   DLOG ("TX: tx_cnt=%d", e1000->tx_cnt);
+  return tx_reclaim (budget);
+}
 
-  /* find descriptors that have completed */
-  for (i=0; i<TDESC_COUNT; i++) {
-    if (e1000->tdescs[i].cmd && (e1000->tdescs[i].sta & TDESC_STA_DD)) {
-      e1000->tdescs[i].cmd = 0;
-      e1000->tdescs[i].sta = 0;
-      e1000->tx_cnt--;
-    }
-  }
+static void
+e1000_irq_enable (bool enable)
+{
+  if (enable)
+    IMS = IMS_RXT | IMS_TXQE;
+  else
+    IMC = IMS_RXT | IMS_TXQE;
+}
+
+static void
+e1000_set_itr (uint usec)
+{
+  ITR = usec * 1000 / 256;
 }
 
 extern void
 e1000_poll (void)
 {
-  e1000_rx_poll ();
-  handle_tx (ICR_TXQE);
+  e1000_rx_poll (RDESC_COUNT);
+  klock_lock (&net_lock);
+  tx_reclaim (TDESC_COUNT);
+  klock_unlock (&net_lock);
 }
 
 #ifdef E1000_DEBUG
@@ -363,47 +414,17 @@ mdi_write (uint8 phy_reg, uint16 val)
 #endif
 
 static uint32 e1000_bh_stack[1024] ALIGNED (0x1000);
-static quest_tss *e1000_bh_id = NULL;
-static void
-e1000_bh_thread (void)
-{
-  for (;;) {
-    /* ICR is cleared upon read; this implicitly acknowledges the
-     * interrupt. */
-    uint32 icr = ICR;
-    DLOG ("IRQ: ICR=%p CTRL=%p CTRLE=%p STA=%p", icr, CTRL, CTRLEXT, STATUS);
-    //DLOG ("PHY_CTL=0x%.04X", mdi_read (0));
-    //DLOG ("PHY_STA=0x%.04X", mdi_read (1));
-    //DLOG ("PHY_GCON=0x%.04X", mdi_read (9));
-    //DLOG ("PHY_GSTA=0x%.04X", mdi_read (10));
-    DLOG ("TPT=%p", TPT);
-
-    if (icr & ICR_RXT)            /* RX */
-      e1000_rx_poll ();
-    if (icr & ICR_TXQE)           /* TX queue empty */
-      handle_tx (icr);
 
-#if 0
-    unlock_kernel ();
-    sti ();
-    tsc_delay_usec (3000);
-    cli ();
-    lock_kernel ();
-#endif
-
-    iovcpu_job_completion ();
-  }
-}
-
-extern DEF_PER_CPU (vcpu *, vcpu_current);
 static uint32
 e1000_irq_handler (uint8 vec)
 {
-  if (e1000_bh_id) {
-    extern vcpu *vcpu_lookup (int);
-    /* hack: use VCPU2's period */
-    iovcpu_job_wakeup (e1000_bh_id, vcpu_lookup (2)->T);
-  }
+  /* ICR is cleared upon read; this implicitly acknowledges the
+   * interrupt.  The poll thread looks at both rings whatever the
+   * cause. */
+  uint32 icr = ICR;
+  DLOG ("IRQ: ICR=%p", icr);
+
+  net_napi_schedule (&e1000_ethdev);
 
   return 0;
 }
@@ -652,7 +673,9 @@ reset (void)
 
   /* set up rdesc addresses */
   for (i=0; i<RDESC_COUNT; i++) {
-    e1000->rdescs[i].address = V2P (uint64, e1000->rbufs[i]);
+    if (e1000->rx_buf[i] == NULL)
+      e1000->rx_buf[i] = net_rxbuf_get (&e1000_rxpool);
+    e1000->rdescs[i].address = e1000->rx_buf[i]->phys;
     e1000->rdescs[i].status = 0;
   }
 
@@ -673,7 +696,7 @@ reset (void)
 
   /* set up tdesc addresses */
   for (i=0; i<TDESC_COUNT; i++) {
-    e1000->tdescs[i].address = V2P (uint64, e1000->tbufs[i]);
+    e1000->tdescs[i].address = 0;
     e1000->tdescs[i].sta = 0;
   }
 
@@ -687,6 +710,7 @@ reset (void)
   TDT = 0;
 
   e1000->tx_cnt = 0;
+  e1000->tx_clean = 0;
 
   DLOG ("TDBAL=%p TDLEN=%p TDH=%d TDT=%d",
         V2P (uint32, e1000->tdescs), TDESC_COUNT * sizeof (struct e1000_tdesc),
@@ -815,6 +839,12 @@ e1000_init (void)
 
   DLOG ("DMA region at virt=%p phys=%p count=%d", e1000, e1000_phys, frame_count);
 
+  /* receive buffers are lent to lwIP, so keep spares beyond the ring */
+  if (!net_rxpool_init (&e1000_rxpool, RDESC_COUNT + RBUF_SPARE, RBUF_SIZE)) {
+    DLOG ("Unable to allocate receive buffers");
+    goto abort_virt;
+  }
+
   if (!pci_get_interrupt (device_index, &irq_line, &irq_pin)) {
     DLOG ("Unable to get IRQ");
     goto abort_virt;
@@ -865,19 +895,22 @@ e1000_init (void)
 
   /* Register network device with net subsystem */
   e1000_ethdev.recv_func = NULL;
-  e1000_ethdev.send_func = e1000_transmit;
+  e1000_ethdev.send_func = NULL;
+  e1000_ethdev.send_pbuf_func = e1000_transmit_pbuf;
   e1000_ethdev.get_hwaddr_func = e1000_get_hwaddr;
   e1000_ethdev.poll_func = e1000_poll;
+  net_napi_init (&e1000_ethdev, e1000_rx_poll, e1000_tx_clean,
+                 e1000_irq_enable, e1000_set_itr);
 
   if (!net_register_device (&e1000_ethdev)) {
     DLOG ("registration failed");
     goto abort_virt;
   }
 
-  e1000_bh_id = create_kernel_thread_args ((u32) e1000_bh_thread,
-                                           (u32) &e1000_bh_stack[1023],
-                                           "Intel e1000", FALSE, 0);
-  set_iovcpu (e1000_bh_id, IOVCPU_CLASS_NET);
+  if (!net_napi_start (&e1000_ethdev, &e1000_bh_stack[1023], "Intel e1000")) {
+    DLOG ("Unable to start bottom half");
+    goto abort_virt;
+  }
 
   return TRUE;
 
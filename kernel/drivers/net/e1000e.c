@@ -25,6 +25,7 @@
 #include "smp/apic.h"
 #include "mem/physical.h"
 #include "mem/virtual.h"
+#include "smp/klock.h"
 #include "kernel.h"
 
 #define DEBUG_E1000E
@@ -38,15 +39,14 @@
 
 #define E1000E_VECTOR 0x4D       /* arbitrary */
 
-#define RDESC_COUNT 8           /* must be multiple of 8 */
+#define RDESC_COUNT 64          /* must be multiple of 8, power of 2 */
 #define RDESC_COUNT_MOD_MASK (RDESC_COUNT - 1)
 #define RBUF_SIZE   2048        /* configured in RCTL.BSIZE */
 #define RBUF_SIZE_MASK 0        /* 0 = 2048 bytes */
+#define RBUF_SPARE  64          /* buffers lwIP may hold on to */
 
-#define TDESC_COUNT 8           /* must be multiple of 8 */
-#define TDESC_COUNT_MOD_MASK (RDESC_COUNT - 1)
-#define TBUF_SIZE   2048        /* configured in TCTL.BSIZE */
-#define TBUF_SIZE_MASK 0        /* 0 = 2048 bytes */
+#define TDESC_COUNT 64          /* must be multiple of 8, power of 2 */
+#define TDESC_COUNT_MOD_MASK (TDESC_COUNT - 1)
 #define TCTL_CT_MASK   0x100
 #define TCTL_COLD_MASK 0x40000
 #define TIPG_MASK (10 | (10 << 10) | (10 << 20))
@@ -81,6 +81,7 @@ static volatile uint32 *mmio_base, *flash_base;
 #define IMS_RXO (0x40)          /* RX Overrun Int. */
 #define IMS_TXQE (0x02)         /* TX Queue Empty Int. */
 #define IMC    (REG (0x36))     /* Interrupt Mask Clear */
+#define ITR    (REG (0x31))     /* Interrupt Throttling, 256ns units */
 #define RCTL   (REG (0x40))     /* Receive Control */
 #define RCTL_EN (0x02)          /* RX Enable */
 #define RCTL_BAM (1<<15)        /* Accept Broadcast packets */
@@ -141,12 +142,15 @@ struct e1000e_tdesc {
 static struct e1000e_interface {
   struct e1000e_rdesc rdescs[RDESC_COUNT] ALIGNED(0x10);
   struct e1000e_tdesc tdescs[TDESC_COUNT] ALIGNED(0x10);
-  uint8 rbufs[RDESC_COUNT][RBUF_SIZE];
-  uint8 tbufs[TDESC_COUNT][TBUF_SIZE];
+  net_rxbuf *rx_buf[RDESC_COUNT]; /* buffer behind each RX descriptor */
+  struct pbuf *tx_pbuf[TDESC_COUNT]; /* frame, on its last descriptor */
   uint  rx_idx;                 /* current RX descriptor */
   uint  tx_cnt;                 /* number of pending TX descriptors */
+  uint  tx_clean;               /* oldest pending TX descriptor */
 } *e1000e;
 
+static net_rxpool e1000e_rxpool;
+
 /* Virtual-to-Physical */
 #define V2P(ty,p) ((ty)((((uint) (p)) - ((uint) e1000e))+e1000e_phys))
 /* Physical-to-Virtual */
@@ -165,39 +169,81 @@ e1000e_get_hwaddr (uint8 a[ETH_ADDR_LEN])
   return TRUE;
 }
 
+/* Release the frames of up to budget descriptors the hardware has
+ * finished with, oldest first, and return how many.  tx_clean is the
+ * head of the pending descriptors, so only those are looked at.
+ * Must hold net_lock. */
+static uint
+tx_reclaim (uint budget)
+{
+  uint i = e1000e->tx_clean, done = 0;
+
+  while (done < budget && e1000e->tx_cnt > 0 &&
+         (e1000e->tdescs[i].sta & TDESC_STA_DD)) {
+    if (e1000e->tx_pbuf[i]) {
+      pbuf_free (e1000e->tx_pbuf[i]);
+      e1000e->tx_pbuf[i] = NULL;
+    }
+    e1000e->tdescs[i].cmd = 0;
+    e1000e->tdescs[i].sta = 0;
+    e1000e->tx_cnt--;
+    done++;
+    i = (i + 1) & TDESC_COUNT_MOD_MASK;
+  }
+  e1000e->tx_clean = i;
+  return done;
+}
+
+/* Scatter-gather transmit: one descriptor per physically contiguous
+ * piece of the pbuf chain, so the frame is never copied. */
 extern sint
-e1000e_transmit (uint8* buffer, sint len)
+e1000e_transmit_pbuf (struct pbuf *p)
 {
-  uint32 tdt = TDT;
-  DLOG ("TX: (%p, %d) TDH=%d TDT=%d", buffer, len, TDH, tdt);
+  net_dma_seg segs[NET_TX_MAX_SEGS];
+  uint32 tdt = TDT, last = tdt;
+  int i, n;
+
+  DLOG ("TX: (%p, %d) TDH=%d TDT=%d", p, p->tot_len, TDH, tdt);
 
-  if (len > TBUF_SIZE)
+  if (p->tot_len > MAX_FRAME_SIZE)
     return 0;
 
-  if (e1000e->tx_cnt >= TDESC_COUNT - 1) /* overrun */
+  n = net_pbuf_dma_map (p, segs, NET_TX_MAX_SEGS);
+  if (n < 0)
+    return -1;
+
+  tx_reclaim (TDESC_COUNT);
+  if (e1000e->tx_cnt + n > TDESC_COUNT - 1) /* overrun */
     return 0;
 
-  /* set up the first available descriptor */
-  memcpy (e1000e->tbufs[tdt], buffer, len);
-  e1000e->tdescs[tdt].length = len;
-  e1000e->tdescs[tdt].cmd = TDESC_CMD_RS | TDESC_CMD_EOP;
+  for (i = 0; i < n; i++) {
+    e1000e->tdescs[tdt].address = segs[i].phys;
+    e1000e->tdescs[tdt].length = segs[i].len;
+    e1000e->tdescs[tdt].sta = 0;
+    e1000e->tdescs[tdt].cmd = TDESC_CMD_RS | (i == n - 1 ? TDESC_CMD_EOP : 0);
+    last = tdt;
+    tdt = (tdt + 1) & TDESC_COUNT_MOD_MASK;
+  }
+
+  /* hold the frame until its last descriptor is done */
+  pbuf_ref (p);
+  e1000e->tx_pbuf[last] = p;
+  e1000e->tx_cnt += n;
 
   /* advance the TDT, notifying hardware */
-  tdt++;
-  if (tdt >= TDESC_COUNT)
-    tdt = 0;
   TDT = tdt;
 
-  e1000e->tx_cnt++;
-
-  return len;
+  return p->tot_len;
 }
 
-extern void
-e1000e_rx_poll (void)
+/* Pass up to budget received frames up the stack, and return how
+ * many. */
+extern uint
+e1000e_rx_poll (uint budget)
 {
-  uint32 entry, rdt;
+  uint32 entry;
   uint8 *ptr;
+  uint done = 0;
 
   DLOG ("RX: %d %d %d %d %d %d %d %d",
         e1000e->rdescs[0].status & RDESC_STATUS_DD,
@@ -210,16 +256,19 @@ e1000e_rx_poll (void)
         e1000e->rdescs[7].status & RDESC_STATUS_DD);
 
   entry = e1000e->rx_idx & RDESC_COUNT_MOD_MASK;
-  while (e1000e->rdescs[entry].status & RDESC_STATUS_DD) {
+  while (done < budget && (e1000e->rdescs[entry].status & RDESC_STATUS_DD)) {
     if (e1000e->rdescs[entry].status & RDESC_STATUS_EOP) {
       uint16 len;
       /* full packet */
-      ptr = e1000e->rbufs[entry];
+      ptr = e1000e->rx_buf[entry]->data;
       len = e1000e->rdescs[entry].length;
       DLOG ("RX: full packet@%p len=%d", ptr, len);
-      if (e1000e_ethdev.recv_func)
-        e1000e_ethdev.recv_func (&e1000e_ethdev, ptr, len);
-      else                      /* drop it */
+      if (e1000e_ethdev.recv_func) {
+        /* may swap in a fresh buffer */
+        net_rx_deliver (&e1000e_ethdev, &e1000e_rxpool,
+                        &e1000e->rx_buf[entry], len);
+        e1000e->rdescs[entry].address = e1000e->rx_buf[entry]->phys;
+      } else                    /* drop it */
         DLOG ("recv_func is null");
     } else {
       /* error */
@@ -228,54 +277,62 @@ e1000e_rx_poll (void)
 
     /* clear status */
     e1000e->rdescs[entry].status = 0;
-
-    /* advance "tail" to notify hardware */
-    rdt = RDT;
-    rdt++;
-    if (rdt >= RDESC_COUNT)
-      rdt = 0;
-    RDT = rdt;
+    done++;
 
     /* check next entry */
     entry = (++e1000e->rx_idx) & RDESC_COUNT_MOD_MASK;
   }
+
+  if (done > 0)
+    /* advance "tail" to notify hardware, once for the whole batch */
+    RDT = (e1000e->rx_idx - 1) & RDESC_COUNT_MOD_MASK;
+
+  return done;
 }
 
-static void
-handle_tx (uint32 icr)
+static uint
+e1000e_tx_clean (uint budget)
 {
-  uint i;
   DLOG ("TX: tx_cnt=%d", e1000e->tx_cnt);
+  return tx_reclaim (budget);
+}
 
-  /* find descriptors that have completed */
-  for (i=0; i<TDESC_COUNT; i++) {
-    if (e1000e->tdescs[i].cmd && (e1000e->tdescs[i].sta & TDESC_STA_DD)) {
-      e1000e->tdescs[i].cmd = 0;
-      e1000e->tdescs[i].sta = 0;
-      e1000e->tx_cnt--;
-    }
-  }
+static void
+e1000e_irq_enable (bool enable)
+{
+  if (enable)
+    IMS = IMS_RXT | IMS_TXQE;
+  else
+    IMC = IMS_RXT | IMS_TXQE;
+}
+
+static void
+e1000e_set_itr (uint usec)
+{
+  ITR = usec * 1000 / 256;
 }
 
 extern void
 e1000e_poll (void)
 {
-  e1000e_rx_poll ();
-  handle_tx (ICR_TXQE);
+  e1000e_rx_poll (RDESC_COUNT);
+  klock_lock (&net_lock);
+  tx_reclaim (TDESC_COUNT);
+  klock_unlock (&net_lock);
 }
 
+static uint32 e1000e_bh_stack[1024] ALIGNED (0x1000);
+
 static uint32
 e1000e_irq_handler (uint8 vec)
 {
   /* ICR is cleared upon read; this implicitly acknowledges the
-   * interrupt. */
+   * interrupt.  The poll thread looks at both rings whatever the
+   * cause. */
   uint32 icr = ICR;
   DLOG ("IRQ: ICR=%p", icr);
 
-  if (icr & ICR_RXT)            /* RX */
-    e1000e_rx_poll ();
-  if (icr & ICR_TXQE)           /* TX queue empty */
-    handle_tx (icr);
+  net_napi_schedule (&e1000e_ethdev);
 
   return 0;
 }
@@ -333,7 +390,9 @@ reset (void)
 
   /* set up rdesc addresses */
   for (i=0; i<RDESC_COUNT; i++) {
-    e1000e->rdescs[i].address = V2P (uint64, e1000e->rbufs[i]);
+    if (e1000e->rx_buf[i] == NULL)
+      e1000e->rx_buf[i] = net_rxbuf_get (&e1000e_rxpool);
+    e1000e->rdescs[i].address = e1000e->rx_buf[i]->phys;
     e1000e->rdescs[i].status = 0;
   }
 
@@ -354,7 +413,7 @@ reset (void)
 
   /* set up tdesc addresses */
   for (i=0; i<TDESC_COUNT; i++) {
-    e1000e->tdescs[i].address = V2P (uint64, e1000e->tbufs[i]);
+    e1000e->tdescs[i].address = 0;
     e1000e->tdescs[i].sta = 0;
   }
 
@@ -368,6 +427,7 @@ reset (void)
   TDT = 0;
 
   e1000e->tx_cnt = 0;
+  e1000e->tx_clean = 0;
 
   DLOG ("TDBAL=%p TDLEN=%p TDH=%d TDT=%d",
         V2P (uint32, e1000e->tdescs), TDESC_COUNT * sizeof (struct e1000e_tdesc),
@@ -498,6 +558,12 @@ e1000e_init (void)
 
   DLOG ("DMA region at virt=%p phys=%p count=%d", e1000e, e1000e_phys, frame_count);
 
+  /* receive buffers are lent to lwIP, so keep spares beyond the ring */
+  if (!net_rxpool_init (&e1000e_rxpool, RDESC_COUNT + RBUF_SPARE, RBUF_SIZE)) {
+    DLOG ("Unable to allocate receive buffers");
+    goto abort_virt;
+  }
+
   if (!pci_get_interrupt (device_index, &irq_line, &irq_pin)) {
     DLOG ("Unable to get IRQ");
     goto abort_virt;
@@ -534,15 +600,23 @@ e1000e_init (void)
 
   /* Register network device with net subsystem */
   e1000e_ethdev.recv_func = NULL;
-  e1000e_ethdev.send_func = e1000e_transmit;
+  e1000e_ethdev.send_func = NULL;
+  e1000e_ethdev.send_pbuf_func = e1000e_transmit_pbuf;
   e1000e_ethdev.get_hwaddr_func = e1000e_get_hwaddr;
   e1000e_ethdev.poll_func = e1000e_poll;
+  net_napi_init (&e1000e_ethdev, e1000e_rx_poll, e1000e_tx_clean,
+                 e1000e_irq_enable, e1000e_set_itr);
 
   if (!net_register_device (&e1000e_ethdev)) {
     DLOG ("registration failed");
     goto abort_virt;
   }
 
+  if (!net_napi_start (&e1000e_ethdev, &e1000e_bh_stack[1023], "Intel e1000e")) {
+    DLOG ("Unable to start bottom half");
+    goto abort_virt;
+  }
+
   return TRUE;
 
  abort_virt:
@@ -71,8 +71,13 @@
 #include "util/printf.h"
 #include "util/circular.h"
 #include "sched/sched.h"
+#include "sched/vcpu.h"
 #include "module/header.h"
 #include "kernel.h"
+#include "smp/klock.h"
+#include "mem/physical.h"
+#include "mem/virtual.h"
+#include "mem/malloc.h"
 #include "arch/i386-div64.h"
 
 //#define DEBUG_NETIF
@@ -101,7 +106,7 @@ struct ethernetif {
 };
 
 /* Forward declarations. */
-static void  ethernetif_input(struct netif *netif);
+static void  ethernetif_input(struct netif *netif, struct pbuf *p);
 
 /**
  * In this function, the hardware should be initialized.
@@ -143,33 +148,114 @@ low_level_init(struct netif *netif)
  *       dropped because of memory failure (except for the TCP timers).
  */
 
+/* Split the pbuf chain p into physically contiguous pieces, for a
+ * scatter-gather transmit.  Returns the number of pieces, or -1 if
+ * there would be more than max. */
+int
+net_pbuf_dma_map (struct pbuf *p, net_dma_seg *segs, int max)
+{
+  int n = 0;
+
+  for (; p != NULL; p = p->next) {
+    uint8 *va = p->payload;
+    u32 left = p->len, chunk, phys;
+
+    while (left > 0) {
+      /* a piece may not cross a page boundary */
+      chunk = 0x1000 - ((u32) va & 0xFFF);
+      if (chunk > left)
+        chunk = left;
+      phys = (u32) get_phys_addr (va);
+      if (n > 0 && segs[n - 1].phys + segs[n - 1].len == phys)
+        segs[n - 1].len += chunk;
+      else {
+        if (n == max)
+          return -1;
+        segs[n].phys = phys;
+        segs[n].len = chunk;
+        n++;
+      }
+      va += chunk;
+      left -= chunk;
+    }
+  }
+  return n;
+}
+
+/* The driver keeps a reference to p until the frame is on the wire.
+ * Only pbufs that lwIP will not reuse once we return may be lent
+ * that way: ROM and REF pbufs (e.g. IP fragments, built in a static
+ * buffer) are gathered into a fresh PBUF_RAM first, as are chains
+ * with more pieces than the driver can describe. */
+static err_t
+low_level_output_pbuf(ethernet_device *dev, struct pbuf *p)
+{
+  struct pbuf *q;
+  sint ret = -1;
+
+  for (q = p; q != NULL; q = q->next)
+    if (q->type != PBUF_RAM && q->type != PBUF_POOL &&
+        !(q->flags & PBUF_FLAG_IS_CUSTOM))
+      break;
+
+  if (q == NULL)
+    ret = dev->send_pbuf_func (p);
+
+  if (ret < 0) {
+    q = pbuf_alloc(PBUF_RAW, p->tot_len, PBUF_RAM);
+    if (q == NULL) {
+      LINK_STATS_INC(link.memerr);
+      return ERR_MEM;
+    }
+    pbuf_copy(q, p);
+    ret = dev->send_pbuf_func (q);
+    pbuf_free(q);
+    dev->tx_coalesced++;
+  } else
+    dev->tx_mapped++;
+
+  return ret == p->tot_len ? ERR_OK : ERR_BUF;
+}
+
 static err_t
 low_level_output(struct netif *netif, struct pbuf *p)
 {
   struct ethernetif *ethernetif = netif->state;
   struct pbuf *q;
   uint8 buffer[MAX_FRAME_SIZE], *ptr; /* this is a kludge for the moment */
+  err_t err;
 
 #if ETH_PAD_SIZE
   pbuf_header(p, -ETH_PAD_SIZE); /* drop the padding word */
 #endif
 
-  ptr = buffer;
-  for(q = p; q != NULL; q = q->next) {
-    /* Send the data from the pbuf to the interface, one pbuf at a
-       time. The size of the data in each pbuf is kept in the ->len
-       variable. */
-    memcpy(ptr, q->payload, q->len);
-    ptr += q->len;
-  }
+  if (ethernetif->dev->send_pbuf_func)
+    err = low_level_output_pbuf (ethernetif->dev, p);
+  else {
+    ptr = buffer;
+    for(q = p; q != NULL; q = q->next) {
+      /* Send the data from the pbuf to the interface, one pbuf at a
+         time. The size of the data in each pbuf is kept in the ->len
+         variable. */
+      memcpy(ptr, q->payload, q->len);
+      ptr += q->len;
+    }
 
-  if (ethernetif->dev->send_func (buffer, p->tot_len) != p->tot_len)
-    return ERR_BUF;
+    if (ethernetif->dev->send_func (buffer, p->tot_len) != p->tot_len)
+      err = ERR_BUF;
+    else
+      err = ERR_OK;
+  }
 
 #if ETH_PAD_SIZE
   pbuf_header(p, ETH_PAD_SIZE); /* reclaim the padding word */
 #endif
 
+  if (err != ERR_OK) {
+    LINK_STATS_INC(link.drop);
+    return err;
+  }
+
   LINK_STATS_INC(link.xmit);
 
   return ERR_OK;
@@ -254,11 +340,10 @@ low_level_input(struct netif *netif)
  * @param netif the lwip network interface structure for this ethernetif
  */
 static void
-ethernetif_input(struct netif *netif)
+ethernetif_input(struct netif *netif, struct pbuf *p)
 {
   /*struct ethernetif *ethernetif;*/
   struct eth_hdr *ethhdr;
-  struct pbuf *p = low_level_input (netif);
 
   if (!p) return;
 
@@ -340,9 +425,243 @@ static void
 dispatch(ethernet_device *dev, uint8* buf, sint len)
 {
   struct ethernetif *ethernetif = dev->netif.state;
+  /* Drivers deliver frames from their own threads, so all of lwIP
+   * input runs under net_lock */
+  klock_lock (&net_lock);
   ethernetif->cur_buf = buf;
   ethernetif->cur_len = len;
-  ethernetif_input (&dev->netif);
+  ethernetif_input (&dev->netif, low_level_input (&dev->netif));
+  klock_unlock (&net_lock);
+}
+
+/* ************************************************** */
+
+/* Zero-copy receive buffers (see ethernet.h) */
+
+static void
+net_rxbuf_free (struct pbuf *p)
+{
+  net_rxbuf *b = (net_rxbuf *) p;
+  net_rxpool *pool = b->pool;
+
+  spinlock_lock (&pool->lock);
+  b->next = pool->free;
+  pool->free = b;
+  pool->nfree++;
+  spinlock_unlock (&pool->lock);
+}
+
+/* Allocate count DMA buffers of buf_size bytes, which must divide the
+ * page size. */
+bool
+net_rxpool_init (net_rxpool *pool, uint count, uint buf_size)
+{
+  uint i, per_page, pages;
+  u32 phys;
+  uint8 *virt;
+
+  if (buf_size == 0 || buf_size > 0x1000 || (0x1000 % buf_size) != 0)
+    return FALSE;
+  per_page = 0x1000 / buf_size;
+  pages = (count + per_page - 1) / per_page;
+
+  pool->bufs = kzalloc (count * sizeof (net_rxbuf));
+  if (pool->bufs == NULL)
+    return FALSE;
+
+  phys = alloc_phys_frames (pages);
+  if (phys == (u32) -1)
+    goto abort_bufs;
+
+  virt = map_contiguous_virtual_pages (phys | 3, pages);
+  if (virt == NULL)
+    goto abort_phys;
+
+  spinlock_initialise (&pool->lock);
+  pool->free = NULL;
+  for (i = 0; i < count; i++) {
+    net_rxbuf *b = &pool->bufs[i];
+    b->pool = pool;
+    b->data = virt + i * buf_size;
+    b->phys = phys + i * buf_size;
+    b->pc.custom_free_function = net_rxbuf_free;
+    b->next = pool->free;
+    pool->free = b;
+  }
+  pool->count = pool->nfree = count;
+  pool->buf_size = buf_size;
+  pool->lent = pool->copied = pool->starved = 0;
+
+  DLOG ("rxpool: %d buffers of %d bytes at phys=%p", count, buf_size, phys);
+  return TRUE;
+
+ abort_phys:
+  free_phys_frames (phys, pages);
+ abort_bufs:
+  kfree (pool->bufs);
+  return FALSE;
+}
+
+net_rxbuf *
+net_rxbuf_get (net_rxpool *pool)
+{
+  net_rxbuf *b;
+
+  spinlock_lock (&pool->lock);
+  b = pool->free;
+  if (b) {
+    pool->free = b->next;
+    pool->nfree--;
+  }
+  spinlock_unlock (&pool->lock);
+  return b;
+}
+
+/* Pass the frame of len bytes in *slot up the stack.  If the pool
+ * has a spare, the buffer itself is lent to lwIP and *slot becomes
+ * the spare, so the driver must re-read (*slot)->phys for its
+ * descriptor.  Otherwise the frame is copied and *slot is unchanged.
+ * Called from the driver's receive path, without net_lock. */
+void
+net_rx_deliver (ethernet_device *dev, net_rxpool *pool, net_rxbuf **slot,
+                sint len)
+{
+  net_rxbuf *b = *slot, *spare = NULL;
+  struct pbuf *p;
+
+  if (len >= NET_RX_COPYBREAK) {
+    spare = net_rxbuf_get (pool);
+    if (spare == NULL)
+      pool->starved++;
+  }
+
+  if (spare == NULL) {
+    pool->copied++;
+    if (dev->recv_func)
+      dev->recv_func (dev, b->data, len);
+    return;
+  }
+
+  *slot = spare;
+  pool->lent++;
+  /* The whole buffer is the pbuf's payload_mem, so that lwIP can move
+   * back over headers it has stripped, e.g. to answer a ping in place */
+  p = pbuf_alloced_custom (PBUF_RAW, len, PBUF_REF, &b->pc,
+                           b->data, pool->buf_size);
+  if (p == NULL) {
+    net_rxbuf_free ((struct pbuf *) b);
+    return;
+  }
+
+  klock_lock (&net_lock);
+  LINK_STATS_INC(link.recv);
+  ethernetif_input (&dev->netif, p);
+  klock_unlock (&net_lock);
+}
+
+/* ************************************************** */
+
+/* NAPI-style bottom halves (see ethernet.h) */
+
+void
+net_napi_init (ethernet_device *dev,
+               net_napi_poll_func_t rx_poll,
+               net_napi_poll_func_t tx_clean,
+               net_napi_irq_func_t irq_enable,
+               net_napi_itr_func_t set_itr)
+{
+  net_napi *n = &dev->napi;
+
+  memset (n, 0, sizeof (net_napi));
+  n->rx_poll = rx_poll;
+  n->tx_clean = tx_clean;
+  n->irq_enable = irq_enable;
+  n->set_itr = set_itr;
+  n->rx_budget = NET_NAPI_RX_BUDGET;
+  n->tx_budget = NET_NAPI_TX_BUDGET;
+  net_napi_set_itr (dev, NET_NAPI_ITR_USEC);
+}
+
+void
+net_napi_set_itr (ethernet_device *dev, uint usec)
+{
+  dev->napi.itr_usec = usec;
+  if (dev->napi.set_itr)
+    dev->napi.set_itr (usec);
+}
+
+/* Called from the driver's IRQ handler, once the device has been
+ * acknowledged. */
+void
+net_napi_schedule (ethernet_device *dev)
+{
+  net_napi *n = &dev->napi;
+
+  lock_kernel ();
+  n->irqs++;
+  if (!n->scheduled && n->thread) {
+    n->scheduled = TRUE;
+    n->irq_enable (FALSE);
+    /* runs at the IO-VCPU's own period */
+    iovcpu_job_wakeup (n->thread, vcpu_lookup (n->thread->cpu)->T);
+  }
+  unlock_kernel ();
+}
+
+static void
+net_napi_thread (ethernet_device *dev)
+{
+  net_napi *n = &dev->napi;
+  uint rx, tx;
+
+  DLOG ("napi: en%d thread id=0x%x", dev->num, str ()->tid);
+
+  for (;;) {
+    n->polls++;
+
+    /* freeing the frames' pbufs needs the stack's lock */
+    klock_lock (&net_lock);
+    tx = n->tx_clean (n->tx_budget);
+    klock_unlock (&net_lock);
+
+    rx = n->rx_poll (n->rx_budget);
+
+    n->tx_descs += tx;
+    n->rx_frames += rx;
+    if (tx >= n->tx_budget)
+      n->tx_exhausted++;
+    if (rx >= n->rx_budget)
+      n->rx_exhausted++;
+
+    if (rx < n->rx_budget && tx < n->tx_budget) {
+      /* Caught up: take interrupts again.  Anything that arrived
+       * while they were masked is still latched in the device, so
+       * it interrupts straight away. */
+      n->scheduled = FALSE;
+      n->irq_enable (TRUE);
+    } else
+      /* more work: stay runnable, within the IO-VCPU's budget */
+      wakeup (str ());
+
+    iovcpu_job_completion ();
+  }
+}
+
+/* Create the device's poll thread on a network IO-VCPU and unmask
+ * its interrupts. */
+bool
+net_napi_start (ethernet_device *dev, u32 *stack_top, const char *name)
+{
+  net_napi *n = &dev->napi;
+
+  n->thread = create_kernel_thread_args ((u32) net_napi_thread,
+                                         (u32) stack_top, name,
+                                         FALSE, 1, dev);
+  if (n->thread == NULL)
+    return FALSE;
+  set_iovcpu (n->thread, IOVCPU_CLASS_NET);
+  n->irq_enable (TRUE);
+  return TRUE;
 }
 
 /* ************************************************** */
@@ -822,7 +1141,6 @@ net_init(void)
   net_tmr_pid = start_kernel_thread ((uint) net_tmr_thread,
                                      (uint) &net_tmr_stack[1023],
                                      "Network Timer Thread");
-  uint select_iovcpu (u32);
   net_tmr_pid->cpu = select_iovcpu (0);
   ethernet_device_count = 0;
 
@@ -958,6 +1276,8 @@ net_tmr_process(void)
 
   uint32 now = tick;
 
+  klock_lock (&net_lock);
+
   /* assume HZ=100 */
 
   if (now >= next_tcp_time) {
@@ -981,6 +1301,8 @@ net_tmr_process(void)
     next_dhcp_fine_time = now + (DHCP_FINE_TIMER_MSECS / 10);
   }
 #endif
+
+  klock_unlock (&net_lock);
 }
 
 static const struct module_ops mod_ops = {
@@ -34,6 +34,7 @@
 #include "kernel.h"
 #include "sched/vcpu.h"
 #include "sched/sched.h"
+#include "smp/klock.h"
 #include "module/header.h"
 
 #ifdef USE_VMX
@@ -586,6 +587,7 @@ struct RxDesc {
 struct ring_info {
   struct sk_buff        *skb;
   u32           len;
+  struct pbuf   *p;             /* zero-copy frame, on its last descriptor */
   u8            __pad[sizeof(void *) - sizeof(u32)];
 };
 
@@ -1679,6 +1681,23 @@ rx_int (struct rtl8169_private *tp)
 
 uint32 free_skb_count = 0;
 static inline void free_skb (struct sk_buff *);
+
+/* Free what a completed TX descriptor was holding */
+static inline void
+tx_release (struct ring_info *tx_skb)
+{
+  if (tx_skb->skb) {
+    free_skb (tx_skb->skb);
+    tx_skb->skb = NULL;
+    free_skb_count++;
+  }
+  if (tx_skb->p) {
+    pbuf_free (tx_skb->p);
+    tx_skb->p = NULL;
+  }
+  tx_skb->len = 0;
+}
+
 static void
 tx_int (struct rtl8169_private *tp)
 {
@@ -1686,6 +1705,9 @@ tx_int (struct rtl8169_private *tp)
   uint dirty_tx, tx_left;
 #ifdef USE_VMX
   spinlock_lock (r8169_tx_lock);
+#else
+  /* completed frames may hold lwIP pbufs */
+  klock_lock (&net_lock);
 #endif
   dirty_tx = tp->dirty_tx;
   tx_left = tp->cur_tx - dirty_tx;
@@ -1706,9 +1728,7 @@ tx_int (struct rtl8169_private *tp)
 
     DLOG ("TX: entry %d sent %d bytes", entry, tx_skb->len);
     desc->opts1 = desc->opts2 = desc->addr = 0;
-    tx_skb->len = 0;
-    free_skb (tx_skb->skb);
-    free_skb_count++;
+    tx_release (tx_skb);
 
     dirty_tx++;
     tx_left--;
@@ -1726,6 +1746,8 @@ tx_int (struct rtl8169_private *tp)
   }
 #ifdef USE_VMX
   spinlock_unlock (r8169_tx_lock);
+#else
+  klock_unlock (&net_lock);
 #endif
 }
 
@@ -3625,9 +3647,7 @@ r8169_transmit (u8 *buffer, sint len)
       }
 
       desc->opts1 = desc->opts2 = desc->addr = 0;
-      tx_skb->len = 0;
-      free_skb (tx_skb->skb);
-      free_skb_count++;
+      tx_release (tx_skb);
 
       dirty_tx++;
       tx_left--;
@@ -3686,6 +3706,73 @@ r8169_transmit (u8 *buffer, sint len)
   return -1;
 }
 
+#ifndef USE_VMX
+/* Scatter-gather transmit straight from the pbufs.  Not with
+ * USE_VMX: the ring is shared by the sandboxes and only the master
+ * reclaims it, and it cannot free another sandbox's pbufs, so there
+ * frames are still copied into shared memory. */
+static sint
+r8169_transmit_pbuf (struct pbuf *p)
+{
+  net_dma_seg segs[NET_TX_MAX_SEGS];
+  void __iomem *ioaddr = tp->mmio_addr;
+  struct TxDesc *txd;
+  uint entry, dirty_tx;
+  u32 opts1;
+  int i, n;
+
+  DLOG ("TX: pbuf=0x%p len=%d", p, p->tot_len);
+
+  if (p->tot_len > MAX_FRAME_SIZE)
+    return 0;
+
+  n = net_pbuf_dma_map (p, segs, NET_TX_MAX_SEGS);
+  if (n < 0)
+    return -1;
+
+  /* reclaim finished descriptors */
+  for (dirty_tx = tp->dirty_tx; dirty_tx != tp->cur_tx; dirty_tx++) {
+    entry = dirty_tx % NUM_TX_DESC;
+    txd = tp->TxDescArray + entry;
+    if (le32_to_cpu (txd->opts1) & DescOwn)
+      break;
+    txd->opts1 = txd->opts2 = txd->addr = 0;
+    tx_release (tp->tx_skb + entry);
+  }
+  tp->dirty_tx = dirty_tx;
+
+  if (tp->cur_tx + n - tp->dirty_tx > NUM_TX_DESC - 1)
+    return 0;
+
+  /* Fill in from the last piece back, so that the hardware cannot
+   * see the first descriptor before the rest are ready. */
+  for (i = n - 1; i >= 0; i--) {
+    entry = (tp->cur_tx + i) % NUM_TX_DESC;
+    txd = tp->TxDescArray + entry;
+    opts1 = DescOwn | segs[i].len | (RingEnd * !((entry + 1) % NUM_TX_DESC));
+    if (i == 0)
+      opts1 |= FirstFrag;
+    if (i == n - 1) {
+      opts1 |= LastFrag;
+      tp->tx_skb[entry].p = p;
+    }
+    tp->tx_skb[entry].len = segs[i].len;
+    txd->addr = __cpu_to_le64 (segs[i].phys);
+    txd->opts2 = 0;
+    wmb ();
+    txd->opts1 = __cpu_to_le32 (opts1);
+  }
+
+  /* hold the frame until its last descriptor is done */
+  pbuf_ref (p);
+  tp->cur_tx += n;
+
+  RTL_W8 (TxPoll, NPQ); /* set polling bit */
+
+  return p->tot_len;
+}
+#endif
+
 #ifdef TX_TIMING
 static u32 timing_stack[1024] ALIGNED (0x1000);
 static quest_tss *timing_id;
@@ -3918,6 +4005,9 @@ r8169_init (void)
   for (i = 0; i < MAX_NUM_SHARE; i++) {
     tp->ethdev[i].recv_func = NULL;
     tp->ethdev[i].send_func = r8169_transmit;
+#ifndef USE_VMX
+    tp->ethdev[i].send_pbuf_func = r8169_transmit_pbuf;
+#endif
     tp->ethdev[i].get_hwaddr_func = r8169_get_hwaddr;
     tp->ethdev[i].poll_func = r8169_poll;
     tp->ethdev[i].drvdata = tp;
@@ -4020,6 +4110,7 @@ r8169_register (void)
   cpu = get_pcpu_id ();
   uint8 vector = 0;
   uint64 flags = 0;
+  uint32 dest;
 
   if (cpu >= MAX_NUM_SHARE) {
     DLOG ("Too many sandboxes");
@@ -4047,9 +4138,24 @@ r8169_register (void)
     return FALSE;
   }
 
-  /* Ask IOAPIC for interrupt delivery to THIS sandbox (core) */
-  IOAPIC_map_GSI (irq_backup.gsi, vector, flags |
-                  (((uint64)(get_logical_dest_addr (cpu))) << 56));
+  /* Ask IOAPIC for interrupt delivery to THIS sandbox (core) as well.
+   * A logical destination names every sharing sandbox, but only CPUs
+   * with a logical ID that fits in its 8 bits can be added to it; the
+   * others (CPUs from 8 up in xAPIC mode) have none.  Such a CPU can
+   * only take the interrupt alone, in physical mode, and only if no
+   * other sandbox relies on it yet. */
+  dest = get_logical_dest_addr (cpu);
+  if (dest && dest <= 0xFF && (flags & IOAPIC_DESTINATION_LOGICAL)) {
+    flags |= ((uint64) dest) << 56;
+  } else if (num_sharing.counter == 0 && CPU_to_APIC[cpu] < 0xFF) {
+    flags &= ~((0xFFULL << 56) | IOAPIC_DESTINATION_LOGICAL);
+    flags |= ((uint64) CPU_to_APIC[cpu]) << 56;
+  } else {
+    logger_printf ("r8169: cannot route the IRQ to sandbox %d too\n", cpu);
+    flags = 0;
+  }
+  if (flags)
+    IOAPIC_map_GSI (irq_backup.gsi, vector, flags);
 
   atomic_inc (&num_sharing);
   logger_printf ("r8169: %d sandboxes sharing this driver\n", num_sharing.counter);
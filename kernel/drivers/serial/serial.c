@@ -18,6 +18,31 @@ serial_putc (char c)
   outb (c, serial_port1);
 }
 
+#define UART_FIFO_SIZE 16
+
+/* Like serial_putc for n characters, but waits for the transmitter
+ * only once per FIFO-full rather than once per character. */
+void
+serial_write (const char *p, int n)
+{
+  int room = 0;
+
+  while (n > 0) {
+    if (room < 2) {
+      /* an empty holding register means an empty FIFO */
+      while (!(inb (serial_port1 + 5) & 0x20));
+      room = UART_FIFO_SIZE;
+    }
+    if (*p == '\n') {
+      outb ('\r', serial_port1);
+      room--;
+    }
+    outb (*p++, serial_port1);
+    room--;
+    n--;
+  }
+}
+
 int serial_getc (void)
 {
   unlock_kernel();
@@ -22,6 +22,7 @@
 #include <kernel.h>
 #include "sched/sched.h"
 #include <mem/malloc.h>
+#include <mem/slab.h>
 
 #define DEBUG_USB
 
@@ -273,18 +274,41 @@ void usb_kill_urb(struct urb *urb)
 
 
 
+/* URBs without isochronous packets all have the same size, so they
+ * come from an object cache; the others from kmalloc. */
+static kmem_cache urb_cache =
+  KMEM_CACHE_INIT ("urb", sizeof (struct urb), 0, NULL);
+
 struct urb *usb_alloc_urb(int iso_packets, gfp_t mem_flags)
 {
-  struct urb *urb = kmalloc(sizeof(struct urb) +
-                            iso_packets * sizeof(struct usb_iso_packet_descriptor));
+  struct urb *urb;
+  bool cached = (iso_packets == 0);
+
+  if (cached)
+    urb = kmem_cache_alloc(&urb_cache);
+  else
+    urb = kmalloc(sizeof(struct urb) +
+                  iso_packets * sizeof(struct usb_iso_packet_descriptor));
   if (!urb) {
     DLOG("Failed to allocate urb");
     return NULL;
   }
-  usb_init_urb(urb);
+  memset(urb, 0, sizeof(*urb));
+  urb->cached = cached;
   return urb;
 }
 
+void usb_free_urb(struct urb *urb)
+{
+  if(urb) {
+    if(urb->hcpriv) kfree(urb->hcpriv);
+    if(urb->cached)
+      kmem_cache_free(&urb_cache, urb);
+    else
+      kfree(urb);
+  }
+}
+
 int usb_rt_iso_update_packets(struct urb* urb, int max_packets)
 {
   return urb->dev->hcd->rt_iso_update_packets(urb, max_packets);
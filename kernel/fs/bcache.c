@@ -0,0 +1,415 @@
+/*                    The Quest Operating System
+ *  Copyright (C) 2005-2012  Richard West, Boston University
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Block cache for the filesystem backends.
+ *
+ * Devices are read through bcache_read () instead of their sector
+ * routines.  The cache holds BCACHE_BLOCKS blocks of BCACHE_BLOCK_SIZE
+ * bytes each, keyed by (device, block), and recycles them in LRU
+ * order.  A block covers BCACHE_BLOCK_SIZE / sector_size consecutive
+ * sectors, so even a one-sector miss fetches its neighbours.  When a
+ * device is read sequentially, the next dev->readahead blocks are
+ * fetched as well, each time half of that window has been consumed.
+ * A device with a read_blocks hook gets the missing blocks of the
+ * window as one batch.
+ *
+ * Filesystems are read-only in Quest, so blocks never need writing
+ * back or invalidating.
+ *
+ * A small name cache maps (device, path) to a few bytes of
+ * backend-specific lookup state, such as an inode number.  With it a
+ * repeated open skips the directory walk.
+ *
+ * All callers hold vfs_lock, which serialises the backends, so the
+ * cache has no lock of its own. */
+
+#include "kernel.h"
+#include "fs/bcache.h"
+#include "mem/mem.h"
+#include "util/printf.h"
+#include "util/debug.h"
+
+//#define DEBUG_BCACHE
+
+#ifdef DEBUG_BCACHE
+#define DLOG(fmt,...) DLOG_PREFIX("bcache",fmt,##__VA_ARGS__)
+#else
+#define DLOG(fmt,...) ;
+#endif
+
+#define BCACHE_BLOCKS 256       /* 1 MiB of cached data */
+#define BCACHE_BUCKETS 64
+#define BCACHE_NAMES 32
+#define BCACHE_PATH_LEN 64
+#define BCACHE_NAME_VAL 16
+#define BCACHE_MAX_READAHEAD 32
+
+struct bcache_block
+{
+  bcache_dev *dev;              /* NULL if unused */
+  u32 block;
+  u8 *data;
+  struct bcache_block *hnext;   /* hash chain */
+  struct bcache_block *prev, *next;     /* LRU list */
+};
+
+struct bcache_name
+{
+  bcache_dev *dev;              /* NULL if unused */
+  char path[BCACHE_PATH_LEN];
+  u8 val[BCACHE_NAME_VAL];
+  u32 last_use;
+};
+
+static struct bcache_block blocks[BCACHE_BLOCKS];
+static struct bcache_block *hash[BCACHE_BUCKETS];
+static struct bcache_block *lru_head = NULL, *lru_tail = NULL;
+static struct bcache_name names[BCACHE_NAMES];
+static u32 name_clock = 0;
+static bcache_dev *devices = NULL;
+
+#define BUCKET(dev, blk) ((((u32) (dev) >> 4) + (blk)) % BCACHE_BUCKETS)
+
+void
+bcache_register (bcache_dev *dev)
+{
+  if (dev->registered)
+    return;
+  dev->registered = TRUE;
+  dev->last_block = -1;
+  dev->next = devices;
+  devices = dev;
+}
+
+static void
+lru_unlink (struct bcache_block *b)
+{
+  if (b->prev)
+    b->prev->next = b->next;
+  else
+    lru_head = b->next;
+  if (b->next)
+    b->next->prev = b->prev;
+  else
+    lru_tail = b->prev;
+  b->prev = b->next = NULL;
+}
+
+static void
+lru_push (struct bcache_block *b)
+{
+  b->prev = NULL;
+  b->next = lru_head;
+  if (lru_head)
+    lru_head->prev = b;
+  else
+    lru_tail = b;
+  lru_head = b;
+}
+
+static void
+hash_remove (struct bcache_block *b)
+{
+  struct bcache_block **pp = &hash[BUCKET (b->dev, b->block)];
+
+  for (; *pp; pp = &(*pp)->hnext)
+    if (*pp == b) {
+      *pp = b->hnext;
+      break;
+    }
+  b->hnext = NULL;
+}
+
+static struct bcache_block *
+lookup (bcache_dev *dev, u32 blk)
+{
+  struct bcache_block *b;
+
+  for (b = hash[BUCKET (dev, blk)]; b; b = b->hnext)
+    if (b->dev == dev && b->block == blk)
+      return b;
+  return NULL;
+}
+
+/* Take a recycled cache entry off the lists */
+static struct bcache_block *
+claim (void)
+{
+  static u32 next_unused = 0;
+  struct bcache_block *b;
+
+  if (next_unused < BCACHE_BLOCKS) {
+    b = &blocks[next_unused];
+    b->data = kmalloc (BCACHE_BLOCK_SIZE);
+    if (b->data)
+      next_unused++;
+    else if (!lru_tail)
+      return NULL;
+    else
+      b = lru_tail;
+  } else
+    b = lru_tail;
+
+  if (b->dev) {
+    b->dev->evictions++;
+    hash_remove (b);
+  }
+  if (b->prev || b->next || lru_head == b)
+    lru_unlink (b);
+  b->dev = NULL;
+  return b;
+}
+
+static void
+insert (struct bcache_block *b, bcache_dev *dev, u32 blk)
+{
+  b->dev = dev;
+  b->block = blk;
+  b->hnext = hash[BUCKET (dev, blk)];
+  hash[BUCKET (dev, blk)] = b;
+  lru_push (b);
+}
+
+/* Leave a claimed entry unused, at the cold end */
+static void
+discard (struct bcache_block *b)
+{
+  b->next = NULL;
+  b->prev = lru_tail;
+  if (lru_tail)
+    lru_tail->next = b;
+  else
+    lru_head = b;
+  lru_tail = b;
+}
+
+/* Read a block from the device into a recycled cache entry */
+static struct bcache_block *
+fill (bcache_dev *dev, u32 blk)
+{
+  u32 spb = BCACHE_BLOCK_SIZE / dev->sector_size;
+  struct bcache_block *b = claim ();
+
+  if (!b)
+    return NULL;
+  if (dev->read (dev, blk * spb, spb, b->data) != 0) {
+    discard (b);
+    return NULL;
+  }
+  insert (b, dev, blk);
+  return b;
+}
+
+/* Fetch the missing blocks of the window after blk, once the reader
+ * is half way through it. */
+static void
+readahead (bcache_dev *dev, u32 blk)
+{
+  struct bcache_block *run[BCACHE_MAX_READAHEAD];
+  u32 sectors[BCACHE_MAX_READAHEAD];
+  u8 *bufs[BCACHE_MAX_READAHEAD];
+  u32 spb = BCACHE_BLOCK_SIZE / dev->sector_size;
+  u32 i, n = 0, ra = dev->readahead;
+
+  if (ra > BCACHE_MAX_READAHEAD)
+    ra = BCACHE_MAX_READAHEAD;
+  if (ra > 1 && lookup (dev, blk + ra / 2 + 1))
+    return;
+
+  for (i = 1; i <= ra; i++) {
+    if (lookup (dev, blk + i))
+      continue;
+    if (!dev->read_blocks) {
+      if (!fill (dev, blk + i))
+        return;
+      dev->readaheads++;
+      continue;
+    }
+    if (!(run[n] = claim ()))
+      break;
+    sectors[n] = (blk + i) * spb;
+    bufs[n] = run[n]->data;
+    n++;
+  }
+  if (n == 0)
+    return;
+
+  if (dev->read_blocks (dev, sectors, spb, bufs, n) != 0) {
+    for (i = 0; i < n; i++)
+      discard (run[i]);
+    return;
+  }
+  for (i = 0; i < n; i++)
+    insert (run[i], dev, sectors[i] / spb);
+  dev->readaheads += n;
+}
+
+static struct bcache_block *
+get_block (bcache_dev *dev, u32 blk)
+{
+  struct bcache_block *b = lookup (dev, blk);
+  bool sequential = (blk == dev->last_block + 1);
+
+  if (b) {
+    dev->hits++;
+    lru_unlink (b);
+    lru_push (b);
+  } else {
+    dev->misses++;
+    b = fill (dev, blk);
+  }
+  dev->last_block = blk;
+
+  /* Keep the window ahead of a sequential reader filled */
+  if (b && sequential)
+    readahead (dev, blk);
+  return b;
+}
+
+/* Uncached read of part of one block, a sector at a time.  Used when
+ * the whole block cannot be read, e.g. at the end of the device. */
+static int
+read_direct (bcache_dev *dev, u32 sector, u32 offset, u32 len, u8 *buf)
+{
+  u8 *s = kmalloc (dev->sector_size);
+  u32 n;
+
+  if (!s)
+    return -1;
+  while (len > 0) {
+    if (dev->read (dev, sector, 1, s) != 0) {
+      kfree (s);
+      return -1;
+    }
+    n = dev->sector_size - offset;
+    if (n > len)
+      n = len;
+    memcpy (buf, s + offset, n);
+    buf += n;
+    len -= n;
+    sector++;
+    offset = 0;
+  }
+  kfree (s);
+  return 0;
+}
+
+/* Read len bytes starting byte_offset bytes into the given sector.
+ * Returns len, or -1 on a device error. */
+int
+bcache_read (bcache_dev *dev, u32 sector, u32 byte_offset, u32 len, u8 *buf)
+{
+  u32 spb = BCACHE_BLOCK_SIZE / dev->sector_size;
+  u32 pos, n, total = len;
+  struct bcache_block *b;
+
+  sector += byte_offset / dev->sector_size;
+  byte_offset %= dev->sector_size;
+
+  while (len > 0) {
+    /* byte position within the cache block */
+    pos = (sector % spb) * dev->sector_size + byte_offset;
+    n = BCACHE_BLOCK_SIZE - pos;
+    if (n > len)
+      n = len;
+
+    if ((b = get_block (dev, sector / spb)))
+      memcpy (buf, b->data + pos, n);
+    else if (read_direct (dev, sector, byte_offset, n, buf) < 0)
+      return -1;
+
+    buf += n;
+    len -= n;
+    pos += n;
+    sector = (sector / spb) * spb + pos / dev->sector_size;
+    byte_offset = pos % dev->sector_size;
+  }
+  return total;
+}
+
+/* Copy the cached lookup state for path into val, if any */
+bool
+bcache_name_lookup (bcache_dev *dev, const char *path, void *val, u32 len)
+{
+  int i;
+
+  for (i = 0; i < BCACHE_NAMES; i++)
+    if (names[i].dev == dev &&
+        strncmp (names[i].path, path, BCACHE_PATH_LEN) == 0) {
+      memcpy (val, names[i].val, len);
+      names[i].last_use = ++name_clock;
+      dev->name_hits++;
+      return TRUE;
+    }
+  dev->name_misses++;
+  return FALSE;
+}
+
+void
+bcache_name_insert (bcache_dev *dev, const char *path, const void *val, u32 len)
+{
+  int i, victim = 0;
+
+  if (strlen (path) >= BCACHE_PATH_LEN || len > BCACHE_NAME_VAL)
+    return;
+  for (i = 0; i < BCACHE_NAMES; i++) {
+    if (!names[i].dev) {
+      victim = i;
+      break;
+    }
+    if (names[i].last_use < names[victim].last_use)
+      victim = i;
+  }
+  names[victim].dev = dev;
+  memcpy (names[victim].path, path, strlen (path) + 1);
+  memcpy (names[victim].val, val, len);
+  names[victim].last_use = ++name_clock;
+}
+
+/* Copy up to max device counters into stats, returning the number
+ * copied. */
+int
+bcache_get_stats (struct bcache_stat *stats, int max)
+{
+  bcache_dev *dev;
+  int i, n = 0;
+
+  for (dev = devices; dev && n < max; dev = dev->next, n++) {
+    for (i = 0; i < BCACHE_NAME_LEN - 1 && dev->name[i]; i++)
+      stats[n].name[i] = dev->name[i];
+    for (; i < BCACHE_NAME_LEN; i++)
+      stats[n].name[i] = '\0';
+    stats[n].hits = dev->hits;
+    stats[n].misses = dev->misses;
+    stats[n].readaheads = dev->readaheads;
+    stats[n].evictions = dev->evictions;
+    stats[n].name_hits = dev->name_hits;
+    stats[n].name_misses = dev->name_misses;
+  }
+  return n;
+}
+
+/* 
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * mode: C
+ * c-file-style: "gnu"
+ * c-basic-offset: 2
+ * End: 
+ */
+
+/* vi: set et sw=2 sts=2: */
@@ -42,6 +42,7 @@
 #include "fs/filesys.h"
 #include "arch/i386.h"
 #include "util/printf.h"
+#include "fs/bcache.h"
 
 extern void ReadSector (void *offset, int cylinder, int head, int sector);
 extern void WriteSector (void *offset, int cylinder, int head, int sector);
@@ -49,6 +50,7 @@ extern void ReadSectorLBA (void *offset, uint32 lba);
 extern void WriteSectorLBA (void *offset, uint32 lba);
 
 static int mapblock1, mapblock2;
+static int loaded_ino = -1;     /* inode held in the INODE buffer */
 static int errnum;
 static char fsys_buf[0x8000];
 static int filepos;
@@ -438,15 +440,46 @@ LBAtoCHS (int LBA, int *cylinder, int *head, int *sector)
 }
 
 
-int
-devread (int sector, int byte_offset, int byte_len, char *buf)
+/* Read count sectors through the ATA driver for the block cache */
+static int
+ext2_dev_read (bcache_dev *dev, u32 sector, u32 count, u8 *buf)
 {
-
-  char sector_buf[SECTOR_SIZE]; /* Temporary sector buffer */
-  int partial_bytes;
+  int CHS = 0;                  /* --??-- Set to non-zero for CHS mode */
   int cyl, hd, sect;
 
-  int CHS = 0;                  /* --??-- Set to non-zero for CHS mode */
+  if (!CHS)
+    /* one request: a single multi-sector command */
+    return ata_drive_read (ATA_BUS_PRIMARY, ATA_DRIVE_MASTER, sector,
+                           count, buf) < 0 ? -1 : 0;
+
+  for (; count > 0; count--, sector++, buf += SECTOR_SIZE) {
+    LBAtoCHS (sector, &cyl, &hd, &sect);
+    ReadSector (buf, cyl, hd, sect);
+  }
+  return 0;
+}
+
+/* Readahead batch: queued together, so the driver merges adjacent
+ * blocks into larger commands. */
+static int
+ext2_dev_read_blocks (bcache_dev *dev, u32 *sectors, u32 count, u8 **bufs,
+                      u32 n)
+{
+  return ata_drive_read_blocks (ATA_BUS_PRIMARY, ATA_DRIVE_MASTER, sectors,
+                                count, bufs, n);
+}
+
+static bcache_dev ext2_dev = {
+  .name = "ext2",
+  .sector_size = SECTOR_SIZE,
+  .read = ext2_dev_read,
+  .read_blocks = ext2_dev_read_blocks,
+  .readahead = 16,
+};
+
+int
+devread (int sector, int byte_offset, int byte_len, char *buf)
+{
 
   /* Hard-code the size of the disk in sectors */
   /* int part_length = ( ( 60 * 63 + 16 ) * 63 ) + 63 - 1; */
@@ -464,61 +497,12 @@ devread (int sector, int byte_offset, int byte_len, char *buf)
   }
 #endif
 
-
-  /*
-   *  Get the read to the beginning of a partition.
-   */
-  sector += byte_offset >> SECTOR_BITS;
-  byte_offset &= SECTOR_SIZE - 1;
-
-  /*
-   *  Perform RAWREAD, which is very similar, but:
-   *
-   *    --  It requires that "sector" is relative to the beginning
-   *            of the disk.
-   *    --  It doesn't handle offsets of more than 511 bytes into the
-   *            sector.
-   */
-
-  /* In what follows, we read the end of first sector, zero or more sectors
-   * followed by (possibly) a partial final sector.
-   *
-   * Round up to a sector boundary -- Will need to read 'partial_bytes' 
-   */
-  if (byte_offset) {
-    partial_bytes = SECTOR_SIZE - byte_offset;
-
-    if (CHS) {
-      LBAtoCHS (sector, &cyl, &hd, &sect);
-      ReadSector (sector_buf, cyl, hd, sect);
-    } else
-      ReadSectorLBA (sector_buf, sector);
-
-    memcpy (buf, sector_buf + byte_offset, partial_bytes);
-    buf += partial_bytes;
-    byte_len -= partial_bytes;
-    sector++;
-  }
-
-  for (; byte_len >= SECTOR_SIZE; byte_len -= SECTOR_SIZE) {
-    if (CHS) {
-      LBAtoCHS (sector, &cyl, &hd, &sect);
-      ReadSector (buf, cyl, hd, sect);
-    } else
-      ReadSectorLBA (buf, sector);
-
-    buf += SECTOR_SIZE;
-    sector++;
-  }
-
-  if (byte_len) {
-    if (CHS) {
-      LBAtoCHS (sector, &cyl, &hd, &sect);
-      ReadSector (sector_buf, cyl, hd, sect);
-    } else
-      ReadSectorLBA (sector_buf, sector);
-
-    memcpy (buf, sector_buf, byte_len);
+  /* Sectors come from the block cache, so re-reading metadata or a
+   * file is a memory copy. */
+  if (bcache_read (&ext2_dev, sector, byte_offset, byte_len,
+                   (u8 *) buf) != byte_len) {
+    errnum = ERR_READ;
+    return 0;
   }
 
   return 1;
@@ -543,6 +527,7 @@ ext2fs_mount (void)
 {
   int retval = 1;
 
+  bcache_register (&ext2_dev);
   if (!devread (SBLOCK, 0, sizeof (struct ext2_super_block),
                 (char *) SUPERBLOCK)
       || SUPERBLOCK->s_magic != EXT2_SUPER_MAGIC)
@@ -744,6 +729,84 @@ ext2_is_fast_symlink (void)
   return INODE->i_blocks == ea_blocks;
 }
 
+/* Load inode INO into the buffer known as INODE.
+ * returns: 0 if error, nonzero on success
+ * side effects: messes up GROUP_DESC buffer area
+ */
+static int
+ext2_read_inode (int ino)
+{
+  int group_id;                 /* which group the inode is in */
+  int group_desc;               /* fs pointer to that group */
+  int desc;                     /* index within that group */
+  int ino_blk;                  /* fs pointer of the inode's information */
+  struct ext2_group_desc *gdp;
+  struct ext2_inode *raw_inode; /* inode info corresponding to ino */
+#ifdef E2DEBUG
+  uint8 *i;
+#endif /* E2DEBUG */
+
+  loaded_ino = -1;              /* INODE is about to be overwritten */
+  group_id = (ino - 1) / (SUPERBLOCK->s_inodes_per_group);
+  group_desc = group_id >> log2 (EXT2_DESC_PER_BLOCK (SUPERBLOCK));
+  desc = group_id & (EXT2_DESC_PER_BLOCK (SUPERBLOCK) - 1);
+#ifdef E2DEBUG
+  printf ("ipg=%d, dpb=%d\n", SUPERBLOCK->s_inodes_per_group,
+          EXT2_DESC_PER_BLOCK (SUPERBLOCK));
+  printf ("group_id=%d group_desc=%d desc=%d\n", group_id, group_desc,
+          desc);
+#endif /* E2DEBUG */
+  if (!ext2_rdfsb ((WHICH_SUPER + group_desc +
+                    SUPERBLOCK->s_first_data_block), (int) GROUP_DESC)) {
+    return 0;
+  }
+  gdp = GROUP_DESC;
+  ino_blk = gdp[desc].bg_inode_table +
+    (((ino - 1) % (SUPERBLOCK->s_inodes_per_group))
+     >> log2 (EXT2_BLOCK_SIZE (SUPERBLOCK) / sizeof (struct ext2_inode)));
+#ifdef E2DEBUG
+  printf ("inode table fsblock=%d\n", ino_blk);
+#endif /* E2DEBUG */
+  if (!ext2_rdfsb (ino_blk, (int) INODE)) {
+    return 0;
+  }
+
+  /* reset indirect blocks! */
+  mapblock2 = mapblock1 = -1;
+
+  raw_inode = INODE + ((ino - 1)
+                       & (EXT2_BLOCK_SIZE (SUPERBLOCK) /
+                          sizeof (struct ext2_inode) - 1));
+#ifdef E2DEBUG
+  printf ("ipb=%d, sizeof(inode)=%d\n",
+          (EXT2_BLOCK_SIZE (SUPERBLOCK) / sizeof (struct ext2_inode)),
+          sizeof (struct ext2_inode));
+  printf ("inode=%x, raw_inode=%x\n", INODE, raw_inode);
+  printf ("offset into inode table block=%d\n",
+          (int) raw_inode - (int) INODE);
+  for (i = (uint8 *) INODE; i <= (uint8 *) raw_inode; i++) {
+    printf ("%c", "0123456789abcdef"[*i >> 4]);
+    printf ("%c", "0123456789abcdef"[*i % 16]);
+    if (!((i + 1 - (uint8 *) INODE) % 16)) {
+      printf ("\n");
+    } else {
+      printf (" ");
+    }
+  }
+  printf ("first word=%x\n", *((int *) raw_inode));
+#endif /* E2DEBUG */
+
+  /* copy inode to fixed location */
+  memmove ((void *) INODE, (void *) raw_inode, sizeof (struct ext2_inode));
+  loaded_ino = ino;
+
+#ifdef E2DEBUG
+  printf ("first word=%x\n", *((int *) INODE));
+#endif /* E2DEBUG */
+
+  return 1;
+}
+
 /* preconditions: ext2fs_mount already executed, therefore supblk in buffer
  *   known as SUPERBLOCK
  * returns: 0 if error, nonzero iff we were able to find the file successfully
@@ -756,13 +819,7 @@ ext2fs_dir (char *dirname)
 {
   int current_ino = EXT2_ROOT_INO;      /* start at the root */
   int updir_ino = current_ino;  /* the parent of the current directory */
-  int group_id;                 /* which group the inode is in */
-  int group_desc;               /* fs pointer to that group */
-  int desc;                     /* index within that group */
-  int ino_blk;                  /* fs pointer of the inode's information */
   int str_chk = 0;              /* used to hold the results of a string compare */
-  struct ext2_group_desc *gdp;
-  struct ext2_inode *raw_inode; /* inode info corresponding to current_ino */
 
   char linkbuf[PATH_MAX];       /* buffer for following symbolic links */
   int link_count = 0;
@@ -775,9 +832,7 @@ ext2fs_dir (char *dirname)
   int blk;                      /* which data blk within dir entry (off div blocksize) */
   long map;                     /* fs pointer of a particular block from dir entry */
   struct ext2_dir_entry *dp;    /* pointer to directory entry */
-#ifdef E2DEBUG
-  uint8 *i;
-#endif /* E2DEBUG */
+  char *path = dirname;         /* whole name, for the name cache */
 
   /* loop invariants:
      current_ino = inode to lookup
@@ -789,6 +844,14 @@ ext2fs_dir (char *dirname)
   filemax = 0;
   errnum = 0;
 
+  /* A previous walk may already have resolved this name */
+  if (bcache_name_lookup (&ext2_dev, path, &current_ino, sizeof current_ino)) {
+    if (!ext2_read_inode (current_ino))
+      return -1;
+    filemax = (INODE->i_size);
+    return filemax;
+  }
+
   while (1) {
 #ifdef E2DEBUG
     printf ("inode %d\n", current_ino);
@@ -796,61 +859,8 @@ ext2fs_dir (char *dirname)
 #endif /* E2DEBUG */
 
     /* look up an inode */
-    group_id = (current_ino - 1) / (SUPERBLOCK->s_inodes_per_group);
-    group_desc = group_id >> log2 (EXT2_DESC_PER_BLOCK (SUPERBLOCK));
-    desc = group_id & (EXT2_DESC_PER_BLOCK (SUPERBLOCK) - 1);
-#ifdef E2DEBUG
-    printf ("ipg=%d, dpb=%d\n", SUPERBLOCK->s_inodes_per_group,
-            EXT2_DESC_PER_BLOCK (SUPERBLOCK));
-    printf ("group_id=%d group_desc=%d desc=%d\n", group_id, group_desc,
-            desc);
-#endif /* E2DEBUG */
-    if (!ext2_rdfsb ((WHICH_SUPER + group_desc +
-                      SUPERBLOCK->s_first_data_block), (int) GROUP_DESC)) {
+    if (!ext2_read_inode (current_ino))
       return -1;
-    }
-    gdp = GROUP_DESC;
-    ino_blk = gdp[desc].bg_inode_table +
-      (((current_ino - 1) % (SUPERBLOCK->s_inodes_per_group))
-       >> log2 (EXT2_BLOCK_SIZE (SUPERBLOCK) / sizeof (struct ext2_inode)));
-#ifdef E2DEBUG
-    printf ("inode table fsblock=%d\n", ino_blk);
-#endif /* E2DEBUG */
-    if (!ext2_rdfsb (ino_blk, (int) INODE)) {
-      return -1;
-    }
-
-    /* reset indirect blocks! */
-    mapblock2 = mapblock1 = -1;
-
-    raw_inode = INODE + ((current_ino - 1)
-                         & (EXT2_BLOCK_SIZE (SUPERBLOCK) /
-                            sizeof (struct ext2_inode) - 1));
-#ifdef E2DEBUG
-    printf ("ipb=%d, sizeof(inode)=%d\n",
-            (EXT2_BLOCK_SIZE (SUPERBLOCK) / sizeof (struct ext2_inode)),
-            sizeof (struct ext2_inode));
-    printf ("inode=%x, raw_inode=%x\n", INODE, raw_inode);
-    printf ("offset into inode table block=%d\n",
-            (int) raw_inode - (int) INODE);
-    for (i = (uint8 *) INODE; i <= (uint8 *) raw_inode; i++) {
-      printf ("%c", "0123456789abcdef"[*i >> 4]);
-      printf ("%c", "0123456789abcdef"[*i % 16]);
-      if (!((i + 1 - (uint8 *) INODE) % 16)) {
-        printf ("\n");
-      } else {
-        printf (" ");
-      }
-    }
-    printf ("first word=%x\n", *((int *) raw_inode));
-#endif /* E2DEBUG */
-
-    /* copy inode to fixed location */
-    memmove ((void *) INODE, (void *) raw_inode, sizeof (struct ext2_inode));
-
-#ifdef E2DEBUG
-    printf ("first word=%x\n", *((int *) INODE));
-#endif /* E2DEBUG */
 
     /* If we've got a symbolic link, then chase it. */
     if (S_ISLNK (INODE->i_mode)) {
@@ -921,6 +931,7 @@ ext2fs_dir (char *dirname)
       }
 
       filemax = (INODE->i_size);
+      bcache_name_insert (&ext2_dev, path, &current_ino, sizeof current_ino);
       return filemax;
     }
 
@@ -1005,6 +1016,36 @@ ext2fs_dir (char *dirname)
   /* never get here */
 }
 
+/* Look up dirname and remember its inode in f for ext2fs_pread () */
+int
+ext2fs_open (char *dirname, vfs_file *f)
+{
+  int len = ext2fs_dir (dirname);
+
+  if (len >= 0) {
+    f->u.ext2.ino = loaded_ino;
+    f->mtime = INODE->i_mtime;
+  }
+  return len;
+}
+
+/* Read len bytes at offset from the file opened in f.  The inode is
+ * only reloaded when another file has been used since, so
+ * consecutive reads of one file keep the indirect blocks cached in
+ * mapblock1 and mapblock2. */
+int
+ext2fs_pread (vfs_file *f, uint32 offset, char *buf, int len)
+{
+  errnum = 0;
+  if (loaded_ino != f->u.ext2.ino && !ext2_read_inode (f->u.ext2.ino))
+    return -1;
+
+  filepos = offset;
+  filemax = (INODE->i_size);
+  len = ext2fs_read (buf, len);
+  return errnum ? -1 : len;
+}
+
 /* 
  * Local Variables:
  * indent-tabs-mode: nil
@@ -111,6 +111,98 @@ vfs_read (char *pathname, char *buf, int len)
   }
 }
 
+/* Resolve pathname into f, which keeps a pointer to it.  Returns the
+ * file length on success, -1 on failure.  Caller holds vfs_lock. */
+int
+vfs_open (char *pathname, vfs_file *f)
+{
+  char *filepart;
+  int type = parse_pathname (pathname, &filepart);
+  int len;
+
+  if (type == -1) return -1;
+  f->type = type;
+  f->pathname = pathname;
+  f->mtime = 0;
+  switch (type) {
+  case VFS_FSYS_EZEXT2:
+    len = ext2fs_open (filepart, f);
+    break;
+  case VFS_FSYS_EZISO:
+    len = eziso_open (filepart, f);
+    break;
+  case VFS_FSYS_EZUSB:
+    len = vfat_open (filepart, f);
+    break;
+  case VFS_FSYS_EZTFTP:
+    len = eztftp_dir (filepart);
+    break;
+  case VFS_FSYS_EZRAM:
+    len = ramdisk_open (filepart, f);
+    break;
+  default:
+    print ("Unknown vfs_type");
+    return -1;
+  }
+  f->length = len < 0 ? 0 : len;
+  return len;
+}
+
+/* Read up to len bytes at offset from an open file.  Only the blocks
+ * covering [offset, offset+len) are touched.  Returns the number of
+ * bytes read, 0 at end of file, or -1 on error.  Caller holds
+ * vfs_lock. */
+int
+vfs_pread (vfs_file *f, uint32 offset, char *buf, int len)
+{
+  char *filepart;
+
+  if (len < 0)
+    return -1;
+  if (offset >= f->length)
+    return 0;
+  if (len > f->length - offset)
+    len = f->length - offset;
+
+  switch (f->type) {
+  case VFS_FSYS_EZEXT2:
+    return ext2fs_pread (f, offset, buf, len);
+  case VFS_FSYS_EZISO:
+    return eziso_pread (f, offset, buf, len);
+  case VFS_FSYS_EZUSB:
+    return vfat_pread (f, offset, buf, len);
+  case VFS_FSYS_EZTFTP:
+    /* TFTP has no per-file state worth keeping in the handle */
+    parse_pathname (f->pathname, &filepart);
+    return eztftp_pread (filepart, offset, buf, len);
+  case VFS_FSYS_EZRAM:
+    return ramdisk_pread (f, offset, buf, len);
+  default:
+    print ("Unknown vfs_type");
+    return -1;
+  }
+}
+
+/* Identify the file behind an open handle within its backend: the
+ * inode, first sector or first cluster.  TFTP has nothing better
+ * than the name, so it is always 0 there. */
+uint32
+vfs_file_id (vfs_file *f)
+{
+  switch (f->type) {
+  case VFS_FSYS_EZEXT2:
+    return f->u.ext2.ino;
+  case VFS_FSYS_EZISO:
+    return f->u.iso.sector;
+  case VFS_FSYS_EZUSB:
+    return f->u.vfat.first_cluster;
+  case VFS_FSYS_EZRAM:
+    return f->u.ram.data;
+  default:
+    return 0;
+  }
+}
+
 /* ************************************************** */
 
 bool
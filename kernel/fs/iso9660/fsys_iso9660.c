@@ -116,6 +116,17 @@ iso9660_walk_tree (uint32 bus, uint32 drive,
 }
 
 
+static int
+iso9660_dev_read (bcache_dev *dev, u32 sector, u32 count, u8 *buf)
+{
+  iso9660_mounted_info *mi = dev->priv;
+
+  for (; count > 0; count--, sector++, buf += ATAPI_SECTOR_SIZE)
+    if (atapi_drive_read_sector (mi->bus, mi->drive, sector, buf) < 0)
+      return -1;
+  return 0;
+}
+
 int
 iso9660_mount (uint32 bus, uint32 drive, iso9660_mounted_info * mi)
 {
@@ -125,8 +136,17 @@ iso9660_mount (uint32 bus, uint32 drive, iso9660_mounted_info * mi)
 
   /* The first 16 sectors (0-15) are empty. */
 
+  mi->bus = bus;
+  mi->drive = drive;
+  mi->dev.name = "iso9660";
+  mi->dev.sector_size = ATAPI_SECTOR_SIZE;
+  mi->dev.read = iso9660_dev_read;
+  mi->dev.priv = mi;
+  mi->dev.readahead = 4;
+  bcache_register (&mi->dev);
+
   /* Primary Volume descriptor */
-  len = atapi_drive_read_sector (bus, drive, 16, page);
+  len = bcache_read (&mi->dev, 16, 0, ATAPI_SECTOR_SIZE, page);
 
   if (len < 0) {
     com1_printf ("CD-ROM read error\n");
@@ -177,8 +197,6 @@ iso9660_mount (uint32 bus, uint32 drive, iso9660_mounted_info * mi)
 
 #endif
 
-  mi->bus = bus;
-  mi->drive = drive;
   mi->root_dir_sector = ((iso9660_dir_record *) (page + 156))->first_sector;
   mi->root_dir_data_length =
     ((iso9660_dir_record *) (page + 156))->data_length;
@@ -256,7 +274,7 @@ iso9660_search_dir (iso9660_mounted_info * mi,
   for (count = 0; count < num_bytes;) {
     if (count % ATAPI_SECTOR_SIZE == 0) {
       // if 2048-byte aligned get next sector
-      if (atapi_drive_read_sector (mi->bus, mi->drive, secnum, page) < 0) {
+      if (bcache_read (&mi->dev, secnum, 0, ATAPI_SECTOR_SIZE, page) < 0) {
         panic ("CD ROM READ ERROR\n");
       }
       secnum++;
@@ -299,11 +317,20 @@ iso9660_open (iso9660_mounted_info * mi, char *pathname, iso9660_handle * h)
 {
   int len = 0, start = 0, end;
   iso9660_dir_record d, de;
+  u32 cached[2];                /* first sector, length */
   d.first_sector = mi->root_dir_sector;
   d.data_length = mi->root_dir_data_length;
 
   if (pathname[0] != PATHSEP)
     return -1;
+
+  if (bcache_name_lookup (&mi->dev, pathname, cached, sizeof cached)) {
+    h->mount = mi;
+    h->sector = cached[0];
+    h->offset = 0;
+    h->length = cached[1];
+    return 0;
+  }
   while (pathname[len])
     len++;
 
@@ -321,6 +348,9 @@ iso9660_open (iso9660_mounted_info * mi, char *pathname, iso9660_handle * h)
       h->sector = de.first_sector;
       h->offset = 0;
       h->length = de.data_length;
+      cached[0] = h->sector;
+      cached[1] = h->length;
+      bcache_name_insert (&mi->dev, pathname, cached, sizeof cached);
       return 0;
     } else {
       /* This component is a directory name. */
@@ -337,41 +367,17 @@ iso9660_open (iso9660_mounted_info * mi, char *pathname, iso9660_handle * h)
 int
 iso9660_read (iso9660_handle * h, uint8 * buf, uint32 len)
 {
-  int n, count = 0, rem = len, curlen;
   iso9660_mounted_info *mi = h->mount;
-  uint32 frame;
-  uint8 *page;
-
-  frame = alloc_phys_frame ();
-  page = map_virtual_page (frame | 3);
-
-  while (count < len) {
-    n = atapi_drive_read_sector (mi->bus, mi->drive, h->sector, page);
-    if (n < 0)
-      goto error;
-
-    curlen = rem > (n - h->offset) ? (n - h->offset) : rem;
-
-    memcpy (buf + count, page + h->offset, curlen);
-
-    rem -= curlen;
-    count += curlen;
-    h->offset += curlen;
-    h->length -= curlen;
-    if (h->offset == 2048) {
-      h->sector++;
-      h->offset = 0;
-    }
-  }
+  uint32 pos;
 
+  if (bcache_read (&mi->dev, h->sector, h->offset, len, buf) < 0)
+    return -1;
 
-  unmap_virtual_page (page);
-  free_phys_frame (frame);
-  return count;
-error:
-  unmap_virtual_page (page);
-  free_phys_frame (frame);
-  return -1;
+  pos = h->offset + len;
+  h->sector += pos / ATAPI_SECTOR_SIZE;
+  h->offset = pos % ATAPI_SECTOR_SIZE;
+  h->length -= len;
+  return len;
 }
 
 static iso9660_mounted_info eziso_mount_info;
@@ -445,6 +451,27 @@ eziso_read (char *buf, int len)
   return n;
 }
 
+int
+eziso_open (char *pathname, vfs_file *f)
+{
+  int len = eziso_dir (pathname);
+
+  if (len >= 0)
+    f->u.iso.sector = eziso_handle.sector;
+  return len;
+}
+
+/* Files are contiguous extents, so any offset maps straight to a
+ * sector. */
+int
+eziso_pread (vfs_file *f, uint32 offset, char *buf, int len)
+{
+  if (bcache_read (&eziso_mount_info.dev, f->u.iso.sector, offset, len,
+                   (uint8 *) buf) < 0)
+    return -1;
+  return len;
+}
+
 /* 
  * Local Variables:
  * indent-tabs-mode: nil
@@ -159,19 +159,13 @@ int ramdisk_dir (char *pathname)
   }
 }
 
-int ramdisk_read (char *buf, int len)
+/* Copy len bytes starting at physical address phys_addr_data */
+static int ramdisk_copy (size_t phys_addr_data, char *buf, int len)
 {
-  size_t phys_addr_data;
   size_t page_offset;
   int bytes_copied = 0;
   char* temp;
 
-  if(!cur_file_header) return -1;
-
-  if(len > be32toh(cur_file_header->size)) len = be32toh(cur_file_header->size);
-
-  phys_addr_data = ramdisk_phys + cur_file_phys_offset + sizeof(romfs_file_header_t);
-
   while(bytes_copied < len) {
     size_t bytes_to_copy;
     page_offset = (phys_addr_data % 0x1000);
@@ -192,6 +186,31 @@ int ramdisk_read (char *buf, int len)
   return bytes_copied;
 }
 
+int ramdisk_read (char *buf, int len)
+{
+  if(!cur_file_header) return -1;
+
+  if(len > be32toh(cur_file_header->size)) len = be32toh(cur_file_header->size);
+
+  return ramdisk_copy(ramdisk_phys + cur_file_phys_offset + sizeof(romfs_file_header_t),
+                      buf, len);
+}
+
+int ramdisk_open (char *pathname, vfs_file *f)
+{
+  int len = ramdisk_dir(pathname);
+
+  if(len >= 0) {
+    f->u.ram.data = cur_file_phys_offset + sizeof(romfs_file_header_t);
+  }
+  return len;
+}
+
+int ramdisk_pread (vfs_file *f, uint32 offset, char *buf, int len)
+{
+  return ramdisk_copy(ramdisk_phys + f->u.ram.data + offset, buf, len);
+}
+
 /*
  * Local Variables:
  * indent-tabs-mode: nil
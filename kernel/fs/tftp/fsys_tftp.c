@@ -23,6 +23,7 @@
 #include "fs/filesys.h"
 #include "mem/mem.h"
 #include "kernel.h"
+#include "smp/klock.h"
 #include "util/debug.h"
 #include "util/circular.h"
 #include "arch/i386.h"
@@ -102,6 +103,10 @@ typedef struct _blocklist blocklist_t;
 
 blocklist_t *curbuf, *curend;
 
+/* Name of the file held whole in the block list, for eztftp_pread ().
+ * Cleared once eztftp_read () starts consuming the list. */
+static char cached_name[256];
+
 /* format a read request */
 static int
 format_rrq (uint8 *buf, int len, const char *filename)
@@ -136,26 +141,31 @@ send (uint8 *buf, uint32 len)
     return -1;
   }
 
+  klock_lock (&net_lock);
   p = pbuf_alloc (PBUF_TRANSPORT, len, PBUF_RAM);
 
   if (!p) {
+    klock_unlock (&net_lock);
     DLOG ("pbuf_alloc");
     return -1;
   }
 
   if (pbuf_take (p, buf, len) != ERR_OK) {
     pbuf_free (p);
+    klock_unlock (&net_lock);
     DLOG ("pbuf_take");
     return -1;
   }
 
   if (udp_sendto (pcb, p, &server_ip, server_port) != ERR_OK) {
     pbuf_free (p);
+    klock_unlock (&net_lock);
     DLOG ("udp_sendto");
     return -1;
   }
 
   pbuf_free (p);
+  klock_unlock (&net_lock);
 
   return len;
 }
@@ -239,6 +249,7 @@ eztftp_dir (char *pathname)
   uint8 *buf, *ins;
   uint32 len, rem, filesize=0;
   uint negotiated_block_size = TFTP_MAX_BLOCK_SIZE;
+  char *name;
 
   buf = kmalloc(TFTP_MAX_BLOCK_SIZE+4);
 
@@ -248,6 +259,8 @@ eztftp_dir (char *pathname)
                  TFTP_RING_LEN, sizeof (struct pbuf *));
 
   DLOG ("dir (%s)", pathname);
+  cached_name[0] = '\0';
+  name = pathname;
   if (pathname[0] == '/')
     /* some servers don't like leading slash */
     pathname++;
@@ -281,8 +294,10 @@ eztftp_dir (char *pathname)
 
       /* chop pbuf off */
       q = p->next;
+      klock_lock (&net_lock);
       if (q) pbuf_ref (q);
       pbuf_free (p);
+      klock_unlock (&net_lock);
       p = q;
 
       /* if last pbuf in chain */
@@ -330,6 +345,8 @@ eztftp_dir (char *pathname)
 
   DLOG ("opened file size=%d bytes", filesize);
   kfree(buf);
+  if (strlen (name) < sizeof (cached_name))
+    memcpy (cached_name, name, strlen (name) + 1);
   return filesize;
 }
 
@@ -387,8 +404,10 @@ eztftp_bulk_read (char *pathname, uint32 * load_addr)
 
       /* chop pbuf off */
       q = p->next;
+      klock_lock (&net_lock);
       if (q) pbuf_ref (q);
       pbuf_free (p);
+      klock_unlock (&net_lock);
       p = q;
 
       /* if last pbuf in chain */
@@ -447,6 +466,7 @@ eztftp_read (char *buf, int len)
   char *ptr = buf;
   int actual = 0;
   DLOG ("read (%p, %d)", buf, len);
+  cached_name[0] = '\0';
   while (len > 0 && curbuf) {
     int amount = len < curbuf->len ? len : curbuf->len;
 
@@ -471,6 +491,39 @@ eztftp_read (char *buf, int len)
   return actual;
 }
 
+/* Read len bytes at offset from pathname without consuming the block
+ * list.  TFTP cannot seek, so the file is only fetched again when
+ * another file has been fetched since. */
+int
+eztftp_pread (char *pathname, uint32 offset, char *buf, int len)
+{
+  blocklist_t *bl;
+  int actual = 0;
+
+  DLOG ("pread (%s, %d, %p, %d)", pathname, offset, buf, len);
+  if (strcmp (cached_name, pathname) != 0 && eztftp_dir (pathname) < 0)
+    return -1;
+
+  for (bl = curbuf; bl && len > 0; bl = bl->next) {
+    int amount;
+
+    if (offset >= bl->len) {
+      offset -= bl->len;
+      continue;
+    }
+    amount = bl->len - offset;
+    if (amount > len)
+      amount = len;
+    memcpy (buf, &bl->blocks[bl->start + offset], amount);
+    buf += amount;
+    actual += amount;
+    len -= amount;
+    offset = 0;
+  }
+
+  return actual;
+}
+
 static void
 recv_callback (void *arg, struct udp_pcb *pcb, struct pbuf *p,
                struct ip_addr *addr, uint16 port)
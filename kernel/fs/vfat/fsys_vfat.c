@@ -113,33 +113,35 @@ devread_vfat (int sector, int byte_offset, int byte_len, char *buf)
 }
 #endif
 
-#if 1
+static int
+vfat_dev_read (bcache_dev *dev, u32 sector, u32 count, u8 *buf)
+{
+  if (umsc_read_sectors (UMSC_DEVICE_INDEX, sector, buf, count) != count) {
+    com1_printf ("umsc_read_sectors failed: snum = %d\n", count);
+    return -1;
+  }
+  return 0;
+}
+
+static bcache_dev vfat_dev = {
+  .name = "vfat",
+  .sector_size = 512,
+  .read = vfat_dev_read,
+  .readahead = 8,
+};
+
 static int
 devread_vfat (int sector, int byte_offset, int byte_len, char *buf)
 {
-  uint8 * s = NULL;
   sector+=VFAT_FIRST_PARTITION; /* offset into the first partition */
-  int snum = ((byte_len + byte_offset) / 512) + 1;
-  int buf_len = snum * 512;
   DLOG ("fsys_vfat: devread_vfat (%d, %d, %d, %p)",
         sector, byte_offset, byte_len, buf);
 
-  s = (uint8 *) kmalloc (buf_len);
-  if (!s) {
-    com1_printf ("kmalloc failed\n");
+  if (bcache_read (&vfat_dev, sector, byte_offset, byte_len, (u8 *) buf) < 0)
     return 0;
-  }
-  if (umsc_read_sectors (UMSC_DEVICE_INDEX, sector, s, snum) != snum) {
-    com1_printf ("umsc_read_sectors failed: snum = %d\n", snum);
-    kfree (s);
-    return 0;
-  }
-  memcpy (buf, &s[byte_offset], byte_len);
-  kfree (s);
 
   return byte_len;
 }
-#endif
 
 //static int
 //tolower (int c)
@@ -330,6 +332,8 @@ vfat_mount (void)
   struct fat_bpb bpb;
   __u32 magic, first_fat;
 
+  bcache_register (&vfat_dev);
+
   /* Read bpb */
   if (! devread_vfat (0, 0, sizeof (bpb), (char *) &bpb))
     return 0;
@@ -586,6 +590,8 @@ vfat_dir (char *dirname)
   DLOG ("vfat_dir (\"%s\")", dirname);
   char *rest, ch, dir_buf[FAT_DIRENTRY_LENGTH];
   char *filename = (char *) NAME_BUF;
+  char *path = dirname;         /* whole name, for the name cache */
+  int cached[2];                /* first cluster, length */
   int attrib = FAT_ATTRIB_DIR;
 
   /* XXX I18N:
@@ -600,6 +606,14 @@ vfat_dir (char *dirname)
   filepos = 0;
   FAT_SUPER->current_cluster_num = MAXINT;
 
+  /* A previous walk may already have resolved this name */
+  if (bcache_name_lookup (&vfat_dev, path, cached, sizeof cached))
+    {
+      FAT_SUPER->file_cluster = cached[0];
+      filemax = cached[1];
+      return filemax;
+    }
+
   /* main loop to find desired directory entry */
  loop:
 
@@ -614,6 +628,9 @@ vfat_dir (char *dirname)
           return -1;
         }
 
+      cached[0] = FAT_SUPER->file_cluster;
+      cached[1] = filemax;
+      bcache_name_insert (&vfat_dev, path, cached, sizeof cached);
       return filemax;
     }
 
@@ -741,6 +758,38 @@ vfat_dir (char *dirname)
   goto loop;
 }
 
+int
+vfat_open (char *pathname, vfs_file *f)
+{
+  int len = vfat_dir (pathname);
+
+  if (len >= 0) {
+    f->u.vfat.first_cluster = FAT_SUPER->file_cluster;
+    f->u.vfat.cluster = FAT_SUPER->file_cluster;
+    f->u.vfat.cluster_num = 0;
+  }
+  return len;
+}
+
+/* Read len bytes at offset from the file opened in f.  The position
+ * in the cluster chain is kept in f, so a sequential reader follows
+ * one FAT link per cluster instead of walking from the start. */
+int
+vfat_pread (vfs_file *f, uint32 offset, char *buf, int len)
+{
+  FAT_SUPER->file_cluster = f->u.vfat.first_cluster;
+  FAT_SUPER->current_cluster = f->u.vfat.cluster;
+  FAT_SUPER->current_cluster_num = f->u.vfat.cluster_num;
+  filepos = offset;
+  filemax = f->length;
+
+  len = vfat_read (buf, len);
+
+  f->u.vfat.cluster = FAT_SUPER->current_cluster;
+  f->u.vfat.cluster_num = FAT_SUPER->current_cluster_num;
+  return errnum ? -1 : len;
+}
+
 /*
  * Local Variables:
  * indent-tabs-mode: nil
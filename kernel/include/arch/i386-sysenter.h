@@ -0,0 +1,69 @@
+/*                    The Quest Operating System
+ *  Copyright (C) 2005-2012  Richard West, Boston University
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _I386_SYSENTER_H_
+#define _I386_SYSENTER_H_
+#include "arch/i386-msr.h"
+
+/* Fast system-call entry through SYSENTER/SYSEXIT.
+ *
+ * User-level enters the same tables as int $0x30 and int $0x3D.
+ * SYSENTER saves neither the return address nor the user stack, and
+ * SYSEXIT takes them in %edx and %ecx, so those two registers cannot
+ * carry arguments.  Instead the caller pushes them, along with the
+ * return address, and points %ebp at that frame:
+ *
+ *   %eax       syscall number, with SYSENTER_SOCKET set for the
+ *              socket table (int $0x3D)
+ *   %ebx, %esi, %edi
+ *              arguments, as for the int entry points
+ *   0(%ebp)    return address
+ *   4(%ebp)    %edx argument
+ *   8(%ebp)    %ecx argument
+ *
+ * On return %eax holds the result and %ecx, %edx are lost.  The
+ * frame is read with kernel segments, so sysenter_entry first checks
+ * that it lies below SYSENTER_USER_LIMIT and otherwise ends the task,
+ * as _exit (-1) would.  See sysenter_entry in interrupt.S. */
+
+#define SYSENTER_SOCKET 0x80000000
+
+/* End of the user data segment, see boot/boot.S */
+#define SYSENTER_USER_LIMIT 0xC0000000
+#define SYSENTER_FRAME_SIZE 12
+
+#ifndef __ASSEMBLER__
+#include "types.h"
+
+extern bool sysenter_enabled;
+extern void sysenter_init (void);
+
+#endif /* __ASSEMBLER__ */
+
+#endif
+
+
+/*
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * mode: C
+ * c-file-style: "gnu"
+ * c-basic-offset: 2
+ * End:
+ */
+
+/* vi: set et sw=2 sts=2: */
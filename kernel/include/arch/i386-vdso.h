@@ -0,0 +1,53 @@
+/*                    The Quest Operating System
+ *  Copyright (C) 2005-2012  Richard West, Boston University
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _I386_VDSO_H_
+#define _I386_VDSO_H_
+#include "types.h"
+
+/* The vDSO page is mapped read-only at VDSO_ADDR in every user address
+ * space.  It lets user-level read the time of day from the TSC without
+ * entering the kernel, and tells it whether the SYSENTER entry can be
+ * used.  libc keeps a copy of this layout in vdso.h. */
+
+#define VDSO_ADDR 0xBFFFF000    /* last user page below the kernel */
+
+struct vdso_data
+{
+  u32 sysenter;                 /* SYSENTER entry available */
+  u32 boot_sec;                 /* seconds since the epoch at tsc_base */
+  u64 tsc_freq;                 /* TSC ticks per second */
+  u64 tsc_base;                 /* TSC at boot_sec */
+};
+
+extern void vdso_init (void);
+extern bool vdso_map (u32 *pgdir);
+extern void vdso_get_time (u32 *sec, u32 *usec);
+
+#endif
+
+
+/*
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * mode: C
+ * c-file-style: "gnu"
+ * c-basic-offset: 2
+ * End:
+ */
+
+/* vi: set et sw=2 sts=2: */
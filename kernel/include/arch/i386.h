@@ -178,6 +178,16 @@ set_cr4(uint32 cr)
   asm volatile ("movl %0, %%cr4"::"r" (cr));
 }
 
+#define CR0_WP 0x10000             /* write-protect applies to ring 0 */
+
+/* Make the kernel honour read-only user pages, so that its writes to
+ * copy-on-write pages fault like user writes do (see mem/cow.c). */
+static inline void
+enable_write_protect (void)
+{
+  set_cr0 (get_cr0 () | CR0_WP);
+}
+
 static inline void save_fpu_and_mmx_state(void* mem)
 {
   asm volatile("fxsave (%0)\n" :: "r"(mem));
@@ -28,6 +28,12 @@
 typedef struct
 {
   uint32 ata_type, ata_bus, ata_drive;
+  /* From IDENTIFY, for ATA_TYPE_PATA drives */
+  uint32 sectors;               /* capacity (low 32 bits if lba48) */
+  bool lba48;                   /* supports the 48-bit EXT commands */
+  bool dma;                     /* supports bus-master DMA */
+  uint32 multiple;              /* sectors per READ/WRITE MULTIPLE block,
+                                 * or 0 if not enabled */
 } ata_info;
 
 extern ata_info pata_drives[4];
@@ -52,13 +58,46 @@ extern ata_info pata_drives[4];
 #define ATA_COMMAND(x)      (x+7)
 #define ATA_DCR(x)          (x+0x206)   /* device control register */
 
+/* Bus-master IDE registers, relative to a channel's base in BAR4 of
+ * the PCI IDE controller */
+#define ATA_BM_COMMAND(x)   (x)
+#define ATA_BM_STATUS(x)    (x+2)
+#define ATA_BM_PRD(x)       (x+4)
+
 #define ATA_DRIVE_MASTER    0xA0
 #define ATA_DRIVE_SLAVE     0xB0
 
 /* The default and seemingly universal sector size for CD-ROMs. */
 #define ATAPI_SECTOR_SIZE 2048
 
+/* A transfer of up to ATA_MAX_SECTORS sectors.  Requests wait in a
+ * per-bus queue in LBA order, and adjacent ones are served by a
+ * single command.  See ata.c. */
+#define ATA_MAX_SECTORS 256
+#define ATA_REQ_PENDING 1
+
+struct _quest_tss;
+
+typedef struct _ata_req
+{
+  uint32 bus, drive, lba, count;
+  uint8 *buf;
+  bool write;
+  volatile int status;          /* ATA_REQ_PENDING, then 0 or -1 */
+  struct _quest_tss *waiter;
+  struct _ata_req *next;        /* bus queue */
+  struct _ata_req *merged;      /* served by the same command */
+} ata_req;
+
 bool ata_init (void);
+void ata_submit (ata_req *);
+int ata_wait (ata_req *);
+int ata_drive_read (uint32 bus, uint32 drive, uint32 lba, uint32 count,
+                    uint8 * buffer);
+int ata_drive_write (uint32 bus, uint32 drive, uint32 lba, uint32 count,
+                     uint8 * buffer);
+int ata_drive_read_blocks (uint32 bus, uint32 drive, uint32 * lba,
+                           uint32 count, uint8 ** buffers, uint32 n);
 int ata_drive_read_sector (uint32 bus, uint32 drive, uint32 lba,
                            uint8 * buffer);
 int ata_drive_write_sector (uint32 bus, uint32 drive, uint32 lba,
@@ -20,6 +20,8 @@
 
 #include "types.h"
 #include "lwip/netif.h"
+#include "lwip/pbuf.h"
+#include "smp/spinlock.h"
 
 #define MAX_FRAME_SIZE 1600
 #define ETH_ADDR_LEN 6
@@ -31,6 +33,52 @@ typedef void (*packet_recv_func_t)(struct _ethernet_device *dev,
 typedef sint (*packet_send_func_t)(uint8* buffer, sint len);
 typedef bool (*get_hwaddr_func_t)(uint8 addr[ETH_ADDR_LEN]);
 typedef void (*packet_poll_func_t)(void);
+/* Queue the frame in pbuf chain p without copying it, holding a
+ * reference until the hardware is done with it.  Returns the length
+ * queued, 0 if the ring is full, or -1 if the chain has more pieces
+ * than the driver can describe.  Called with net_lock held. */
+typedef sint (*packet_send_pbuf_func_t)(struct pbuf *p);
+
+/* NAPI-style bottom halves.
+ *
+ * The driver's IRQ handler acknowledges the device and calls
+ * net_napi_schedule, which masks the device's interrupts and wakes
+ * its poll thread on a network IO-VCPU.  Each round the thread
+ * reclaims up to tx_budget finished TX descriptors and passes up to
+ * rx_budget frames to lwIP.  While rounds use up their budget the
+ * thread yields and polls again with interrupts still masked, so
+ * under load the IO-VCPU's budget goes to packets rather than to
+ * interrupts.  A round that finishes early unmasks the interrupts and
+ * sleeps.  The hardware's own interrupt throttle (ITR) caps the
+ * interrupt rate when the device is lightly loaded. */
+
+#define NET_NAPI_RX_BUDGET 32   /* frames per round */
+#define NET_NAPI_TX_BUDGET 64   /* descriptors per round */
+#define NET_NAPI_ITR_USEC  125  /* default minimum interrupt interval */
+
+/* Do up to budget units of work and return how many were done */
+typedef uint (*net_napi_poll_func_t)(uint budget);
+/* Unmask (TRUE) or mask (FALSE) the device's interrupts */
+typedef void (*net_napi_irq_func_t)(bool enable);
+/* Program the minimum interval between interrupts, 0 for none */
+typedef void (*net_napi_itr_func_t)(uint usec);
+
+struct _quest_tss;
+
+typedef struct {
+  net_napi_poll_func_t rx_poll;
+  net_napi_poll_func_t tx_clean; /* called with net_lock held */
+  net_napi_irq_func_t irq_enable;
+  net_napi_itr_func_t set_itr;  /* optional */
+  struct _quest_tss *thread;
+  uint rx_budget, tx_budget, itr_usec;
+  bool scheduled;               /* interrupts masked, thread awake */
+  /* counters */
+  u64 irqs;                     /* interrupts taken */
+  u64 polls;                    /* rounds run */
+  u64 rx_frames, tx_descs;      /* work done */
+  u64 rx_exhausted, tx_exhausted; /* rounds that used up a budget */
+} net_napi;
 
 typedef struct _ethernet_device {
   /* ethernet device number */
@@ -45,12 +93,73 @@ typedef struct _ethernet_device {
   get_hwaddr_func_t  get_hwaddr_func;
   /* function that attempts to poll the network device */
   packet_poll_func_t poll_func;
+  /* optional zero-copy transmit; used instead of send_func if set */
+  packet_send_pbuf_func_t send_pbuf_func;
+  /* frames sent straight from their pbufs, and frames that first had
+   * to be gathered into one pbuf */
+  u64 tx_mapped, tx_coalesced;
+  /* bottom half, if the driver uses net_napi_start */
+  net_napi napi;
   /* lwip network interface struct */
   struct netif netif;
   /* driver-specific field */
   void *drvdata;
 } ethernet_device;
 
+/* One physically contiguous piece of an outgoing frame */
+typedef struct {
+  u32 phys;
+  u32 len;
+} net_dma_seg;
+
+#define NET_TX_MAX_SEGS 8       /* pieces a driver need handle per frame */
+
+extern int net_pbuf_dma_map (struct pbuf *p, net_dma_seg *segs, int max);
+
+/* Zero-copy receive buffers.
+ *
+ * A driver fills its RX ring from a net_rxpool.  When a frame
+ * arrives, net_rx_deliver lends the ring's buffer to lwIP as a custom
+ * pbuf and puts a spare in the ring in its place.  The buffer goes
+ * back to the pool when lwIP frees the pbuf.  Short frames, and any
+ * frame while the pool has no spare, are copied instead, so a slow
+ * reader can never leave the ring empty. */
+
+#define NET_RX_COPYBREAK 256    /* copy frames shorter than this */
+
+struct _net_rxpool;
+
+typedef struct _net_rxbuf {
+  struct pbuf_custom pc;        /* must be first */
+  struct _net_rxpool *pool;
+  uint8 *data;
+  u32 phys;
+  struct _net_rxbuf *next;      /* free list */
+} net_rxbuf;
+
+typedef struct _net_rxpool {
+  spinlock lock;                /* free list */
+  net_rxbuf *free;
+  net_rxbuf *bufs;
+  uint count, buf_size, nfree;
+  u64 lent, copied, starved;
+} net_rxpool;
+
+extern bool net_rxpool_init (net_rxpool *pool, uint count, uint buf_size);
+extern net_rxbuf *net_rxbuf_get (net_rxpool *pool);
+extern void net_rx_deliver (struct _ethernet_device *dev, net_rxpool *pool,
+                            net_rxbuf **slot, sint len);
+
+extern void net_napi_init (struct _ethernet_device *dev,
+                           net_napi_poll_func_t rx_poll,
+                           net_napi_poll_func_t tx_clean,
+                           net_napi_irq_func_t irq_enable,
+                           net_napi_itr_func_t set_itr);
+extern bool net_napi_start (struct _ethernet_device *dev, u32 *stack_top,
+                            const char *name);
+extern void net_napi_schedule (struct _ethernet_device *dev);
+extern void net_napi_set_itr (struct _ethernet_device *dev, uint usec);
+
 bool net_init (void);
 bool net_register_device (ethernet_device *);
 bool net_set_default (char *devname);
@@ -43,6 +43,7 @@ extern int mmio32_getc (void);
 extern void * remap_serial_mmio32 (void);
 
 extern void serial_putc (char);
+extern void serial_write (const char *, int);
 extern void initialize_serial_port (void);
 extern int serial_getc (void);
 
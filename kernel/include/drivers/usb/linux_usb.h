@@ -79,6 +79,7 @@ struct urb {
   /* private: usb core and host controller only fields in the urb */
   //struct kref kref;               /* reference count of the URB */
   void *hcpriv;                   /* private data for host controller */
+  bool cached;                    /* allocated from the URB cache */
   //atomic_t use_count;             /* concurrent submissions counter */
   //atomic_t reject;                /* submissions will fail */
   //int unlinked;                   /* unlink error code */
@@ -196,16 +197,12 @@ struct urb {
 
 struct urb *usb_alloc_urb(int iso_packets, gfp_t mem_flags);
 
-static inline void usb_free_urb(struct urb *urb)
-{
-  if(urb) {
-    if(urb->hcpriv) kfree(urb->hcpriv);
-    kfree(urb);
-  }
-}
+void usb_free_urb(struct urb *urb);
 
 static inline void usb_init_urb(struct urb *urb) {
+  bool cached = urb->cached;
   memset(urb, 0, sizeof(*urb));
+  urb->cached = cached;
 }
 
 
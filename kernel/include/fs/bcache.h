@@ -0,0 +1,77 @@
+/*                    The Quest Operating System
+ *  Copyright (C) 2005-2012  Richard West, Boston University
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _BCACHE_H_
+#define _BCACHE_H_
+
+#include "types.h"
+
+/* Block cache shared by the filesystem backends.  See fs/bcache.c. */
+
+#define BCACHE_BLOCK_SIZE 0x1000
+
+typedef struct _bcache_dev
+{
+  const char *name;
+  u32 sector_size;
+  /* Read count sectors into buf, returning 0 on success */
+  int (*read) (struct _bcache_dev *, u32 sector, u32 count, u8 *buf);
+  /* Optional: read count sectors at each of sectors[0..n-1] into
+   * bufs[0..n-1] as one batch, returning 0 if all succeeded */
+  int (*read_blocks) (struct _bcache_dev *, u32 *sectors, u32 count,
+                      u8 **bufs, u32 n);
+  void *priv;                   /* for the backend */
+  u32 readahead;                /* blocks to prefetch on sequential access */
+
+  /* Maintained by the cache */
+  u32 last_block;
+  u32 hits, misses, readaheads, evictions;
+  u32 name_hits, name_misses;
+  bool registered;
+  struct _bcache_dev *next;
+} bcache_dev;
+
+/* Snapshot of one device's counters, as returned to user-level */
+#define BCACHE_NAME_LEN 16
+struct bcache_stat
+{
+  char name[BCACHE_NAME_LEN];
+  u32 hits, misses, readaheads, evictions;
+  u32 name_hits, name_misses;
+};
+
+extern void bcache_register (bcache_dev *);
+extern int bcache_read (bcache_dev *, u32 sector, u32 byte_offset,
+                        u32 len, u8 *buf);
+extern bool bcache_name_lookup (bcache_dev *, const char *path,
+                                void *val, u32 len);
+extern void bcache_name_insert (bcache_dev *, const char *path,
+                                const void *val, u32 len);
+extern int bcache_get_stats (struct bcache_stat *, int max);
+
+#endif
+
+/* 
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * mode: C
+ * c-file-style: "gnu"
+ * c-basic-offset: 2
+ * End: 
+ */
+
+/* vi: set et sw=2 sts=2: */
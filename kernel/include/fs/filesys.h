@@ -20,12 +20,41 @@
 
 #include "types.h"
 #include "drivers/ata/ata.h"
+#include "fs/bcache.h"
 
 #define PATHSEP '/'
 
+/* An open file.  vfs_open () resolves the path once and keeps enough
+ * backend state to read from any offset with vfs_pread (), without
+ * walking the path or reading the file from the start again. */
+typedef struct
+{
+  int type;                     /* VFS_FSYS_* */
+  char *pathname;               /* owned by the caller */
+  uint32 length;
+  uint32 mtime;                 /* last modification, 0 if unknown */
+  union {
+    struct {
+      int ino;
+    } ext2;
+    struct {
+      uint32 sector;            /* first sector of the extent */
+    } iso;
+    struct {
+      int first_cluster;
+      int cluster, cluster_num; /* last cluster visited in the chain */
+    } vfat;
+    struct {
+      uint32 data;              /* offset of the data in the ramdisk */
+    } ram;
+  } u;
+} vfs_file;
+
 int ext2fs_mount (void);
 int ext2fs_read (char *buf, int len);
 int ext2fs_dir (char *dirname);
+int ext2fs_open (char *dirname, vfs_file *f);
+int ext2fs_pread (vfs_file *f, uint32 offset, char *buf, int len);
 
 struct _iso9660_dir_record
 {
@@ -61,6 +90,7 @@ typedef struct _iso9660_dir_record iso9660_dir_record;
 typedef struct
 {
   uint32 bus, drive, root_dir_sector, root_dir_data_length;
+  bcache_dev dev;               /* reads go through the block cache */
 } iso9660_mounted_info;
 
 typedef struct
@@ -76,14 +106,19 @@ int iso9660_open (iso9660_mounted_info *, char *, iso9660_handle *);
 int eziso_mount (uint32 bus, uint32 drive);
 int eziso_dir (char *pathname);
 int eziso_read (char *buf, int len);
+int eziso_open (char *pathname, vfs_file *f);
+int eziso_pread (vfs_file *f, uint32 offset, char *buf, int len);
 
 int vfat_mount (void);
 int vfat_dir (char *pathname);
 int vfat_read (char *buf, int len);
+int vfat_open (char *pathname, vfs_file *f);
+int vfat_pread (vfs_file *f, uint32 offset, char *buf, int len);
 
 bool eztftp_mount (char *ifname);
 int eztftp_dir (char *pathname);
 int eztftp_read (char *buf, int len);
+int eztftp_pread (char *pathname, uint32 offset, char *buf, int len);
 
 #define VFS_FSYS_NONE   0
 #define VFS_FSYS_EZEXT2 1
@@ -95,6 +130,9 @@ int eztftp_read (char *buf, int len);
 void vfs_set_root (int type, ata_info * drive_info);
 int vfs_dir (char *);
 int vfs_read (char *, char *, int);
+int vfs_open (char *, vfs_file *);
+int vfs_pread (vfs_file *, uint32, char *, int);
+uint32 vfs_file_id (vfs_file *);
 
 #define SECTOR_SIZE            0x200
 
@@ -20,6 +20,7 @@
 
 #include "types.h"
 #include "boot/multiboot.h"
+#include "fs/filesys.h"
 
 bool copy_ramdisk_module(multiboot_module *pmm, int mod_num);
 
@@ -27,6 +28,8 @@ bool ramdisk_mount();
 
 int ramdisk_dir (char *pathname);
 int ramdisk_read (char *buf, int len);
+int ramdisk_open (char *pathname, vfs_file *f);
+int ramdisk_pread (vfs_file *f, uint32 offset, char *buf, int len);
 
 typedef enum {
   ROMFS_HARD_LINK = 0,
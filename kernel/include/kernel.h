@@ -32,7 +32,9 @@
 
 #define PIT_FREQ 1193181        /* in Hz */
 #define HZ 500
-#define MAX_CPUS 8
+/* Upper bound on CPUs; tables that only need one entry per CPU
+ * found are allocated at boot.  CPU bitmasks are 32 bits wide. */
+#define MAX_CPUS 32             /* KSTATS_MAX_CPUS in libc's kstats.h */
 
 #include "kernel-defs.h"
 
@@ -80,6 +82,14 @@
 
 #define BEST_EFFORT_VCPU 0
 
+/* Selectors for the kstats syscall.  Make sure these match libc's
+ * kstats.h */
+#define KSTATS_LOCK   0         /* struct lock_stat, klock_get_stats () */
+#define KSTATS_BCACHE 1         /* struct bcache_stat, bcache_get_stats () */
+#define KSTATS_SCHED  2         /* struct sched_stat, vcpu_get_stats () */
+#define KSTATS_KMEM   3         /* struct kmem_stat, kmem_get_stats () */
+#define KSTATS_COW    4         /* struct cow_stat, cow_stats */
+
 
 extern bool update_CPU_TSS (uint32_t esp0);
 void map_user_level_stack(uint32_t* plPageDirectory, void* start_addr, int num_frames,
@@ -155,13 +165,13 @@ extern uint32 kls_pg_table[][1024] __attribute__ ((aligned (4096)));
 /* Declare space for a page table for the user stack (only used if different than pg_dir table */
 extern uint32 uls_pg_table[NR_MODS][1024] ALIGNED(0x1000);
 
-extern quest_tss idleTSS[MAX_CPUS];
+extern quest_tss *idleTSS;
 
-extern tss cpuTSS[MAX_CPUS];
+extern tss *cpuTSS;
 
-extern quest_tss *idleTSS_selector[MAX_CPUS];
+extern quest_tss **idleTSS_selector;
 
-extern uint16 cpuTSS_selector[MAX_CPUS];
+extern uint16 *cpuTSS_selector;
 
 extern spinlock screen_lock;
 
@@ -327,6 +327,15 @@
 #define PBUF_POOL_SIZE                  16
 #endif
 
+/**
+ * LWIP_SUPPORT_CUSTOM_PBUF==1: Support for custom pbufs, whose owner
+ * is called back when the last reference is freed (e.g. to return a
+ * DMA buffer to a driver's receive ring).
+ */
+#ifndef LWIP_SUPPORT_CUSTOM_PBUF
+#define LWIP_SUPPORT_CUSTOM_PBUF        0
+#endif
+
 /*
    ---------------------------------
    ---------- ARP options ----------
@@ -39,6 +39,10 @@ a lot of data that needs to be copied, this should be set high. */
 /* PBUF_POOL_SIZE: the number of buffers in the pbuf pool. */
 #define PBUF_POOL_SIZE          92
 
+/* NIC drivers lend their receive buffers to the stack as custom
+   pbufs (see net_rx_deliver in drivers/net/ethernetif.c). */
+#define LWIP_SUPPORT_CUSTOM_PBUF 1
+
 #if 0
 #define LWIP_DEBUG
 #define LWIP_DBG_TYPES_ON               (~0)
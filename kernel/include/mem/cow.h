@@ -0,0 +1,58 @@
+/*                    The Quest Operating System
+ *  Copyright (C) 2005-2012  Richard West, Boston University
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _COW_H_
+#define _COW_H_
+#include "types.h"
+
+/* Copy-on-write sharing of user frames between forked address
+ * spaces.  See mem/cow.c. */
+
+/* Make sure this matches struct cow_stat in libc's kstats.h.  The
+ * fork counters are kept under the scheduler lock, the rest under
+ * cow_lock. */
+struct cow_stat
+{
+  u64 forks;
+  u64 fork_cycles;              /* spent in clone_page_directory */
+  u64 shared;                   /* frames shared by fork */
+  u64 copied;                   /* frames fork had to copy */
+  u64 fault_copies;             /* write faults that copied a frame */
+  u64 fault_reuses;             /* write faults on the last reference */
+  u32 frames;                   /* frames with more than one user now */
+};
+
+extern struct cow_stat cow_stats;
+
+extern bool cow_share_frame (frame_t frame);
+extern bool cow_frame_ok (frame_t frame);
+extern void cow_free_frame (u32 pte);
+extern void cow_free_bigpage (u32 pde);
+extern u32 cow_clone_bigpage (u32 *pde);
+extern bool cow_fault (u32 cr3, u32 addr);
+
+#endif
+
+/* 
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * mode: C
+ * c-file-style: "gnu"
+ * c-basic-offset: 2
+ * End: 
+ */
+
+/* vi: set et sw=2 sts=2: */
@@ -37,6 +37,7 @@
 #include "arch/i386.h"
 #include "mem/mem.h"
 #include "util/list.h"
+#include "smp/spinlock.h"
 
 
 #define DMA_POOL_NUM_PAGE_TABLES ((uint32)1)
@@ -48,23 +49,46 @@
 #define DMA_POOL_START_PAGE_TABLE					\
   ((uint32)(DMA_POOL_LAST_PAGE_TABLE - DMA_POOL_NUM_PAGE_TABLES + 1))
 
-#define DMA_PAGE_BITMAP_SIZE 2
+/* A pool carves objects out of dma pages.  A dma page is a run of
+ * page_frames physically contiguous frames, mapped contiguously in
+ * the dma pool window, big enough for at least one object.  Objects
+ * never cross a multiple of the pool's boundary in physical memory.
+ *
+ * Each dma page keeps its free objects on a list linked through their
+ * first word.  Pages with free objects sit on the pool's partial
+ * list, partly used ones ahead of empty ones, so that allocation takes
+ * the first of them.  Freeing finds the page through a table indexed
+ * by virtual page in the window.  A pool keeps at most
+ * DMA_POOL_KEEP_EMPTY empty pages and returns the others to the frame
+ * allocator. */
+
+#define DMA_POOL_KEEP_EMPTY 1
 
 typedef struct dma_page {
   char* virt_addr;
   phys_addr_t phys_addr;
-  list_head_t chain;
-  uint32 bitmap[DMA_PAGE_BITMAP_SIZE];
-  uint obj_count;
+  list_head_t chain;            /* on the pool's partial or full list */
+  void* free;                   /* free objects */
+  uint obj_count;               /* objects handed out */
 } dma_page_t;
 
 typedef struct dma_pool {
   char* name;
-  list_head_t dma_pages;
+  spinlock lock;
+  list_head_t partial;          /* pages with free objects */
+  list_head_t full;
   size_t size;
   size_t align;
   size_t boundary;
   size_t objs_per_page;
+  size_t page_frames;           /* frames per dma page */
+  size_t page_align;            /* physical alignment of a dma page */
+  uint empty_pages;
+  /* counters, protected by lock */
+  u64 allocs, frees;
+  u32 in_use, in_use_max;       /* objects */
+  u32 pages, pages_max;         /* dma pages */
+  u32 pages_reclaimed;          /* empty dma pages given back */
 } dma_pool_t;
 
 bool init_dma_pool_page_tables();
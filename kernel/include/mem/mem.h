@@ -22,6 +22,7 @@
 #include "mem/virtual.h"
 #include "mem/malloc.h"
 #include "mem/dma_pool.h"
+#include "mem/tlb.h"
 
 #endif
 
@@ -0,0 +1,71 @@
+/*                    The Quest Operating System
+ *  Copyright (C) 2005-2012  Richard West, Boston University
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _PAGECACHE_H_
+#define _PAGECACHE_H_
+#include "types.h"
+#include "fs/filesys.h"
+
+/* Page cache of executable images, used to demand-page programs
+ * started by _exec.  See mem/pagecache.c. */
+
+#define PCACHE_PATH_LEN 256
+#define PCACHE_MAX_SEGS 8
+
+typedef struct _pcache_seg
+{
+  u32 vaddr, memsz;             /* placement in the address space */
+  u32 offset, filesz;           /* contents in the file */
+  u32 flags;                    /* PF_* */
+} pcache_seg;
+
+typedef struct _pcache_entry
+{
+  char path[PCACHE_PATH_LEN];
+  u32 size;                     /* file size in bytes */
+  int fs_type;                  /* VFS_FSYS_* */
+  u32 fs_id, mtime;             /* see vfs_file_id () */
+  u32 nframes;
+  frame_t *frames;              /* file contents, a page per frame */
+  u32 refs;                     /* address spaces using this image */
+  u32 last_use;                 /* for LRU eviction of idle images */
+  void *entry;                  /* ELF entry point */
+  u32 nsegs;
+  pcache_seg segs[PCACHE_MAX_SEGS];
+  struct _pcache_entry *next;
+} pcache_entry;
+
+extern pcache_entry *pcache_lookup (char *path, vfs_file *f);
+extern pcache_entry *pcache_load (char *path, vfs_file *f, u32 *pgdir);
+extern void pcache_exec_attach (u32 cr3, pcache_entry *);
+extern void pcache_exec_fork (u32 parent_cr3, u32 child_cr3);
+extern void pcache_exec_release (u32 cr3);
+extern bool pcache_fault (u32 cr3, u32 addr);
+extern void pcache_populate (u32 cr3);
+
+#endif
+
+/* 
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * mode: C
+ * c-file-style: "gnu"
+ * c-basic-offset: 2
+ * End: 
+ */
+
+/* vi: set et sw=2 sts=2: */
@@ -0,0 +1,105 @@
+/*                    The Quest Operating System
+ *  Copyright (C) 2005-2012  Richard West, Boston University
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SLAB_H_
+#define _SLAB_H_
+#include "types.h"
+#include "kernel.h"
+#include "smp/klock.h"
+
+/* Object caches for hot fixed-size kernel objects.
+ *
+ * A cache hands out objects of one size.  Each CPU has a magazine of
+ * free objects that it allocates from and frees to with interrupts
+ * off but no lock.  An empty or full magazine is refilled from, or
+ * flushed to, the cache's depot in batches under the cache lock.
+ * The depot grows a slab at a time straight from the physical frame
+ * allocator, so none of this goes through kmalloc.  Memory is kept
+ * by the cache once it has been handed out.
+ *
+ * The constructor, if any, runs once per object when its slab is
+ * created, under the cache lock.  Objects must be freed back in their
+ * constructed state, so that the next user can skip construction.
+ *
+ * Lock ordering: a cache lock nests inside every lock but frame (see
+ * smp/klock.h). */
+
+#define KMEM_MAGAZINE_SIZE 16
+#define KMEM_MAGAZINE_BATCH 8   /* objects moved per depot access */
+#define KMEM_SLAB_MIN_OBJS 8    /* objects per slab, at least */
+
+struct kmem_magazine
+{
+  u32 count;
+  void *objs[KMEM_MAGAZINE_SIZE];
+  /* counted by the owning CPU with interrupts off */
+  u64 allocs, frees;
+  u64 hits;                     /* allocations served by the magazine */
+} ALIGNED (LOCK_ALIGNMENT);
+
+typedef struct _kmem_cache
+{
+  const char *name;
+  u32 size, align;
+  void (*ctor) (void *);
+  klock lock;                   /* depot and counters below */
+  u32 stride;                   /* object plus free link, aligned */
+  u32 slab_pages;
+  void *depot;                  /* free constructed objects */
+  u32 depot_count;
+  u32 slabs, objs;
+  struct _kmem_cache *next;     /* all caches, for statistics */
+  struct kmem_magazine mag[MAX_CPUS];
+} kmem_cache;
+
+/* Define a cache statically: name, object size, alignment (0 for
+ * word alignment) and constructor (or NULL) */
+#define KMEM_CACHE_INIT(n, sz, al, c)                           \
+  { .name = n, .size = sz, .align = al, .ctor = c,              \
+    .lock = KLOCK_INIT (n) }
+
+extern void *kmem_cache_alloc (kmem_cache *);
+extern void kmem_cache_free (kmem_cache *, void *);
+
+/* Snapshot of one cache's counters, as returned to user-level */
+#define KMEM_NAME_LEN 16
+struct kmem_stat
+{
+  char name[KMEM_NAME_LEN];
+  u32 size;                     /* object size */
+  u32 slabs;                    /* slabs created */
+  u32 objs;                     /* objects in those slabs */
+  u32 in_use;                   /* objects allocated now */
+  u64 allocs, frees;
+  u64 hits;                     /* allocations that took no lock */
+};
+
+extern int kmem_get_stats (struct kmem_stat *, int max);
+
+#endif
+
+
+/*
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * mode: C
+ * c-file-style: "gnu"
+ * c-basic-offset: 2
+ * End:
+ */
+
+/* vi: set et sw=2 sts=2: */
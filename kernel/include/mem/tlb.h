@@ -0,0 +1,95 @@
+/*                    The Quest Operating System
+ *  Copyright (C) 2005-2012  Richard West, Boston University
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TLB_H_
+#define _TLB_H_
+
+#include "types.h"
+#include "kernel.h"
+
+/* TLB shootdowns.
+ *
+ * Every CPU records the page directory it last loaded into CR3 (see
+ * tlb_note_cr3).  A CPU can only hold user TLB entries for that one
+ * address space, so a shootdown for an address space interrupts just
+ * the CPUs that have it loaded.  Mappings shared by every address
+ * space (cr3 == TLB_KERNEL) go to all online CPUs.
+ *
+ * Unmapping code collects the pages it clears in a tlb_batch_t and
+ * flushes them all at once.  Each target CPU has a queue of ranges;
+ * the sender merges the batch into the queue of every target, sends
+ * one IPI to all of them and waits until they have flushed.  The IPI
+ * is delivered as an NMI, because the kernel spins on locks with
+ * interrupts disabled and a target could otherwise be waiting for a
+ * lock the sender holds.
+ *
+ * Clear the page table entries before flushing, and free the frames
+ * only after tlb_batch_flush () returns. */
+
+#define TLB_KERNEL 0            /* cr3 of mappings in every address space */
+#define TLB_BATCH_RANGES 8      /* ranges in a batch before it flushes all */
+#define TLB_FLUSH_ALL_PAGES 32  /* above this, reload CR3 instead of invlpg */
+
+struct tlb_range
+{
+  u32 va, pages;
+};
+
+typedef struct
+{
+  u32 cr3;
+  u32 nr;
+  bool all;                     /* too many ranges: flush everything */
+  struct tlb_range r[TLB_BATCH_RANGES];
+} tlb_batch_t;
+
+extern u32 tlb_loaded_cr3[MAX_CPUS];
+
+/* Called before loading cr3 into this CPU's CR3.  Kernel threads run
+ * in whatever address space was loaded before them (see task.S), so
+ * switching to one does not change it. */
+static inline void
+tlb_note_cr3 (u32 cr3)
+{
+  extern u32 *pgd;              /* original page-global dir */
+
+  if (cr3 != (u32) &pgd)
+    tlb_loaded_cr3[get_pcpu_id ()] = cr3;
+}
+
+extern void tlb_cpu_init (void);
+extern void tlb_batch_init (tlb_batch_t *, u32 cr3);
+extern void tlb_batch_add (tlb_batch_t *, void *va, u32 pages);
+extern void tlb_batch_flush (tlb_batch_t *);
+extern void tlb_shootdown (u32 cr3, void *va, u32 pages);
+extern void tlb_invalidate_local (void *va, u32 pages);
+extern void tlb_release_cr3 (u32 cr3);
+extern bool tlb_shootdown_nmi (void);
+
+#endif
+
+
+/*
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * mode: C
+ * c-file-style: "gnu"
+ * c-basic-offset: 2
+ * End:
+ */
+
+/* vi: set et sw=2 sts=2: */
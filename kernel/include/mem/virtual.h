@@ -33,6 +33,60 @@
 #define BIGFRAMENUM_TO_FRAME(x) ((frame_t) ((x) << BIGPAGE_SIZE_BITS))
 #define FRAME_TO_BIGFRAMENUM(x) ((framenum_t) ((x) >> BIGPAGE_SIZE_BITS))
 
+/* Software (avail) bit in a page table entry: the frame belongs to
+ * the executable page cache and is shared read-only, so it must not
+ * be freed or copied with the address space.  Shared memory frames
+ * (shared_mem_attach) are marked the same way. */
+#define PTE_PCACHE 0x200
+
+/* Software bit: a user page shared copy-on-write after fork.  It is
+ * mapped read-only until the first write (see mem/cow.c). */
+#define PTE_COW 0x400
+
+/* A 4 MiB user page directory entry without PTE_PCACHE is anonymous
+ * memory owned by the address space (see bigpage_map): it is shared
+ * copy-on-write by fork and freed by _exec and _exit.  Other 4 MiB
+ * entries below the kernel (the malloc pool, shared memory) are
+ * supervisor mappings and are left alone. */
+#define PDE_PS 0x80
+#define PDE_USER_BIGPAGE(e) (((e) & (PDE_PS | PTE_PCACHE | 5)) == (PDE_PS | 5))
+
+/* Operations of the bigpage syscall */
+#define BIGPAGE_MAP   0
+#define BIGPAGE_UNMAP 1
+
+extern void *bigpage_map (u32 count);
+extern int bigpage_unmap (void *addr, u32 count);
+extern frame_t copy_bigpage (frame_t old);
+
+/* Permanent mapping of low physical memory with 4 MiB pages, so that
+ * a RAM frame can be reached without claiming a slot in the KERN_PGT
+ * window.  It covers physmap_limit bytes (0 if there is none, e.g. in
+ * a Quest-V sandbox, whose frames are relocated). */
+#define PHYSMAP_BASE 0xC0000000
+#define PHYSMAP_MAX_SIZE 0x20000000 /* 512 MiB, page directory 0x300-0x37F */
+#define PHYSMAP_PGDIR_BEGIN (PHYSMAP_BASE >> BIGPAGE_SIZE_BITS)
+extern u32 physmap_limit;
+#define PHYSMAP_VA(pa) ((void *) (PHYSMAP_BASE + (pa)))
+#define IS_PHYSMAP_VA(va)                                               \
+  ((u32) (va) >= PHYSMAP_BASE && (u32) (va) - PHYSMAP_BASE < physmap_limit)
+/* Can the mapping e (frame | flags) asked of map_virtual_page () be
+ * served from the physmap?  It must be present, writable and normally
+ * cached (no PWT, PCD or PAT). */
+#define PHYSMAP_COVERS(e)                                               \
+  (((e) & 0x9B) == 3 && ((e) & 0xFFFFF000) < physmap_limit)
+
+extern void physmap_init (void);
+extern void physmap_map (uint32 *pgdir);
+
+/* Short-lived mappings from per-CPU slots: no search and no lock.
+ * Only while interrupts are off, and without sleeping, until
+ * kunmap_atomic; otherwise this falls back to map_virtual_page. */
+#define KMAP_SLOTS 8            /* per CPU, nested */
+extern void kmap_cpu_init (void);
+extern void *kmap_atomic (uint32 phys_frame);
+extern void kunmap_atomic (void *virt_addr);
+
 extern void *map_virtual_page (uint32 phys_frame);
 extern void unmap_virtual_page (void *virt_addr);
 extern void *map_virtual_pages (uint32 * phys_frames, uint32 count);
@@ -165,7 +219,7 @@ typedef struct {
  * postcondition: return has valid VA, PA
  * failure result is (0, 0) */
 pgdir_t clone_page_directory (pgdir_t dir);
-pgtbl_t clone_page_table (pgtbl_t tbl);
+pgtbl_t clone_page_table (pgtbl_t tbl, bool share);
 /* precondition: dir PA and VA are valid, va is aligned */
 /* postcondition: returned frame is aligned */
 /* failure: -1 */
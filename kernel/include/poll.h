@@ -0,0 +1,46 @@
+/*                    The Quest Operating System
+ *  Portions Copyright (C) 2005-2012  Richard West, Boston University
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _POLL_H
+#define _POLL_H
+
+/* Must match poll.h in libc */
+
+#define POLLIN   0x0001         /* data or a connection to accept */
+#define POLLOUT  0x0004         /* room in the send buffer */
+#define POLLERR  0x0008
+#define POLLHUP  0x0010         /* remote side closed */
+#define POLLNVAL 0x0020         /* not an open socket */
+
+struct pollfd {
+  int fd;
+  short events;
+  short revents;
+};
+
+#endif
+
+/*
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * mode: C
+ * c-file-style: "gnu"
+ * c-basic-offset: 2
+ * End:
+ */
+
+/* vi: set et sw=2 sts=2: */
@@ -0,0 +1,54 @@
+/*                    The Quest Operating System
+ *  Copyright (C) 2005-2012  Richard West, Boston University
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _FUTEX_H_
+#define _FUTEX_H_
+
+#include "types.h"
+
+/* Fast user-space wait/wake, keyed by the address of a user word.
+ * User-level code keeps its lock or condition state in that word and
+ * only enters the kernel to block or to wake blocked tasks.
+ *
+ * FUTEX_WAIT (uaddr, val): block while *uaddr == val.  The compare
+ * and the enqueue happen under the scheduler lock, so a FUTEX_WAKE
+ * issued after the word changes cannot be missed.
+ *
+ * FUTEX_WAKE (uaddr, n): wake up to n tasks blocked on uaddr.
+ *
+ * Make sure these match libc's futex.h */
+#define FUTEX_WAIT 0
+#define FUTEX_WAKE 1
+
+/* Must hold the scheduler lock */
+extern int futex_wait (u32 *uaddr, u32 val);
+extern int futex_wake (u32 *uaddr, int n);
+extern void futex_exit_mm (u32 pdbr);
+
+#endif
+
+
+/*
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * mode: C
+ * c-file-style: "gnu"
+ * c-basic-offset: 2
+ * End:
+ */
+
+/* vi: set et sw=2 sts=2: */
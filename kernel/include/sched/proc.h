@@ -22,6 +22,7 @@
 #include "util/cassert.h"
 #include "util/circular.h"
 #include "linux_socket.h"
+#include "fs/filesys.h"
 #include "types.h"
 
 typedef union
@@ -36,6 +37,7 @@ CASSERT (sizeof (task_id) == sizeof (uint32), task_id);
 
 #define NUM_M   32
 #define MAX_FD  32
+#define FD_MAX_POLLERS 4
 
 #define FD_TYPE_FILE    0
 #define FD_TYPE_UDP     1
@@ -55,17 +57,25 @@ typedef struct _fd_table_entry {
   circular * tcp_recv_buf_circ;
   circular * tcp_accept_circ;
   struct _quest_tss * task;
+  union {
+    udp_recv_buf_t udp;
+    tcp_recv_buf_t tcp;
+  } recv_cur;                   /* partially consumed pbuf */
+  bool rx_closed;               /* remote side closed the connection */
+  /* Tasks asleep in poll on this socket, including through forked
+   * copies of the descriptor (see socket.c) */
+  struct _quest_tss * pollers[FD_MAX_POLLERS];
 } fd_table_entry_t;
 
 typedef struct _fd_table_file_entry
 {
   char* pathname;
   int current_pos;
-  unsigned char* file_buffer;
   size_t file_length;
+  vfs_file file;                /* read with vfs_pread () */
 } fd_table_file_entry_t;
 
-fd_table_file_entry_t* alloc_fd_table_file_entry(char* pathname, size_t file_length);
+fd_table_file_entry_t* alloc_fd_table_file_entry(char* pathname);
 void free_fd_table_file_entry(fd_table_file_entry_t* entry);
 
 /* --YL-- We have a cyclic include in kernel.h involves proc.h and vcpu.h */
@@ -73,7 +83,6 @@ void free_fd_table_file_entry(fd_table_file_entry_t* entry);
 #define _SCHED_VCPU_REPL_
 typedef struct _replenishment {
   u64 t, b;
-  struct _replenishment *next;
 } replenishment;
 #define MAX_REPL 32
 #endif
@@ -140,7 +149,10 @@ typedef struct _quest_tss
   /* common VCPU scheduling parameters backup */
   u64 C_bak, T_bak, b_bak, usage_bak;
   struct _fault_detection_info* fdi;
-  //u8 padding2[1];
+  /* sleep queue links, see sched/sleep.c */
+  struct _quest_tss *sleep_child, *sleep_next, *sleep_prev;
+  struct _quest_tss *hash_next; /* tid hash chain, see lookup_TSS */
+  u8 padding2[16];
   u8 hr_sleep;
 } PACKED quest_tss;
 
@@ -21,6 +21,7 @@
 #include "kernel.h"
 #include "arch/i386-percpu.h"
 #include "sched/sched-defs.h"
+#include "mem/tlb.h"
 
 extern void runqueue_append (uint32 prio, task_id selector);
 extern void queue_append (quest_tss **queue, quest_tss *selector);
@@ -58,7 +59,8 @@ software_context_switch (quest_tss *nxt_TSS)
   percpu_write (current_task, nxt_TSS);
   /* Update kernel stack in per-CPU TSS */
   update_CPU_TSS ((nxt_TSS->ESP & 0xFFFFF000) + 0x1000);
-  
+  tlb_note_cr3 (nxt_TSS->CR3);
+
   asm volatile ("call _sw_jmp_task":
                 :"S" (cur_TSS), "D" (nxt_TSS)
                 :"eax", "ebx", "ecx", "edx");
@@ -69,18 +69,27 @@ struct sched_param
 #define _SCHED_VCPU_REPL_
 typedef struct _replenishment {
   u64 t, b;
-  struct _replenishment *next;
 } replenishment;
 #define MAX_REPL 32
 #endif
 
+/* Replenishments of a MAIN_VCPU: a min-heap on t in array[0..size),
+ * so the earliest replenishment is always array[0]. */
 typedef struct {
   replenishment array[MAX_REPL];
-  replenishment *head;
   u32 size;
 } repl_queue;
 void repl_queue_pop (repl_queue *Q);
 void repl_queue_add (repl_queue *Q, u64 b, u64 t);
+void repl_queue_head_changed (repl_queue *Q);
+replenishment *repl_queue_second (repl_queue *Q);
+u64 repl_queue_next_after (repl_queue *Q, u64 now);
+
+static inline replenishment *
+repl_queue_head (repl_queue *Q)
+{
+  return Q->size > 0 ? &Q->array[0] : NULL;
+}
 
 struct _vcpu;
 typedef struct {
@@ -98,7 +107,7 @@ typedef struct _vcpu
       spinlock lock;
       vcpu_type type;
       vcpu_hooks *hooks;
-      struct _vcpu *next;       /* next vcpu in a queue */
+      u32 runq_idx;             /* slot in PCPU runqueue + 1, or 0 */
       bool runnable, running;
       u16 cpu;                  /* cpu affinity for vcpu */
       quest_tss *tr;               /* task register */
@@ -154,6 +163,32 @@ typedef struct _vcpu
 } vcpu;
 CASSERT (sizeof (vcpu) == VCPU_ALIGNMENT, vcpu);
 
+#define MAX_NUM_VCPUS 512
+
+/* Per-PCPU queue of runnable VCPUs: a binary min-heap ordered by
+ * period (ties broken by VCPU index), highest priority at heap[0]. */
+typedef struct {
+  vcpu *heap[MAX_NUM_VCPUS];
+  u32 size;
+} vcpu_runq;
+
+extern void vcpu_runq_insert (vcpu_runq *, vcpu *);
+extern void vcpu_runq_remove (vcpu_runq *, vcpu *);
+extern void vcpu_runq_update (vcpu_runq *, vcpu *);
+
+/* Scheduler counters of one PCPU, as returned to user-level */
+struct sched_stat
+{
+  u64 calls;                    /* vcpu_schedule invocations */
+  u64 cycles;                   /* TSC cycles spent in vcpu_schedule */
+  u64 overruns;                 /* timeslices that overran their budget */
+  u64 overhead;                 /* sum of sched_overhead of those */
+  u32 runnable;                 /* VCPUs on the runqueue now */
+  u32 runnable_max;             /* most VCPUs ever on the runqueue */
+};
+
+extern int vcpu_get_stats (struct sched_stat *, int max);
+
 extern u64 vcpu_current_vtsc (void);
 
 extern void iovcpu_job_wakeup (quest_tss *job, u64 T);
@@ -178,7 +213,7 @@ extern void vcpu_reset (void);
 #endif
 
 extern DEF_PER_CPU (vcpu*, vcpu_current);
-extern DEF_PER_CPU (vcpu*, vcpu_queue);
+extern DEF_PER_CPU (vcpu_runq, vcpu_queue);
 
 #endif
 
@@ -94,6 +94,8 @@ typedef enum {
 
 /* Local APIC */
 
+#define APIC_BROADCAST_ID                       0xFF
+
 #define LAPIC_ID                                0x20
 #define LAPIC_VER                               0x30
 #define LAPIC_TPR                               0x80
@@ -110,6 +112,17 @@ typedef enum {
 #define LAPIC_ESR                               0x280
 #define LAPIC_ICR                               0x300
 
+/* x2APIC mode: the registers above become MSRs, one per 16-byte
+ * slot, and the ICR is a single 64-bit MSR with a 32-bit destination
+ * in its upper half.  There is no DFR, and the LDR is read-only. */
+#define IA32_APIC_BASE                          0x1B
+#define         IA32_APIC_BASE_BSP              0x100
+#define         IA32_APIC_BASE_EXTD             0x400   /* x2APIC mode */
+#define         IA32_APIC_BASE_EN               0x800
+#define X2APIC_MSR(reg)                         (0x800 + ((reg) >> 4))
+/* x2APIC logical IDs: cluster in bits 31:16, one bit per member below */
+#define X2APIC_LDR_CLUSTER(ldr)                 ((ldr) & 0xFFFF0000)
+
 /* The ICR consists of an int-vector ORed with the following flags: */
 
 /* Destination modes: */
@@ -22,8 +22,8 @@
 #include "smp/apic-defs.h"
 #include "smp/smp.h"
 
-uint8 LAPIC_get_physical_ID (void);
-void LAPIC_set_logical_destination (uint32);
+uint32 LAPIC_get_physical_ID (void);
+void LAPIC_set_logical_destination (uint32 cpu);
 void LAPIC_enable_timer (uint8, bool, uint8);
 void send_eoi (void);
 #ifdef NANOSLEEP
@@ -36,6 +36,7 @@ void LAPIC_start_timer (uint32);
 #endif
 
 int LAPIC_send_ipi (uint32, uint32);
+int LAPIC_send_ipi_cpus (uint32 cpus, uint32);
 uint32 LAPIC_clear_error (void);
 void LAPIC_set_task_priority (uint8);
 
@@ -49,15 +50,16 @@ int IOAPIC_get_GSI_mapping (uint32 GSI, uint8 *vector, uint64 *flags);
 uint32 IOAPIC_num_entries (void);
 extern uint32 mp_ISA_bus_id;
 
+extern bool x2apic_enabled;
+extern uint32 lapic_logical_dest[MAX_CPUS];
+
+/* Logical destination address of cpu, or 0 if it can only be reached
+ * by physical destination (see LAPIC_set_logical_destination). */
 static inline uint32
 get_logical_dest_addr (uint32 cpu)
 {
-  /* Maximum of 8 cores */
-  if (cpu >= 8) panic ("Invalid cpu number!");
-  if (cpu < 7)
-    return ((uint32) (0x2 << cpu));
-  else
-    return ((uint32) 0x1);
+  if (cpu >= MAX_CPUS) panic ("Invalid cpu number!");
+  return lapic_logical_dest[cpu];
 }
 
 #endif 
@@ -48,6 +48,19 @@ atomic_xchg_dword (volatile uint32 * addr, uint32 x)
   return x;
 }
 
+/* Store x at addr if it still holds old.  Returns what addr held, so
+ * the store happened if that equals old. */
+static inline uint32
+atomic_cmpxchg_dword (volatile uint32 * addr, uint32 old, uint32 x)
+{
+  uint32 prev;
+  asm volatile ("lock cmpxchgl %2,%1"
+                :"=a" (prev), "+m" (*addr)
+                :"r" (x), "0" (old)
+                :"memory", "cc");
+  return prev;
+}
+
 static inline void
 atomic_inc (atomic_t *v)
 {
@@ -0,0 +1,144 @@
+/*                    The Quest Operating System
+ *  Copyright (C) 2005-2012  Richard West, Boston University
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _KLOCK_H_
+#define _KLOCK_H_
+#include "types.h"
+#include "smp/spinlock.h"
+
+/* Per-subsystem kernel locks.
+ *
+ * The old global kernel lock is now only the scheduler lock
+ * (lock_kernel/unlock_kernel).  Other subsystems have their own
+ * locks, and every lock counts its acquisitions and how many of them
+ * had to wait.  The counters can be read with the kstats syscall.
+ *
+ * Lock ordering, outermost first:
+ *
+ *   sched -> vfs -> net -> fd -> pcache -> cow -> slab -> frame
+ *
+ * where slab is the lock of any object cache (mem/slab.h).
+ *
+ * vfs is a sleeping lock.  Its holder may block inside a filesystem
+ * backend, so it is only taken with the scheduler lock held.  The
+ * others are spinlocks and must never be held across schedule (). */
+
+struct _klock_stat
+{
+  const char *name;
+  u64 acquired;                 /* total acquisitions */
+  u64 contended;                /* acquisitions that had to wait */
+};
+typedef struct _klock_stat klock_stat;
+
+struct _klock
+{
+  spinlock lock;
+  klock_stat stat;
+};
+typedef struct _klock klock;
+
+#define KLOCK_INIT(n) { SPINLOCK_INIT, { n, 0, 0 } }
+
+static inline void
+klock_lock (klock * l)
+{
+  bool contended = !spinlock_attempt_lock (&l->lock);
+  if (contended)
+    spinlock_lock (&l->lock);
+  /* counters are protected by the lock itself */
+  l->stat.acquired++;
+  if (contended)
+    l->stat.contended++;
+}
+
+static inline void
+klock_unlock (klock * l)
+{
+  spinlock_unlock (&l->lock);
+}
+
+static inline u32 WARN_UNUSED_RESULT
+_klock_lock_irq_save (klock * l)
+{
+  u32 flags = get_flags ();
+  cli ();
+  klock_lock (l);
+  return flags;
+}
+
+#define klock_lock_irq_save(l, flags)           \
+  do {                                          \
+    flags = _klock_lock_irq_save (l);           \
+  } while (0)
+
+static inline void
+klock_unlock_irq_restore (klock * l, u32 flags)
+{
+  klock_unlock (l);
+  restore_flags (flags);
+}
+
+/* Sleeping lock, owned by a task.  Caller must hold the scheduler
+ * lock. */
+struct _quest_tss;
+
+struct _kmutex
+{
+  struct _quest_tss *owner;
+  struct _quest_tss *waitqueue;
+  klock_stat stat;
+};
+typedef struct _kmutex kmutex;
+
+#define KMUTEX_INIT(n) { NULL, NULL, { n, 0, 0 } }
+
+extern void kmutex_lock (kmutex *);
+extern void kmutex_unlock (kmutex *);
+
+/* Subsystem locks */
+extern klock sched_lock;        /* see lock_kernel () */
+extern klock fd_lock;           /* fd_table slot allocation */
+extern klock pcache_lock;       /* executable page cache (mem/pagecache.c) */
+extern klock cow_lock;          /* copy-on-write frame counts (mem/cow.c) */
+extern klock net_lock;          /* lwIP and socket state */
+extern klock frame_lock;        /* physical frame allocator, KERN_PGT window */
+extern kmutex vfs_lock;         /* filesystem backends (see fs/fsys.c) */
+
+/* Snapshot of one lock's counters, as returned to user-level */
+#define KLOCK_NAME_LEN 16
+struct lock_stat
+{
+  char name[KLOCK_NAME_LEN];
+  u64 acquired;
+  u64 contended;
+};
+
+extern int klock_get_stats (struct lock_stat *, int max);
+
+#endif
+
+/*
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * mode: C
+ * c-file-style: "gnu"
+ * c-basic-offset: 2
+ * End:
+ */
+
+/* vi: set et sw=2 sts=2: */
@@ -44,10 +44,9 @@ extern uint64 tsc2QUANTUM_HZ_ratio;
 int smp_init (void);
 void smp_secondary_init (void);
 void smp_enable_scheduling (void);
-uint32 smp_boot_cpu (uint8 apic_id, uint8 version);
+uint32 smp_boot_cpu (uint32 apic_id, uint8 version);
 
-extern uint8 CPU_to_APIC[MAX_CPUS];
-extern uint8 APIC_to_CPU[MAX_CPUS];
+extern uint32 CPU_to_APIC[MAX_CPUS];
        
 extern uint32 mp_num_cpus;
 extern bool mp_ISA_PC;
@@ -42,7 +42,7 @@ spinlock_lock (spinlock * lock)
   extern void com1_putc (char);
   extern void com1_puts (char *);
   extern void com1_putx (uint32);
-  uint8 LAPIC_get_physical_ID (void);
+  uint32 LAPIC_get_physical_ID (void);
 
 #ifdef DEBUG_SPINLOCK
   int count = 0;
@@ -118,7 +118,7 @@ spinlock_unlock (spinlock * lock)
   extern void com1_putc (char);
   extern void com1_puts (char *);
   extern void com1_putx (uint32);
-  uint8 LAPIC_get_physical_ID (void);
+  uint32 LAPIC_get_physical_ID (void);
   void stacktrace (void);
 
   asm volatile ("lock xchgl %1,(%0)":"=r" (addr), "=ir" (x):"0" (addr),
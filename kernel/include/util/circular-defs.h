@@ -20,6 +20,11 @@
 
 #define CIRCULAR_FLAG_NOWAIT 1
 
+/* Kinds of circular buffer, chosen by the init function */
+#define CIRCULAR_LOCKED 0       /* any number of producers and consumers */
+#define CIRCULAR_SPSC   1       /* lock-free, one producer, one consumer */
+#define CIRCULAR_MPSC   2       /* lock-free, many producers, one consumer */
+
 #endif
 
 /* 
@@ -31,10 +31,28 @@ struct _circular
   sint32 (*remove)(struct _circular *, void *, uint32);
   spinlock lock;
   struct _quest_tss *ins_waitq, *rem_waitq;
+  uint32 type;                  /* CIRCULAR_LOCKED, _SPSC or _MPSC */
+  /* Lock-free kinds: free-running counts of elements inserted and
+   * removed, on separate cache lines, and for CIRCULAR_MPSC the
+   * sequence number of each slot */
+  volatile uint32 *seq;
+  volatile uint32 head;
+  uint8 _pad[LOCK_ALIGNMENT];
+  volatile uint32 tail;
 };
 
 typedef struct _circular circular;
 
+/* Number of elements in c.  For CIRCULAR_MPSC this includes ones a
+ * producer is still writing. */
+static inline sint32
+circular_count (circular *c)
+{
+  if (c->type == CIRCULAR_LOCKED)
+    return c->cur_count;
+  return c->head - c->tail;
+}
+
 static inline sint32
 circular_insert (circular *c, void *elt)
 {
@@ -60,6 +78,27 @@ circular_remove_nowait (circular *c, void *out_elt)
 }
 
 void circular_init (circular *c, void *buffer, sint32 num_elts, sint32 elt_size);
+void circular_init_spsc (circular *c, void *buffer, sint32 num_elts,
+                         sint32 elt_size);
+void circular_init_mpsc (circular *c, void *buffer, uint32 *seq,
+                         sint32 num_elts, sint32 elt_size);
+
+/* Zero-copy access.  circular_insert_reserve returns the slot the
+ * next element goes in, or NULL if c is full; the caller writes the
+ * element there and passes the slot to circular_insert_commit.
+ * circular_remove_peek and circular_remove_release do the same on
+ * the removal side.  Neither blocks.  With CIRCULAR_LOCKED the lock
+ * is held from a successful reserve (or peek) to the commit (or
+ * release). */
+void *circular_insert_reserve (circular *c);
+void circular_insert_commit (circular *c, void *slot);
+void *circular_remove_peek (circular *c);
+void circular_remove_release (circular *c, void *slot);
+
+/* Insert or remove up to n elements at once, without blocking.
+ * Returns the number moved. */
+sint32 circular_insert_n (circular *c, void *elts, sint32 n);
+sint32 circular_remove_n (circular *c, void *out_elts, sint32 n);
 
 #endif
 
@@ -20,6 +20,7 @@
 
 extern void com1_putc (char);
 extern void com1_puts (char *);
+extern void com1_write (const char *, int);
 extern void com1_putx (uint32);
 extern int getc(void);
 
@@ -29,6 +29,7 @@ void fun_vprintf (void putc (char), const char *fmt, va_list args);
 void fun_printf (void putc (char), const char *fmt, ...);
 void com1_printf (const char *fmt, ...);
 void logger_printf (const char *fmt, ...);
+void logger_vprintf (const char *fmt, va_list args);
 void printf (const char *fmt, ...);
 void _printf (const char *fmt, ...);
 
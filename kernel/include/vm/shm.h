@@ -37,7 +37,10 @@
 #define SHM_MAGIC               0xCAFEBABE
 
 #define SHM_MAX_SCREEN          0x08
-#define SHM_MAX_SANDBOX         0x08
+/* One sandbox per CPU.  Every pair of sandboxes has a private
+ * channel page, so the channels take n(n-1)/2 pages of the shared
+ * area, 496 of its 2048 for 32 CPUs. */
+#define SHM_MAX_SANDBOX         MAX_CPUS
 
 /* The start (high, grows down) physical address of private channels b/w sandboxes */
 #define PHYS_PRIV_CHANNEL_HIGH  (PHYS_SHARED_MEM_HIGH - ((1 + SHM_MAX_SCREEN) << 12))
@@ -105,6 +108,9 @@ typedef struct _shm_info {
   /* Used to muffle network output of a certain sandbox to implement "hot" backup */
   bool network_transmit_enabled[SHM_MAX_SANDBOX];
   bool bsp_booted;
+  /* Physical address of each sandbox's log, if built with LOGGER_SHM
+   * (see util/logger.c) */
+  uint32 logger_buf[SHM_MAX_SANDBOX];
 } shm_info;
 
 #define POOL_SIZE_IN_PAGES 20
@@ -120,19 +126,78 @@ typedef struct {
 } new_shared_memory_arena_msg_t;
 
 CASSERT(POOL_SIZE_IN_PAGES <= (sizeof(uint) * 8), vshm_pool_size)
+CASSERT(1 + SHM_MAX_SCREEN + NUM_PRIV_CHANNELS < (SHARED_MEM_SIZE >> 12),
+        shm_priv_channels)
 
 typedef enum {
   ISBM_NO_MESSAGE = 0,
   ISBM_NEW_SHARED_MEMORY_ARENA,
-  ISBM_TEST
+  ISBM_TEST,
+  ISBM_VSHM_NOTIFY
 } isb_msg_type_t;
 
+/* Inter-sandbox messages.  Each direction of a private channel is a
+ * single-producer ring of ISBM_RING_SLOTS messages.  The receiving
+ * sandbox's ISBM thread sleeps while its rings are empty; a sender
+ * finding it parked rings the doorbell, an IPI on
+ * ISBM_DOORBELL_VECTOR.  The same IPI tells a sender waiting for room
+ * that the receiver has freed slots. */
+#define ISBM_DOORBELL_VECTOR  242 /* after the migration IPIs */
+#define ISBM_RING_SLOTS       8
+#define ISBM_MSG_MAX          224 /* largest message, in bytes */
+
+typedef struct {
+  uint32 type;                  /* isb_msg_type_t */
+  uint32 size;
+  uint64 tsc;                   /* when sent, for the latency histogram */
+  uint8 data[ISBM_MSG_MAX];
+} isbm_slot_t;
+
+typedef struct {
+  /* Written by the sender only */
+  volatile uint32 head;
+  volatile uint32 producer_parked; /* waiting for a free slot */
+  uint8 _pad0[56];
+  /* Written by the receiver only */
+  volatile uint32 tail;
+  volatile uint32 consumer_parked;
+  uint8 _pad1[56];
+  isbm_slot_t slot[ISBM_RING_SLOTS];
+} isbm_ring_t;
+
+CASSERT(sizeof(isbm_ring_t) <= 0x1000 / 2, isbm_ring_size)
+
+/* Flags for isbm_send */
+#define ISBM_NOWAIT           0x1
+
+bool isbm_send(isb_msg_type_t msg_type, uint target_sandbox,
+               void* msg, size_t size, uint flags);
+int isbm_send_space(uint target_sandbox);
+
 bool send_intersandbox_msg(isb_msg_type_t msg_type, uint target_sandbox,
 			   void* msg, size_t size);
 
+/* Send-to-process latency of received messages.  Bucket 0 counts
+ * those under 1 usec, bucket i > 0 those in [2^(i-1), 2^i) usec,
+ * and the last bucket everything longer. */
+#define ISBM_LATENCY_BUCKETS  16
+
+int isbm_latency_histogram(uint32* buckets, int max);
+void isbm_print_latency(void);
+
 int virtual_shared_mem_map(uint vshm_key, uint size, uint sandboxes,
                            uint flags, void** addr, bool user_space);
 
+/* Cross-sandbox wakeups for vshm users (see libc vshm_channel).
+ * vshm_notify wakes a task of the given sandbox waiting in vshm_wait
+ * on the same key; a notification with no waiter is kept until the
+ * next vshm_wait on its key, or until vshm_forget drops it. */
+#define VSHM_MAX_WAITERS 16
+
+int vshm_notify(uint sandbox, uint vshm_key);
+int vshm_wait(uint vshm_key, uint usec);
+int vshm_forget(uint vshm_key);
+
 static inline void
 initialise_new_shared_memory_arena_msg(new_shared_memory_arena_msg_t* msg,
 				       bool new_pool, uint vshm_key,
@@ -160,6 +225,9 @@ typedef struct {
   shm_pool_t pools[SHM_MAX_SANDBOX][NUM_POOLS_PER_SANDBOX];
   void* priv_write_regions[SHM_MAX_SANDBOX];
   void* priv_read_regions[SHM_MAX_SANDBOX];
+  /* Local task waiting for room in each write ring, if any */
+  quest_tss* send_waiter[SHM_MAX_SANDBOX];
+  uint32 latency[ISBM_LATENCY_BUCKETS];
 } shm_comm_t;
 
 extern shm_comm_t shm_comm;
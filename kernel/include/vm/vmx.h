@@ -21,11 +21,9 @@
 #include "vmx-defs.h"
 #include "smp/spinlock.h"
 #include "vm/hypercall.h"
+#include "arch/i386-msr.h"
 
 #define IA32_FEATURE_CONTROL         0x003A
-#define IA32_SYSENTER_CS             0x0174
-#define IA32_SYSENTER_ESP            0x0175
-#define IA32_SYSENTER_EIP            0x0176
 
 /* See Intel System Programming Manual appendix G */
 #define IA32_VMX_BASIC               0x0480
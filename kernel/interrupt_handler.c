@@ -24,12 +24,18 @@
 #include "arch/i386.h"
 #include "arch/i386-percpu.h"
 #include "arch/i386-measure.h"
+#include "arch/i386-vdso.h"
 #include "kernel.h"
 #include "mem/mem.h"
+#include "mem/pagecache.h"
+#include "mem/cow.h"
+#include "mem/slab.h"
 #include "util/elf.h"
 #include "fs/filesys.h"
+#include "fs/bcache.h"
 #include "smp/smp.h"
 #include "smp/apic.h"
+#include "smp/klock.h"
 #include "util/printf.h"
 #include "util/screen.h"
 #include "util/debug.h"
@@ -37,6 +43,7 @@
 #include "drivers/input/keyboard.h"
 #include "sched/sched.h"
 #include "sched/vcpu.h"
+#include "sched/futex.h"
 #include "drivers/usb/usb.h"
 #include "drivers/serial/serial.h"
 #include "lwip/pbuf.h"
@@ -197,6 +204,18 @@ handle_interrupt (u32 edi, u32 esi, u32 ebp, u32 _esp, u32 ebx, u32 edx, u32 ecx
                 :"=m" (cr0), "=m" (cr2), "=m" (cr3),
                  "=m" (tr), "=m" (fs), "=m" (ds):);
 
+  /* TLB shootdowns arrive as NMIs */
+  if (ulInt == 2 && tlb_shootdown_nmi ())
+    return;
+
+  /* Not-present page fault in a demand-paged executable */
+  if (ulInt == 0xE && !(ulCode & 1) && pcache_fault (cr3, cr2))
+    return;
+
+  /* Write to a copy-on-write page, from user or kernel mode */
+  if (ulInt == 0xE && (ulCode & 3) == 3 && cow_fault (cr3, cr2))
+    return;
+
   if ((cs & 0x3) == 0) {
     /* same priv level: ESP and SS were not pushed onto stack by interrupt transfer */
     asm volatile ("movl %%ss, %0":"=r" (ss));
@@ -393,15 +412,20 @@ syscall_usb (u32 eax, u32 ebx, u32 ecx, u32 edx, u32 esi)
 #endif
 
   if(operation == USB_USER_OPEN) {
-    fd = find_fd(tss);
-    if(fd < 0) return fd;
     device_id = get_usb_device_id(buf);
     if(device_id < 0) return device_id;
+    klock_lock (&fd_lock);
+    fd = find_fd(tss);
+    if(fd < 0) {
+      klock_unlock (&fd_lock);
+      return fd;
+    }
     tss->fd_table[fd].type = FD_TYPE_USB_DEV;
     /* -- EM -- Need to offset it by 1 so entry is never NULL, fix
        this later to store device struct address instead of it's
        index */
     tss->fd_table[fd].entry = (void*)(device_id+1);
+    klock_unlock (&fd_lock);
   }
   else {
     device_id = (int)(tss->fd_table[fd].entry-1);
@@ -652,25 +676,90 @@ int syscall_get_keyboard_events(u32 eax, int blocking, uint* codes, uint max, u3
   return count;
 }
 
+/* Kernel statistics, selected by which; see KSTATS_* in kernel.h */
+static int
+syscall_kstats (u32 eax, int which, void *buf, int max, u32 esi)
+{
+  if (!buf || max <= 0)
+    return -1;
+  switch (which) {
+  case KSTATS_LOCK:
+    return klock_get_stats (buf, max);
+  case KSTATS_BCACHE:
+    return bcache_get_stats (buf, max);
+  case KSTATS_SCHED:
+    return vcpu_get_stats (buf, max);
+  case KSTATS_KMEM:
+    return kmem_get_stats (buf, max);
+  case KSTATS_COW:
+    /* unlocked snapshot, like the other counters */
+    memcpy (buf, &cow_stats, sizeof (struct cow_stat));
+    return 1;
+  default:
+    return -1;
+  }
+}
+
+/* Anonymous memory in 4 MiB pages; see bigpage_map () */
+static u32
+syscall_bigpage (u32 eax, int op, u32 arg, u32 count, u32 esi)
+{
+  switch (op) {
+  case BIGPAGE_MAP:
+    return (u32) bigpage_map (count);
+  case BIGPAGE_UNMAP:
+    return (u32) bigpage_unmap ((void *) arg, count);
+  default:
+    return -1;
+  }
+}
+
+/* Runs under the scheduler lock; see sched/futex.h */
+static int
+syscall_futex (u32 eax, u32 *uaddr, int op, u32 val, u32 esi)
+{
+  switch (op) {
+  case FUTEX_WAIT:
+    return futex_wait (uaddr, val);
+  case FUTEX_WAKE:
+    return futex_wake (uaddr, (int) val);
+  default:
+    return -1;
+  }
+}
+
+/* Each syscall runs under the lock of the subsystem it touches.  A
+ * NULL lock means it needs none, or takes its own.  None of the
+ * sched_lock entries below is covered by the fd, net, vfs, pcache,
+ * cow or frame locks: the sleep, VCPU and futex calls change
+ * scheduler state; usb, keyboard events, gpio and i2c drive devices
+ * that block through schedule (); enable_video and bigpage edit the
+ * caller's page directory, which fork and exit walk under the
+ * scheduler lock.  vcpu_setparams is only a stub, but it gets the
+ * lock its VCPU state will need. */
 struct syscall {
   u32 (*func) (u32, u32, u32, u32, u32);
+  klock *lock;
 };
 struct syscall syscall_table[] = {
-  { .func = (void *)syscall_putchar },
-  { .func = (void *)syscall_usleep },
-  { .func = (void *)syscall_usb },
-  { .func = (void *)syscall_getpid },
-  { .func = (void *)syscall_vcpu_create },
-  { .func = (void *)syscall_vcpu_bind_task },
-  { .func = (void *)syscall_vcpu_destroy },
-  { .func = (void *)syscall_vcpu_getparams },
-  { .func = (void *)syscall_vcpu_setparams },
-  { .func = (void *)syscall_enable_video },
-  { .func = (void *)syscall_lseek},
-  { .func = (void *)syscall_get_keyboard_events },
-  { .func = (void *)syscall_gpio },
-  { .func = (void *)syscall_i2c},
-  { .func = (void *)syscall_nanosleep},
+  { .func = (void *)syscall_putchar, .lock = NULL },
+  { .func = (void *)syscall_usleep, .lock = &sched_lock },
+  { .func = (void *)syscall_usb, .lock = &sched_lock },
+  { .func = (void *)syscall_getpid, .lock = NULL },
+  { .func = (void *)syscall_vcpu_create, .lock = &sched_lock },
+  { .func = (void *)syscall_vcpu_bind_task, .lock = &sched_lock },
+  { .func = (void *)syscall_vcpu_destroy, .lock = &sched_lock },
+  { .func = (void *)syscall_vcpu_getparams, .lock = &sched_lock },
+  { .func = (void *)syscall_vcpu_setparams, .lock = &sched_lock },
+  { .func = (void *)syscall_enable_video, .lock = &sched_lock },
+  { .func = (void *)syscall_lseek, .lock = &fd_lock },
+  { .func = (void *)syscall_get_keyboard_events, .lock = &sched_lock },
+  { .func = (void *)syscall_gpio, .lock = &sched_lock },
+  { .func = (void *)syscall_i2c, .lock = &sched_lock },
+  { .func = (void *)syscall_nanosleep, .lock = &sched_lock },
+  { .func = (void *)syscall_kstats, .lock = NULL },
+  { .func = (void *)syscall_futex, .lock = &sched_lock },
+  { .func = (void *)syscall_bigpage, .lock = &sched_lock },
 };
 #define NUM_SYSCALLS (sizeof (syscall_table) / sizeof (struct syscall))
 
@@ -678,12 +767,16 @@ u32
 handle_syscall0 (u32 eax, u32 ebx, u32 ecx, u32 edx, u32 esi)
 {
   u32 res;
-  lock_kernel ();
-  if (eax < NUM_SYSCALLS)
-    res = syscall_table[eax].func (eax, ebx, ecx, edx, esi);
-  else
-    res = 0;
-  unlock_kernel ();
+  klock *l;
+
+  if (eax >= NUM_SYSCALLS)
+    return 0;
+  l = syscall_table[eax].lock;
+  if (l)
+    klock_lock (l);
+  res = syscall_table[eax].func (eax, ebx, ecx, edx, esi);
+  if (l)
+    klock_unlock (l);
   return res;
 }
 
@@ -926,6 +1019,7 @@ _fork (vcpu_id_t vcpu_id, uint32 ebp, uint32 *esp)
   pgdir_t childpgd = clone_page_directory (parentpgd);
   if (childpgd.dir_pa == -1)
     panic ("_fork: clone_page_directory: failed");
+  pcache_exec_fork (parentpgd.dir_pa, childpgd.dir_pa);
 
   unmap_virtual_page (parentpgd.dir_va);
   unmap_virtual_page (childpgd.dir_va);
@@ -948,32 +1042,22 @@ _fork (vcpu_id_t vcpu_id, uint32 ebp, uint32 *esp)
   return tssp->tid;       /* Use this index for child ID for now */
 }
 
-/* --??-- TODO: Rewrite _exec to create a temporary new address space
- before overwriting the old one in case of errors */
-
 /* Syscall: _exec: replace address space of caller with new memory areas, in part
  * populated by program image on disk
+ *
+ * The image and the stack frames are obtained before the old address
+ * space is torn down, so a missing, unreadable or malformed file
+ * fails with -1 and the caller keeps running.  Only a failure to map
+ * the vDSO page after that point ends the task.
  */
 int
 _exec (char *filename, char *argv[], uint32 *curr_stack)
 {
   uint32 *plPageDirectory;
-  uint32 *plPageTable;
-  uint32 currentPageTableEntry;
-  uint32 newPageTableEntry;
   uint32 pStack[USER_STACK_SIZE];
-  Elf32_Ehdr *pe = (Elf32_Ehdr *) 0x60000000;   /* Read executable in at 1.5 gigabyte */
-  Elf32_Phdr *pph;
+  pcache_entry *image;
+  vfs_file file;
   void *pEntry;
-  int filesize, orig_filesize;
-  /* Temporary storage for frame pointers for a file image up to 4MB
-     discounting bss */
-  uint32 *phys_addrs;
-  /* frame_map is a 1024 bit bitmap to mark frames not needed for 
-     file of specific size when not all sections need loading into RAM */
-  uint32* frame_map;
-  uint32 **frame_ptrs;
-  uint32 num_frame_ptrs;
   uint32 *tmp_page;
   int i, j, c;
   char command_args[80];
@@ -1005,42 +1089,44 @@ _exec (char *filename, char *argv[], uint32 *curr_stack)
    * and will already be gone with the old stack at that time.
    */
   strncpy (filename_bak, filename, 256);
-  c = strlen (filename);
-  if (c > 31) c = 31;
-  tss = str ();
-  memcpy (tss->name, filename, c);
-  tss->name[c] = '\0';
+  filename_bak[255] = '\0';
 
-#ifdef DEBUG_SYSCALL
-  com1_printf ("_exec: vfs_dir\n");
-#endif
-  /* Find file on disk -- essentially a basic open call */
-  if ((filesize = vfs_dir (filename)) < 0) {    /* Error */
+  /* Frames for the new stack, mapped once the old image is gone */
+  for (i = 0; i < USER_STACK_SIZE; i++) {
+    pStack[i] = alloc_phys_frame ();
+    if (pStack[i] == -1)
+      break;
+  }
+  if (i < USER_STACK_SIZE) {
+    while (i-- > 0)
+      free_phys_frame (pStack[i]);
     unlock_kernel ();
     return -1;
   }
 
-
-  num_frame_ptrs = DIV_ROUND_UP(filesize, 0x400000);
-
-  phys_addrs = kmalloc(num_frame_ptrs * sizeof(*phys_addrs));
-  if(phys_addrs == NULL) goto exec_cleanup;
-  frame_ptrs = kmalloc(num_frame_ptrs * sizeof(*frame_ptrs));
-  if(frame_ptrs== NULL) goto exec_cleanup;
-  frame_map = kmalloc(32 * sizeof (uint32) * num_frame_ptrs);
-  if(frame_map == NULL) goto exec_cleanup;
-  
+#ifdef DEBUG_SYSCALL
+  com1_printf ("_exec: vfs_open\n");
+#endif
+  /* Find file on disk.  A page cache hit reads nothing more; on a miss
+   * the VFS lock keeps the backend's current file until pcache_load,
+   * which loads the image through the old address space. */
   plPageDirectory = map_virtual_page ((uint32) get_pdbr () | 3);
-
-  for(i = 0; i < num_frame_ptrs; ++i) {
-    phys_addrs[i] = alloc_phys_frame () | 3;
-    if(phys_addrs[i] == 0xFFFFFFFF) goto exec_cleanup;
-    frame_ptrs[i] = map_virtual_page (phys_addrs[i]);
-    if(frame_ptrs[i] == NULL) goto exec_cleanup;
+  kmutex_lock (&vfs_lock);
+  image = NULL;
+  if (vfs_open (filename_bak, &file) >= 0) {
+    image = pcache_lookup (filename_bak, &file);
+    if (!image)
+      image = pcache_load (filename_bak, &file, plPageDirectory);
   }
-  
-  
-  
+  kmutex_unlock (&vfs_lock);
+  if (!image)
+    goto exec_cleanup;
+
+  c = strlen (filename_bak);
+  if (c > 31) c = 31;
+  tss = str ();
+  memcpy (tss->name, filename_bak, c);
+  tss->name[c] = '\0';
 
   /* Free frames used for old address space before _exec was called
    *
@@ -1061,220 +1147,62 @@ _exec (char *filename, char *argv[], uint32 *curr_stack)
         (i < MALLOC_POOL_START_DIR_ENTRY || i > MALLOC_POOL_LAST_DIR_ENTRY) &&
         (i < DMA_POOL_START_PAGE_TABLE || i > DMA_POOL_LAST_PAGE_TABLE)) {
 #endif
+      if (plPageDirectory[i] & PDE_PS) {
+        /* 4 MiB page: only anonymous ones belong to the process */
+        if (PDE_USER_BIGPAGE (plPageDirectory[i])) {
+          cow_free_bigpage (plPageDirectory[i]);
+          plPageDirectory[i] = 0;
+        }
+        continue;
+      }
       /* Present in currrent address space */
-      tmp_page = map_virtual_page (plPageDirectory[i] | 3);
+      tmp_page = kmap_atomic (plPageDirectory[i] | 3);
       for (j = 0; j < 1024; j++) {
         if (tmp_page[j]) {      /* Present in current address space */
-          BITMAP_SET (mm_table, tmp_page[j] >> 12);   /* Free frame */
+          if (!(tmp_page[j] & PTE_PCACHE))
+            cow_free_frame (tmp_page[j]);    /* Free frame, unless shared */
           tmp_page[j] = 0;
         }
       }
-      unmap_virtual_page (tmp_page);
-      BITMAP_SET (mm_table, plPageDirectory[i] >> 12);
+      kunmap_atomic (tmp_page);
+      free_phys_frame (plPageDirectory[i]);
       plPageDirectory[i] = 0;
     }
   }
-    
-  /* Allocate space for new page tables */
+  pcache_exec_release ((uint32) get_pdbr ());
 
-  currentPageTableEntry = 0;
-  plPageDirectory[currentPageTableEntry] = alloc_phys_frame() | 7;
-  if(plPageDirectory[currentPageTableEntry] == 0xFFFFFFFF) {
-    goto exec_cleanup;
-  }
-  plPageTable = map_virtual_page(plPageDirectory[currentPageTableEntry]);
-  if(plPageTable == NULL) goto exec_cleanup;
-  memset(plPageTable, 0, 0x1000);
-  
-  
-  for (i = 0, c = 0; i < filesize; ++c) {
-    for(j = 0; (j < 1024) && (i < filesize); ++j, i += 4096) {
-      frame_ptrs[c][j] = alloc_phys_frame () | 3;
-      if(frame_ptrs[c][j] == 0xFFFFFFFF) {
-        goto exec_cleanup;
-      }
-    }
-  }
-    
-  /* Temporary dir entry for mapping file image into virtual address
-     space */
-  for(i = 0; i < num_frame_ptrs; ++i) {
-    plPageDirectory[((uint32) pe >> 22) + i] = phys_addrs[i];
-  }
-  
   flush_tlb_all ();
 
-
-#ifdef DEBUG_SYSCALL
-  com1_printf ("_exec: vfs read\n");
-#endif
-  /* Read into virtual address corresponding to plPageDirectory[1021] */
-  orig_filesize = filesize;
-  filesize = vfs_read (filename_bak, (void *) pe, orig_filesize);
-  if (filesize != orig_filesize) {
-    printf ("expected filesize=%d got filesize=%d\n", orig_filesize, filesize);
-    panic ("File size mismatch on read");
-  }
-
-  pph = (void *) pe + pe->e_phoff;
-  pEntry = (void *) pe->e_entry;
-
-  memset (frame_map, 0, 32 * sizeof (uint32) * num_frame_ptrs);
-
-#ifdef DEBUG_SYSCALL
-  com1_printf ("_exec: walk ELF header\n");
-#endif
-  /* Walk ELF header */
-  for (i = 0; i < pe->e_phnum; i++) {
-    if (pph->p_type == PT_LOAD) {
-      if ((pph->p_offset & 0xFFF) != (pph->p_vaddr & 0xFFF))
-        panic ("Misalignment in program header");
-
-      /* map pages loaded from file */
-      c = ((pph->p_offset + pph->p_filesz - 1) >> 12) - (pph->p_offset >> 12) + 1;      /* #pages to load for module */
-
-      for (j = 0; j < c; j++) {
-        if (j == c - 1) {
-          /* Page is the last of this header, and needs to be
-             zero-padded, but unfortunately the page may be
-             shared with the next phdr.  We copy it to avoid any
-             conflicts. */
-          uint32 frame = alloc_phys_frame ();
-          char *buf = map_virtual_page (frame | 3);
-          int partial = (pph->p_offset + pph->p_filesz) & 0xFFF;
-
-          memcpy (buf, (char *) pe + (pph->p_offset & ~0xFFF) +
-                  (j << 12), partial);
-          memset (buf + partial, 0, 0x1000 - partial);
-
-          unmap_virtual_page (buf);
-
-          if(currentPageTableEntry !=
-             (newPageTableEntry = (((uint32) pph->p_vaddr >> 12) + j) / 1024)) {
-            currentPageTableEntry = newPageTableEntry;
-            unmap_virtual_page(plPageTable);
-            if(!plPageDirectory[newPageTableEntry]) {
-              plPageDirectory[currentPageTableEntry] = alloc_phys_frame() | 7;
-              if(plPageDirectory[currentPageTableEntry] == 0xFFFFFFFF) {
-                goto exec_cleanup;
-              }
-              plPageTable = map_virtual_page(plPageDirectory[currentPageTableEntry]);
-              if(plPageTable == NULL) goto exec_cleanup;
-              memset(plPageTable, 0, 0x1000);
-            }
-            else {
-              plPageTable = map_virtual_page(plPageDirectory[currentPageTableEntry]);
-            }
-
-            
-          }
-          plPageTable[(((uint32) pph->p_vaddr >> 12) + j) % 1024] = frame | 7;
-        } else {
-          BITMAP_SET (frame_map, j + (pph->p_offset >> 12));
-
-          if(currentPageTableEntry !=
-             (newPageTableEntry = (((uint32) pph->p_vaddr >> 12) + j) / 1024)) {
-              currentPageTableEntry = newPageTableEntry;
-              unmap_virtual_page(plPageTable);
-              if(!plPageDirectory[newPageTableEntry]) {
-                plPageDirectory[currentPageTableEntry] = alloc_phys_frame() | 7;
-                if(plPageDirectory[currentPageTableEntry] == 0xFFFFFFFF) {
-                  goto exec_cleanup;
-                }
-                plPageTable = map_virtual_page(plPageDirectory[currentPageTableEntry]);
-                if(plPageTable == NULL) goto exec_cleanup;
-                memset(plPageTable, 0, 0x1000);
-              }
-              else {
-                plPageTable = map_virtual_page(plPageDirectory[currentPageTableEntry]);
-              }
-          }
-          plPageTable[(((uint32) pph->p_vaddr >> 12) + j) % 1024] =
-            frame_ptrs[(j + (pph->p_offset >> 12)) / 1024][(j + (pph->p_offset >> 12)) % 1024] | 7;
-        }
-      }
-
-      /* map additional zeroed pages */
-      c = ((pph->p_offset + pph->p_memsz - 1) >> 12) - (pph->p_offset >> 12) + 1;       /* page limit to clear for module */
-      
-
-      /* Allocate space for bss section.  Use temporary virtual memory for
-       * memset call to clear physical frame(s)
-       */
-      for (; j < c; j++) {
-        uint32 page_frame = (uint32) alloc_phys_frame ();
-        void *virt_page = map_virtual_page (page_frame | 3);
-
-        if(currentPageTableEntry !=
-           (newPageTableEntry = ((((uint32) pph->p_vaddr >> 12) + j) / 1024))) {
-          currentPageTableEntry = newPageTableEntry;
-          unmap_virtual_page(plPageTable);
-          if(!plPageDirectory[newPageTableEntry]) {
-            plPageDirectory[currentPageTableEntry] = alloc_phys_frame() | 7;
-            if(plPageDirectory[currentPageTableEntry] == 0xFFFFFFFF) {
-              goto exec_cleanup;
-            }
-            plPageTable = map_virtual_page(plPageDirectory[currentPageTableEntry]);
-            if(plPageTable == NULL) goto exec_cleanup;
-            memset(plPageTable, 0, 0x1000);
-          }
-          else {
-            plPageTable = map_virtual_page(plPageDirectory[currentPageTableEntry]);
-          }
-          
-        }
-        plPageTable[(((uint32) pph->p_vaddr >> 12) + j) % 1024] = page_frame | 7;
-        memset (virt_page, 0, 0x1000);
-        unmap_virtual_page (virt_page);
-      }
-    }
-
-    pph = (void *) pph + pe->e_phentsize;
-  }
-
-  /* Deallocate unsued frames for file that were not loaded with contents */
-
-  for (i = 0, c = 0; i < filesize; ++c) {
-    for(j = 0; (j < 1024) && (i < filesize); ++j, i += 4096) {
-      if (!BITMAP_TST (frame_map, i >> 12))
-        BITMAP_SET (mm_table, frame_ptrs[c][j] >> 12);
-    }
-  }
+  /* Text, data and bss are faulted in from the image on first touch
+   * (see pcache_fault) */
+  pEntry = image->entry;
+  pcache_exec_attach ((uint32) get_pdbr (), image);
 
   /* --??-- temporarily map video memory into exec()ed process */
   //for (i = 0; i < 16; i++)
   //  plPageTable[0x200 + i] = 0xA0000 | (i << 12) | 7;
 
-  /* map stack and clear its contents -- Here, setup 16 pages for stack */
-  
-  for (i = 0; i < USER_STACK_SIZE; i++) {
-    pStack[i] = alloc_phys_frame ();
-  }
-
   map_user_level_stack(plPageDirectory, (void *) USER_STACK_START,
                        USER_STACK_SIZE, pStack, TRUE);
 
+  if (!vdso_map (plPageDirectory)) {
+    /* libc reads the vDSO page without checking for it, and the old
+     * image is already gone, so there is nothing left to run */
+    void __exit (int);
+    com1_printf ("_exec: vdso_map failed\n");
+    unmap_virtual_page (plPageDirectory);
+    unlock_kernel ();
+    __exit (-1);
+  }
+
   //invalidate_page ((void *) ((1023 - i) << 12));
   
   
   memset ((void *) USER_STACK_START - (0x1000 * USER_STACK_SIZE),
           0, 0x1000 * USER_STACK_SIZE);       /* Clear 16 page stack */
 
-  for(i = 0; i < num_frame_ptrs; ++i) {
-    plPageDirectory[((uint32) pe >> 22) + i] = 0;
-  }
   unmap_virtual_page (plPageDirectory);
   
-  unmap_virtual_page (plPageTable);
-  for(i = 0; i < num_frame_ptrs; ++i) {
-    unmap_virtual_page (frame_ptrs[i]);
-    BITMAP_SET (mm_table, phys_addrs[i] >> 12);
-  }
-
-  kfree (frame_ptrs);
-  kfree (phys_addrs);
-  kfree (frame_map);
-  
   flush_tlb_all ();
 
   /* --TOM-- Currently support two commandline arguments */
@@ -1323,8 +1251,11 @@ _exec (char *filename, char *argv[], uint32 *curr_stack)
 
 
   exec_cleanup:
-  com1_printf("Exec cleanup not implemented\n");
-  panic("Exec cleanup not implemented");
+  /* The old address space is untouched */
+  for (i = 0; i < USER_STACK_SIZE; i++)
+    free_phys_frame (pStack[i]);
+  unmap_virtual_page (plPageDirectory);
+  unlock_kernel ();
   return -1;
 }
 
@@ -1367,56 +1298,54 @@ _open (char *pathname, int flags)
   quest_tss * tss;
   int fd;
   fd_table_entry_t* fd_table_entry;
+  fd_table_file_entry_t* file_entry;
   int res;
 
-  lock_kernel ();
-  
   tss = percpu_read (current_task);
   
   if (!tss) {
     com1_printf ("No current task\n");
-    unlock_kernel ();
     return -1;
   }
   
   //com1_printf ("_open (\"%s\", 0x%x)\n", pathname, flags);
-  res = vfs_dir (pathname);
-  
+
+  file_entry = alloc_fd_table_file_entry(pathname);
+
+  if(!file_entry) {
+    com1_printf("alloc for fd_table_entry->entry failed\n");
+    return -1;
+  }
+
+  /* Filesystem backends may block, so the VFS lock is taken with the
+   * scheduler lock held */
+  lock_kernel ();
+  kmutex_lock (&vfs_lock);
+  res = vfs_open (file_entry->pathname, &file_entry->file);
+  kmutex_unlock (&vfs_lock);
+  unlock_kernel ();
+
+  if(res < 0) {
+    free_fd_table_file_entry(file_entry);
+    return -1;
+  }
+  file_entry->file_length = res;
+
   /* File exists lets assign it a descriptor if a free one is available */
-  if(res >= 0) {
-    
-    fd = find_fd(tss);
-    if(fd < 0) {
-      unlock_kernel ();
-      return -1;
-    }
-    
+  klock_lock (&fd_lock);
+  fd = find_fd(tss);
+  if(fd >= 0) {
     fd_table_entry = &tss->fd_table[fd];
-    fd_table_entry->entry = alloc_fd_table_file_entry(pathname, (size_t)res);
-    
-    if(!fd_table_entry->entry) {
-      com1_printf("alloc for fd_table_entry->entry failed\n");
-      unlock_kernel ();
-      return -1;
-    }
-
-#ifdef ONE_FILE_READ
-    if(vfs_read(pathname, ((fd_table_file_entry_t*)(fd_table_entry->entry))->file_buffer, res) != res) {
-      kfree(fd_table_entry->entry);
-      unlock_kernel();
-      return -1;
-    }
-    
-#endif
+    fd_table_entry->entry = file_entry;
     fd_table_entry->type = FD_TYPE_FILE;
-    res = fd;
   }
-  else {
-    unlock_kernel();
+  klock_unlock (&fd_lock);
+
+  if(fd < 0) {
+    free_fd_table_file_entry(file_entry);
     return -1;
   }
-  unlock_kernel ();
-  return res;
+  return fd;
 }
 
 /* Syscall: read --??-- proess-global file handle */
@@ -1427,13 +1356,11 @@ _read (int fd, char *buf, int count)
   quest_tss * tss;
   fd_table_entry_t* fd_table_entry;
   fd_table_file_entry_t* file_entry;
-  int act_len;
   int res;
-  char* temp_buf;
+  int pos, want;
   //uint c = 0;
   //key_event e;
   
-  lock_kernel ();
   //com1_printf ("_read (%d, %p, 0x%x)\n", fd, buf, count);
 
   /* Check for STDIN, STDOUT or STDERR */
@@ -1441,6 +1368,8 @@ _read (int fd, char *buf, int count)
 
     
   case 0: /* STDIN */
+    /* Console input blocks in the scheduler */
+    lock_kernel ();
 #ifdef USE_LINUX_SANDBOX
   {
     static int off = -1;
@@ -1526,13 +1455,11 @@ start:
     /* Can't read on STDOUT or STDERR */
   case 1:
   case 2:
-    unlock_kernel();
     return -1;
   }
   
 
   if(fd < 0 || fd >= MAX_FD) {
-    unlock_kernel ();
     return -1;
   }
   
@@ -1540,14 +1467,15 @@ start:
   
   if (!tss) {
     com1_printf ("No current task\n");
-    unlock_kernel ();
     return -1;
   }
   
   fd_table_entry = &tss->fd_table[fd];
 
+  klock_lock (&fd_lock);
+
   if(!fd_table_entry->entry) {
-    unlock_kernel ();
+    klock_unlock (&fd_lock);
     return -1;
   }
 
@@ -1558,60 +1486,49 @@ start:
 
     file_entry = (fd_table_file_entry_t*)fd_table_entry->entry;
 
-#ifdef ONE_FILE_READ
-
-    act_len = file_entry->file_length;
-    temp_buf = file_entry->file_buffer;
+    /* Claim [pos, pos+want) under the fd lock, then read only that
+     * range from the backend */
+    pos = file_entry->current_pos;
+    want = file_entry->file_length - pos;
 
-#else
-    
-    act_len = vfs_dir(file_entry->pathname);
-    temp_buf = kmalloc(act_len);
-    
-    if(!temp_buf) {
-      com1_printf("Failed to allocate temp buffer for read\n");
-      unlock_kernel();
-      return -1;
-    }
-    
-    /* -- EM -- Read the entire file, a hack right now but good enough
-       to let us to get a semi-functioning read */
-    
-    res = vfs_read (file_entry->pathname, temp_buf, act_len);
-    
-    if(res < 0) {
-      kfree(temp_buf);
-      unlock_kernel();
-      return res;
+    if(count < want) {
+      want = count;
     }
 
-#endif
-
-    res = act_len - file_entry->current_pos;
+    file_entry->current_pos += want;
+    klock_unlock (&fd_lock);
 
-    if(count < res) {
-      res = count;
+    if(want <= 0) {
+      return 0;
     }
 
-    memcpy(buf, &temp_buf[file_entry->current_pos], res);
-    file_entry->current_pos += res;
+    lock_kernel ();
+    kmutex_lock (&vfs_lock);
+    res = vfs_pread (&file_entry->file, pos, buf, want);
+    kmutex_unlock (&vfs_lock);
+    unlock_kernel ();
 
-#ifndef ONE_FILE_READ
-    kfree(temp_buf);
-#endif
+    /* On a short read or error, give back the unread part of the
+     * claim, unless a seek or another read has moved on since */
+    if(res < want) {
+      klock_lock (&fd_lock);
+      if(file_entry->current_pos == pos + want) {
+        file_entry->current_pos = pos + (res > 0 ? res : 0);
+      }
+      klock_unlock (&fd_lock);
+    }
 
     break;
     
   default:
     
+    klock_unlock (&fd_lock);
     com1_printf("Unsupported file type in read\n");
-    unlock_kernel ();
     return -1;
   }
   
   
   
-  unlock_kernel ();
   return res;
 }
 
@@ -1643,6 +1560,8 @@ _meminfo (uint32 eax, uint32 edx)
     for (i = 0; i < mm_limit; i++)
       if (BITMAP_TST (mm_table, i))
         j++;
+    /* frames cached per-CPU are free too */
+    j += phys_frames_cached ();
 
     return j << 12;
   case 1:{
@@ -1675,8 +1594,9 @@ _meminfo (uint32 eax, uint32 edx)
       addr = -1;
       for (i = 1; i < 1024; i++) {
         if ((ptab1_virt[i] & 0x1) == 0) {
-          /* found empty entry */
-          ptab1_virt[i] = frame | 7;
+          /* found empty entry; like a page cache frame it is shared
+           * by fork rather than copied-on-write, and not ours to free */
+          ptab1_virt[i] = frame | PTE_PCACHE | 7;
           addr = i << 12;
           break;
         }
@@ -1700,7 +1620,7 @@ _meminfo (uint32 eax, uint32 edx)
       /* shared_mem_free() */
       frame = edx;
       /* again, this is insecure atm */
-      BITMAP_SET (mm_table, frame >> 12);
+      free_phys_frame (frame);
       return 0;
     }
   default:
@@ -1872,30 +1792,45 @@ __exit (int status)
 
   /* TODO: Need to check all child threads and remove them from the run queue */
 
+  /* Threads blocked on a futex must not be found by a later process
+   * that gets the same page directory. */
+  futex_exit_mm ((u32) phys_addr);
+
+  /* Kernel threads elsewhere may still be running on this page
+   * directory; move them off it before it is freed. */
+  tlb_release_cr3 ((u32) phys_addr);
+
   /* Free user-level virtual address space */
   for (i = 0; i < 1023; i++) {
+    if (PDE_USER_BIGPAGE (virt_addr[i])) {
+      cow_free_bigpage (virt_addr[i]);
+      continue;
+    }
     if (virt_addr[i]             /* Free page directory entry */
         && (virt_addr[i] & 4 || i == (KERN_STK >> 22))      /* and is a user space page or
                                                                kernel stack */
         &&!(virt_addr[i] & 0x80)) {     /* and not 4MB page */
-      tmp_page = map_virtual_page (virt_addr[i] | 3);
+      tmp_page = kmap_atomic (virt_addr[i] | 3);
       for (j = 0; j < 1024; j++) {
         if (tmp_page[j]) {      /* Free frame */
           if ((i == (KERN_STK >> 22)) && (kern_stk_pte_free (tmp_page[j]))) {
             /* Kernel stack for threads that are already freed but not unmapped. Skip! */
             continue;
           }
+          if (tmp_page[j] & PTE_PCACHE)
+            continue;           /* Shared page cache frame */
           if ((j < 0x200) || (j > 0x20F) || i) {        /* --??-- Skip releasing
                                                            video memory */
-            BITMAP_SET (mm_table, tmp_page[j] >> 12);
+            cow_free_frame (tmp_page[j]);
           }
         }
       }
-      unmap_virtual_page (tmp_page);
-      BITMAP_SET (mm_table, virt_addr[i] >> 12);
+      kunmap_atomic (tmp_page);
+      free_phys_frame (virt_addr[i]);
     }
   }
-  BITMAP_SET (mm_table, (uint32) phys_addr >> 12);    /* Free up page for page directory */
+  pcache_exec_release ((uint32) phys_addr);
+  free_phys_frame ((uint32) phys_addr);    /* Free up page for page directory */
   unmap_virtual_page (virt_addr);
 
   /* Destroyed current page directory, so everything that happens
@@ -2122,41 +2057,6 @@ _switch_screen (int dir)
 }
 #endif
 
-#if 0
-static void *tlb_shootdown_page = NULL;
-static uint32 tlb_shootdown_count = 0;
-static spinlock tlb_shootdown_lock = SPINLOCK_INIT;
-
-extern void
-invlpg_shootdown (void *va)
-{
-
-  invalidate_page (va);
-  send_ipi (0xFF,
-            LAPIC_ICR_LEVELASSERT |
-            LAPIC_ICR_DS_ALLEX | LAPIC_ICR_DM_LOGICAL | 0xfd);
-
-}
-
-extern uint32
-invlpg_handler (uint8 vec)
-{
-  asm volatile ("invlpg %0"::"m" (*(char *) tlb_shootdown_page));
-  asm volatile ("lock decl %0"::"m" (tlb_shootdown_count));
-  return 0;
-}
-
-extern uint32
-flush_tlb_handler (uint8 vec)
-{
-  asm volatile ("movl %%cr3, %%eax\n"
-                "movl %%eax, %%cr3\n"
-                "lock decl %0"::"m" (tlb_shootdown_count));
-  return 0;
-}
-
-#endif
-
 /* Initialize the vector handling table. */
 extern void
 init_interrupt_handlers (void)
@@ -2164,10 +2064,7 @@ init_interrupt_handlers (void)
   int i;
   for (i = 0; i < 256; i++)
     vector_handlers[i] = default_vector_handler;
-  /************************************************
-   * set_vector_handler(0xfd, invlpg_handler);    *
-   * set_vector_handler(0xfe, flush_tlb_handler); *
-   ************************************************/
+  /* TLB shootdowns use NMIs, see mem/tlb.c */
 }
 
 /* 
@@ -18,6 +18,7 @@
 #include "arch/i386.h"
 #include "kernel.h"
 #include "smp/spinlock.h"
+#include "smp/klock.h"
 #include "util/printf.h"
 #include "util/screen.h"
 #include "util/debug.h"
@@ -29,8 +30,7 @@
 #include "sched/vcpu.h"
 #include "arch/i386-percpu.h"
 #include "arch/i386-mtrr.h"
-
-static spinlock kernel_lock ALIGNED(LOCK_ALIGNMENT) = SPINLOCK_INIT;
+#include "arch/i386-sysenter.h"
 
 /* Declare space for a stack */
 uint32 ul_stack[NR_MODS][1024] ALIGNED (0x1000);
@@ -53,13 +53,15 @@ uint32 kls_pg_table[NR_MODS][1024] ALIGNED (0x1000);
 /* Declare space for a page table for the user stack (only used if different than pg_dir table */
 uint32 uls_pg_table[NR_MODS][1024] ALIGNED(0x1000);
 
-/* Each CPU gets an IDLE task -- something to do when nothing else */
-quest_tss idleTSS[MAX_CPUS] ALIGNED(0x1000);
-quest_tss *idleTSS_selector[MAX_CPUS];
+/* Each CPU gets an IDLE task -- something to do when nothing else.
+ * These tables have one entry per CPU and are allocated by init once
+ * the CPUs have been counted. */
+quest_tss *idleTSS;
+quest_tss **idleTSS_selector;
 
 /* Each CPU gets a CPU TSS for sw task switching */
-tss cpuTSS[MAX_CPUS];
-uint16 cpuTSS_selector[MAX_CPUS];
+tss *cpuTSS;
+uint16 *cpuTSS_selector;
 
 char *pchVideo = (char *) KERN_SCR;
 
@@ -73,17 +75,18 @@ void panic (char *sz)
   hlt ();
 }
 
-/* Global kernel lock */
+/* Scheduler lock -- formerly the global kernel lock.  Other
+ * subsystems have their own locks; see smp/klock.h. */
 void
 lock_kernel (void)
 {
-  spinlock_lock (&kernel_lock);
+  klock_lock (&sched_lock);
 }
 
 void
 unlock_kernel (void)
 {
-  spinlock_unlock (&kernel_lock);
+  klock_unlock (&sched_lock);
 }
 
 bool
@@ -92,7 +95,12 @@ update_CPU_TSS (uint32_t esp0)
   int cpu = get_pcpu_id ();
   tss * tss = &cpuTSS[cpu];
   if (!tss) panic ("update_CPU_TSS failed");
-  tss->ulESP0 = esp0;
+  if (tss->ulESP0 != esp0) {
+    tss->ulESP0 = esp0;
+    /* SYSENTER takes its stack from an MSR, not from the TSS */
+    if (sysenter_enabled)
+      wrmsr (IA32_SYSENTER_ESP, esp0);
+  }
   return TRUE;
 }
 
@@ -267,12 +275,19 @@ void map_user_level_stack(uint32_t* plPageDirectory, void* start_addr,
   unmap_virtual_page(plPageTable);
 }
 
+/* Unmap and free a user stack in the current address space.  Other
+ * threads of the process may have it in their TLBs, so the frames are
+ * only freed after one shootdown for the whole stack. */
 void
 free_user_level_stack (uint32_t * plPageDirectory, uint32_t stack_addr, int num_frames)
 {
   int pg_dir_index, pg_tbl_index;
   uint32_t * plPageTable = NULL;
-  uint32_t phys_frame = 0;
+  uint32_t frames[num_frames];
+  int i, nr_frames = 0;
+  tlb_batch_t batch;
+
+  tlb_batch_init (&batch, (u32) get_pdbr ());
   get_pg_dir_and_table_indices((void *) (stack_addr - 1), &pg_dir_index, &pg_tbl_index);
 
   if(!plPageDirectory[pg_dir_index]) {
@@ -294,24 +309,30 @@ free_user_level_stack (uint32_t * plPageDirectory, uint32_t stack_addr, int num_
       if(!plPageDirectory[pg_dir_index]) {
         /* Not present */
         com1_printf ("Warning: tried to free unmapped user stack (0x%X)!\n", stack_addr);
-        return;
+        plPageTable = NULL;
+        break;
       }
       plPageTable = map_virtual_page ((plPageDirectory[pg_dir_index] & 0xFFFFF000) | 0x3);
       if (!plPageTable) panic ("free_user_level_stack: Out of memory!");
     }
 
     if (plPageTable[pg_tbl_index]) {
-      phys_frame = plPageTable[pg_tbl_index] & 0xFFFFF000;
-      /* Free physical memory */
-      free_phys_frame (phys_frame);
+      frames[nr_frames++] = plPageTable[pg_tbl_index] & 0xFFFFF000;
       /* Set entry to 0 */
       plPageTable[pg_tbl_index] = 0;
-      invalidate_page((void*)((pg_tbl_index) << 12) + ((1 << 22) * pg_dir_index));
+      tlb_batch_add (&batch,
+                     (void*)((pg_tbl_index) << 12) + ((1 << 22) * pg_dir_index), 1);
     }
     pg_tbl_index--;
   }
 
-  unmap_virtual_page (plPageTable);
+  if (plPageTable)
+    unmap_virtual_page (plPageTable);
+
+  tlb_batch_flush (&batch);
+  /* Free physical memory */
+  for (i = 0; i < nr_frames; i++)
+    free_phys_frame (frames[i]);
 }
 
 extern void *
@@ -499,7 +520,7 @@ begin_kernel_threads (void)
 void
 exit_kernel_thread (void)
 {
-  uint8 LAPIC_get_physical_ID (void);
+  uint32 LAPIC_get_physical_ID (void);
   quest_tss *tss, *waiter;
 
   //for (;;)
@@ -538,6 +559,8 @@ check_copied_threads (void)
   uint cpu = get_pcpu_id ();
   quest_tss * t;
   vcpu * queue = NULL;
+  vcpu_runq * runq;
+  int i;
   logger_printf ("Checking threads in sandbox %d\n", cpu);
   logger_printf ("Current Task: 0x%X\n", str ()->tid);
 
@@ -559,9 +582,10 @@ check_copied_threads (void)
 
   /* Check VCPU queues */
   logger_printf ("Checking VCPU run queues...\n");
-  queue = percpu_read (vcpu_queue);
+  runq = percpu_pointer (cpu, vcpu_queue);
   /* Iterate VCPU queue */
-  while (queue) { 
+  for (i = 0; i < runq->size; i++) {
+    queue = runq->heap[i];
     if (queue->tr) {
       logger_printf ("  vcpu 0x%X has current task:\n", queue);
       t = queue->tr;
@@ -574,7 +598,6 @@ check_copied_threads (void)
                      t->name, t->tid, t->sandbox_affinity, queue, t->cpu);
       t = t->next;
     }
-    queue = queue->next;
   }
 
   return;
@@ -0,0 +1,324 @@
+/*                    The Quest Operating System
+ *  Copyright (C) 2005-2012  Richard West, Boston University
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/* Copy-on-write fork.
+ *
+ * clone_page_directory () used to copy every user page of the parent.
+ * Now a writable user page is write-protected in both the parent and
+ * the child and marked PTE_COW, and its frame is reference counted.
+ * The first write from either side faults into cow_fault (), which
+ * copies the frame, or just makes the page writable again if the
+ * writer holds the last reference.  User pages that are already
+ * read-only are shared outright.
+ *
+ * A fork followed by _exec therefore copies next to nothing: _exec
+ * drops the child's references, and the parent takes its pages back
+ * with one cheap fault each.
+ *
+ * Only frames with more than one user are in the table; a frame that
+ * is not there has a single owner.  The counts and the PTE_COW
+ * entries of every address space are guarded by cow_lock.  The kernel
+ * runs with CR0.WP set, so that its own writes to user memory
+ * (syscall results) fault here as well instead of going straight
+ * through to a shared frame.
+ *
+ * Anonymous 4 MiB pages (bigpage_map) are shared the same way, their
+ * page directory entry standing in for the page table entry.  They
+ * are counted under their first frame, which no 4 KiB mapping can
+ * use, and are copied whole. */
+
+#include "kernel.h"
+#include "mem/mem.h"
+#include "mem/cow.h"
+#include "mem/slab.h"
+#include "smp/klock.h"
+#include "util/printf.h"
+#include "util/debug.h"
+
+//#define DEBUG_COW
+
+#ifdef DEBUG_COW
+#define DLOG(fmt,...) DLOG_PREFIX("cow",fmt,##__VA_ARGS__)
+#else
+#define DLOG(fmt,...) ;
+#endif
+
+#define COW_BUCKETS 1024
+#define COW_BUCKET(f) (((f) >> PAGE_SIZE_BITS) % COW_BUCKETS)
+#define COW_USER_LIMIT ((u32) PGDIR_KERNEL_BEGIN << BIGPAGE_SIZE_BITS)
+
+/* A frame mapped by more than one address space */
+struct cow_ref
+{
+  frame_t frame;
+  u32 refs;
+  struct cow_ref *next;
+};
+
+static kmem_cache cow_cache =
+  KMEM_CACHE_INIT ("cow", sizeof (struct cow_ref), 0, NULL);
+static struct cow_ref *cow_table[COW_BUCKETS];
+
+struct cow_stat cow_stats;
+
+/* Must hold cow_lock */
+static struct cow_ref **
+find_ref (frame_t frame)
+{
+  struct cow_ref **pp;
+
+  for (pp = &cow_table[COW_BUCKET (frame)]; *pp; pp = &(*pp)->next)
+    if ((*pp)->frame == frame)
+      break;
+  return pp;
+}
+
+/* Must hold cow_lock */
+static u32
+frame_refs (frame_t frame)
+{
+  struct cow_ref *r = *find_ref (frame);
+
+  return r ? r->refs : 1;
+}
+
+/* Drop a reference to the count frames at frame, freeing them with
+ * the last one.  Must hold cow_lock. */
+static void
+put_frame (frame_t frame, u32 count)
+{
+  struct cow_ref **pp = find_ref (frame), *r = *pp;
+
+  if (!r) {
+    if (count == 1)
+      free_phys_frame (frame);
+    else
+      free_phys_frames (frame, count);
+    return;
+  }
+  if (--r->refs == 1) {
+    /* back to a single owner */
+    *pp = r->next;
+    kmem_cache_free (&cow_cache, r);
+    cow_stats.frames--;
+  }
+}
+
+/* Can frame be shared by reference?  Only frames the allocator hands
+ * out; device memory such as the video window is always copied. */
+bool
+cow_frame_ok (frame_t frame)
+{
+  u32 n = FRAME_TO_FRAMENUM (frame);
+
+  return n >= 0x100 && n >= mm_begin && n < mm_limit;
+}
+
+/* Take another reference to frame for a new mapping.  Returns FALSE
+ * if there is no memory to count it, and the caller must copy the
+ * frame instead.  Must hold cow_lock. */
+bool
+cow_share_frame (frame_t frame)
+{
+  struct cow_ref **pp = find_ref (frame), *r;
+
+  if (*pp) {
+    (*pp)->refs++;
+    return TRUE;
+  }
+  r = kmem_cache_alloc (&cow_cache);
+  if (!r)
+    return FALSE;
+  r->frame = frame;
+  r->refs = 2;
+  r->next = NULL;
+  *pp = r;
+  cow_stats.frames++;
+  return TRUE;
+}
+
+/* Release the frame of a user page table entry that is being torn
+ * down (_exec, _exit).  The frame is freed only if no other address
+ * space still maps it. */
+void
+cow_free_frame (u32 pte)
+{
+  u32 flags;
+
+  klock_lock_irq_save (&cow_lock, flags);
+  put_frame (pte & 0xFFFFF000, 1);
+  klock_unlock_irq_restore (&cow_lock, flags);
+}
+
+/* The same for an anonymous 4 MiB page directory entry */
+void
+cow_free_bigpage (u32 pde)
+{
+  u32 flags;
+
+  klock_lock_irq_save (&cow_lock, flags);
+  put_frame (pde & ~(BIGPAGE_SIZE - 1), PGTBL_NUM_ENTRIES);
+  klock_unlock_irq_restore (&cow_lock, flags);
+}
+
+/* Fork of an anonymous 4 MiB page: share it copy-on-write,
+ * write-protecting the parent's entry *pde, or copy it if there is no
+ * memory to count the reference.  Returns the child's entry, or 0. */
+u32
+cow_clone_bigpage (u32 *pde)
+{
+  u32 e = *pde, flags;
+  frame_t new;
+
+  klock_lock_irq_save (&cow_lock, flags);
+  if (cow_share_frame (e & ~(BIGPAGE_SIZE - 1))) {
+    if (e & 2) {
+      e = (e & ~2) | PTE_COW;
+      *pde = e;
+    }
+    cow_stats.shared += PGTBL_NUM_ENTRIES;
+    klock_unlock_irq_restore (&cow_lock, flags);
+    return e;
+  }
+  klock_unlock_irq_restore (&cow_lock, flags);
+
+  new = copy_bigpage (e & ~(BIGPAGE_SIZE - 1));
+  if (new == -1)
+    return 0;
+  cow_stats.copied += PGTBL_NUM_ENTRIES;
+  /* a private copy is writable again */
+  if (e & PTE_COW)
+    e |= 2;
+  return new | (e & (BIGPAGE_SIZE - 1) & ~PTE_COW);
+}
+
+/* Write fault on the anonymous 4 MiB page at pgdir[i], with cow_lock
+ * held.  Like the 4 KiB case below, but the page is copied whole. */
+static bool
+cow_fault_bigpage (u32 cr3, u32 *pgdir, u32 i)
+{
+  u32 pde = pgdir[i];
+  void *va = (void *) (i << BIGPAGE_SIZE_BITS);
+  frame_t old = pde & ~(BIGPAGE_SIZE - 1), new;
+
+  if ((pde & 7) == 7) {
+    invalidate_page (va);
+    return TRUE;
+  }
+  if (!(pde & PTE_COW))
+    return FALSE;
+  if (frame_refs (old) == 1) {
+    pgdir[i] = (pde & ~PTE_COW) | 2;
+    invalidate_page (va);
+    cow_stats.fault_reuses++;
+    return TRUE;
+  }
+  new = copy_bigpage (old);
+  if (new == -1)
+    return FALSE;
+  put_frame (old, PGTBL_NUM_ENTRIES);
+  pgdir[i] = new | (pde & (BIGPAGE_SIZE - 1) & ~PTE_COW) | 2;
+  tlb_shootdown (cr3, va, 1);
+  cow_stats.fault_copies++;
+  return TRUE;
+}
+
+/* Write to a present, read-only page at addr in address space cr3.
+ * Returns TRUE if it was a copy-on-write page and is now writable, so
+ * the faulting instruction can be restarted. */
+bool
+cow_fault (u32 cr3, u32 addr)
+{
+  u32 page = addr & ~(PAGE_SIZE - 1), flags, s, pte;
+  u32 *pgdir, *pgtbl;
+  frame_t old, new;
+  u8 *src, *dst;
+  bool ret = FALSE;
+
+  if (addr >= COW_USER_LIMIT)
+    return FALSE;
+
+  cr3 &= 0xFFFFF000;
+  klock_lock_irq_save (&cow_lock, flags);
+  pgdir = kmap_atomic (cr3 | 3);
+  if (!pgdir)
+    goto out;
+  if (PDE_USER_BIGPAGE (pgdir[page >> BIGPAGE_SIZE_BITS])) {
+    ret = cow_fault_bigpage (cr3, pgdir, page >> BIGPAGE_SIZE_BITS);
+    goto out_dir;
+  }
+  /* not present, or some other 4 MiB page */
+  if ((pgdir[page >> BIGPAGE_SIZE_BITS] & 0x81) != 1)
+    goto out_dir;
+  pgtbl = kmap_atomic ((pgdir[page >> BIGPAGE_SIZE_BITS] & 0xFFFFF000) | 3);
+  if (!pgtbl)
+    goto out_dir;
+
+  s = (page >> PAGE_SIZE_BITS) & (PGTBL_NUM_ENTRIES - 1);
+  pte = pgtbl[s];
+  old = pte & 0xFFFFF000;
+  if ((pte & 7) == 7) {
+    /* Another CPU running this address space got here first, and
+     * ours is a stale TLB entry */
+    invalidate_page ((void *) page);
+    ret = TRUE;
+  } else if ((pte & 5) != 5 || !(pte & PTE_COW)) {
+    /* a genuine protection fault */
+  } else if (frame_refs (old) == 1) {
+    /* Everyone else has dropped the frame: keep it.  Stale read-only
+     * entries elsewhere only cause a spurious fault. */
+    pgtbl[s] = (pte & ~PTE_COW) | 2;
+    invalidate_page ((void *) page);
+    cow_stats.fault_reuses++;
+    ret = TRUE;
+  } else if ((new = alloc_phys_frame ()) != -1) {
+    src = kmap_atomic (old | 3);
+    dst = kmap_atomic (new | 3);
+    if (src && dst) {
+      memcpy (dst, src, PAGE_SIZE);
+      put_frame (old, 1);
+      pgtbl[s] = new | (pte & 0xFFF & ~PTE_COW) | 2;
+      /* the other CPUs must stop using the old frame */
+      tlb_shootdown (cr3, (void *) page, 1);
+      cow_stats.fault_copies++;
+      ret = TRUE;
+    } else
+      free_phys_frame (new);
+    if (dst)
+      kunmap_atomic (dst);
+    if (src)
+      kunmap_atomic (src);
+  }
+  DLOG ("fault at 0x%X in 0x%X: pte 0x%X -> 0x%X", addr, cr3, pte, pgtbl[s]);
+
+  kunmap_atomic (pgtbl);
+ out_dir:
+  kunmap_atomic (pgdir);
+ out:
+  klock_unlock_irq_restore (&cow_lock, flags);
+  return ret;
+}
+
+/* 
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * mode: C
+ * c-file-style: "gnu"
+ * c-basic-offset: 2
+ * End: 
+ */
+
+/* vi: set et sw=2 sts=2: */
@@ -18,6 +18,7 @@
 #include "types.h"
 #include "arch/i386.h"
 #include "mem/mem.h"
+#include "mem/slab.h"
 #include "kernel.h"
 #include <util/printf.h>
 
@@ -32,15 +33,24 @@
 #endif
 
 
+static kmem_cache dma_page_cache =
+  KMEM_CACHE_INIT ("dma_page", sizeof (dma_page_t), 0, NULL);
+
 static uint32  page_table_phys_addrs   [DMA_POOL_NUM_PAGE_TABLES];
 static uint32* page_table_virtual_addrs[DMA_POOL_NUM_PAGE_TABLES];
 
-static void* map_dma_pool_virtual_page (uint32 phys_frame)
+/* Serialises changes to the dma pool window and page_owner */
+static spinlock dma_window_lock = SPINLOCK_INIT;
+
+/* Dma page that each virtual page of the window belongs to */
+static dma_page_t* page_owner[DMA_POOL_NUM_PAGE_TABLES * 0x400];
+
+#define DMA_POOL_WINDOW_START (DMA_POOL_START_PAGE_TABLE * 0x400000)
+
+static inline uint window_index(void* vaddr)
 {
-  return map_pool_virtual_page(phys_frame, DMA_POOL_START_PAGE_TABLE,
-                               DMA_POOL_NUM_PAGE_TABLES,
-                               page_table_virtual_addrs);
-};
+  return (((uint32)vaddr) - DMA_POOL_WINDOW_START) >> 12;
+}
 
 bool init_dma_pool_page_tables()
 {
@@ -95,121 +105,272 @@ void map_dma_page_tables(pgdir_entry_t* pageDir, uint32 offset)
 }
 
 
+/* Offset of the first object slot at or after offset: aligned, and
+   not crossing a boundary */
+static size_t next_obj_offset(dma_pool_t* pool, size_t offset)
+{
+  offset = ALIGN(offset, pool->align);
+  if(pool->boundary &&
+     offset / pool->boundary != (offset + pool->size - 1) / pool->boundary) {
+    offset = ALIGN(offset, pool->boundary);
+  }
+  return offset;
+}
+
 struct dma_pool* dma_pool_create(const char *name,
 				 size_t size, size_t align, size_t boundary)
 {
-  dma_pool_t* pool = kmalloc(sizeof(dma_pool_t) + strlen(name) + 1);
+  dma_pool_t* pool;
+  size_t page_bytes, span, offset;
+
+  /* Free objects hold a link in their first word */
+  if(align < sizeof(void*)) align = sizeof(void*);
+  if(size < sizeof(void*)) size = sizeof(void*);
+
+  if(align & (align - 1)) {
+    DLOG("%s: align %d is not a power of 2", name, align);
+    return NULL;
+  }
+  size = ALIGN(size, align);
+  if(boundary != 0 && ((boundary & (boundary - 1)) || boundary < size)) {
+    DLOG("%s: bad boundary %d for size %d", name, boundary, size);
+    return NULL;
+  }
+
+  /* Pool mappings do not cross a page table */
+  page_bytes = ALIGN(size, 0x1000);
+  if(page_bytes > 0x400000 || align > 0x400000) {
+    DLOG("%s: object size %d too large", name, size);
+    return NULL;
+  }
+
+  pool = kzalloc(sizeof(dma_pool_t) + strlen(name) + 1);
   if(pool == NULL) return NULL;
   /* Put the name right after the dma_pool itself, avoid two calls to
      kmalloc */
   pool->name = ((char*)pool) + sizeof(dma_pool_t);
   strcpy(pool->name, name);
-  /* -- EM -- Our bitmap for a page is only 32*DMA_PAGE_BITMAP_SIZE so
-     if the object is too small for the bitmap we just treat it as
-     bigger, fix this later */
-  if(size < (4096 / (DMA_PAGE_BITMAP_SIZE * 32))) {
-    size = 4096 / (DMA_PAGE_BITMAP_SIZE * 32);
-  }
-
-  if ((size % align) != 0) size = ALIGN(size, align);
-  
+  spinlock_initialise(&pool->lock);
+  INIT_LIST_HEAD(&pool->partial);
+  INIT_LIST_HEAD(&pool->full);
   pool->size = size;
   pool->align = align;
+  pool->boundary = boundary;
+  pool->page_frames = page_bytes >> 12;
 
-  /* -- EM -- Fix this restriction later */
-  if(size > 0x1000) {
-    DLOG("Cannot handle dma object larger than a page right now");
-    panic("Cannot handle dma object larger than a page right now");
-  }
-  
-  /* -- EM -- Fix this restriction later */
-  if(boundary != 0 && boundary != 0x1000) {
-    DLOG("dma_pools only work if boundary is 0 or 0x1000");
-    panic("dma_pools only work if boundary is 0 or 0x1000");
+  /* Offsets within a dma page are offsets from a physical address
+     aligned at least this much, so alignment and boundaries computed
+     on offsets hold in physical memory.  A dma page smaller than the
+     boundary is aligned so that it does not straddle one. */
+  pool->page_align = align > 0x1000 ? align : 0x1000;
+  if(boundary) {
+    for(span = 0x1000; span < page_bytes; span <<= 1);
+    if(span > boundary) span = boundary;
+    if(span > pool->page_align) pool->page_align = span;
   }
 
-  pool->objs_per_page = 0x1000 / size;
-  pool->boundary = boundary;
-  INIT_LIST_HEAD(&pool->dma_pages);
+  for(offset = next_obj_offset(pool, 0); offset + size <= page_bytes;
+      offset = next_obj_offset(pool, offset + size)) {
+    pool->objs_per_page++;
+  }
 
-  DLOG("name = %s, size = %d, align = %d, boundary = %d",
-       pool->name, pool->size, pool->align, pool->boundary);
+  DLOG("name = %s, size = %d, align = %d, boundary = %d, "
+       "%d objs in %d frames aligned on 0x%X",
+       pool->name, pool->size, pool->align, pool->boundary,
+       pool->objs_per_page, pool->page_frames, pool->page_align);
   return pool;
 }
 
-void *dma_pool_alloc(struct dma_pool *pool, 
-		     phys_addr_t *dma_handle)
+/* Take a new dma page from the frame allocator and thread all of its
+   objects on its free list */
+static dma_page_t* dma_page_create(dma_pool_t* pool)
 {
-  dma_page_t* page = NULL;
-  dma_page_t* temp_page;
-  int i;
-  DLOG("Calling DMA alloc for pool %s", pool->name);
-  list_for_each_entry(temp_page, &pool->dma_pages, chain) {
-    DLOG("temp_page = 0x%p  pool = 0x%p", temp_page, pool);
-    if(temp_page->obj_count < pool->objs_per_page) {
-      page = temp_page;
-      break;
-    }
-  }
+  dma_page_t* page;
+  size_t offset;
+  void** link;
+  uint i;
+  u32 flags;
+
+  page = kmem_cache_alloc(&dma_page_cache);
   if(page == NULL) {
-    page = kmalloc(sizeof(dma_page_t));
-    if(page == NULL) {
-      return NULL;
-    }
+    return NULL;
+  }
+  if(pool->page_frames == 1 && pool->page_align == 0x1000) {
     page->phys_addr = alloc_phys_frame();
-    if(page->phys_addr == 0xFFFFFFFF) {
-      kfree(page);
-      return NULL;
+  } else {
+    page->phys_addr = alloc_phys_frames_aligned_on(pool->page_frames,
+                                                   pool->page_align);
+  }
+  if(page->phys_addr == 0xFFFFFFFF) {
+    kmem_cache_free(&dma_page_cache, page);
+    return NULL;
+  }
+
+  spinlock_lock_irq_save(&dma_window_lock, flags);
+  page->virt_addr =
+    map_contiguous_pool_virtual_pages(page->phys_addr | 3, pool->page_frames,
+                                      DMA_POOL_START_PAGE_TABLE,
+                                      DMA_POOL_NUM_PAGE_TABLES,
+                                      page_table_virtual_addrs);
+  if(page->virt_addr != NULL) {
+    for(i = 0; i < pool->page_frames; ++i) {
+      page_owner[window_index(page->virt_addr) + i] = page;
     }
-    page->virt_addr = map_dma_pool_virtual_page(page->phys_addr | 3);
-    if(page->virt_addr == NULL) {
+  }
+  spinlock_unlock_irq_restore(&dma_window_lock, flags);
+
+  if(page->virt_addr == NULL) {
+    if(pool->page_frames == 1) {
       free_phys_frame(page->phys_addr);
-      kfree(page);
-      return NULL;
+    } else {
+      free_phys_frames(page->phys_addr, pool->page_frames);
     }
-    INIT_LIST_HEAD(&page->chain);
-    page->obj_count = 0;
-    memset(page->bitmap, 0xFF, DMA_PAGE_BITMAP_SIZE * 4);
-    list_add(&page->chain, &pool->dma_pages);
-  }
-
-  for(i = 0; i < pool->objs_per_page; ++i) {
-    if(BITMAP_TST(page->bitmap, i)) {
-      BITMAP_CLR(page->bitmap, i);
-      page->obj_count++;
-      *dma_handle = ((uint32_t)page->phys_addr) + pool->size * i;
-      return &page->virt_addr[pool->size * i];
+    kmem_cache_free(&dma_page_cache, page);
+    return NULL;
+  }
+
+  link = &page->free;
+  for(offset = next_obj_offset(pool, 0);
+      offset + pool->size <= (pool->page_frames << 12);
+      offset = next_obj_offset(pool, offset + pool->size)) {
+    *link = page->virt_addr + offset;
+    link = (void**)*link;
+  }
+  *link = NULL;
+  page->obj_count = 0;
+  INIT_LIST_HEAD(&page->chain);
+
+  DLOG("%s: new page virt = 0x%p, phys = 0x%X",
+       pool->name, page->virt_addr, page->phys_addr);
+  return page;
+}
+
+/* Give an unlinked dma page back to the frame allocator */
+static void dma_page_release(dma_pool_t* pool, dma_page_t* page)
+{
+  uint i;
+  u32 flags;
+
+  DLOG("%s: releasing page virt = 0x%p, phys = 0x%X",
+       pool->name, page->virt_addr, page->phys_addr);
+  spinlock_lock_irq_save(&dma_window_lock, flags);
+  for(i = 0; i < pool->page_frames; ++i) {
+    page_owner[window_index(page->virt_addr) + i] = NULL;
+  }
+  unmap_pool_virtual_pages(page->virt_addr, pool->page_frames,
+                           DMA_POOL_START_PAGE_TABLE, DMA_POOL_NUM_PAGE_TABLES,
+                           page_table_virtual_addrs);
+  spinlock_unlock_irq_restore(&dma_window_lock, flags);
+
+  if(pool->page_frames == 1) {
+    free_phys_frame(page->phys_addr);
+  } else {
+    free_phys_frames(page->phys_addr, pool->page_frames);
+  }
+  kmem_cache_free(&dma_page_cache, page);
+}
+
+void *dma_pool_alloc(struct dma_pool *pool, 
+		     phys_addr_t *dma_handle)
+{
+  dma_page_t* page;
+  void* obj;
+  u32 flags;
+
+  DLOG("Calling DMA alloc for pool %s", pool->name);
+  spinlock_lock_irq_save(&pool->lock, flags);
+  if(list_empty(&pool->partial)) {
+    /* Frames are not taken under the pool lock */
+    spinlock_unlock_irq_restore(&pool->lock, flags);
+    page = dma_page_create(pool);
+    if(page == NULL) {
+      return NULL;
     }
+    spinlock_lock_irq_save(&pool->lock, flags);
+    list_add_tail(&page->chain, &pool->partial);
+    pool->empty_pages++;
+    if(++pool->pages > pool->pages_max) pool->pages_max = pool->pages;
   }
-  DLOG("Error should never reach end of dma_pool_alloc");
-#ifdef DEBUG_DMA_POOL
-  panic("Error should never reach end of dma_pool_alloc");
-#endif
-  return NULL;
+
+  page = list_entry(pool->partial.next, dma_page_t, chain);
+  obj = page->free;
+  page->free = *(void**)obj;
+  if(page->obj_count++ == 0) {
+    pool->empty_pages--;
+  }
+  if(page->free == NULL) {
+    list_move(&page->chain, &pool->full);
+  }
+  pool->allocs++;
+  if(++pool->in_use > pool->in_use_max) pool->in_use_max = pool->in_use;
+  *dma_handle = page->phys_addr + ((char*)obj - page->virt_addr);
+  spinlock_unlock_irq_restore(&pool->lock, flags);
+
+  return obj;
 }
 
 void dma_pool_free(struct dma_pool *pool, void *vaddr,
 		   phys_addr_t addr)
 {
-  dma_page_t* page;
-  list_for_each_entry(page, &pool->dma_pages, chain) {
-    if((((uint)vaddr) & (~0xFFF)) == ((uint)page->virt_addr)) {
-      BITMAP_SET(page->bitmap, ((((uint)vaddr) & (0xFFF)) / pool->size));
-      return;
-    }
+  dma_page_t* page = NULL;
+  uint index = window_index(vaddr);
+  u32 flags;
+
+  if(index < DMA_POOL_NUM_PAGE_TABLES * 0x400) {
+    page = page_owner[index];
   }
-  DLOG("Error should never reach end of dma_pool_free");
+  if(page == NULL) {
+    DLOG("%s: 0x%p is not in a dma page", pool->name, vaddr);
 #ifdef DEBUG_DMA_POOL
-  panic("Error should never reach end of dma_pool_free");
+    panic("dma_pool_free of an address not in a dma page");
 #endif
+    return;
+  }
+
+  spinlock_lock_irq_save(&pool->lock, flags);
+  if(page->free == NULL) {
+    /* Was full: partly used pages go ahead of empty ones */
+    list_move(&page->chain, &pool->partial);
+  }
+  *(void**)vaddr = page->free;
+  page->free = vaddr;
+  pool->frees++;
+  pool->in_use--;
+
+  if(--page->obj_count == 0) {
+    if(pool->empty_pages < DMA_POOL_KEEP_EMPTY) {
+      pool->empty_pages++;
+      list_move_tail(&page->chain, &pool->partial);
+      page = NULL;
+    } else {
+      list_del(&page->chain);
+      pool->pages--;
+      pool->pages_reclaimed++;
+    }
+  } else {
+    page = NULL;
+  }
+  spinlock_unlock_irq_restore(&pool->lock, flags);
+
+  if(page != NULL) {
+    dma_page_release(pool, page);
+  }
 }
 
 void dma_pool_destroy(struct dma_pool *pool)
 {
-  dma_page_t *page;
-  
-  list_for_each_entry(page, &pool->dma_pages, chain) {
-    kfree(page);
+  dma_page_t *page, *next;
+
+  DLOG("%s: allocs = %lld, frees = %lld, in use = %d (max %d), "
+       "pages = %d (max %d), reclaimed = %d",
+       pool->name, pool->allocs, pool->frees, pool->in_use, pool->in_use_max,
+       pool->pages, pool->pages_max, pool->pages_reclaimed);
+
+  list_for_each_entry_safe(page, next, &pool->partial, chain) {
+    dma_page_release(pool, page);
+  }
+  list_for_each_entry_safe(page, next, &pool->full, chain) {
+    dma_page_release(pool, page);
   }
 
   kfree(pool);
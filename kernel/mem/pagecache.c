@@ -0,0 +1,538 @@
+/*                    The Quest Operating System
+ *  Copyright (C) 2005-2012  Richard West, Boston University
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Page cache for demand-paged executables.
+ *
+ * The first _exec of a file reads it once into a set of frames owned
+ * by a cache entry, and records its PT_LOAD segments.  Nothing is
+ * copied or mapped up front: the new address space starts out empty
+ * and pcache_fault () fills pages on first touch.
+ *
+ *  - A page wholly backed by a read-only segment is mapped straight
+ *    from the cache frame, read-only and marked PTE_PCACHE, so every
+ *    process running the binary shares it.
+ *  - Any other page (data, bss, or one shared between segments) gets
+ *    a private frame with the file bytes copied in and the rest
+ *    zeroed.
+ *
+ * Later _execs of the same file find the entry and read nothing; they
+ * only resolve the path, which the name cache makes cheap.  An entry
+ * matches by path, backend identity (see vfs_file_id), size and, where
+ * the backend records one, modification time, so a file replaced at
+ * the same path is read afresh.  Entries no address space uses are
+ * kept idle and evicted LRU first, or all at once if frames run out.
+ *
+ * Faults can arrive while a syscall holds other kernel locks, so the
+ * fault path takes only pcache_lock and frame_lock.  It never needs
+ * the filesystem. */
+
+#include "kernel.h"
+#include "mem/mem.h"
+#include "mem/pagecache.h"
+#include "smp/klock.h"
+#include "fs/filesys.h"
+#include "util/elf.h"
+#include "util/printf.h"
+#include "util/debug.h"
+
+//#define DEBUG_PCACHE
+
+#ifdef DEBUG_PCACHE
+#define DLOG(fmt,...) DLOG_PREFIX("pcache",fmt,##__VA_ARGS__)
+#else
+#define DLOG(fmt,...) ;
+#endif
+
+#define PCACHE_MAX_IDLE 8       /* unused images kept cached */
+#define PCACHE_WINDOW 0x60000000 /* user window for the initial read */
+#define PCACHE_USER_LIMIT ((u32) PGDIR_KERNEL_BEGIN << BIGPAGE_SIZE_BITS)
+#define PCACHE_MAP_BUCKETS 64
+
+/* An address space running a cached image */
+struct pcache_map
+{
+  u32 cr3;
+  pcache_entry *image;
+  struct pcache_map *next;
+};
+
+static pcache_entry *pcache_list = NULL;
+static u32 pcache_idle = 0;
+static u32 pcache_clock = 0;
+static struct pcache_map *pcache_maps[PCACHE_MAP_BUCKETS];
+static struct
+{
+  u32 hits, misses, evictions;
+  u32 shared_faults;            /* text pages mapped from the cache */
+  u32 private_faults;           /* data/bss pages filled on first touch */
+} stats;
+
+#define MAP_BUCKET(cr3) (((cr3) >> PAGE_SIZE_BITS) % PCACHE_MAP_BUCKETS)
+
+static void
+free_entry (pcache_entry *e)
+{
+  u32 i;
+
+  for (i = 0; i < e->nframes; i++)
+    if (e->frames[i] != -1)
+      free_phys_frame (e->frames[i]);
+  kfree (e->frames);
+  kfree (e);
+}
+
+/* Unlink idle entries, oldest first, until at most keep remain.
+ * Returns the unlinked entries chained through next.  Must hold
+ * pcache_lock. */
+static pcache_entry *
+evict_idle (u32 keep)
+{
+  pcache_entry *victims = NULL, **pp, **oldest;
+
+  while (pcache_idle > keep) {
+    oldest = NULL;
+    for (pp = &pcache_list; *pp; pp = &(*pp)->next)
+      if ((*pp)->refs == 0 &&
+          (!oldest || (*pp)->last_use < (*oldest)->last_use))
+        oldest = pp;
+    if (!oldest)
+      break;
+    pcache_entry *e = *oldest;
+    *oldest = e->next;
+    e->next = victims;
+    victims = e;
+    pcache_idle--;
+    stats.evictions++;
+  }
+  return victims;
+}
+
+static void
+free_victims (pcache_entry *victims)
+{
+  pcache_entry *next;
+
+  for (; victims; victims = next) {
+    next = victims->next;
+    DLOG ("evict %s", victims->path);
+    free_entry (victims);
+  }
+}
+
+/* Drop every idle image, e.g. to make frames available */
+static void
+pcache_shrink (void)
+{
+  pcache_entry *victims;
+  u32 flags;
+
+  klock_lock_irq_save (&pcache_lock, flags);
+  victims = evict_idle (0);
+  klock_unlock_irq_restore (&pcache_lock, flags);
+  free_victims (victims);
+}
+
+static void
+pcache_put (pcache_entry *e)
+{
+  pcache_entry *victims = NULL;
+  u32 flags;
+
+  klock_lock_irq_save (&pcache_lock, flags);
+  if (--e->refs == 0) {
+    pcache_idle++;
+    victims = evict_idle (PCACHE_MAX_IDLE);
+  }
+  klock_unlock_irq_restore (&pcache_lock, flags);
+  free_victims (victims);
+}
+
+/* Find a cached image of the file that vfs_open () resolved path to,
+ * taking a reference to it */
+pcache_entry *
+pcache_lookup (char *path, vfs_file *f)
+{
+  pcache_entry *e;
+  u32 flags, id = vfs_file_id (f);
+
+  klock_lock_irq_save (&pcache_lock, flags);
+  for (e = pcache_list; e; e = e->next)
+    if (e->size == f->length && e->fs_type == f->type &&
+        e->fs_id == id && e->mtime == f->mtime &&
+        strncmp (e->path, path, PCACHE_PATH_LEN) == 0) {
+      if (e->refs++ == 0)
+        pcache_idle--;
+      e->last_use = ++pcache_clock;
+      stats.hits++;
+      break;
+    }
+  klock_unlock_irq_restore (&pcache_lock, flags);
+  return e;
+}
+
+/* Record the loadable segments of the image read into the window */
+static bool
+parse_elf (pcache_entry *e)
+{
+  Elf32_Ehdr *pe = (Elf32_Ehdr *) PCACHE_WINDOW;
+  Elf32_Phdr *pph;
+  int i;
+
+  if (e->size < sizeof (Elf32_Ehdr) ||
+      pe->e_ident[EI_MAG0] != ELFMAG0 || pe->e_ident[EI_MAG1] != ELFMAG1 ||
+      pe->e_ident[EI_MAG2] != ELFMAG2 || pe->e_ident[EI_MAG3] != ELFMAG3)
+    return FALSE;
+  if (pe->e_phoff + pe->e_phnum * pe->e_phentsize > e->size)
+    return FALSE;
+
+  e->entry = (void *) pe->e_entry;
+  pph = (void *) pe + pe->e_phoff;
+  for (i = 0; i < pe->e_phnum; i++, pph = (void *) pph + pe->e_phentsize) {
+    if (pph->p_type != PT_LOAD)
+      continue;
+    if ((pph->p_offset & 0xFFF) != (pph->p_vaddr & 0xFFF))
+      panic ("Misalignment in program header");
+    if (e->nsegs == PCACHE_MAX_SEGS ||
+        pph->p_offset + pph->p_filesz > e->size ||
+        pph->p_filesz > pph->p_memsz ||
+        pph->p_vaddr + pph->p_memsz > PCACHE_USER_LIMIT)
+      return FALSE;
+    e->segs[e->nsegs].vaddr = pph->p_vaddr;
+    e->segs[e->nsegs].memsz = pph->p_memsz;
+    e->segs[e->nsegs].offset = pph->p_offset;
+    e->segs[e->nsegs].filesz = pph->p_filesz;
+    e->segs[e->nsegs].flags = pph->p_flags;
+    e->nsegs++;
+  }
+  return TRUE;
+}
+
+/* Read a file into a new cache entry, returning it referenced, or
+ * NULL if it cannot be read or is not a loadable ELF image.  The
+ * backends only read whole files into a contiguous buffer, so the
+ * frames are mapped at a temporary window in the caller's user
+ * address space, pgdir.  Whatever the caller maps there is set aside
+ * for the read and put back afterwards, so _exec can load the image
+ * before it tears down the old one.  Must hold vfs_lock, with
+ * vfs_open (path, f) having succeeded. */
+pcache_entry *
+pcache_load (char *path, vfs_file *f, u32 *pgdir)
+{
+  pcache_entry *e;
+  int size = f->length;
+  u32 ntables, i, t, flags;
+  u32 *pgtbl, *saved;
+  bool ok = FALSE;
+
+  if (size <= 0 || size > PCACHE_USER_LIMIT - PCACHE_WINDOW)
+    return NULL;
+
+  e = kmalloc (sizeof (pcache_entry));
+  if (!e)
+    return NULL;
+  memset (e, 0, sizeof (pcache_entry));
+  for (i = 0; i < PCACHE_PATH_LEN - 1 && path[i]; i++)
+    e->path[i] = path[i];
+  e->size = size;
+  e->fs_type = f->type;
+  e->fs_id = vfs_file_id (f);
+  e->mtime = f->mtime;
+  e->nframes = DIV_ROUND_UP (size, PAGE_SIZE);
+  e->frames = kmalloc (e->nframes * sizeof (frame_t));
+  if (!e->frames) {
+    kfree (e);
+    return NULL;
+  }
+  for (i = 0; i < e->nframes; i++) {
+    e->frames[i] = alloc_phys_frame ();
+    if (e->frames[i] == -1) {
+      pcache_shrink ();
+      e->frames[i] = alloc_phys_frame ();
+    }
+    if (e->frames[i] == -1) {
+      /* Leave the rest marked missing for free_entry */
+      for (; i < e->nframes; i++)
+        e->frames[i] = -1;
+      free_entry (e);
+      return NULL;
+    }
+  }
+
+  ntables = DIV_ROUND_UP (size, BIGPAGE_SIZE);
+  saved = kmalloc (ntables * sizeof (u32));
+  if (!saved) {
+    free_entry (e);
+    return NULL;
+  }
+  for (t = 0; t < ntables; t++) {
+    saved[t] = pgdir[(PCACHE_WINDOW >> BIGPAGE_SIZE_BITS) + t];
+    pgdir[(PCACHE_WINDOW >> BIGPAGE_SIZE_BITS) + t] = 0;
+  }
+  for (t = 0; t < ntables; t++) {
+    frame_t table = alloc_phys_frame ();
+    if (table == -1)
+      goto unmap;
+    pgtbl = map_virtual_page (table | 3);
+    memset (pgtbl, 0, PAGE_SIZE);
+    for (i = 0; i < PGTBL_NUM_ENTRIES && (t << 10) + i < e->nframes; i++)
+      pgtbl[i] = e->frames[(t << 10) + i] | 3;
+    unmap_virtual_page (pgtbl);
+    pgdir[(PCACHE_WINDOW >> BIGPAGE_SIZE_BITS) + t] = table | 3;
+  }
+  flush_tlb_all ();
+
+  if (vfs_read (path, (char *) PCACHE_WINDOW, size) == size)
+    ok = parse_elf (e);
+  else
+    printf ("pcache: short read of %s\n", path);
+
+ unmap:
+  for (t = 0; t < ntables; t++) {
+    u32 *pde = &pgdir[(PCACHE_WINDOW >> BIGPAGE_SIZE_BITS) + t];
+    if (*pde)
+      free_phys_frame (*pde & 0xFFFFF000);
+    *pde = saved[t];
+  }
+  kfree (saved);
+  /* Other threads of the address space may have touched the window */
+  tlb_shootdown ((u32) get_pdbr (), (void *) PCACHE_WINDOW,
+                 ntables << (BIGPAGE_SIZE_BITS - PAGE_SIZE_BITS));
+
+  if (!ok) {
+    free_entry (e);
+    return NULL;
+  }
+
+  e->refs = 1;
+  klock_lock_irq_save (&pcache_lock, flags);
+  e->last_use = ++pcache_clock;
+  e->next = pcache_list;
+  pcache_list = e;
+  stats.misses++;
+  klock_unlock_irq_restore (&pcache_lock, flags);
+  DLOG ("loaded %s: %d bytes, %d segments", e->path, size, e->nsegs);
+  DLOG ("hits=%d misses=%d evictions=%d shared=%d private=%d",
+        stats.hits, stats.misses, stats.evictions,
+        stats.shared_faults, stats.private_faults);
+  return e;
+}
+
+/* Must hold pcache_lock */
+static struct pcache_map *
+find_map (u32 cr3)
+{
+  struct pcache_map *m;
+
+  for (m = pcache_maps[MAP_BUCKET (cr3)]; m; m = m->next)
+    if (m->cr3 == cr3)
+      return m;
+  return NULL;
+}
+
+/* Back the user space of address space cr3 with an image, consuming
+ * the caller's reference. */
+void
+pcache_exec_attach (u32 cr3, pcache_entry *e)
+{
+  struct pcache_map *m = kmalloc (sizeof (struct pcache_map));
+  u32 flags;
+
+  if (!m)
+    panic ("pcache_exec_attach: out of memory");
+  cr3 &= 0xFFFFF000;
+  m->cr3 = cr3;
+  m->image = e;
+  klock_lock_irq_save (&pcache_lock, flags);
+  m->next = pcache_maps[MAP_BUCKET (cr3)];
+  pcache_maps[MAP_BUCKET (cr3)] = m;
+  klock_unlock_irq_restore (&pcache_lock, flags);
+}
+
+/* A forked child keeps demand-paging from its parent's image */
+void
+pcache_exec_fork (u32 parent_cr3, u32 child_cr3)
+{
+  struct pcache_map *m = kmalloc (sizeof (struct pcache_map)), *p;
+  u32 flags;
+
+  if (!m)
+    panic ("pcache_exec_fork: out of memory");
+  child_cr3 &= 0xFFFFF000;
+  klock_lock_irq_save (&pcache_lock, flags);
+  p = find_map (parent_cr3 & 0xFFFFF000);
+  if (p) {
+    m->cr3 = child_cr3;
+    m->image = p->image;
+    p->image->refs++;
+    m->next = pcache_maps[MAP_BUCKET (child_cr3)];
+    pcache_maps[MAP_BUCKET (child_cr3)] = m;
+  }
+  klock_unlock_irq_restore (&pcache_lock, flags);
+  if (!p)
+    kfree (m);
+}
+
+/* The address space is being torn down or replaced */
+void
+pcache_exec_release (u32 cr3)
+{
+  struct pcache_map **pp, *m = NULL;
+  u32 flags;
+
+  cr3 &= 0xFFFFF000;
+  klock_lock_irq_save (&pcache_lock, flags);
+  for (pp = &pcache_maps[MAP_BUCKET (cr3)]; *pp; pp = &(*pp)->next)
+    if ((*pp)->cr3 == cr3) {
+      m = *pp;
+      *pp = m->next;
+      break;
+    }
+  klock_unlock_irq_restore (&pcache_lock, flags);
+
+  if (m) {
+    pcache_put (m->image);
+    kfree (m);
+  }
+}
+
+/* Fill a private page with the file bytes of every segment
+ * overlapping it. */
+static void
+fill_page (pcache_entry *e, u32 page, u8 *buf)
+{
+  u32 s, lo, hi, off;
+  u8 *src;
+
+  memset (buf, 0, PAGE_SIZE);
+  for (s = 0; s < e->nsegs; s++) {
+    pcache_seg *seg = &e->segs[s];
+    lo = seg->vaddr > page ? seg->vaddr : page;
+    hi = seg->vaddr + seg->filesz;
+    if (hi > page + PAGE_SIZE)
+      hi = page + PAGE_SIZE;
+    if (lo >= hi)
+      continue;
+    /* offset and vaddr agree mod PAGE_SIZE, so this is one frame */
+    off = seg->offset + (lo - seg->vaddr);
+    src = map_virtual_page (e->frames[off >> PAGE_SIZE_BITS] | 3);
+    memcpy (buf + (lo - page), src + (off & (PAGE_SIZE - 1)), hi - lo);
+    unmap_virtual_page (src);
+  }
+}
+
+/* Handle a not-present fault at addr in address space cr3.  Returns
+ * TRUE if the page was part of a cached image and is now mapped. */
+bool
+pcache_fault (u32 cr3, u32 addr)
+{
+  struct pcache_map *m;
+  pcache_entry *e;
+  pcache_seg *only = NULL;
+  u32 page = addr & ~(PAGE_SIZE - 1), flags, s, n = 0;
+  u32 *pgdir, *pgtbl;
+  frame_t frame;
+  bool ret = FALSE;
+
+  if (addr >= PCACHE_USER_LIMIT)
+    return FALSE;
+
+  klock_lock_irq_save (&pcache_lock, flags);
+  if (!(m = find_map (cr3 & 0xFFFFF000)))
+    goto out;
+  e = m->image;
+
+  for (s = 0; s < e->nsegs; s++)
+    if (e->segs[s].vaddr < page + PAGE_SIZE &&
+        e->segs[s].vaddr + e->segs[s].memsz > page) {
+      only = &e->segs[s];
+      n++;
+    }
+  if (n == 0)
+    goto out;
+
+  pgdir = kmap_atomic ((cr3 & 0xFFFFF000) | 3);
+  if (!(pgdir[page >> BIGPAGE_SIZE_BITS] & 1)) {
+    frame = alloc_phys_frame ();
+    if (frame == -1)
+      goto out_dir;
+    pgtbl = kmap_atomic (frame | 3);
+    memset (pgtbl, 0, PAGE_SIZE);
+    pgdir[page >> BIGPAGE_SIZE_BITS] = frame | 7;
+  } else
+    pgtbl = kmap_atomic ((pgdir[page >> BIGPAGE_SIZE_BITS] & 0xFFFFF000) | 3);
+
+  s = (page >> PAGE_SIZE_BITS) & (PGTBL_NUM_ENTRIES - 1);
+  if (pgtbl[s] & 1) {
+    /* Another thread of this process got here first */
+    ret = TRUE;
+  } else if (n == 1 && !(only->flags & PF_W) && page >= only->vaddr &&
+             page + PAGE_SIZE <= only->vaddr + only->filesz) {
+    /* Text: share the cache frame, read-only */
+    frame = e->frames[(only->offset + (page - only->vaddr)) >> PAGE_SIZE_BITS];
+    pgtbl[s] = frame | PTE_PCACHE | 5;
+    stats.shared_faults++;
+    ret = TRUE;
+  } else if ((frame = alloc_phys_frame ()) != -1) {
+    u8 *buf = kmap_atomic (frame | 3);
+    fill_page (e, page, buf);
+    kunmap_atomic (buf);
+    pgtbl[s] = frame | 7;
+    stats.private_faults++;
+    ret = TRUE;
+  }
+  kunmap_atomic (pgtbl);
+  if (ret)
+    invalidate_page ((void *) page);
+ out_dir:
+  kunmap_atomic (pgdir);
+ out:
+  klock_unlock_irq_restore (&pcache_lock, flags);
+  return ret;
+}
+
+/* Fault in every page of the image, e.g. before the address space is
+ * copied somewhere the cache is not available (migration). */
+void
+pcache_populate (u32 cr3)
+{
+  struct pcache_map *m;
+  pcache_entry *e;
+  u32 s, page, flags;
+
+  klock_lock_irq_save (&pcache_lock, flags);
+  m = find_map (cr3 & 0xFFFFF000);
+  e = m ? m->image : NULL;
+  klock_unlock_irq_restore (&pcache_lock, flags);
+  if (!e)
+    return;
+  /* The image stays referenced by the map while we work */
+  for (s = 0; s < e->nsegs; s++)
+    for (page = e->segs[s].vaddr & ~(PAGE_SIZE - 1);
+         page < e->segs[s].vaddr + e->segs[s].memsz; page += PAGE_SIZE)
+      pcache_fault (cr3, page);
+}
+
+/* 
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * mode: C
+ * c-file-style: "gnu"
+ * c-basic-offset: 2
+ * End: 
+ */
+
+/* vi: set et sw=2 sts=2: */
@@ -17,6 +17,10 @@
 
 #include "mem/physical.h"
 #include "kernel.h"
+#include "smp/klock.h"
+#include "smp/spinlock.h"
+#include "smp/smp.h"
+#include "arch/i386-percpu.h"
 
 /* Declare space for bitmap (physical) memory usage table.
  * PHYS_INDEX_MAX entries of 32-bit integers each for a 4K page => 4GB
@@ -26,6 +30,316 @@ uint32 mm_table[PHYS_INDEX_MAX] __attribute__ ((aligned (4096)));
 uint32 mm_limit;                /* Actual physical page limit */
 uint32 mm_begin = 0;
 
+/* All allocator state is guarded by frame_lock.  Callers may be in
+ * interrupt context, so it is taken with interrupts disabled. */
+
+/* mm_table stays the authoritative record of free frames (bit set =
+ * free), but searching it linearly is O(memory).  Above it sits a
+ * three-level summary: bit w of mm_summary1 is set if mm_table[w] may
+ * hold a free frame inside [mm_begin, mm_limit), bit v of mm_summary2
+ * if mm_summary1[v] is non-zero, and bit u of mm_summary3 if
+ * mm_summary2[u] is.  Finding the lowest free frame is then four bsf
+ * instructions.
+ *
+ * Summary bits are set exactly when frames are freed through this
+ * file, but are only cleared lazily, when a search finds the word
+ * below them empty.  That makes it safe for boot code to clear bits
+ * in mm_table directly.  Code that sets mm_table bits directly must
+ * call phys_frames_resync () afterwards.  A change of mm_begin or
+ * mm_limit (sandbox relocation) is noticed and rebuilds the summary. */
+#define SUMMARY1_WORDS (PHYS_INDEX_MAX >> 5)
+#define SUMMARY2_WORDS (SUMMARY1_WORDS >> 5)
+
+static uint32 mm_summary1[SUMMARY1_WORDS];
+static uint32 mm_summary2[SUMMARY2_WORDS];
+static uint32 mm_summary3;
+static uint32 summary_begin, summary_limit;
+static bool summary_valid = FALSE;
+static uint32 summary_generation = 0;
+
+static inline uint32
+bit_scan_forward (uint32 word)
+{
+  uint32 bit;
+  asm ("bsfl %1,%0":"=r" (bit):"rm" (word));
+  return bit;
+}
+
+/* Mask of the frames in mm_table[w] that lie within [mm_begin, mm_limit) */
+static inline uint32
+range_mask (uint32 w)
+{
+  uint32 mask = 0xFFFFFFFF;
+  uint32 base = w << 5;
+
+  if (mm_begin > base) {
+    if (mm_begin - base >= 32)
+      return 0;
+    mask &= 0xFFFFFFFF << (mm_begin - base);
+  }
+  if (mm_limit < base + 32) {
+    if (mm_limit <= base)
+      return 0;
+    mask &= 0xFFFFFFFF >> (base + 32 - mm_limit);
+  }
+  return mask;
+}
+
+static inline void
+summary_mark (uint32 w)
+{
+  mm_summary1[w >> 5] |= 1 << (w & 31);
+  mm_summary2[w >> 10] |= 1 << ((w >> 5) & 31);
+  mm_summary3 |= 1 << (w >> 10);
+}
+
+/* Clear the summary bit of an empty word, propagating upwards */
+static inline void
+summary_unmark (uint32 w)
+{
+  mm_summary1[w >> 5] &= ~(1 << (w & 31));
+  if (mm_summary1[w >> 5] == 0) {
+    mm_summary2[w >> 10] &= ~(1 << ((w >> 5) & 31));
+    if (mm_summary2[w >> 10] == 0)
+      mm_summary3 &= ~(1 << (w >> 10));
+  }
+}
+
+static void
+summary_build (void)
+{
+  uint32 w;
+
+  memset (mm_summary1, 0, sizeof (mm_summary1));
+  memset (mm_summary2, 0, sizeof (mm_summary2));
+  mm_summary3 = 0;
+  for (w = mm_begin >> 5; w < ((mm_limit + 31) >> 5) && w < PHYS_INDEX_MAX; w++)
+    if (mm_table[w] & range_mask (w))
+      summary_mark (w);
+  summary_begin = mm_begin;
+  summary_limit = mm_limit;
+  summary_valid = TRUE;
+  /* Frames cached in per-CPU magazines may now be out of range */
+  summary_generation++;
+}
+
+static inline void
+summary_check (void)
+{
+  if (!summary_valid || summary_begin != mm_begin || summary_limit != mm_limit)
+    summary_build ();
+}
+
+/* Force a rebuild of the summary after mm_table has been edited
+ * directly. */
+void
+phys_frames_resync (void)
+{
+  u32 flags;
+
+  klock_lock_irq_save (&frame_lock, flags);
+  summary_valid = FALSE;
+  klock_unlock_irq_restore (&frame_lock, flags);
+}
+
+/* Index of the first mm_table word at or after w that may hold a free
+ * frame, or -1.  Stale summary bits are cleared on the way. */
+static int
+next_free_word (uint32 w)
+{
+  uint32 v, u, bits;
+
+  while (w < SUMMARY1_WORDS << 5) {
+    v = w >> 5;
+    bits = mm_summary1[v] & (0xFFFFFFFF << (w & 31));
+    if (bits == 0) {
+      /* Skip to the next non-empty summary1 word */
+      v++;
+      u = v >> 5;
+      if (u >= SUMMARY2_WORDS)
+        return -1;
+      bits = mm_summary2[u] & (0xFFFFFFFF << (v & 31));
+      if (bits == 0) {
+        u++;
+        if (u >= SUMMARY2_WORDS)
+          return -1;
+        bits = mm_summary3 & (0xFFFFFFFF << u);
+        if (bits == 0)
+          return -1;
+        u = bit_scan_forward (bits);
+        bits = mm_summary2[u];
+      }
+      v = (u << 5) + bit_scan_forward (bits);
+      bits = mm_summary1[v];
+    }
+    w = (v << 5) + bit_scan_forward (bits);
+    if (mm_table[w] & range_mask (w))
+      return w;
+    summary_unmark (w);
+    w++;
+  }
+  return -1;
+}
+
+/* Lowest free frame in range, with frame_lock held */
+static int
+find_free_frame (void)
+{
+  int w = next_free_word (mm_begin >> 5);
+
+  if (w < 0)
+    return -1;
+  return (w << 5) + bit_scan_forward (mm_table[w] & range_mask (w));
+}
+
+static inline void
+take_frame (uint32 i)
+{
+  BITMAP_CLR (mm_table, i);
+  if ((mm_table[i >> 5] & range_mask (i >> 5)) == 0)
+    summary_unmark (i >> 5);
+}
+
+static inline void
+give_frame (uint32 i)
+{
+  BITMAP_SET (mm_table, i);
+  if (summary_valid && i >= mm_begin && i < mm_limit)
+    summary_mark (i >> 5);
+}
+
+/* Set or clear a run of frames a word at a time */
+static void
+take_frames (uint32 i, uint32 count)
+{
+  uint32 n, mask;
+
+  while (count > 0) {
+    n = 32 - (i & 31);
+    if (n > count)
+      n = count;
+    mask = (n == 32 ? 0xFFFFFFFF : ((1 << n) - 1)) << (i & 31);
+    mm_table[i >> 5] &= ~mask;
+    if ((mm_table[i >> 5] & range_mask (i >> 5)) == 0)
+      summary_unmark (i >> 5);
+    i += n;
+    count -= n;
+  }
+}
+
+static void
+give_frames (uint32 i, uint32 count)
+{
+  uint32 n, mask;
+
+  while (count > 0) {
+    n = 32 - (i & 31);
+    if (n > count)
+      n = count;
+    mask = (n == 32 ? 0xFFFFFFFF : ((1 << n) - 1)) << (i & 31);
+    mm_table[i >> 5] |= mask;
+    if (summary_valid && (mask & range_mask (i >> 5)))
+      summary_mark (i >> 5);
+    i += n;
+    count -= n;
+  }
+}
+
+/* Number of consecutive free frames starting at i, up to max */
+static uint32
+free_run_length (uint32 i, uint32 max)
+{
+  uint32 n = 0, used;
+
+  while (n < max) {
+    used = ~mm_table[i >> 5] >> (i & 31);
+    if (used) {
+      n += bit_scan_forward (used);
+      break;
+    }
+    n += 32 - (i & 31);
+    i += 32 - (i & 31);
+  }
+  return n < max ? n : max;
+}
+
+/* Lowest run of count free frames starting on a multiple of align
+ * (in frames, a power of two), with frame_lock held.  Words with no
+ * free frames are skipped through the summary, and runs are measured
+ * a word at a time. */
+static int
+find_free_run (uint32 count, uint32 align)
+{
+  uint32 i = ROUNDUP (mm_begin, align), n;
+  int w;
+
+  while (i + count <= mm_limit) {
+    if ((mm_table[i >> 5] >> (i & 31)) == 0) {
+      /* Nothing free in the rest of this word */
+      w = next_free_word ((i >> 5) + 1);
+      if (w < 0)
+        return -1;
+      i = ROUNDUP ((uint32) w << 5, align);
+      continue;
+    }
+    n = free_run_length (i, count);
+    if (n == count)
+      return i;
+    /* frame i + n is in use */
+    i = ROUNDUP (i + n + 1, align);
+  }
+  return -1;
+}
+
+/* Per-CPU magazines of single frames.  alloc_phys_frame and
+ * free_phys_frame are served from the local magazine without taking
+ * frame_lock, and refill or flush it in batches.  Frames in a magazine
+ * are marked used in mm_table.  Magazines are only used once the
+ * other CPUs are up (mp_enabled); before that the lock is uncontended
+ * anyway. */
+#define MAGAZINE_SIZE 32
+#define MAGAZINE_BATCH 16
+
+struct frame_magazine
+{
+  uint32 generation;
+  uint32 count;
+  uint32 frames[MAGAZINE_SIZE];
+};
+
+DEF_PER_CPU (struct frame_magazine, frame_magazine);
+
+static inline struct frame_magazine *
+local_magazine (void)
+{
+  return percpu_pointer (get_pcpu_id (), frame_magazine);
+}
+
+/* Return all frames of a magazine to mm_table, with frame_lock held */
+static void
+magazine_drain (struct frame_magazine *mag)
+{
+  while (mag->count > 0)
+    give_frame (mag->frames[--mag->count]);
+  mag->generation = summary_generation;
+}
+
+/* Number of frames cached in magazines, which mm_table shows as used */
+uint32
+phys_frames_cached (void)
+{
+  uint32 cpu, n = 0;
+  struct frame_magazine *mag;
+
+  if (!mp_enabled)
+    return 0;
+  for (cpu = 0; cpu < mp_num_cpus; cpu++) {
+    mag = percpu_pointer (cpu, frame_magazine);
+    n += mag->count;
+  }
+  return n;
+}
+
 /* Find free page in mm_table 
  *
  * Returns physical address rather than virtual, since we we don't
@@ -36,12 +350,48 @@ alloc_phys_frame (void)
 {
 
   int i;
+  u32 flags;
+  struct frame_magazine *mag;
 
-  for (i = mm_begin; i < mm_limit; i++)
-    if (BITMAP_TST (mm_table, i)) {     /* Free page */
-      BITMAP_CLR (mm_table, i);
-      return (i << 12);         /* physical byte address of free page/frame */
+  if (mp_enabled) {
+    flags = get_flags ();
+    cli ();
+    mag = local_magazine ();
+    if (mag->count > 0 && mag->generation == summary_generation) {
+      i = mag->frames[--mag->count];
+      restore_flags (flags);
+      return (i << 12);
     }
+    restore_flags (flags);
+
+    /* Refill: take a batch under one acquisition of frame_lock */
+    klock_lock_irq_save (&frame_lock, flags);
+    summary_check ();
+    mag = local_magazine ();
+    if (mag->generation != summary_generation)
+      magazine_drain (mag);
+    while (mag->count < MAGAZINE_BATCH) {
+      if ((i = find_free_frame ()) < 0)
+        break;
+      take_frame (i);
+      mag->frames[mag->count++] = i;
+    }
+    /* Hand out the lowest frame of the batch */
+    i = mag->count > 0 ? mag->frames[0] : -1;
+    if (mag->count > 0)
+      mag->frames[0] = mag->frames[--mag->count];
+    klock_unlock_irq_restore (&frame_lock, flags);
+    return i < 0 ? -1 : (i << 12);
+  }
+
+  klock_lock_irq_save (&frame_lock, flags);
+  summary_check ();
+  if ((i = find_free_frame ()) >= 0) {      /* Free page */
+    take_frame (i);
+    klock_unlock_irq_restore (&frame_lock, flags);
+    return (i << 12);         /* physical byte address of free page/frame */
+  }
+  klock_unlock_irq_restore (&frame_lock, flags);
 
   return -1;                    /* Error -- no free page? */
 }
@@ -53,83 +403,112 @@ uint32
 alloc_phys_frame_high (void)
 {
 
-  int i;
+  int i, w;
+  u32 flags, bits;
 
-  for (i = mm_limit - 1; i >= mm_begin; i--) {
-    if (BITMAP_TST (mm_table, i)) {
-      BITMAP_CLR (mm_table, i);
+  klock_lock_irq_save (&frame_lock, flags);
+  /* Rare and mostly at boot: scan down a word at a time */
+  for (w = (mm_limit - 1) >> 5; w >= (int) (mm_begin >> 5); w--) {
+    bits = mm_table[w] & range_mask (w);
+    if (bits) {
+      asm ("bsrl %1,%0":"=r" (i):"rm" (bits));
+      i += w << 5;
+      summary_check ();
+      take_frame (i);
+      klock_unlock_irq_restore (&frame_lock, flags);
       return (i << 12);
     }
   }
+  klock_unlock_irq_restore (&frame_lock, flags);
 
   return -1;
 }
 
-uint32
-alloc_phys_frames (uint32 count)
+static uint32
+alloc_frames_aligned (uint32 count, uint32 frame_alignment)
 {
+  int i;
+  u32 flags;
 
-  int i, j;
+  if (count == 0 || count > mm_limit)
+    return -1;
 
-  for (i = mm_begin; i < mm_limit - count + 1; i++) {
-    for (j = 0; j < count; j++) {
-      if (!BITMAP_TST (mm_table, i + j)) {      /* Is not free page? */
-        i = i + j;
-        goto keep_searching;
-      }
-    }
-    /* found window: */
-    for (j = 0; j < count; j++) {
-      BITMAP_CLR (mm_table, i + j);
-    }
-    return (i << 12);           /* physical byte address of free frames */
-  keep_searching:
-    ;
+  klock_lock_irq_save (&frame_lock, flags);
+  summary_check ();
+  i = find_free_run (count, frame_alignment);
+  if (i < 0 && mp_enabled) {
+    /* Frames cached locally may be what breaks up the run */
+    magazine_drain (local_magazine ());
+    i = find_free_run (count, frame_alignment);
   }
-  return -1;                    /* Error -- no free page? */
+  if (i >= 0)
+    take_frames (i, count);
+  klock_unlock_irq_restore (&frame_lock, flags);
+
+  return i < 0 ? -1 : (i << 12);  /* physical byte address of free frames */
 }
 
 uint32
-alloc_phys_frames_aligned_on (uint32 count, uint32 alignment)
+alloc_phys_frames (uint32 count)
 {
+  return alloc_frames_aligned (count, 1);
+}
 
-  int i, j;
+uint32
+alloc_phys_frames_aligned_on (uint32 count, uint32 alignment)
+{
   int frame_alignment = alignment / FRAME_SIZE;
 
-  for (i = ROUNDUP(mm_begin, frame_alignment);
-       i < mm_limit - count + 1;
-       i = ROUNDUP(i + 1, frame_alignment))
-  {
-    for (j = 0; j < count; j++) {
-      if (!BITMAP_TST (mm_table, i + j)) {      /* Is not free page? */
-        i = i + j;
-        goto keep_searching;
-      }
-    }
-    /* found window: */
-    for (j = 0; j < count; j++) {
-      BITMAP_CLR (mm_table, i + j);
-    }
-    return (i << 12);           /* physical byte address of free frames */
-  keep_searching:
-    ;
-  }
-  return -1;                    /* Error -- no free page? */
+  if (frame_alignment < 1)
+    frame_alignment = 1;
+  return alloc_frames_aligned (count, frame_alignment);
 }
 
 void
 free_phys_frame (uint32 frame)
 {
-  BITMAP_SET (mm_table, frame >> 12);
+  u32 flags;
+  struct frame_magazine *mag;
+
+  frame >>= 12;
+  if (mp_enabled) {
+    flags = get_flags ();
+    cli ();
+    mag = local_magazine ();
+    if (mag->count < MAGAZINE_SIZE && mag->generation == summary_generation
+        && frame >= mm_begin && frame < mm_limit) {
+      mag->frames[mag->count++] = frame;
+      restore_flags (flags);
+      return;
+    }
+    restore_flags (flags);
+
+    /* Flush: return half the magazine along with this frame */
+    klock_lock_irq_save (&frame_lock, flags);
+    mag = local_magazine ();
+    if (mag->generation != summary_generation)
+      magazine_drain (mag);
+    while (mag->count > MAGAZINE_SIZE - MAGAZINE_BATCH)
+      give_frame (mag->frames[--mag->count]);
+    give_frame (frame);
+    klock_unlock_irq_restore (&frame_lock, flags);
+    return;
+  }
+
+  klock_lock_irq_save (&frame_lock, flags);
+  give_frame (frame);
+  klock_unlock_irq_restore (&frame_lock, flags);
 }
 
 void
 free_phys_frames (uint32 frame, uint32 count)
 {
-  int i;
+  u32 flags;
+
   frame >>= 12;
-  for (i = 0; i < count; i++)
-    BITMAP_SET (mm_table, frame + i);
+  klock_lock_irq_save (&frame_lock, flags);
+  give_frames (frame, count);
+  klock_unlock_irq_restore (&frame_lock, flags);
 }
 
 /* 
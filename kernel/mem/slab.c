@@ -0,0 +1,253 @@
+/*                    The Quest Operating System
+ *  Copyright (C) 2005-2012  Richard West, Boston University
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "kernel.h"
+#include "mem/mem.h"
+#include "mem/slab.h"
+#include "smp/spinlock.h"
+#include "util/printf.h"
+
+//#define DEBUG_SLAB
+
+#ifdef DEBUG_SLAB
+#define DLOG(fmt,...) DLOG_PREFIX("slab",fmt,##__VA_ARGS__)
+#else
+#define DLOG(fmt,...) ;
+#endif
+
+/* Every cache that has grown a slab, for kmem_get_stats */
+static kmem_cache *kmem_caches = NULL;
+static spinlock kmem_caches_lock = SPINLOCK_INIT;
+
+/* A free object in the depot is linked through the word just past
+ * the object, so that its constructed contents are left alone. */
+#define FREE_LINK(c, obj) (*(void **) ((u8 *) (obj) + (c)->stride - sizeof (void *)))
+
+/* Lay out the cache on first use, with the cache lock held */
+static void
+kmem_cache_setup (kmem_cache *c)
+{
+  u32 align = c->align < sizeof (void *) ? sizeof (void *) : c->align;
+  u32 pages, min_pages, waste, best_waste;
+
+  c->stride = ROUNDUP (ROUNDUP (c->size, sizeof (void *)) + sizeof (void *),
+                       align);
+  min_pages = (c->stride * KMEM_SLAB_MIN_OBJS + 0xFFF) >> 12;
+
+  /* Large objects can leave most of a page unused at the end of a
+   * slab.  Allow up to twice the minimum slab size and keep the one
+   * wasting the smallest fraction of its pages. */
+  c->slab_pages = min_pages;
+  best_waste = (min_pages << 12) % c->stride;
+  for (pages = min_pages + 1; pages <= 2 * min_pages; pages++) {
+    waste = (pages << 12) % c->stride;
+    if (waste * c->slab_pages < best_waste * pages) {
+      c->slab_pages = pages;
+      best_waste = waste;
+    }
+  }
+
+  spinlock_lock (&kmem_caches_lock);
+  c->next = kmem_caches;
+  kmem_caches = c;
+  spinlock_unlock (&kmem_caches_lock);
+
+  DLOG ("%s: size=%d stride=%d slab_pages=%d",
+        c->name, c->size, c->stride, c->slab_pages);
+}
+
+/* Add a slab of constructed objects to the depot, with the cache lock
+ * held */
+static bool
+kmem_cache_grow (kmem_cache *c)
+{
+  u32 frame, i, n;
+  u8 *slab;
+
+  if (c->stride == 0)
+    kmem_cache_setup (c);
+
+  frame = alloc_phys_frames (c->slab_pages);
+  if (frame == -1)
+    return FALSE;
+  slab = map_contiguous_virtual_pages (frame | 3, c->slab_pages);
+  if (!slab) {
+    free_phys_frames (frame, c->slab_pages);
+    return FALSE;
+  }
+
+  n = (c->slab_pages << 12) / c->stride;
+  for (i = 0; i < n; i++) {
+    void *obj = slab + i * c->stride;
+    memset (obj, 0, c->size);
+    if (c->ctor)
+      c->ctor (obj);
+    FREE_LINK (c, obj) = c->depot;
+    c->depot = obj;
+  }
+  c->depot_count += n;
+  c->slabs++;
+  c->objs += n;
+  DLOG ("%s: new slab %p, %d objects", c->name, slab, n);
+  return TRUE;
+}
+
+/* Take an object from the depot, with the cache lock held */
+static void *
+depot_get (kmem_cache *c)
+{
+  void *obj;
+
+  if (!c->depot && !kmem_cache_grow (c))
+    return NULL;
+  obj = c->depot;
+  c->depot = FREE_LINK (c, obj);
+  c->depot_count--;
+  return obj;
+}
+
+/* Return an object to the depot, with the cache lock held */
+static inline void
+depot_put (kmem_cache *c, void *obj)
+{
+  FREE_LINK (c, obj) = c->depot;
+  c->depot = obj;
+  c->depot_count++;
+}
+
+void *
+kmem_cache_alloc (kmem_cache *c)
+{
+  struct kmem_magazine *m;
+  void *obj;
+  u32 flags;
+
+  if (!mp_enabled) {
+    /* no per-CPU area yet, the depot lock is uncontended anyway */
+    klock_lock_irq_save (&c->lock, flags);
+    obj = depot_get (c);
+    if (obj)
+      c->mag[0].allocs++;
+    klock_unlock_irq_restore (&c->lock, flags);
+    return obj;
+  }
+
+  flags = get_flags ();
+  cli ();
+  m = &c->mag[get_pcpu_id ()];
+  if (m->count > 0) {
+    obj = m->objs[--m->count];
+    m->allocs++;
+    m->hits++;
+    restore_flags (flags);
+    return obj;
+  }
+
+  /* Refill: take a batch under one acquisition of the cache lock */
+  klock_lock (&c->lock);
+  while (m->count < KMEM_MAGAZINE_BATCH) {
+    if (!(obj = depot_get (c)))
+      break;
+    m->objs[m->count++] = obj;
+  }
+  klock_unlock (&c->lock);
+
+  obj = NULL;
+  if (m->count > 0) {
+    obj = m->objs[--m->count];
+    m->allocs++;
+  }
+  restore_flags (flags);
+  return obj;
+}
+
+void
+kmem_cache_free (kmem_cache *c, void *obj)
+{
+  struct kmem_magazine *m;
+  u32 flags;
+
+  if (!obj)
+    return;
+
+  if (!mp_enabled) {
+    klock_lock_irq_save (&c->lock, flags);
+    depot_put (c, obj);
+    c->mag[0].frees++;
+    klock_unlock_irq_restore (&c->lock, flags);
+    return;
+  }
+
+  flags = get_flags ();
+  cli ();
+  m = &c->mag[get_pcpu_id ()];
+  if (m->count == KMEM_MAGAZINE_SIZE) {
+    /* Flush the older half of the magazine */
+    u32 i;
+    klock_lock (&c->lock);
+    for (i = 0; i < KMEM_MAGAZINE_BATCH; i++)
+      depot_put (c, m->objs[i]);
+    klock_unlock (&c->lock);
+    for (i = KMEM_MAGAZINE_BATCH; i < KMEM_MAGAZINE_SIZE; i++)
+      m->objs[i - KMEM_MAGAZINE_BATCH] = m->objs[i];
+    m->count -= KMEM_MAGAZINE_BATCH;
+  }
+  m->objs[m->count++] = obj;
+  m->frees++;
+  restore_flags (flags);
+}
+
+/* Copy up to max cache counters into stats, returning the number
+ * copied.  The counters are read without locks, so a snapshot may be
+ * slightly stale. */
+int
+kmem_get_stats (struct kmem_stat *stats, int max)
+{
+  kmem_cache *c;
+  int i, n = 0;
+
+  for (c = kmem_caches; c && n < max; c = c->next, n++) {
+    struct kmem_stat *s = &stats[n];
+    for (i = 0; i < KMEM_NAME_LEN - 1 && c->name[i]; i++)
+      s->name[i] = c->name[i];
+    for (; i < KMEM_NAME_LEN; i++)
+      s->name[i] = '\0';
+    s->size = c->size;
+    s->slabs = c->slabs;
+    s->objs = c->objs;
+    s->allocs = s->frees = s->hits = 0;
+    for (i = 0; i < MAX_CPUS; i++) {
+      s->allocs += c->mag[i].allocs;
+      s->frees += c->mag[i].frees;
+      s->hits += c->mag[i].hits;
+    }
+    s->in_use = (u32) (s->allocs - s->frees);
+  }
+  return n;
+}
+
+
+/*
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * mode: C
+ * c-file-style: "gnu"
+ * c-basic-offset: 2
+ * End:
+ */
+
+/* vi: set et sw=2 sts=2: */
@@ -0,0 +1,311 @@
+/*                    The Quest Operating System
+ *  Copyright (C) 2005-2012  Richard West, Boston University
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "arch/i386.h"
+#include "kernel.h"
+#include "mem/tlb.h"
+#include "sched/sched.h"
+#include "smp/apic.h"
+#include "smp/smp.h"
+#include "smp/spinlock.h"
+#include "util/debug.h"
+#include "util/printf.h"
+
+//#define DEBUG_TLB
+
+#ifdef DEBUG_TLB
+#define DLOG(fmt,...) DLOG_PREFIX("tlb",fmt,##__VA_ARGS__)
+#else
+#define DLOG(fmt,...) ;
+#endif
+
+#define TLB_QUEUE_RANGES 8
+
+/* Flushes queued for one CPU.  Senders add to it under the lock; the
+ * owner drains it in its NMI handler and then advances done to the
+ * gen it saw, which is what senders wait for.
+ *
+ * At most one shootdown NMI is in flight to a CPU: kicked is set by
+ * the sender that sends it and cleared by the handler as it drains
+ * the queue, and senders that find it set rely on that NMI.  So an NMI
+ * that arrives with kicked clear is not a shootdown. */
+struct tlb_queue
+{
+  spinlock lock;
+  u32 nr;
+  bool all;
+  u32 release_cr3;              /* stop using this page directory */
+  struct tlb_range r[TLB_QUEUE_RANGES];
+  u32 gen;                      /* requests queued */
+  volatile u32 done;            /* requests handled */
+  volatile bool kicked;         /* shootdown NMI sent, not yet taken */
+} ALIGNED (LOCK_ALIGNMENT);
+
+static struct tlb_queue tlb_queue[MAX_CPUS];
+static volatile u32 tlb_online; /* CPUs taking shootdowns */
+u32 tlb_loaded_cr3[MAX_CPUS];
+
+static inline void
+full_barrier (void)
+{
+  asm volatile ("lock addl $0, (%%esp)":::"memory", "cc");
+}
+
+static inline void
+load_cr3 (u32 cr3)
+{
+  asm volatile ("movl %0, %%cr3"::"r" (cr3):"memory");
+}
+
+/* Add pages [va, va + pages) to a list of *n ranges, merging it with
+ * a range it overlaps or touches.  Returns FALSE if the list is
+ * full. */
+static bool
+range_add (struct tlb_range *r, u32 *n, u32 max, u32 va, u32 pages)
+{
+  u32 i, first = va >> 12, last = first + pages, f, l;
+
+  for (i = 0; i < *n; i++) {
+    f = r[i].va >> 12;
+    l = f + r[i].pages;
+    if (first <= l && f <= last) {
+      if (first < f)
+        f = first;
+      if (last > l)
+        l = last;
+      r[i].va = f << 12;
+      r[i].pages = l - f;
+      return TRUE;
+    }
+  }
+  if (*n == max)
+    return FALSE;
+  r[*n].va = va & 0xFFFFF000;
+  r[*n].pages = pages;
+  (*n)++;
+  return TRUE;
+}
+
+static void
+invalidate_ranges (struct tlb_range *r, u32 n, bool all)
+{
+  u32 i, j, total = 0;
+
+  for (i = 0; i < n; i++)
+    total += r[i].pages;
+  if (all || total > TLB_FLUSH_ALL_PAGES) {
+    flush_tlb_all ();
+    return;
+  }
+  for (i = 0; i < n; i++)
+    for (j = 0; j < r[i].pages; j++)
+      invalidate_page ((void *) (r[i].va + (j << 12)));
+}
+
+/* Leave page directory cr3 if this CPU is only borrowing it, i.e. a
+ * kernel thread is running on top of it. */
+static void
+drop_cr3 (u32 cr3)
+{
+  quest_tss *cur = str ();
+  uint cpu = get_pcpu_id ();
+
+  if ((u32) get_pdbr () != cr3)
+    return;
+  if (!cur || cur->CR3 == cr3)
+    return;                     /* still in use by the running task */
+  load_cr3 (cur->CR3);
+  tlb_loaded_cr3[cpu] = cur->CR3;
+}
+
+/* Per-CPU setup; the LAPIC logical destination must be set */
+void
+tlb_cpu_init (void)
+{
+  uint cpu = get_pcpu_id ();
+
+  spinlock_initialise (&tlb_queue[cpu].lock);
+  tlb_loaded_cr3[cpu] = (u32) get_pdbr ();
+  asm volatile ("lock orl %1, %0"
+                :"+m" (tlb_online):"r" (1u << cpu):"memory", "cc");
+}
+
+void
+tlb_batch_init (tlb_batch_t *b, u32 cr3)
+{
+  b->cr3 = cr3;
+  b->nr = 0;
+  b->all = FALSE;
+}
+
+void
+tlb_batch_add (tlb_batch_t *b, void *va, u32 pages)
+{
+  if (pages == 0 || b->all)
+    return;
+  if (!range_add (b->r, &b->nr, TLB_BATCH_RANGES, (u32) va, pages))
+    b->all = TRUE;
+}
+
+static void
+queue_add (struct tlb_queue *q, tlb_batch_t *b)
+{
+  u32 i;
+
+  if (b->all)
+    q->all = TRUE;
+  for (i = 0; i < b->nr && !q->all; i++)
+    if (!range_add (q->r, &q->nr, TLB_QUEUE_RANGES, b->r[i].va, b->r[i].pages))
+      q->all = TRUE;
+}
+
+/* Queue b, or a release of release_cr3 if that is non-zero, on every
+ * CPU other than this one that has cr3 loaded, interrupt those without
+ * a shootdown NMI in flight with one NMI per APIC cluster and wait
+ * until each has handled its queue. */
+static void
+tlb_send (tlb_batch_t *b, u32 cr3, u32 release_cr3)
+{
+  uint me = get_pcpu_id (), cpu;
+  u32 gen[MAX_CPUS], targets = 0, waiting = 0, flags;
+  struct tlb_queue *q;
+
+  /* Whoever loads cr3 after this point walks the updated tables */
+  full_barrier ();
+
+  for (cpu = 0; cpu < MAX_CPUS; cpu++) {
+    if (cpu == me || !(tlb_online & (1u << cpu)))
+      continue;
+    if (cr3 != TLB_KERNEL && tlb_loaded_cr3[cpu] != cr3)
+      continue;
+    q = &tlb_queue[cpu];
+    spinlock_lock_irq_save (&q->lock, flags);
+    if (release_cr3)
+      q->release_cr3 = release_cr3;
+    else
+      queue_add (q, b);
+    gen[cpu] = ++q->gen;
+    if (!q->kicked) {
+      q->kicked = TRUE;
+      targets |= 1u << cpu;
+    }
+    spinlock_unlock_irq_restore (&q->lock, flags);
+    waiting |= 1u << cpu;
+  }
+
+  if (!waiting)
+    return;
+
+  DLOG ("cpu %d: cr3 0x%X to cpus 0x%X", me, cr3, targets);
+  if (targets)
+    LAPIC_send_ipi_cpus (targets, LAPIC_ICR_LEVELASSERT | LAPIC_ICR_DM_NMI);
+
+  for (cpu = 0; cpu < MAX_CPUS; cpu++)
+    if (waiting & (1u << cpu))
+      while ((s32) (tlb_queue[cpu].done - gen[cpu]) < 0)
+        asm volatile ("pause");
+}
+
+/* Invalidate everything in b here and on each CPU that may cache it.
+ * Returns once no CPU can use the old translations. */
+void
+tlb_batch_flush (tlb_batch_t *b)
+{
+  if (b->nr == 0 && !b->all)
+    return;
+  if (b->cr3 == TLB_KERNEL || b->cr3 == (u32) get_pdbr ())
+    invalidate_ranges (b->r, b->nr, b->all);
+  tlb_send (b, b->cr3, 0);
+  tlb_batch_init (b, b->cr3);
+}
+
+void
+tlb_shootdown (u32 cr3, void *va, u32 pages)
+{
+  tlb_batch_t b;
+
+  tlb_batch_init (&b, cr3);
+  tlb_batch_add (&b, va, pages);
+  tlb_batch_flush (&b);
+}
+
+/* Invalidate pages on this CPU only, for mappings no other CPU uses.
+ * A long run is cheaper to drop with one CR3 reload. */
+void
+tlb_invalidate_local (void *va, u32 pages)
+{
+  struct tlb_range r = { (u32) va, pages };
+
+  invalidate_ranges (&r, 1, FALSE);
+}
+
+/* Page directory cr3 is about to be freed.  Make the CPUs that still
+ * have it loaded under a kernel thread switch away from it. */
+void
+tlb_release_cr3 (u32 cr3)
+{
+  drop_cr3 (cr3);
+  tlb_send (NULL, cr3, cr3);
+}
+
+/* NMI handler.  Returns FALSE if the NMI was not a shootdown, which
+ * is the case unless a sender has queued work for this CPU and kicked
+ * it.  An NMI from elsewhere that lands while a shootdown NMI is on
+ * its way is taken for it, and the shootdown NMI is then refused. */
+bool
+tlb_shootdown_nmi (void)
+{
+  struct tlb_queue *q = &tlb_queue[get_pcpu_id ()];
+  struct tlb_range r[TLB_QUEUE_RANGES];
+  u32 n, i, gen, release;
+  bool all;
+
+  /* kicked is set before the NMI is sent and only cleared here */
+  if (!q->kicked)
+    return FALSE;
+
+  spinlock_lock (&q->lock);
+  n = q->nr;
+  for (i = 0; i < n; i++)
+    r[i] = q->r[i];
+  all = q->all;
+  release = q->release_cr3;
+  gen = q->gen;
+  q->nr = 0;
+  q->all = FALSE;
+  q->release_cr3 = 0;
+  q->kicked = FALSE;
+  spinlock_unlock (&q->lock);
+
+  if (release)
+    drop_cr3 (release);
+  invalidate_ranges (r, n, all);
+  q->done = gen;
+  return TRUE;
+}
+
+
+/*
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * mode: C
+ * c-file-style: "gnu"
+ * c-basic-offset: 2
+ * End:
+ */
+
+/* vi: set et sw=2 sts=2: */
@@ -20,7 +20,10 @@
 #include "types.h"
 #include "mem/physical.h"
 #include "mem/virtual.h"
+#include "mem/tlb.h"
+#include "mem/cow.h"
 #include "util/printf.h"
+#include "smp/klock.h"
 
 extern uint32 _kernelstart;
 
@@ -40,6 +43,125 @@ extern uint32 _kernelstart;
 #endif
 
 
+u32 physmap_limit = 0;
+
+/* Map the physical memory below mm_limit, up to PHYSMAP_MAX_SIZE, at
+ * PHYSMAP_BASE in the current page directory.  Called once on the
+ * bootstrap CPU, before any other address space is built; those get
+ * the entries from physmap_map (). */
+void
+physmap_init (void)
+{
+#ifndef USE_VMX
+  u32 *pgdir, n, i;
+
+  n = mm_limit >> (BIGPAGE_SIZE_BITS - PAGE_SIZE_BITS);
+  if (n > PHYSMAP_MAX_SIZE >> BIGPAGE_SIZE_BITS)
+    n = PHYSMAP_MAX_SIZE >> BIGPAGE_SIZE_BITS;
+  pgdir = map_virtual_page ((u32) get_pdbr () | 3);
+  if (!pgdir)
+    return;
+  for (i = 0; i < n; i++)
+    pgdir[PHYSMAP_PGDIR_BEGIN + i] = (i << BIGPAGE_SIZE_BITS) | 0x83;
+  unmap_virtual_page (pgdir);
+  physmap_limit = n << BIGPAGE_SIZE_BITS;
+  DLOG ("physmap: %d MiB at 0x%X\n", physmap_limit >> 20, PHYSMAP_BASE);
+#endif
+}
+
+/* Add the physmap to a new page directory */
+void
+physmap_map (uint32 *pgdir)
+{
+  u32 i;
+
+  for (i = 0; i < physmap_limit >> BIGPAGE_SIZE_BITS; i++)
+    pgdir[PHYSMAP_PGDIR_BEGIN + i] = (i << BIGPAGE_SIZE_BITS) | 0x83;
+}
+
+/* Per-CPU kmap slots: a run of KERN_PGT entries claimed once per CPU
+ * and used as a stack.  Free slots hold KMAP_FREE, which is not
+ * present but keeps map_virtual_page () from taking them.  A slot is
+ * invalidated when it is mapped; unmapping only clears it, since no
+ * other CPU ever touches it. */
+#define KMAP_FREE 0x2
+
+static struct kmap_cpu
+{
+  u32 base;                     /* first slot in KERN_PGT, 0 if none */
+  u32 top;                      /* slots in use */
+} kmap_cpu[MAX_CPUS];
+
+void
+kmap_cpu_init (void)
+{
+  uint32 *page_table = (uint32 *) KERN_PGT;
+  struct kmap_cpu *k = &kmap_cpu[get_pcpu_id ()];
+  u32 i, j, flags;
+
+  klock_lock_irq_save (&frame_lock, flags);
+  for (i = 1; i + KMAP_SLOTS <= 0x400; i++) {
+    for (j = 0; j < KMAP_SLOTS && !page_table[i + j]; j++);
+    if (j == KMAP_SLOTS) {
+      for (j = 0; j < KMAP_SLOTS; j++)
+        page_table[i + j] = KMAP_FREE;
+      k->base = i;
+      k->top = 0;
+      break;
+    }
+    i += j;
+  }
+  klock_unlock_irq_restore (&frame_lock, flags);
+  if (!k->base)
+    com1_printf ("kmap: no slots for CPU %d\n", get_pcpu_id ());
+}
+
+void *
+kmap_atomic (uint32 phys_frame)
+{
+  uint32 *page_table = (uint32 *) KERN_PGT;
+  struct kmap_cpu *k;
+  void *va;
+  u32 i;
+
+  if (PHYSMAP_COVERS (phys_frame))
+    return PHYSMAP_VA (phys_frame & 0xFFFFF000);
+  if (get_flags () & F_IF)
+    /* could be preempted while holding the slot */
+    return map_virtual_page (phys_frame);
+  k = &kmap_cpu[get_pcpu_id ()];
+  if (!k->base || k->top == KMAP_SLOTS)
+    return map_virtual_page (phys_frame);
+
+  i = k->base + k->top++;
+  page_table[i] = phys_frame;
+  va = (char *) &_kernelstart + (i << 12);
+  invalidate_page (va);
+  return va;
+}
+
+void
+kunmap_atomic (void *virt_addr)
+{
+  uint32 *page_table = (uint32 *) KERN_PGT;
+  struct kmap_cpu *k;
+  u32 i;
+
+  if (IS_PHYSMAP_VA (virt_addr))
+    return;
+  k = &kmap_cpu[get_pcpu_id ()];
+  i = ((uint32) virt_addr >> 12) & 0x3FF;
+  if (!k->base || i < k->base || i >= k->base + KMAP_SLOTS ||
+      (uint32) virt_addr < (uint32) &_kernelstart) {
+    unmap_virtual_page (virt_addr);
+    return;
+  }
+  page_table[i] = KMAP_FREE;
+  /* Normally the top one; otherwise it is popped with the ones above */
+  while (k->top > 0 && page_table[k->base + k->top - 1] == KMAP_FREE)
+    k->top--;
+}
+
 /* Find free virtual page and map it to a corresponding physical frame
  *
  * Returns virtual address
@@ -52,10 +174,18 @@ map_virtual_page (uint32 phys_frame)
   uint32 *page_table = (uint32 *) KERN_PGT;
   int i;
   void *va;
+  u32 flags;
 
+  /* RAM needs no slot */
+  if (PHYSMAP_COVERS (phys_frame))
+    return PHYSMAP_VA (phys_frame & 0xFFFFF000);
+
+  /* Slots in KERN_PGT are claimed under frame_lock */
+  klock_lock_irq_save (&frame_lock, flags);
   for (i = 0; i < 0x400; i++)
     if (!page_table[i]) {       /* Free page */
       page_table[i] = phys_frame;
+      klock_unlock_irq_restore (&frame_lock, flags);
 
       va = (char *) &_kernelstart + (i << 12);
 
@@ -64,6 +194,7 @@ map_virtual_page (uint32 phys_frame)
 
       return va;
     }
+  klock_unlock_irq_restore (&frame_lock, flags);
 
   return NULL;                  /* Invalid address */
 }
@@ -75,10 +206,16 @@ map_contiguous_virtual_pages (uint32 phys_frame, uint32 count)
   uint32 *page_table = (uint32 *) KERN_PGT;
   uint32 i, j;
   void *va;
+  u32 flags;
 
   if (count == 0 || count >= 0x400)
     return NULL;
 
+  if (PHYSMAP_COVERS (phys_frame) &&
+      (phys_frame & 0xFFFFF000) + (count << 12) <= physmap_limit)
+    return PHYSMAP_VA (phys_frame & 0xFFFFF000);
+
+  klock_lock_irq_save (&frame_lock, flags);
   for (i = 0; i < 0x400 - count + 1; i++) {
     if (!page_table[i]) {       /* Free page */
       for (j = 0; j < count; j++) {
@@ -93,6 +230,8 @@ map_contiguous_virtual_pages (uint32 phys_frame, uint32 count)
         page_table[i + j] = phys_frame + j * 0x1000;
       }
 
+      klock_unlock_irq_restore (&frame_lock, flags);
+
       va = (char *) &_kernelstart + (i << 12);
 
       /* Invalidate page in case it was cached in the TLB */
@@ -105,6 +244,7 @@ map_contiguous_virtual_pages (uint32 phys_frame, uint32 count)
   keep_searching:
     ;
   }
+  klock_unlock_irq_restore (&frame_lock, flags);
 
   return NULL;                  /* Invalid address */
 }
@@ -116,10 +256,12 @@ map_virtual_pages (uint32 * phys_frames, uint32 count)
   uint32 *page_table = (uint32 *) KERN_PGT;
   int i, j;
   void *va;
+  u32 flags;
 
   if (count == 0)
     return NULL;
 
+  klock_lock_irq_save (&frame_lock, flags);
   for (i = 0; i < 0x400 - count + 1; i++) {
     if (!page_table[i]) {       /* Free page */
       for (j = 0; j < count; j++) {
@@ -134,6 +276,8 @@ map_virtual_pages (uint32 * phys_frames, uint32 count)
         page_table[i + j] = phys_frames[j];
       }
 
+      klock_unlock_irq_restore (&frame_lock, flags);
+
       va = (char *) &_kernelstart + (i << 12);
 
       /* Invalidate page in case it was cached in the TLB */
@@ -146,6 +290,7 @@ map_virtual_pages (uint32 * phys_frames, uint32 count)
   keep_searching:
     ;
   }
+  klock_unlock_irq_restore (&frame_lock, flags);
 
   return NULL;                  /* Invalid address */
 }
@@ -192,18 +337,28 @@ unmap_virtual_page (void *virt_addr)
 
   uint32 *page_table = (uint32 *) KERN_PGT;
 
+  if (IS_PHYSMAP_VA (virt_addr))
+    return;
+
   page_table[((uint32) virt_addr >> 12) & 0x3FF] = 0;
 
   /* Invalidate page in case it was cached in the TLB */
   invalidate_page (virt_addr);
 }
 
+/* Window slots are private to the CPU that mapped them (each map
+ * invalidates its slots locally), so only the local TLB is flushed,
+ * once for the whole run. */
 void
 unmap_virtual_pages (void *virt_addr, uint32 count)
 {
+  uint32 *page_table = (uint32 *) KERN_PGT;
   int j;
+  if (IS_PHYSMAP_VA (virt_addr))
+    return;
   for (j = 0; j < count; j++)
-    unmap_virtual_page (virt_addr + j * 0x1000);
+    page_table[(((uint32) virt_addr >> 12) + j) & 0x3FF] = 0;
+  tlb_invalidate_local (virt_addr, count);
 }
 
 /* ******************************************** */
@@ -346,8 +501,8 @@ map_contiguous_pool_virtual_pages (uint32 phys_frame, uint32 count,
 /*
  * Release previously mapped virtual page
  */
-void
-unmap_pool_virtual_page (void *virt_addr, uint32 start_dir_entry, uint32 num_dir_entries,
+static void
+clear_pool_virtual_page (void *virt_addr, uint32 start_dir_entry, uint32 num_dir_entries,
                          uint32* page_table_virtual_addrs[])
 {
   uint i;
@@ -357,23 +512,33 @@ unmap_pool_virtual_page (void *virt_addr, uint32 start_dir_entry, uint32 num_dir
       uint32 *page_table = page_table_virtual_addrs[i];
     
       page_table[((uint32) virt_addr >> 12) & 0x3FF] = 0;
-      
-      /* Invalidate page in case it was cached in the TLB */
-      invalidate_page (virt_addr);
       return;
     }
   }
   panic("Failed to unmap page in pool");
 }
 
+/* Pool pages are shared by all CPUs (drivers touch them from any
+ * CPU), so unmapping them is a shootdown on every CPU. */
+void
+unmap_pool_virtual_page (void *virt_addr, uint32 start_dir_entry, uint32 num_dir_entries,
+                         uint32* page_table_virtual_addrs[])
+{
+  clear_pool_virtual_page (virt_addr, start_dir_entry, num_dir_entries,
+                           page_table_virtual_addrs);
+  tlb_shootdown (TLB_KERNEL, virt_addr, 1);
+}
+
 void
 unmap_pool_virtual_pages (void *virt_addr, uint32 count, uint32 start_dir_entry, uint32 num_dir_entries,
                           uint32* page_table_virtual_addrs[])
 {
   uint j;
   for (j = 0; j < count; j++)
-    unmap_pool_virtual_page (virt_addr + j * 0x1000, start_dir_entry, num_dir_entries,
+    clear_pool_virtual_page (virt_addr + j * 0x1000, start_dir_entry, num_dir_entries,
                              page_table_virtual_addrs);
+  /* One shootdown for the whole run */
+  tlb_shootdown (TLB_KERNEL, virt_addr, count);
 }
 
 
@@ -392,18 +557,21 @@ get_phys_addr (void *virt_addr)
   uint32 phys_pdbr = (uint32) get_pdbr (), phys_ptbr;
   uint32 *virt_pdbr, *virt_ptbr;
 
-  virt_pdbr = map_virtual_page (phys_pdbr | 3);
+  if (IS_PHYSMAP_VA (virt_addr))
+    return (void *) (va - PHYSMAP_BASE);
+
+  virt_pdbr = kmap_atomic (phys_pdbr | 3);
   phys_ptbr = (virt_pdbr[va >> 22] & 0xFFFFF000);
   if (virt_pdbr[va >> 22] & 0x80) {
     /* 4MB page */
     pa = (void *) (phys_ptbr + (va & 0x003FFFFF));
   } else {
-    virt_ptbr = map_virtual_page (phys_ptbr | 3);
+    virt_ptbr = kmap_atomic (phys_ptbr | 3);
     phys_frame = virt_ptbr[(va >> 12) & 0x3FF] & 0xFFFFF000;
     pa = (void *) (phys_frame + (va & 0x00000FFF));
-    unmap_virtual_page (virt_ptbr);
+    kunmap_atomic (virt_ptbr);
   }
-  unmap_virtual_page (virt_pdbr);
+  kunmap_atomic (virt_pdbr);
 
   return pa;
 }
@@ -522,15 +690,19 @@ pgdir_get_phys_addr (pgdir_t dir, void *va)
   return frame + la.offset;
 }
 
-/* Clone the contents of a page table, copying data. */
+/* Clone the contents of a page table.  If share, read-only page cache
+ * frames (PTE_PCACHE) are mapped by both tables, and so are user
+ * frames, write-protected copy-on-write (see mem/cow.c).  Everything
+ * else, and everything if !share, is copied. */
 /* failure result is (-1, 0) */
 /* precondition: all of tbl is valid */
 /* postcondition: new physical and virtual address are valid in returned pgtbl */
 pgtbl_t
-clone_page_table (pgtbl_t tbl)
+clone_page_table (pgtbl_t tbl, bool share)
 {
   pgtbl_t new_tbl;
   uint i;
+  u32 raw, flags = 0;
 
   new_tbl.table_pa = alloc_phys_frame ();
   if (new_tbl.table_pa == -1)
@@ -542,36 +714,63 @@ clone_page_table (pgtbl_t tbl)
 
   memset (new_tbl.table_va, 0, PGTBL_NUM_ENTRIES * sizeof (pgtbl_entry_t));
 
+  /* the parent's entries change under us */
+  if (share)
+    klock_lock_irq_save (&cow_lock, flags);
+
   for (i=0; i<PGTBL_NUM_ENTRIES; i++) {
-    if (tbl.table_va[i].flags.present) {
+    raw = tbl.table_va[i].raw;
+    if (share && (raw & PTE_PCACHE)) {
+      /* read-only page cache frame: share it */
+      new_tbl.table_va[i].raw = raw;
+    } else if (share && (raw & 5) == 5 &&
+               cow_frame_ok (FRAMENUM_TO_FRAME (tbl.table_va[i].framenum)) &&
+               cow_share_frame (FRAMENUM_TO_FRAME (tbl.table_va[i].framenum))) {
+      /* user frame: share it, read-only until one side writes */
+      if (raw & 2) {
+        raw = (raw & ~2) | PTE_COW;
+        tbl.table_va[i].raw = raw;
+      }
+      new_tbl.table_va[i].raw = raw;
+      cow_stats.shared++;
+    } else if (tbl.table_va[i].flags.present) {
       frame_t new_frame = alloc_phys_frame ();
       frame_t old_frame = FRAMENUM_TO_FRAME (tbl.table_va[i].framenum);
 
       /* temporarily map frames */
-      void *old_page_tmp = _prim_map_virtual_page (old_frame | 3);
+      void *old_page_tmp = kmap_atomic (old_frame | 3);
       if (old_page_tmp == NULL)
         goto abort_tbl_va;
-      void *new_page_tmp = _prim_map_virtual_page (new_frame | 3);
+      void *new_page_tmp = kmap_atomic (new_frame | 3);
       if (new_page_tmp == NULL) {
-        _prim_unmap_virtual_page (old_page_tmp);
+        kunmap_atomic (old_page_tmp);
         goto abort_tbl_va;
       }
 
       /* copy contents of old frame to new frame */
       memcpy (new_page_tmp, old_page_tmp, PAGE_SIZE);
 
-      /* setup new page table entry */
-      new_tbl.table_va[i].flags.raw = tbl.table_va[i].flags.raw;
+      /* setup new page table entry, a private copy is writable again */
+      if (raw & PTE_COW)
+        raw |= 2;
+      new_tbl.table_va[i].flags.raw = raw & ~(PTE_PCACHE | PTE_COW);
       new_tbl.table_va[i].framenum = FRAME_TO_FRAMENUM (new_frame);
+      if (share)
+        cow_stats.copied++;
 
-      _prim_unmap_virtual_page (old_page_tmp);
-      _prim_unmap_virtual_page (new_page_tmp);
+      kunmap_atomic (new_page_tmp);
+      kunmap_atomic (old_page_tmp);
     }
   }
 
+  if (share)
+    klock_unlock_irq_restore (&cow_lock, flags);
+
   return new_tbl;
 
  abort_tbl_va:
+  if (share)
+    klock_unlock_irq_restore (&cow_lock, flags);
   _prim_unmap_virtual_page (new_tbl.table_va);
  abort_tbl_pa:
   free_phys_frame (new_tbl.table_pa);
@@ -581,8 +780,8 @@ clone_page_table (pgtbl_t tbl)
   return new_tbl;
 }
 
-/* Clone an entire address space making copies of data where
- * appropriate (e.g. userspace and kernel stack). */
+/* Clone an entire address space for fork.  User pages are shared
+ * copy-on-write, the kernel stack is copied. */
 
 /* precondition: dir has valid VA, PA 
  * postcondition: return has valid VA, PA
@@ -593,7 +792,9 @@ clone_page_directory (pgdir_t dir)
   frame_t new_pgd_pa;
   pgdir_t new_dir;
   uint i;
+  u64 start, end;
 
+  RDTSC (start);
   new_pgd_pa = alloc_phys_frame ();
 
   if (new_pgd_pa == -1)
@@ -612,6 +813,11 @@ clone_page_directory (pgdir_t dir)
       if (i >= PGDIR_KERNEL_BEGIN && i != PGDIR_KERNEL_STACK) {
         /* shared kernel-space */
         new_dir.dir_va[i].raw = dir.dir_va[i].raw;
+      } else if (PDE_USER_BIGPAGE (dir.dir_va[i].raw)) {
+        /* anonymous 4 MiB page */
+        new_dir.dir_va[i].raw = cow_clone_bigpage (&dir.dir_va[i].raw);
+        if (!new_dir.dir_va[i].raw)
+          goto abort_pgd_va;
       } else if (dir.dir_va[i].flags.page_size) {
         /* clone 4 MiB page */
         //panic ("userspace 4 MiB pages not supported");
@@ -625,14 +831,14 @@ clone_page_directory (pgdir_t dir)
         /* setup a pgtbl struct with physical and virtual addresses of
          * the existing page table */
         tbl.table_pa = FRAMENUM_TO_FRAME (dir.dir_va[i].table_framenum);
-        tbl.table_va = _prim_map_virtual_page (tbl.table_pa | 3);
+        tbl.table_va = kmap_atomic (tbl.table_pa | 3);
         if (tbl.table_va == NULL)
           goto abort_pgd_va;
         tbl.starting_va = (uint8 *) (i << 22);
 
-        new_tbl = clone_page_table (tbl);
+        new_tbl = clone_page_table (tbl, TRUE);
 
-        _prim_unmap_virtual_page (tbl.table_va);
+        kunmap_atomic (tbl.table_va);
 
         if (new_tbl.table_pa == -1)
           goto abort_pgd_va;
@@ -646,6 +852,13 @@ clone_page_directory (pgdir_t dir)
     }
   }
 
+  /* The parent's user pages are read-only now */
+  tlb_shootdown (dir.dir_pa, NULL, PGDIR_KERNEL_BEGIN * PGTBL_NUM_ENTRIES);
+
+  RDTSC (end);
+  cow_stats.forks++;
+  cow_stats.fork_cycles += end - start;
+
   return new_dir;
 
  abort_pgd_va:
@@ -659,6 +872,133 @@ clone_page_directory (pgdir_t dir)
 }
 
 
+/* Fill the 4 MiB page at frame with a copy of src, or with zeroes if
+ * src is -1, a frame at a time */
+static bool
+fill_bigpage (frame_t frame, frame_t src)
+{
+  u32 i;
+  u8 *s = NULL, *d;
+
+  for (i = 0; i < PGTBL_NUM_ENTRIES; i++) {
+    d = kmap_atomic ((frame + (i << PAGE_SIZE_BITS)) | 3);
+    if (!d)
+      return FALSE;
+    if (src != -1) {
+      s = kmap_atomic ((src + (i << PAGE_SIZE_BITS)) | 3);
+      if (!s) {
+        kunmap_atomic (d);
+        return FALSE;
+      }
+      memcpy (d, s, PAGE_SIZE);
+      kunmap_atomic (s);
+    } else
+      memset (d, 0, PAGE_SIZE);
+    kunmap_atomic (d);
+  }
+  return TRUE;
+}
+
+/* Copy the 4 MiB page at old to newly allocated frames.  Returns the
+ * new frame, or -1. */
+frame_t
+copy_bigpage (frame_t old)
+{
+  frame_t new = alloc_phys_frames_aligned_on (PGTBL_NUM_ENTRIES, BIGPAGE_SIZE);
+
+  if (new == -1)
+    return -1;
+  if (!fill_bigpage (new, old)) {
+    free_phys_frames (new, PGTBL_NUM_ENTRIES);
+    return -1;
+  }
+  return new;
+}
+
+/* Map count zeroed 4 MiB pages of anonymous memory into the current
+ * address space.  They go in the highest free run of user page
+ * directory entries, well away from the program and its stack, and
+ * each takes one TLB entry instead of 1024.  Returns the address, or
+ * NULL.  Must hold the scheduler lock. */
+void *
+bigpage_map (u32 count)
+{
+  u32 *pgdir, i, j, n = 0;
+  frame_t frame;
+  void *addr = NULL;
+
+  if (count == 0 || count >= PGDIR_KERNEL_BEGIN)
+    return NULL;
+  pgdir = map_virtual_page ((u32) get_pdbr () | 3);
+  if (!pgdir)
+    return NULL;
+
+  /* entry 0 is never used, so NULL can mean failure */
+  for (i = PGDIR_KERNEL_BEGIN - 1; i > 0 && n < count; i--)
+    n = pgdir[i] ? 0 : n + 1;
+  if (n < count)
+    goto out;
+  i++;                          /* lowest entry of the run */
+
+  for (j = 0; j < count; j++) {
+    frame = alloc_phys_frames_aligned_on (PGTBL_NUM_ENTRIES, BIGPAGE_SIZE);
+    if (frame == -1)
+      break;
+    if (!fill_bigpage (frame, -1)) {
+      free_phys_frames (frame, PGTBL_NUM_ENTRIES);
+      break;
+    }
+    pgdir[i + j] = frame | PDE_PS | 7;
+  }
+  if (j < count) {
+    /* never used, so nothing to flush */
+    while (j-- > 0) {
+      free_phys_frames (pgdir[i + j] & ~(BIGPAGE_SIZE - 1), PGTBL_NUM_ENTRIES);
+      pgdir[i + j] = 0;
+    }
+    goto out;
+  }
+  addr = (void *) (i << BIGPAGE_SIZE_BITS);
+  DLOG ("bigpage_map: %d pages at %p\n", count, addr);
+
+ out:
+  unmap_virtual_page (pgdir);
+  return addr;
+}
+
+/* Unmap count 4 MiB pages at addr, all of which must have come from
+ * bigpage_map.  Returns 0, or -1.  Must hold the scheduler lock. */
+int
+bigpage_unmap (void *addr, u32 count)
+{
+  u32 *pgdir, i, pde, cr3 = (u32) get_pdbr ();
+  u32 first = (u32) addr >> BIGPAGE_SIZE_BITS;
+  int ret = -1;
+
+  if (((u32) addr & (BIGPAGE_SIZE - 1)) || count == 0 ||
+      first + count > PGDIR_KERNEL_BEGIN)
+    return -1;
+  pgdir = map_virtual_page (cr3 | 3);
+  if (!pgdir)
+    return -1;
+
+  for (i = first; i < first + count; i++)
+    if (!PDE_USER_BIGPAGE (pgdir[i]))
+      goto out;
+
+  for (i = first; i < first + count; i++) {
+    pde = pgdir[i];
+    pgdir[i] = 0;
+    /* one invlpg drops a whole 4 MiB translation */
+    tlb_shootdown (cr3, (void *) (i << BIGPAGE_SIZE_BITS), 1);
+    cow_free_bigpage (pde);
+  }
+  ret = 0;
+
+ out:
+  unmap_virtual_page (pgdir);
+  return ret;
+}
 
 /* Searches the current process address space to find a free region to
    that can accommodate the request size, useful when you want to map
@@ -0,0 +1,159 @@
+/*                    The Quest Operating System
+ *  Copyright (C) 2005-2012  Richard West, Boston University
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "arch/i386.h"
+#include "kernel.h"
+#include "sched/sched.h"
+#include "sched/futex.h"
+#include "util/debug.h"
+#include "util/printf.h"
+
+//#define DEBUG_FUTEX
+
+#ifdef DEBUG_FUTEX
+#define DLOG(fmt,...) DLOG_PREFIX("futex",fmt,##__VA_ARGS__)
+#else
+#define DLOG(fmt,...) ;
+#endif
+
+/* Blocked tasks hang off a small hash table.  Each waiter lives on
+ * its own kernel stack for as long as it is blocked, so waiting needs
+ * no allocation.  A futex is identified by its user address together
+ * with the address space (page directory) it lives in, so threads of
+ * one process share futexes and separate processes do not.
+ *
+ * Everything here is protected by the scheduler lock. */
+
+#define FUTEX_HASH_BITS 6
+#define FUTEX_HASH_SIZE (1 << FUTEX_HASH_BITS)
+
+/* End of the user data segment */
+#define FUTEX_USER_LIMIT 0xC0000000
+
+struct futex_waiter
+{
+  u32 pdbr, uaddr;              /* key */
+  quest_tss *task;
+  bool woken;
+  struct futex_waiter *next;
+};
+
+static struct futex_waiter *futex_hash[FUTEX_HASH_SIZE];
+
+static inline struct futex_waiter **
+futex_bucket (u32 pdbr, u32 uaddr)
+{
+  u32 h = (uaddr >> 2) ^ (pdbr >> 12);
+  h ^= h >> FUTEX_HASH_BITS;
+  h ^= h >> (2 * FUTEX_HASH_BITS);
+  return &futex_hash[h & (FUTEX_HASH_SIZE - 1)];
+}
+
+static inline bool
+futex_addr_ok (u32 *uaddr)
+{
+  u32 a = (u32) uaddr;
+  return a != 0 && (a & 3) == 0 && a < FUTEX_USER_LIMIT;
+}
+
+/* Block the current task until a FUTEX_WAKE on uaddr, unless *uaddr
+ * no longer holds val.  Returns 0 when woken and -1 if the value had
+ * already changed or uaddr is bad. */
+int
+futex_wait (u32 *uaddr, u32 val)
+{
+  struct futex_waiter w, **b;
+
+  if (!futex_addr_ok (uaddr))
+    return -1;
+  if (*((volatile u32 *) uaddr) != val)
+    return -1;
+
+  w.pdbr = (u32) get_pdbr ();
+  w.uaddr = (u32) uaddr;
+  w.task = str ();
+  w.woken = FALSE;
+  b = futex_bucket (w.pdbr, w.uaddr);
+  w.next = *b;
+  *b = &w;
+
+  DLOG ("task 0x%x waits on 0x%p", w.task->tid, uaddr);
+
+  /* The task is on no runqueue now; giving up the CPU leaves the rest
+   * of its VCPU budget to others until futex_wake () runs. */
+  while (!w.woken)
+    schedule ();
+
+  return 0;
+}
+
+/* Wake up to n tasks blocked on uaddr.  Returns how many woke. */
+int
+futex_wake (u32 *uaddr, int n)
+{
+  u32 pdbr = (u32) get_pdbr ();
+  struct futex_waiter **pw, *w;
+  int woken = 0;
+
+  if (!futex_addr_ok (uaddr))
+    return -1;
+
+  pw = futex_bucket (pdbr, (u32) uaddr);
+  while ((w = *pw) && woken < n) {
+    if (w->pdbr == pdbr && w->uaddr == (u32) uaddr) {
+      *pw = w->next;
+      w->woken = TRUE;
+      wakeup (w->task);
+      woken++;
+    } else
+      pw = &w->next;
+  }
+
+  DLOG ("woke %d on 0x%p", woken, uaddr);
+  return woken;
+}
+
+/* Forget every waiter in the address space with page directory pdbr,
+ * which is going away.  Its threads are never run again. */
+void
+futex_exit_mm (u32 pdbr)
+{
+  struct futex_waiter **pw, *w;
+  int i;
+
+  for (i = 0; i < FUTEX_HASH_SIZE; i++) {
+    pw = &futex_hash[i];
+    while ((w = *pw)) {
+      if (w->pdbr == pdbr)
+        *pw = w->next;
+      else
+        pw = &w->next;
+    }
+  }
+}
+
+
+/*
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * mode: C
+ * c-file-style: "gnu"
+ * c-basic-offset: 2
+ * End:
+ */
+
+/* vi: set et sw=2 sts=2: */
@@ -40,6 +40,7 @@ fast_send_m (task_id dst_id, u32 arg1, u32 arg2)
   dst->M[0] = arg1;
   dst->M[1] = arg2;
   ltr (dst);
+  tlb_note_cr3 (dst->CR3);
   asm volatile ("call _sw_ipc"
                 :
                 :"S" (src), "D" (dst)
@@ -58,6 +59,7 @@ fast_call_m (task_id dst_id, u32 arg1, u32 arg2, u32 *r_arg1, u32 *r_arg2)
   dst->M[1] = arg2;
   semaphore_signal (&src->Msem, 1);
   ltr (dst);
+  tlb_note_cr3 (dst->CR3);
   asm volatile ("call _sw_ipc"
                 :"+S" (src), "+D" (dst)
                 :
@@ -93,6 +95,7 @@ fast_sendrecv_m (task_id dst_id, u32 arg1, u32 arg2, u32 *r_arg1, u32 *r_arg2)
   dst->M[1] = arg2;
   semaphore_signal (&src->Msem, 1);
   ltr (dst);
+  tlb_note_cr3 (dst->CR3);
   asm volatile ("call _sw_ipc"
                 :"+S" (src), "+D" (dst)
                 :
@@ -21,6 +21,7 @@
 #include "mem/malloc.h"
 #include "mem/virtual.h"
 #include "mem/physical.h"
+#include "mem/slab.h"
 #include "sched/proc.h"
 #include "sched/vcpu.h"
 #ifdef USE_VMX
@@ -36,6 +37,48 @@ quest_tss init_tss = {
   .tid = 0
 };
 
+/* Index of the task ring by tid, so lookup_TSS does not walk every
+ * task.  Chains are linked through hash_next and kept in step with
+ * the ring by tss_add_head/tss_add_tail/tss_remove.  Like the ring,
+ * it is protected by the scheduler lock. */
+#define TSS_HASH_BUCKETS 1024
+
+static quest_tss *tss_hash[TSS_HASH_BUCKETS];
+
+/* tids are (cpu << 16) | index, so fold the cpu into the low bits */
+static inline u32
+tss_hash_fn (task_id tid)
+{
+  return (tid ^ (tid >> 16)) & (TSS_HASH_BUCKETS - 1);
+}
+
+static void
+tss_hash_insert (quest_tss * t)
+{
+  quest_tss **b = &tss_hash[tss_hash_fn (t->tid)];
+
+  t->hash_next = *b;
+  *b = t;
+}
+
+static void
+tss_hash_remove (quest_tss * t)
+{
+  u32 h = tss_hash_fn (t->tid);
+  quest_tss *p;
+
+  if (tss_hash[h] == t)
+    tss_hash[h] = t->hash_next;
+  else
+    for (p = tss_hash[h]; p; p = p->hash_next)
+      if (p->hash_next == t) {
+        p->hash_next = t->hash_next;
+        break;
+      }
+  t->hash_next = NULL;
+}
+
+/* new_tss->tid must be set before it is added */
 void
 tss_add_head (quest_tss * new_tss)
 {
@@ -52,8 +95,10 @@ tss_add_head (quest_tss * new_tss)
     new_tss->prev_tss = &init_tss;
     old_head->prev_tss = new_tss;
   }
+  tss_hash_insert (new_tss);
 }
 
+/* new_tss->tid must be set before it is added */
 void
 tss_add_tail (quest_tss * new_tss)
 {
@@ -70,6 +115,7 @@ tss_add_tail (quest_tss * new_tss)
     new_tss->prev_tss = old_tail;
     old_tail->next_tss = new_tss;
   }
+  tss_hash_insert (new_tss);
 }
 
 void
@@ -77,22 +123,26 @@ tss_remove (quest_tss *t)
 {
   (t->prev_tss)->next_tss = t->next_tss;
   (t->next_tss)->prev_tss = t->prev_tss;
+  tss_hash_remove (t);
 
   return;
 }
 
+/* Packed several to a slab rather than one per page.  An object may
+ * straddle two pages, but slabs are physically contiguous, so a
+ * sandbox receiving a migrating task can still map it by physical
+ * address (see pull_quest_tss).  32-byte alignment keeps fpu_state
+ * suitably aligned for fxsave. */
+static kmem_cache quest_tss_cache =
+  KMEM_CACHE_INIT ("quest_tss", sizeof (quest_tss), 32, NULL);
+
 quest_tss *
 alloc_quest_tss ()
 {
-  // TODO
-  // Use kernel memory allocator later.
-  // For now, one page for a quest_tss.
   quest_tss *pTSS;
-  uint32 pa;
 
-  pa = alloc_phys_frame ();
-  if (pa == -1) return NULL;
-  pTSS = map_virtual_page (pa + 3);
+  pTSS = kmem_cache_alloc (&quest_tss_cache);
+  if (!pTSS) return NULL;
   memset (pTSS, 0, sizeof (quest_tss));
 
   return pTSS;
@@ -102,9 +152,7 @@ void
 free_quest_tss (quest_tss * tss)
 {
   memset (tss, 0, sizeof (quest_tss));
-  uint32 pa = (uint32) get_phys_addr (tss);
-  unmap_virtual_page (tss);
-  free_phys_frame (pa);
+  kmem_cache_free (&quest_tss_cache, tss);
 }
 
 task_id
@@ -124,7 +172,7 @@ lookup_TSS (task_id tid)
 {
   quest_tss * t;
 
-  for (t = &init_tss; ((t = t->next_tss) != &init_tss);) {
+  for (t = tss_hash[tss_hash_fn (tid)]; t; t = t->hash_next) {
     if (t->tid == tid) return t;
   }
 
@@ -157,8 +205,9 @@ alloc_thread_TSS (uint32_t child_directory,
   }
 
   /* Clear virtual page before use. */
-  memset (pTSS, 0, 4096);
+  memset (pTSS, 0, sizeof (quest_tss));
 
+  pTSS->tid = new_task_id ();
   tss_add_tail (pTSS);
 
   virt_pgd = map_virtual_page (child_directory | 0x3);
@@ -221,7 +270,6 @@ alloc_thread_TSS (uint32_t child_directory,
   pTSS->EFLAGS = child_eflags & 0xFFFFBFFF;   /* Disable NT flag */
   /* Inherit priority from main thread */
   pTSS->priority = mTSS->priority;
-  pTSS->tid = new_task_id ();
   /* Set parent tid to main thread tid */
   pTSS->ptid = mTSS->tid;
   /* Increase thread count. Child num_threads is not changed. */
@@ -262,12 +310,13 @@ duplicate_TSS (uint32 ebp,
   pTSS = alloc_quest_tss ();
 
   /* Clear virtual page before use. */
-  memset (pTSS, 0, 4096);
+  memset (pTSS, 0, sizeof (quest_tss));
 
   //logger_printf ("duplicate_TSS: pTSS=%p i=0x%x esp=%p ebp=%p\n",
   //               pTSS, i << 3,
   //               child_esp, child_ebp);
 
+  pTSS->tid = new_task_id ();
   tss_add_tail (pTSS);
   
   pTSS->CR3 = (u32) child_directory;
@@ -292,7 +341,6 @@ duplicate_TSS (uint32 ebp,
   pTSS->EFLAGS = child_eflags & 0xFFFFBFFF;   /* Disable NT flag */
   pTSS->ESP = child_esp;
   pTSS->EBP = child_ebp;
-  pTSS->tid = new_task_id ();
   pTSS->ptid = pTSS->tid;
   pTSS->num_threads = 1;
   pTSS->ulStack = USER_STACK_START;
@@ -319,6 +367,7 @@ alloc_idle_TSS (int cpu_num)
   void idle_task (void);
   char * name = "idle thread";
 
+  pTSS->tid = new_task_id ();
   tss_add_tail (pTSS);
 
   u32 *stk = map_virtual_page (alloc_phys_frame () | 3);
@@ -334,7 +383,6 @@ alloc_idle_TSS (int cpu_num)
 
   pTSS->ESP = (u32) &stk[1023];
   pTSS->EBP = pTSS->ESP;
-  pTSS->tid = new_task_id ();
   pTSS->ptid = pTSS->tid;
   pTSS->num_threads = 1;
   pTSS->ulStack = USER_STACK_START;
@@ -353,6 +401,7 @@ alloc_TSS (void *pPageDirectory, void *pEntry, int mod_num)
 {
   quest_tss *pTSS = (quest_tss *) ul_tss[mod_num];
 
+  pTSS->tid = new_task_id ();
   tss_add_tail (pTSS);
 
   pTSS->CR3 = (u32) pPageDirectory;
@@ -366,7 +415,6 @@ alloc_TSS (void *pPageDirectory, void *pEntry, int mod_num)
 
   pTSS->ESP = USER_STACK_START - 100;
   pTSS->EBP = USER_STACK_START - 100;
-  pTSS->tid = new_task_id ();
   pTSS->ptid = pTSS->tid;
   pTSS->num_threads = 1;
   pTSS->ulStack = USER_STACK_START;
@@ -383,34 +431,27 @@ alloc_TSS (void *pPageDirectory, void *pEntry, int mod_num)
 /* -- EM -- This should probably be put someplace else but for now
       this is good enough */
 
-fd_table_file_entry_t* alloc_fd_table_file_entry(char* pathname, size_t file_length)
+static kmem_cache fd_file_cache =
+  KMEM_CACHE_INIT ("fd_file", sizeof (fd_table_file_entry_t), 0, NULL);
+
+fd_table_file_entry_t* alloc_fd_table_file_entry(char* pathname)
 {
   fd_table_file_entry_t* res;
-  res = kmalloc(sizeof(fd_table_file_entry_t));
+  res = kmem_cache_alloc(&fd_file_cache);
 
   if(!res) {
     return NULL;
   }
 
-  res->file_length = file_length;
+  memset(res, 0, sizeof(fd_table_file_entry_t));
+  res->current_pos = 0;
+  res->file_length = 0;
   res->pathname = kmalloc(strlen(pathname) + 1);
 
   if(!res->pathname) {
-    kfree(res);
-    return NULL;
-  }
-
-#ifdef ONE_FILE_READ
-  res->file_buffer = kmalloc(file_length);
-  if(!res->file_buffer) {
-    kfree(res->pathname);
-    kfree(res);
+    kmem_cache_free(&fd_file_cache, res);
     return NULL;
   }
-#else
-  res->file_buffer = NULL;
-#endif
-  
 
   strcpy(res->pathname, pathname);
   return res;
@@ -418,9 +459,8 @@ fd_table_file_entry_t* alloc_fd_table_file_entry(char* pathname, size_t file_len
 
 void free_fd_table_file_entry(fd_table_file_entry_t* entry)
 {
-  if(entry->file_buffer) kfree(entry->file_buffer);
   kfree(entry->pathname);
-  kfree(entry);
+  kmem_cache_free(&fd_file_cache, entry);
 }
 
 /*
@@ -33,10 +33,127 @@
 #define DLOG(fmt,...) ;
 #endif
 
+/* The sleep queue is a pairing heap ordered by wake-up time
+ * (tss->time), so the earliest sleeper is always at the root.
+ * Inserting is O(1) and removing a sleeper is O(log n) amortized.
+ * Each task keeps its own links, so wakeup () detaches a task without
+ * searching for it:
+ *
+ *   sleep_child  first child
+ *   sleep_next   next sibling
+ *   sleep_prev   previous sibling, or the parent of a first child
+ *
+ * Only the root has no sleep_prev. */
 static quest_tss * sleepqueue = NULL;
 
 extern uint64 tsc_freq;         /* timestamp counter frequency */
 
+static inline bool
+sleeping (quest_tss *t)
+{
+  return t == sleepqueue || t->sleep_prev != NULL;
+}
+
+/* Join two heaps, neither of whose roots has siblings */
+static quest_tss *
+meld (quest_tss *a, quest_tss *b)
+{
+  quest_tss *t;
+
+  if (a == NULL)
+    return b;
+  if (b == NULL)
+    return a;
+  if (b->time < a->time) {
+    t = a; a = b; b = t;
+  }
+  /* b becomes the first child of a */
+  b->sleep_prev = a;
+  b->sleep_next = a->sleep_child;
+  if (a->sleep_child)
+    a->sleep_child->sleep_prev = b;
+  a->sleep_child = b;
+  return a;
+}
+
+/* Join a list of siblings into one heap: meld them in pairs from the
+ * left, then meld the pairs together from the right. */
+static quest_tss *
+merge_pairs (quest_tss *first)
+{
+  quest_tss *pairs = NULL, *a, *b, *h;
+
+  while (first) {
+    a = first;
+    b = a->sleep_next;
+    first = b ? b->sleep_next : NULL;
+    a->sleep_next = a->sleep_prev = NULL;
+    if (b)
+      b->sleep_next = b->sleep_prev = NULL;
+    h = meld (a, b);
+    /* stack the pair, which reverses the list */
+    h->sleep_next = pairs;
+    pairs = h;
+  }
+
+  h = NULL;
+  while (pairs) {
+    a = pairs;
+    pairs = a->sleep_next;
+    a->sleep_next = NULL;
+    h = meld (h, a);
+  }
+  return h;
+}
+
+static void
+sleepqueue_insert (quest_tss *t)
+{
+  t->sleep_child = t->sleep_next = t->sleep_prev = NULL;
+  sleepqueue = meld (sleepqueue, t);
+}
+
+static void
+sleepqueue_remove (quest_tss *t)
+{
+  quest_tss *sub;
+
+  if (t != sleepqueue) {
+    /* cut t's subtree out of its parent's list of children */
+    if (t->sleep_prev->sleep_child == t)
+      t->sleep_prev->sleep_child = t->sleep_next;
+    else
+      t->sleep_prev->sleep_next = t->sleep_next;
+    if (t->sleep_next)
+      t->sleep_next->sleep_prev = t->sleep_prev;
+  }
+
+  sub = merge_pairs (t->sleep_child);
+  if (t == sleepqueue)
+    sleepqueue = sub;
+  else
+    sleepqueue = meld (sleepqueue, sub);
+
+  t->sleep_child = t->sleep_next = t->sleep_prev = NULL;
+}
+
+/* Program the one-shot LAPIC timer for the earliest sleeper, if it is
+ * due before the next scheduling tick.  LAPIC_start_timer_tick_only
+ * leaves an earlier deadline alone. */
+static inline void
+sleepqueue_arm_timer (void)
+{
+#ifdef NANOSLEEP
+  extern u32 tsc_freq_msec;
+  uint64 now;
+
+  RDTSC (now);
+  if (sleepqueue && sleepqueue->time > now &&
+      sleepqueue->time - now < tsc_freq_msec)
+    LAPIC_start_timer_tick_only (sleepqueue->time - now, sleepqueue->time);
+#endif
+}
+
 static inline uint64
 compute_finish (uint32 usec)
 {
@@ -63,8 +180,12 @@ sched_usleep (uint32 usec)
     tssp = str ();
     DLOG ("task 0x%x sleeping for %d usec (0x%llX -> 0x%llX)",
           tssp->tid, usec, now, finish);
+    if (sleeping (tssp))
+      sleepqueue_remove (tssp);
     tssp->time = finish;
-    queue_append (&sleepqueue, tssp);
+    sleepqueue_insert (tssp);
+    if (sleepqueue == tssp)
+      sleepqueue_arm_timer ();
 
     schedule ();
   } else
@@ -84,27 +205,20 @@ sched_nanosleep (struct timespec * t)
     ticks = div64_64 (tsc_freq * nanosec, 1000000000LL);
     /* a magic number to indicate nanosleep */
     tssp->hr_sleep = 73;
-    queue_append (&sleepqueue, tssp);
+    if (sleeping (tssp))
+      sleepqueue_remove (tssp);
 
     /* delay as much as possible to read the current time stamp */
     RDTSC (now);
     finish = now + ticks;
     tssp->time = finish;
+    sleepqueue_insert (tssp);
 
-    /* --TC--
-     * The longest time to the next timer interrupt is 1 millisecond.
-     * If I need to sleep longer than that, don't bother with the timer.
-     * Otherwise before I go to sleep, program the timer to wake me up.
-     * Note that it's possible the timer is already set to fire
-     * before my wakeup time. In this case I shouldn't program the timer
-     * to delay its fire (But I don't really need to worry about this because 
-     * LAPIC_start_timer() will do the checking for me). When the timer
-     * fires, sleep queue will be traversed in the timer interrupt handler.
-     * Then, I need to update my time left to wake up and make the decision
-     * again to program the timer or not.
-     */
+    /* The scheduling tick comes at least once a millisecond, so only
+     * a shorter sleep needs the one-shot timer.  When the timer fires
+     * the sleep queue is processed and the next deadline armed. */
     if (nanosec < 1000000LL)
-      LAPIC_start_timer_tick_only(ticks, finish);
+      LAPIC_start_timer_tick_only (ticks, finish);
 
     schedule ();
   } 
@@ -126,54 +240,26 @@ tsc_delay_usec (uint32 usec)
   }
 }
 
-/* Must hold lock */
+/* Wake every sleeper whose time has come, earliest first.  Must
+ * hold lock. */
 extern void
 process_sleepqueue (void)
 {
   uint64 now;
-  quest_tss **q, *next;
   quest_tss *tssp;
 
   RDTSC (now);
-
-  if (sleepqueue == NULL)
-    return;
-
-  q = &sleepqueue;
-  tssp = sleepqueue;
   DLOG ("process_sleepqueue 0x%llX", now);
-  for (;;) {
-    /* examine finish time of task */
-    next = tssp->next;
-
-    if (tssp->time <= now) {
-      DLOG ("waking task 0x%x (0x%llX <= 0x%llX)", *q, tssp->time, now);
-      /* time to wake-up */
-      wakeup (*q);
-      /* remove from sleepqueue */
-      *q = next;
-      tssp->time = 0;
-      tssp->hr_sleep = 0;
-    } else {
-#ifdef NANOSLEEP
-      if (tssp->hr_sleep == 73) {
-        /* nanosleep */
-        uint64 tick_left = tssp->time - now;
-        extern u32 tsc_freq_msec;
-        /* less than 1 millisecond */
-        if (tick_left < tsc_freq_msec) {
-          LAPIC_start_timer_tick_only(tick_left, tssp->time);
-        }
-      }
-#endif
-      q = &tssp->next;
-    }
 
-    /* move to next sleeper */
-    if (next == NULL)
-      break;
-    tssp = *q;
+  while ((tssp = sleepqueue) != NULL && tssp->time <= now) {
+    DLOG ("waking task 0x%x (0x%llX <= 0x%llX)", tssp->tid, tssp->time, now);
+    sleepqueue_remove (tssp);
+    wakeup (tssp);
+    tssp->time = 0;
+    tssp->hr_sleep = 0;
   }
+
+  sleepqueue_arm_timer ();
 }
 
 /* Detach a task from sleep queue. This is used in migration. */
@@ -181,36 +267,19 @@ process_sleepqueue (void)
 extern bool
 sleepqueue_detach (quest_tss *task)
 {
-  quest_tss **q = NULL;
-  quest_tss *tssp = NULL, *next = NULL;
-  task_id tid = task->tid;
-
-  if (sleepqueue == NULL)
+  if (!sleeping (task))
     return FALSE;
-
-  q = &sleepqueue;
-  tssp = sleepqueue;
-
-  for (;;) {
-    next = tssp->next;
-    if ((*q)->tid == tid) {
-      *q = next;
-      return TRUE;
-    }
-    
-    if (next == NULL)
-      return FALSE;
-    q = &tssp->next;
-    tssp = *q;
-  }
-
-  return FALSE;
+  sleepqueue_remove (task);
+  return TRUE;
 }
 
+/* Must hold lock */
 extern void
 sleepqueue_append (quest_tss *tid)
 {
-  queue_append (&sleepqueue, tid);
+  if (sleeping (tid))
+    sleepqueue_remove (tid);
+  sleepqueue_insert (tid);
 }
 /*
  * Local Variables:
@@ -77,8 +77,6 @@ static struct sched_param init_params[] = {
 
 #define NUM_INIT_VCPUS (sizeof (init_params) / sizeof (struct sched_param))
 
-#define MAX_NUM_VCPUS 100
-
 static vcpu *vcpu_list[MAX_NUM_VCPUS];
 static vcpu_id_t max_vcpu_id = 0;
 static int num_vcpus = 0;
@@ -138,22 +136,11 @@ vcpu_in_runqueue (vcpu *vcpu, quest_tss *task)
   return task == NULL;
 }
 
-void vcpu_queue_remove(vcpu** queue, vcpu* vcpu)
-{
-  while (*queue) {
-    if (*queue == vcpu) {
-      *queue = vcpu->next;
-      return;
-    }
-    queue = &((*queue)->next);
-  }
-}
-
 void vcpu_destroy(vcpu_id_t vcpu_index)
 {
   vcpu* v = vcpu_lookup(vcpu_index);
   if(v) {
-    vcpu_queue_remove(percpu_pointer (v->cpu, vcpu_queue), v);
+    vcpu_runq_remove(percpu_pointer (v->cpu, vcpu_queue), v);
     vcpu_list[vcpu_index] = NULL;
   }
 }
@@ -221,20 +208,6 @@ vcpu_is_idle (vcpu *vcpu)
   return vcpu->tr == 0;
 }
 
-void
-vcpu_queue_append (vcpu **queue, vcpu *vcpu)
-{
-  while (*queue) {
-    if (*queue == vcpu)
-      /* already on queue */
-      return;
-    queue = &((*queue)->next);
-  }
-  vcpu->next = NULL;
-  *queue = vcpu;
-}
-
-
 static vcpu_id_t next_vcpu_index(void)
 {
   vcpu_id_t i;
@@ -244,23 +217,147 @@ static vcpu_id_t next_vcpu_index(void)
   return -1;
 }
 
+/* ************************************************** */
 
-vcpu *
-vcpu_queue_remove_head (vcpu **queue)
+/* PCPU runqueue.  v->runq_idx is the slot of v in the heap plus one,
+ * or 0 when v is not queued, so membership tests and removal need no
+ * search. */
+
+DEF_PER_CPU (vcpu_runq, vcpu_queue);
+INIT_PER_CPU (vcpu_queue) {
+  percpu_write (vcpu_queue.size, 0);
+}
+
+static inline bool
+runq_before (vcpu *a, vcpu *b)
 {
-  vcpu *vcpu = NULL;
-  if (*queue) {
-    vcpu = *queue;
-    *queue = (*queue)->next;
+  return a->T < b->T || (a->T == b->T && a->index < b->index);
+}
+
+static inline void
+runq_set (vcpu_runq *q, u32 i, vcpu *v)
+{
+  q->heap[i] = v;
+  v->runq_idx = i + 1;
+}
+
+static void
+runq_sift_up (vcpu_runq *q, u32 i)
+{
+  vcpu *v = q->heap[i];
+  while (i > 0) {
+    u32 p = (i - 1) >> 1;
+    if (!runq_before (v, q->heap[p]))
+      break;
+    runq_set (q, i, q->heap[p]);
+    i = p;
   }
-  return vcpu;
+  runq_set (q, i, v);
 }
 
-/* ************************************************** */
+static void
+runq_sift_down (vcpu_runq *q, u32 i)
+{
+  vcpu *v = q->heap[i];
+  for (;;) {
+    u32 c = (i << 1) + 1;
+    if (c >= q->size)
+      break;
+    if (c + 1 < q->size && runq_before (q->heap[c + 1], q->heap[c]))
+      c++;
+    if (!runq_before (q->heap[c], v))
+      break;
+    runq_set (q, i, q->heap[c]);
+    i = c;
+  }
+  runq_set (q, i, v);
+}
 
-DEF_PER_CPU (vcpu *, vcpu_queue);
-INIT_PER_CPU (vcpu_queue) {
-  percpu_write (vcpu_queue, NULL);
+void
+vcpu_runq_insert (vcpu_runq *q, vcpu *v)
+{
+  if (v->runq_idx)
+    /* already on queue */
+    return;
+  if (q->size >= MAX_NUM_VCPUS)
+    panic ("vcpu_runq_insert: runqueue full");
+  q->heap[q->size++] = v;
+  runq_sift_up (q, q->size - 1);
+}
+
+void
+vcpu_runq_remove (vcpu_runq *q, vcpu *v)
+{
+  u32 i = v->runq_idx;
+  vcpu *last;
+
+  if (i == 0)
+    return;
+  v->runq_idx = 0;
+  last = q->heap[--q->size];
+  if (last == v)
+    return;
+  /* move the last VCPU into the hole, then restore heap order */
+  q->heap[i - 1] = last;
+  runq_sift_up (q, i - 1);
+  runq_sift_down (q, last->runq_idx - 1);
+}
+
+/* Restore heap order after v->T has changed */
+void
+vcpu_runq_update (vcpu_runq *q, vcpu *v)
+{
+  if (v->runq_idx == 0)
+    return;
+  runq_sift_up (q, v->runq_idx - 1);
+  runq_sift_down (q, v->runq_idx - 1);
+}
+
+/* Highest priority VCPU with budget in the subtree at slot i, or
+ * best if there is none before it.  Replenishments are brought up to
+ * date only for VCPUs visited, and a subtree is skipped as soon as
+ * its root does not come before best, so the search touches the
+ * depleted VCPUs of higher priority than the result and their
+ * children rather than the whole queue. */
+static vcpu *
+runq_pick (vcpu_runq *q, u32 i, u64 tcur, vcpu *best)
+{
+  vcpu *v;
+
+  if (i >= q->size)
+    return best;
+  v = q->heap[i];
+  if (best && !runq_before (v, best))
+    return best;
+  if (v->hooks->update_replenishments)
+    v->hooks->update_replenishments (v, tcur);
+  if (v->b > 0)
+    /* everything below v has lower priority */
+    return v;
+  best = runq_pick (q, (i << 1) + 1, tcur, best);
+  return runq_pick (q, (i << 1) + 2, tcur, best);
+}
+
+/* Shorten tdelta to the earliest next event, relative to tcur, of
+ * the VCPUs in the subtree at slot i with period at most Tmax (0
+ * for no bound). */
+static u64
+runq_next_event (vcpu_runq *q, u32 i, u64 Tmax, u64 tcur, u64 tdelta)
+{
+  vcpu *v;
+  u64 event = 0;
+
+  if (i >= q->size)
+    return tdelta;
+  v = q->heap[i];
+  if (Tmax != 0 && v->T > Tmax)
+    return tdelta;
+  if (v->hooks->next_event)
+    event = v->hooks->next_event (v);
+  if (event != 0 && (tdelta == 0 || event - tcur < tdelta))
+    tdelta = event - tcur;
+  tdelta = runq_next_event (q, (i << 1) + 1, Tmax, tcur, tdelta);
+  return runq_next_event (q, (i << 1) + 2, Tmax, tcur, tdelta);
 }
 
 DEF_PER_CPU (vcpu *, vcpu_current);
@@ -320,85 +417,6 @@ vcpu_acnt_begin_timeslice (vcpu *vcpu)
 #endif
 }
 
-extern void
-vcpu_rr_schedule (void)
-{
-  quest_tss *next = NULL;
-  vcpu
-    *queue = percpu_read (vcpu_queue),
-    *cur   = percpu_read (vcpu_current),
-    *vcpu  = NULL;
-
-  if (cur)
-    /* handle end-of-timeslice accounting */
-    vcpu_acnt_end_timeslice (cur);
-  if (queue) {
-    /* get next vcpu from queue */
-    vcpu = vcpu_queue_remove_head (&queue);
-    /* perform 2nd-level scheduling */
-    vcpu_internal_schedule (vcpu);
-    next = vcpu->tr;
-    /* if vcpu still has a runqueue, put it back on 1st-level queue */
-    if (vcpu->runqueue)
-      vcpu_queue_append (&queue, vcpu);
-    percpu_write (vcpu_queue, queue);
-    percpu_write (vcpu_current, vcpu);
-    DLOG ("vcpu_schedule: pcpu=%d vcpu=%p vcpu->tr=0x%x ->runqueue=0x%x next=0x%x",
-          get_pcpu_id (), vcpu, vcpu->tr, vcpu->runqueue, next);
-  }
-  if (vcpu)
-    /* handle beginning-of-timeslice accounting */
-    vcpu_acnt_begin_timeslice (vcpu);
-  if (next == NULL) {
-    /* no task selected, go idle */
-    next = percpu_read (vcpu_idle_task);
-    percpu_write (vcpu_current, NULL);
-  }
-  if (next == NULL) {
-    /* workaround: vcpu_idle_task was not initialized yet */
-    next = idleTSS_selector[get_pcpu_id ()];
-    percpu_write (vcpu_idle_task, next);
-  }
-
-  /* switch to new task or continue running same task */
-  if (str () == next)
-    return;
-  else
-    switch_to (next);
-}
-
-#if 0
-extern void
-vcpu_rr_wakeup (task_id task)
-{
-  DLOG ("vcpu_wakeup (0x%x), cpu=%d", task, get_pcpu_id ());
-  quest_tss *tssp = lookup_TSS (task);
-  static int next_vcpu_binding = 1;
-
-  if (tssp->cpu == 0xFF) {
-    do {
-      tssp->cpu = next_vcpu_binding;
-      next_vcpu_binding++;
-      if (next_vcpu_binding >= NUM_VCPUS)
-        next_vcpu_binding = 0;
-    } while  (vcpu_lookup (tssp->cpu)->type != MAIN_VCPU);
-    logger_printf ("vcpu: task 0x%x now bound to vcpu=%d\n", task, tssp->cpu);
-  }
-
-  vcpu *vcpu = vcpu_lookup (tssp->cpu);
-
-  /* put task on vcpu runqueue (2nd level) */
-  vcpu_runqueue_append (vcpu, task);
-
-  /* put vcpu on pcpu queue (1st level) */
-  vcpu_queue_append (percpu_pointer (vcpu->cpu, vcpu_queue), vcpu);
-
-  if (!vcpu->runnable && !vcpu->running && vcpu->hooks->unblock)
-    vcpu->hooks->unblock (vcpu);
-  vcpu->runnable = TRUE;
-}
-#endif
-
 /* ************************************************** */
 
 DEF_PER_CPU (u64, pcpu_tprev);
@@ -421,6 +439,48 @@ DEF_PER_CPU (u32, pcpu_sched_time);
 INIT_PER_CPU (pcpu_sched_time) {
   percpu_write (pcpu_sched_time, 0);
 }
+/* cumulative, unlike the windowed counters above */
+DEF_PER_CPU (struct sched_stat, pcpu_sched_stat);
+INIT_PER_CPU (pcpu_sched_stat) {
+  percpu_write64 (pcpu_sched_stat.calls, 0LL);
+  percpu_write64 (pcpu_sched_stat.cycles, 0LL);
+  percpu_write64 (pcpu_sched_stat.overruns, 0LL);
+  percpu_write64 (pcpu_sched_stat.overhead, 0LL);
+  percpu_write (pcpu_sched_stat.runnable, 0);
+  percpu_write (pcpu_sched_stat.runnable_max, 0);
+}
+
+static inline struct sched_stat *
+local_sched_stat (void)
+{
+  return percpu_pointer (get_pcpu_id (), pcpu_sched_stat);
+}
+
+/* Count a timeslice that overran the budget of cur */
+static inline void
+sched_stat_overrun (vcpu *cur)
+{
+  struct sched_stat *st = local_sched_stat ();
+  st->overruns++;
+  st->overhead += cur->sched_overhead;
+}
+
+/* Copy up to max per-PCPU scheduler counters into stats, returning
+ * the number copied.  Counters of other PCPUs are read without
+ * locking, so they may be slightly stale. */
+int
+vcpu_get_stats (struct sched_stat *stats, int max)
+{
+  int cpu;
+
+  for (cpu = 0; cpu < mp_num_cpus && cpu < max; cpu++) {
+    struct sched_stat *st = percpu_pointer (cpu, pcpu_sched_stat);
+    vcpu_runq *q = percpu_pointer (cpu, vcpu_queue);
+    memcpy (&stats[cpu], st, sizeof (struct sched_stat));
+    stats[cpu].runnable = q->size;
+  }
+  return cpu;
+}
 
 static void
 idle_time_acnt_begin ()
@@ -487,15 +547,12 @@ vcpu_dump_stats (void)
                  uhci_bps, atapi_bps);
 #define DUMP_CACHE_STATS
 #ifdef DUMP_CACHE_STATS
-  vcpu *queue = percpu_read (vcpu_queue);
-  vcpu **ptr = NULL;
-
-  if (queue) {
-    for (ptr = &queue; *ptr != NULL; ptr = &(*ptr)->next) {
-      logger_printf ("vcpu=%X pcpu=%d cache occupancy=%llX mpki=%llX\n type=%d",
-                     (uint32) *ptr, (*ptr)->cpu, (*ptr)->cache_occupancy,
-                     (*ptr)->mpki, (*ptr)->type);
-    }
+  vcpu_runq *queue = percpu_pointer (get_pcpu_id (), vcpu_queue);
+
+  for (i = 0; i < queue->size; i++) {
+    vcpu *v = queue->heap[i];
+    logger_printf ("vcpu=%X pcpu=%d cache occupancy=%llX mpki=%llX\n type=%d",
+                   (uint32) v, v->cpu, v->cache_occupancy, v->mpki, v->type);
   }
 #endif
 #ifdef DUMP_STATS_VERBOSE
@@ -590,15 +647,32 @@ vcpu_dump_stats (void)
 
 /* ************************************************** */
 
+static void
+repl_sift_down (repl_queue *Q, u32 i)
+{
+  replenishment r = Q->array[i];
+  for (;;) {
+    u32 c = (i << 1) + 1;
+    if (c >= Q->size)
+      break;
+    if (c + 1 < Q->size && Q->array[c + 1].t < Q->array[c].t)
+      c++;
+    if (Q->array[c].t >= r.t)
+      break;
+    Q->array[i] = Q->array[c];
+    i = c;
+  }
+  Q->array[i] = r;
+}
+
 void
 repl_queue_pop (repl_queue *Q)
 {
-  if (Q->head) {
-    replenishment *r = Q->head->next;
-    Q->head->t = Q->head->b = 0;
-    Q->head->next = NULL;
-    Q->head = r;
+  if (Q->size > 0) {
     Q->size--;
+    Q->array[0] = Q->array[Q->size];
+    Q->array[Q->size].t = Q->array[Q->size].b = 0;
+    repl_sift_down (Q, 0);
   }
 }
 
@@ -606,62 +680,88 @@ void
 repl_queue_add (repl_queue *Q, u64 b, u64 t)
 {
   if (Q->size < MAX_REPL) {
-    replenishment *r = NULL, **rq;
-    int i;
-    for (i=0; i<MAX_REPL; i++) {
-      if (Q->array[i].t == 0) {
-        r = &Q->array[i];
-        break;
-      }
+    u32 i = Q->size++;
+    while (i > 0 && Q->array[(i - 1) >> 1].t > t) {
+      Q->array[i] = Q->array[(i - 1) >> 1];
+      i = (i - 1) >> 1;
     }
-    if (!r) panic ("Q->size < MAX_REPL but no free entry");
-    rq = &Q->head;
-    /* find insertion point */
-    while (*rq && (*rq)->t < t)
-      rq = &(*rq)->next;
-    /* insert */
-    r->next = *rq;
-    *rq = r;
-    r->t = t;
-    r->b = b;
-    Q->size++;
+    Q->array[i].t = t;
+    Q->array[i].b = b;
   }
 }
 
+/* Restore heap order after the time of the head has changed */
+void
+repl_queue_head_changed (repl_queue *Q)
+{
+  if (Q->size > 1)
+    repl_sift_down (Q, 0);
+}
+
+/* The replenishment that becomes the head when the head is popped */
+replenishment *
+repl_queue_second (repl_queue *Q)
+{
+  if (Q->size < 2)
+    return NULL;
+  if (Q->size > 2 && Q->array[2].t < Q->array[1].t)
+    return &Q->array[2];
+  return &Q->array[1];
+}
+
+static u64
+repl_next_after (repl_queue *Q, u32 i, u64 now, u64 best)
+{
+  if (i >= Q->size || (best != 0 && Q->array[i].t >= best))
+    return best;
+  if (now < Q->array[i].t)
+    /* nothing below i is earlier */
+    return Q->array[i].t;
+  best = repl_next_after (Q, (i << 1) + 1, now, best);
+  return repl_next_after (Q, (i << 1) + 2, now, best);
+}
+
+/* Earliest replenishment time after now, or 0 if there is none */
+u64
+repl_queue_next_after (repl_queue *Q, u64 now)
+{
+  return repl_next_after (Q, 0, now, 0);
+}
+
 /* ************************************************** */
 
 #ifdef CHECK_INVARIANTS
 static void
 check_run_invariants (void)
 {
+  vcpu_runq *queue = percpu_pointer (get_pcpu_id (), vcpu_queue);
   vcpu
-    *queue = percpu_read (vcpu_queue),
     *cur   = percpu_read (vcpu_current),
-    *v, *q;
-  int i;
+    *v;
+  int i, j;
   if (cur && !cur->running) panic ("current is not running");
-  for (i=0; i<NUM_VCPUS; i++) {
-    v = &vcpus[i];
+  for (i=0; i<queue->size; i++) {
+    if (queue->heap[i]->runq_idx != i + 1)
+      panic ("vcpu runqueue index out of whack");
+    if (i > 0 && runq_before (queue->heap[i], queue->heap[(i - 1) >> 1]))
+      panic ("vcpu runqueue out of order");
+  }
+  for (i=0; i<max_vcpu_id; i++) {
+    v = vcpu_list[i];
+    if (!v || v->cpu != get_pcpu_id ())
+      continue;
     if (v->running && v != cur)
       panic ("vcpu running is not current");
-    if (v->runnable) {
-      for (q = queue; q; q = q->next) {
-        if (q == v) goto ok;
-      }
+    if (v->runnable && !v->runq_idx)
       panic ("vcpu runnable is not on queue");
-    ok:;
-    } else {
-      for (q = queue; q; q = q->next) {
-        if (q == v) panic ("vcpu not runnable is on queue");
-      }
-    }
+    if (!v->runnable && v->runq_idx)
+      panic ("vcpu not runnable is on queue");
     if (v->type == MAIN_VCPU) {
       if (v->main.Q.size >= MAX_REPL-1)
         logger_printf ("vcpu %d has %d repls\n", i, v->main.Q.size);
       u64 sum = 0;
-      replenishment *r;
-      for (r = v->main.Q.head; r != NULL; r = r->next)
-        sum += r->b;
+      for (j = 0; j < v->main.Q.size; j++)
+        sum += v->main.Q.array[j].b;
       if (sum != v->C) {
         com1_printf ("v->C=0x%llX sum=0x%llX\n", v->C, sum);
         panic ("vcpu replenishments out of whack");
@@ -682,12 +782,11 @@ vcpu_schedule (void)
   vcpu * mvcpu = NULL;
 #endif
 
+  vcpu_runq *queue = percpu_pointer (get_pcpu_id (), vcpu_queue);
+  struct sched_stat *st = local_sched_stat ();
   vcpu
-    *queue = percpu_read (vcpu_queue),
     *cur   = percpu_read (vcpu_current),
-    *vcpu  = NULL,
-    **ptr,
-    **vnext = NULL;
+    *vcpu  = NULL;
   u64 tprev = percpu_read64 (pcpu_tprev);
   u64 tcur, tdelta, Tnext = 0;
   //u64 Tprev = 0;
@@ -714,28 +813,21 @@ vcpu_schedule (void)
       cur->hooks->end_timeslice (cur, tdelta);
   } else idle_time_acnt_end ();
 
-  if (queue) {
+  if (queue->size > st->runnable_max)
+    st->runnable_max = queue->size;
+
+  if (queue->size > 0) {
     /* pick highest priority vcpu with available budget */
-    for (ptr = &queue; *ptr != NULL; ptr = &(*ptr)->next) {
-      if (Tnext == 0 || (*ptr)->T < Tnext) {
-        /* update replenishments to refresh budget */
-        if ((*ptr)->hooks->update_replenishments)
-          (*ptr)->hooks->update_replenishments (*ptr, tcur);
-        if ((*ptr)->b > 0) {
-          Tnext = (*ptr)->T;
-          vnext = ptr;
-        }
-      }
-    }
+    vcpu = runq_pick (queue, 0, tcur, NULL);
 
-    if (vnext) {
-      vcpu = *vnext;
+    if (vcpu) {
+      Tnext = vcpu->T;
       /* internally schedule */
       vcpu_internal_schedule (vcpu);
       /* keep vcpu on queue if it has other runnable tasks */
       if (vcpu->runqueue == 0) {
         /* otherwise, remove it */
-        *vnext = (*vnext)->next;
+        vcpu_runq_remove (queue, vcpu);
         vcpu->runnable = FALSE;
       }
       next = vcpu->tr;
@@ -747,7 +839,6 @@ vcpu_schedule (void)
 #endif
 
       percpu_write (vcpu_current, vcpu);
-      percpu_write (vcpu_queue, queue);
       DLOGV ("scheduling vcpu=%p with budget=0x%llX", vcpu, vcpu->b);
     } else {
 #if 0
@@ -764,15 +855,7 @@ vcpu_schedule (void)
       tdelta = vcpu->b;
     else
       tdelta = 0;
-    for (ptr = &queue; *ptr != NULL; ptr = &(*ptr)->next) {
-      if (Tnext == 0 || (*ptr)->T <= Tnext) {
-        u64 event = 0;
-        if ((*ptr)->hooks->next_event)
-          event = (*ptr)->hooks->next_event (*ptr);
-        if (event != 0 && (tdelta == 0 || event - tcur < tdelta))
-          tdelta = event - tcur;
-      }
-    }
+    tdelta = runq_next_event (queue, 0, Tnext, tcur, tdelta);
 
     /* set timer */
     if (tdelta > 0) {
@@ -958,6 +1041,8 @@ vmx_migration_end:
   u64 now; RDTSC (now);
   u32 sched_time = percpu_read (pcpu_sched_time);
   percpu_write (pcpu_sched_time, sched_time + (u32) (now - tcur));
+  st->calls++;
+  st->cycles += now - tcur;
 
   if (cur) cur->running = FALSE;
   if (vcpu) vcpu->running = TRUE;
@@ -987,7 +1072,7 @@ vcpu_wakeup (quest_tss *tssp)
   vcpu_runqueue_append (v, tssp);
 
   /* put vcpu on pcpu queue (1st level) */
-  vcpu_queue_append (percpu_pointer (v->cpu, vcpu_queue), v);
+  vcpu_runq_insert (percpu_pointer (v->cpu, vcpu_queue), v);
 
   if (!v->runnable && !v->running && v->hooks->unblock)
     v->hooks->unblock (v);
@@ -1019,10 +1104,11 @@ vcpu_wakeup (quest_tss *tssp)
 static inline s64
 capacity (vcpu *v)
 {
+  replenishment *head = repl_queue_head (&v->main.Q);
   u64 now; RDTSC (now);
-  if (v->main.Q.head == NULL || v->main.Q.head->t > now)
+  if (head == NULL || head->t > now)
     return 0;
-  return (s64) v->main.Q.head->b - (s64) v->usage;
+  return (s64) head->b - (s64) v->usage;
 }
 
 static void
@@ -1035,28 +1121,24 @@ main_vcpu_update_replenishments (vcpu *v, u64 tcur)
 static u64
 main_vcpu_next_event (vcpu *v)
 {
-  replenishment *r;
   u64 now; RDTSC (now);
-  for (r = v->main.Q.head; r != NULL; r = r->next) {
-    if (now < r->t)
-      return r->t;
-  }
-  return 0;
+  return repl_queue_next_after (&v->main.Q, now);
 }
 
 #if 0
 static void
 repl_merge (vcpu *v)
 {
+  repl_queue *Q = &v->main.Q;
   /* possibly merge */
-  while (v->main.Q.size > 1) {
-    u64 t = v->main.Q.head->t;
-    u64 b = v->main.Q.head->b;
+  while (Q->size > 1) {
+    u64 t = repl_queue_head (Q)->t;
+    u64 b = repl_queue_head (Q)->b;
     /* observation 3 */
-    if (t + b >= v->main.Q.head->next->t) {
-      repl_queue_pop (&v->main.Q);
-      v->main.Q.head->b += b;
-      v->main.Q.head->t = t;
+    if (t + b >= repl_queue_second (Q)->t) {
+      repl_queue_pop (Q);
+      repl_queue_head (Q)->b += b;
+      repl_queue_head (Q)->t = t;
     } else
       break;
   }
@@ -1066,26 +1148,29 @@ repl_merge (vcpu *v)
 static void
 budget_check (vcpu *v)
 {
+  repl_queue *Q = &v->main.Q;
+  replenishment *head = repl_queue_head (Q);
+
   if (capacity (v) <= 0) {
-    while (v->main.Q.head->b <= v->usage) {
+    while (head->b <= v->usage) {
       /* exhaust and reschedule the replenishment */
-      v->usage -= v->main.Q.head->b;
-      u64 b = v->main.Q.head->b, t = v->main.Q.head->t;
-      repl_queue_pop (&v->main.Q);
-      t += v->T;
-      repl_queue_add (&v->main.Q, b, t);
+      v->usage -= head->b;
+      head->t += v->T;
+      repl_queue_head_changed (Q);
     }
     if (v->usage > 0) {
       /* v->usage is the overrun amount */
-      v->main.Q.head->t += v->usage;
+      head->t += v->usage;
+      repl_queue_head_changed (Q);
       /* possibly merge */
-      if (v->main.Q.size > 1) {
-        u64 t = v->main.Q.head->t;
-        u64 b = v->main.Q.head->b;
-        if (t + b >= v->main.Q.head->next->t) {
-          repl_queue_pop (&v->main.Q);
-          v->main.Q.head->b += b;
-          v->main.Q.head->t = t;
+      if (Q->size > 1) {
+        u64 t = head->t;
+        u64 b = head->b;
+        if (t + b >= repl_queue_second (Q)->t) {
+          /* t is no later than the new head, so order is kept */
+          repl_queue_pop (Q);
+          head->b += b;
+          head->t = t;
         }
       }
     }
@@ -1101,18 +1186,20 @@ budget_check (vcpu *v)
 static void
 split_check (vcpu *v)
 {
+  repl_queue *Q = &v->main.Q;
+  replenishment *head = repl_queue_head (Q);
   u64 now; RDTSC (now);
-  if (v->usage > 0 && v->main.Q.head->t <= now) {
-    u64 remnant = v->main.Q.head->b - v->usage;
-    if (v->main.Q.size == MAX_REPL) {
+  if (v->usage > 0 && head->t <= now) {
+    u64 remnant = head->b - v->usage;
+    if (Q->size == MAX_REPL) {
       /* merge with next replenishment */
-      repl_queue_pop (&v->main.Q);
-      v->main.Q.head->b += remnant;
+      repl_queue_pop (Q);
+      head->b += remnant;
     } else {
       /* leave remnant as reduced replenishment */
-      v->main.Q.head->b = remnant;
+      head->b = remnant;
     }
-    repl_queue_add (&v->main.Q, v->usage, v->main.Q.head->t + v->T);
+    repl_queue_add (Q, v->usage, head->t + v->T);
     /* invariant: sum of replenishments remains the same */
     v->usage = 0;
   }
@@ -1127,6 +1214,7 @@ main_vcpu_end_timeslice (vcpu *cur, u64 tdelta)
   if (cur->b < tdelta) {
     cur->sched_overhead = tdelta - cur->b;
     percpu_write64 (pcpu_overhead, cur->sched_overhead);
+    sched_stat_overrun (cur);
   }
 
   cur->usage += tdelta;
@@ -1149,17 +1237,22 @@ main_vcpu_end_timeslice (vcpu *cur, u64 tdelta)
 static void
 unblock_check (vcpu *v)
 {
+  repl_queue *Q = &v->main.Q;
+  replenishment *head = repl_queue_head (Q);
+
   if (capacity (v) > 0) {
     u64 now;
     RDTSC (now);
-    v->main.Q.head->t = now;
+    head->t = now;
+    repl_queue_head_changed (Q);
     /* merge replenishments using observation 3 */
-    while (v->main.Q.size > 1) {
-      u64 b = v->main.Q.head->b;
-      if (v->main.Q.head->next->t <= now + b - v->usage) {
-        repl_queue_pop (&v->main.Q);
-        v->main.Q.head->b += b;
-        v->main.Q.head->t = now;
+    while (Q->size > 1) {
+      u64 b = head->b;
+      if (repl_queue_second (Q)->t <= now + b - v->usage) {
+        repl_queue_pop (Q);
+        head->b += b;
+        head->t = now;
+        repl_queue_head_changed (Q);
       } else
         break;
     }
@@ -1210,6 +1303,7 @@ io_vcpu_end_timeslice (vcpu *cur, u64 tdelta)
     cur->sched_overhead = tdelta - cur->b;
     overhead = cur->sched_overhead;
     percpu_write64 (pcpu_overhead, overhead);
+    sched_stat_overrun (cur);
   }
 
   cur->b -= u;
@@ -1264,8 +1358,10 @@ iovcpu_job_wakeup (quest_tss *tssp, u64 T)
 {
   vcpu *v = vcpu_lookup (tssp->cpu);
   if (v->type == IO_VCPU) {
-    if (T < v->T || !(v->running || v->runnable))
+    if (T < v->T || !(v->running || v->runnable)) {
       v->T = T;
+      vcpu_runq_update (percpu_pointer (v->cpu, vcpu_queue), v);
+    }
   }
   wakeup (tssp);
 }
@@ -1486,7 +1582,7 @@ validate_migration_condition (quest_tss * tss)
 
   v = vcpu_lookup (tss->cpu);
   rq = &v->main.Q;
-  rp = rq->head;
+  rp = repl_queue_head (rq);
 
   if (rp) {
     /* TODO: Need to also look at sleep time and compare it with E_s */
@@ -1536,11 +1632,10 @@ vcpu_fix_replenishment (quest_tss * tss, vcpu * v, replenishment r[], bool remot
 #ifdef DEBUG_VCPU
   /* What is the current replenishment queue of v? */
   rq = &v->main.Q;
-  rp = rq->head;
   com1_printf ("Target VCPU Replenishment Queue:\n");
-  while (rp) {
+  for (i = 0; i < rq->size; i++) {
+    rp = &rq->array[i];
     com1_printf ("  b=0x%llX, t=0x%llX\n", rp->b, rp->t);
-    rp = rp->next;
   }
 #endif
 
@@ -1556,11 +1651,8 @@ vcpu_fix_replenishment (quest_tss * tss, vcpu * v, replenishment r[], bool remot
   } else {
     /* Clear the current replenishment queue */
     rq = &v->main.Q;
-    rp = rq->head;
-    while (rp) {
+    while (rq->size > 0)
       repl_queue_pop (rq);
-      rp = rq->head;
-    }
     /* Add fixed new replenishments */
     for (i = 0; i < MAX_REPL; i++) {
       if (tss->vcpu_backup[i].t == 0) break;
@@ -1581,12 +1673,11 @@ vcpu_fix_replenishment (quest_tss * tss, vcpu * v, replenishment r[], bool remot
 #ifdef DEBUG_VCPU
     /* Check the updated replenishment queue of v */
     rq = &v->main.Q;
-    rp = rq->head;
     com1_printf ("Updated VCPU Replenishment Queue (b=0x%llX, usage=0x%llX):\n",
                  v->b, v->usage);
-    while (rp) {
+    for (i = 0; i < rq->size; i++) {
+      rp = &rq->array[i];
       com1_printf ("  b=0x%llX, t=0x%llX\n", rp->b, rp->t);
-      rp = rp->next;
     }
 #endif
 
@@ -1603,7 +1694,7 @@ vcpu_reset (void)
 {
   vcpu_init ();
  
-  percpu_write (vcpu_queue, NULL);
+  percpu_write (vcpu_queue.size, 0);
   percpu_write (vcpu_current, NULL);
   percpu_write (vcpu_idle_task, NULL);
 }
@@ -26,7 +26,6 @@
 #include "drivers/acpi/acmacros.h"
 #include "drivers/acpi/acexcep.h"
 #include "util/printf.h"
-#include "util/cpuid.h"
 
 //#define ACPI_DEBUG
 
@@ -44,7 +43,7 @@
 
 
 static int process_acpi_tables (void);
-static int acpi_add_processor (ACPI_MADT_LOCAL_APIC *);
+static int acpi_add_processor (uint32 apic_id, uint32 flags);
 static void acpi_parse_srat (ACPI_TABLE_SRAT *);
 
 /*******************************************************************
@@ -281,7 +280,20 @@ process_acpi_tables (void)
                   sub->ProcessorId,
                   sub->Id,
                   sub->LapicFlags & 1 ? "(enabled)" : "(disabled)");
-          if (acpi_add_processor (sub)) {
+          if (acpi_add_processor (sub->Id, sub->LapicFlags)) {
+            DLOG_COM1 (" (booted)");
+          }
+          DLOG_COM1 ("\n");
+          break;
+        }
+        case ACPI_MADT_TYPE_LOCAL_X2APIC:{
+          /* Processor entry for an APIC ID that needs 32 bits */
+          ACPI_MADT_LOCAL_X2APIC *sub = (ACPI_MADT_LOCAL_X2APIC *) ptr;
+          DLOG_COM1 ("Processor: 0x%X x2APIC-ID: 0x%X %s",
+                  sub->Uid,
+                  sub->LocalApicId,
+                  sub->LapicFlags & 1 ? "(enabled)" : "(disabled)");
+          if (acpi_add_processor (sub->LocalApicId, sub->LapicFlags)) {
             DLOG_COM1 (" (booted)");
           }
           DLOG_COM1 ("\n");
@@ -388,22 +400,22 @@ process_acpi_tables (void)
 /* A small wrapper around smp_boot_cpu() which does some checks and
  * maintains two small tables. */
 static int
-acpi_add_processor (ACPI_MADT_LOCAL_APIC * ptr)
+acpi_add_processor (uint32 apic_id, uint32 flags)
 {
 #ifndef NO_SMP
-  u32 ebx;
-  cpuid (1, 0, NULL, &ebx, NULL, NULL);
-  uint8 this_apic_id = ebx >> 24;
-  uint8 apic_id = ptr->Id;
-
-  if (!(ptr->LapicFlags & 1))
+  if (!(flags & 1))
     return 0;                   /* disabled processor */
-  if (this_apic_id == apic_id)
+  if (LAPIC_get_physical_ID () == apic_id)
     return 0;                   /* bootstrap processor */
+  if (apic_id >= APIC_BROADCAST_ID && !x2apic_enabled)
+    return 0;                   /* unreachable without x2APIC */
+  if (mp_num_cpus == MAX_CPUS) {
+    DLOG_COM1 (" (over MAX_CPUS)");
+    return 0;
+  }
 
   if (smp_boot_cpu (apic_id, APIC_VER_NEW)) {
     CPU_to_APIC[mp_num_cpus] = apic_id;
-    APIC_to_CPU[apic_id] = mp_num_cpus;
     mp_num_cpus++;
     return 1;
   } else
@@ -24,16 +24,37 @@
 #include "smp/apic.h"
 #include "smp/spinlock.h"
 #include "util/printf.h"
-
-#define APIC_BROADCAST_ID 0xFF
-//#define MAX_CPUS          APIC_BROADCAST_ID
+#include "util/cpuid.h"
 
 #define LAPIC_ADDR_DEFAULT  0xFEE00000uL
 #define IOAPIC_ADDR_DEFAULT 0xFEC00000uL
 
 uint32 mp_LAPIC_addr = LAPIC_ADDR_DEFAULT;
-#define MP_LAPIC_READ(x)   (*((volatile uint32 *) (mp_LAPIC_addr+(x))))
-#define MP_LAPIC_WRITE(x,y) (*((volatile uint32 *) (mp_LAPIC_addr+(x))) = (y))
+
+/* Set when the local APICs run in x2APIC mode: the registers are
+ * MSRs and APIC IDs are 32 bits wide.  Chosen by the BSP in
+ * LAPIC_init, and every AP follows it. */
+bool x2apic_enabled = FALSE;
+
+static inline uint32
+lapic_read (uint32 reg)
+{
+  if (x2apic_enabled)
+    return (uint32) rdmsr (X2APIC_MSR (reg));
+  return *((volatile uint32 *) (mp_LAPIC_addr + reg));
+}
+
+static inline void
+lapic_write (uint32 reg, uint32 v)
+{
+  if (x2apic_enabled)
+    wrmsr (X2APIC_MSR (reg), v);
+  else
+    *((volatile uint32 *) (mp_LAPIC_addr + reg)) = v;
+}
+
+#define MP_LAPIC_READ(x)   (lapic_read (x))
+#define MP_LAPIC_WRITE(x,y) (lapic_write ((x), (y)))
 
 uint32 mp_IOAPIC_addr = IOAPIC_ADDR_DEFAULT;
 mp_IOAPIC_info mp_IOAPICs[MAX_IOAPICS];
@@ -47,7 +68,8 @@ uint32 mp_num_IOAPICs = 0;
 /* Send Interprocessor Interrupt -- prods the Local APIC to deliver an
  * interprocessor interrupt, 'v' specifies the vector but also
  * specifies flags according to the Intel System Programming Manual --
- * also see apic.h and the LAPIC_ICR_* constants. */
+ * also see apic.h and the LAPIC_ICR_* constants.  'dest' is an APIC
+ * ID, or a logical destination if v has LAPIC_ICR_DM_LOGICAL. */
 int
 LAPIC_send_ipi (uint32 dest, uint32 v)
 {
@@ -58,6 +80,16 @@ LAPIC_send_ipi (uint32 dest, uint32 v)
   asm volatile ("pushfl");
   asm volatile ("cli");
 
+  if (x2apic_enabled) {
+    /* WRMSR to the ICR does not order earlier stores, which the
+     * target may be about to read */
+    asm volatile ("mfence":::"memory");
+    wrmsr (X2APIC_MSR (LAPIC_ICR), ((uint64) dest << 32) | v);
+    /* There is no delivery status in x2APIC mode */
+    asm volatile ("popfl");
+    return 1;
+  }
+
   MP_LAPIC_WRITE (LAPIC_ICR + 0x10, dest << 24);
   MP_LAPIC_WRITE (LAPIC_ICR, v);
 
@@ -73,9 +105,78 @@ LAPIC_send_ipi (uint32 dest, uint32 v)
   return (timeout < 1000);
 }
 
+/* Logical destination of each CPU, or 0 if it has none.  See
+ * LAPIC_set_logical_destination. */
+uint32 lapic_logical_dest[MAX_CPUS];
+
+/* Send v to every CPU in the bitmask cpus.  CPUs that share a logical
+ * cluster get one IPI between them (all of them, in the flat model);
+ * CPUs without a logical destination get a physical IPI each.  v must
+ * not have LAPIC_ICR_DM_LOGICAL set.  Returns 0 if any IPI was not
+ * accepted. */
+int
+LAPIC_send_ipi_cpus (uint32 cpus, uint32 v)
+{
+  uint32 cpu, other, dest;
+  int ok = 1;
+
+  for (cpu = 0; cpu < MAX_CPUS && cpus; cpu++) {
+    if (!(cpus & (1u << cpu)))
+      continue;
+    cpus &= ~(1u << cpu);
+
+    dest = lapic_logical_dest[cpu];
+    if (!dest) {
+      if (!LAPIC_send_ipi (CPU_to_APIC[cpu], v))
+        ok = 0;
+      continue;
+    }
+
+    for (other = cpu + 1; other < MAX_CPUS; other++) {
+      if (!(cpus & (1u << other)) || !lapic_logical_dest[other])
+        continue;
+      if (X2APIC_LDR_CLUSTER (lapic_logical_dest[other]) !=
+          X2APIC_LDR_CLUSTER (dest))
+        continue;
+      dest |= lapic_logical_dest[other];
+      cpus &= ~(1u << other);
+    }
+    if (!LAPIC_send_ipi (dest, v | LAPIC_ICR_DM_LOGICAL))
+      ok = 0;
+  }
+
+  return ok;
+}
+
+/* Switch this CPU's local APIC to x2APIC mode if the BSP chose it.
+ * The BSP uses x2APIC whenever the CPU supports it, unless built with
+ * NO_X2APIC; firmware that already enabled it leaves no choice. */
+static void
+LAPIC_setup_mode (void)
+{
+  uint64 base;
+
+  if (mp_ISA_PC || !cpuid_x2apic_support ())
+    return;
+
+  base = rdmsr (IA32_APIC_BASE);
+  if (base & IA32_APIC_BASE_BSP) {
+#ifdef NO_X2APIC
+    x2apic_enabled = !!(base & IA32_APIC_BASE_EXTD);
+#else
+    x2apic_enabled = TRUE;
+#endif
+  }
+
+  if (x2apic_enabled && !(base & IA32_APIC_BASE_EXTD))
+    wrmsr (IA32_APIC_BASE, base | IA32_APIC_BASE_EN | IA32_APIC_BASE_EXTD);
+}
+
 void
 LAPIC_init(void) 
 {
+  LAPIC_setup_mode ();
+
   MP_LAPIC_WRITE (LAPIC_TPR, 0x00);      /* task priority = 0x0 */
   MP_LAPIC_WRITE (LAPIC_LVTT, 0x10000);  /* disable timer int */
   MP_LAPIC_WRITE (LAPIC_LVTPC, 0x10000); /* disable perf ctr int */
@@ -102,13 +203,15 @@ LAPIC_clear_error(void)
   return MP_LAPIC_READ (LAPIC_ESR);
 }
 
-uint8
+uint32
 LAPIC_get_physical_ID (void)
 {
   if (mp_ISA_PC)
     return 0;
+  else if (x2apic_enabled)
+    return MP_LAPIC_READ (LAPIC_ID);
   else
-    return (MP_LAPIC_READ (LAPIC_ID) >> 0x18) & 0xF;
+    return (MP_LAPIC_READ (LAPIC_ID) >> 0x18) & 0xFF;
 }
 
 void
@@ -193,10 +296,31 @@ LAPIC_start_timer (uint32 count)
 }
 #endif
 
+/* Give this CPU, number cpu, its logical destination.  In xAPIC mode
+ * that is the flat model, one bit per CPU, which only covers the
+ * first 8 CPUs; the rest have none and are sent physical IPIs.  In
+ * x2APIC mode the hardware derives a cluster address from the APIC
+ * ID, which is only read back. */
 void
-LAPIC_set_logical_destination(uint32 log_dest) {
-  MP_LAPIC_WRITE (LAPIC_LDR, log_dest); /* write to logical destination reg */
-  MP_LAPIC_WRITE (LAPIC_DFR, -1);       /* use 'flat model' destination format */
+LAPIC_set_logical_destination (uint32 cpu)
+{
+  uint32 log_dest = 0;
+
+  if (cpu >= MAX_CPUS)
+    panic ("Invalid cpu number!");
+
+  if (x2apic_enabled) {
+    log_dest = MP_LAPIC_READ (LAPIC_LDR);
+  } else {
+    if (cpu < 7)
+      log_dest = 0x2 << cpu;
+    else if (cpu == 7)
+      log_dest = 0x1;
+    MP_LAPIC_WRITE (LAPIC_LDR, log_dest << 24); /* write to logical destination reg */
+    MP_LAPIC_WRITE (LAPIC_DFR, -1);       /* use 'flat model' destination format */
+  }
+
+  lapic_logical_dest[cpu] = log_dest;
 }
 
 void
@@ -329,10 +329,11 @@ add_processor (struct mp_config_processor_entry *proc)
     return 0;                   /* disabled processor */
   if (proc->flags & 2)
     return 0;                   /* bootstrap processor */
+  if (mp_num_cpus == MAX_CPUS)
+    return 0;
 
   if (smp_boot_cpu (apic_id, proc->APIC_version)) {
     CPU_to_APIC[mp_num_cpus] = apic_id;
-    APIC_to_CPU[apic_id] = mp_num_cpus;
     mp_num_cpus++;
     return 1;
   } else
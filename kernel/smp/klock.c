@@ -0,0 +1,103 @@
+/*                    The Quest Operating System
+ *  Copyright (C) 2005-2012  Richard West, Boston University
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "kernel.h"
+#include "smp/klock.h"
+#include "sched/sched.h"
+#include "util/printf.h"
+
+klock sched_lock ALIGNED (LOCK_ALIGNMENT) = KLOCK_INIT ("sched");
+klock fd_lock ALIGNED (LOCK_ALIGNMENT) = KLOCK_INIT ("fd");
+klock pcache_lock ALIGNED (LOCK_ALIGNMENT) = KLOCK_INIT ("pcache");
+klock cow_lock ALIGNED (LOCK_ALIGNMENT) = KLOCK_INIT ("cow");
+klock net_lock ALIGNED (LOCK_ALIGNMENT) = KLOCK_INIT ("net");
+klock frame_lock ALIGNED (LOCK_ALIGNMENT) = KLOCK_INIT ("frame");
+kmutex vfs_lock ALIGNED (LOCK_ALIGNMENT) = KMUTEX_INIT ("vfs");
+
+/* Sleeping lock: wait on the mutex's queue until the owner releases
+ * it.  Must hold the scheduler lock. */
+void
+kmutex_lock (kmutex * m)
+{
+  quest_tss *cur = str ();
+
+  m->stat.acquired++;
+  if (m->owner)
+    m->stat.contended++;
+
+  while (m->owner) {
+    queue_append (&m->waitqueue, cur);
+    schedule ();
+  }
+  m->owner = cur;
+}
+
+/* Must hold the scheduler lock. */
+void
+kmutex_unlock (kmutex * m)
+{
+  m->owner = NULL;
+  wakeup_queue (&m->waitqueue);
+}
+
+static void
+copy_stat (struct lock_stat *s, klock_stat *k)
+{
+  int i;
+
+  for (i = 0; i < KLOCK_NAME_LEN - 1 && k->name[i]; i++)
+    s->name[i] = k->name[i];
+  for (; i < KLOCK_NAME_LEN; i++)
+    s->name[i] = '\0';
+  s->acquired = k->acquired;
+  s->contended = k->contended;
+}
+
+/* Copy up to max lock counters into stats, returning the number
+ * copied.  The counters are read without their locks, so a snapshot
+ * may be slightly stale. */
+int
+klock_get_stats (struct lock_stat *stats, int max)
+{
+  klock_stat *all[] = {
+    &sched_lock.stat,
+    &vfs_lock.stat,
+    &net_lock.stat,
+    &fd_lock.stat,
+    &pcache_lock.stat,
+    &cow_lock.stat,
+    &frame_lock.stat,
+  };
+  int i, n = sizeof (all) / sizeof (all[0]);
+
+  if (max < n)
+    n = max;
+  for (i = 0; i < n; i++)
+    copy_stat (&stats[i], all[i]);
+  return n;
+}
+
+/*
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * mode: C
+ * c-file-style: "gnu"
+ * c-basic-offset: 2
+ * End:
+ */
+
+/* vi: set et sw=2 sts=2: */
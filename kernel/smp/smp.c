@@ -17,6 +17,7 @@
 
 #include "arch/i386.h"
 #include "arch/i386-percpu.h"
+#include "arch/i386-sysenter.h"
 #include "kernel.h"
 #include "mem/mem.h"
 #include "smp/smp.h"
@@ -70,8 +71,7 @@ IRQ_to_GSI (uint32 src_bus, uint32 src_irq)
 
 
 /* Mapping from CPU # to APIC ID */
-uint8 CPU_to_APIC[MAX_CPUS];
-uint8 APIC_to_CPU[MAX_CPUS];
+uint32 CPU_to_APIC[MAX_CPUS];
 
 bool mp_ACPI_enabled = 0;
 
@@ -90,7 +90,7 @@ uint32 mp_ISA_bus_id = 0;
 int
 smp_init (void)
 {
-  uint32 phys_id, log_dest;
+  uint32 phys_id;
   uint32 intel_mps_init(bool);
   uint32 acpi_early_init(void);
   void LAPIC_measure_timer(void);
@@ -103,10 +103,10 @@ smp_init (void)
   LAPIC_init();
   
   phys_id = get_pcpu_id();
+  CPU_to_APIC[phys_id] = LAPIC_get_physical_ID ();
 
   /* setup a logical destination address */
-  log_dest = get_logical_dest_addr (phys_id) << 24;
-  LAPIC_set_logical_destination(log_dest);
+  LAPIC_set_logical_destination(phys_id);
 
   /* Find out how fast the LAPIC can tick -- and correspondingly the
    * CPU bus frequency.  Also finds the RDTSC frequency. */
@@ -199,7 +199,7 @@ extern uint8 ap_stack_ptr[];    /* we give the AP a stack pointer through this *
 /* For some reason, if this function is 'static', and -O is on, then
  * qemu fails. */
 uint32
-smp_boot_cpu (uint8 apic_id, uint8 APIC_version)
+smp_boot_cpu (uint32 apic_id, uint8 APIC_version)
 {
   int success = 1;
   volatile int to;
@@ -277,7 +277,7 @@ smp_boot_cpu (uint8 apic_id, uint8 APIC_version)
 void
 ap_init (void)
 {
-  int phys_id, log_dest;
+  int phys_id;
   void LAPIC_init(void);
 
   /* Setup the LAPIC */
@@ -292,8 +292,7 @@ ap_init (void)
   phys_id = get_pcpu_id ();
 
   /* setup a logical destination address */
-  log_dest = get_logical_dest_addr (phys_id) << 24;
-  LAPIC_set_logical_destination(log_dest);
+  LAPIC_set_logical_destination(phys_id);
 
   asm volatile ("lidt idt_ptr");        /* Set the IDT */
 
@@ -318,9 +317,15 @@ ap_init (void)
 
   /* Initialise the floating-point unit (FPU) */
   initialise_fpu_and_mmx();
+
+  /* Copy-on-write pages are read-only to the kernel too */
+  enable_write_protect ();
   
   /* Load the per-CPU TSS for this AP */
   hw_ltr (cpuTSS_selector[phys_id]);
+  sysenter_init ();
+  tlb_cpu_init ();
+  kmap_cpu_init ();
 
 #ifdef USE_VMX
 #ifdef QUESTV_NO_VMX
@@ -384,6 +389,7 @@ ap_init (void)
   memcpy (&pg_dir[mod_num][1023], (void *) (((uint32) vpdbr) + 4092), 4);
   /* LAPIC/IOAPIC mappings */
   memcpy (&pg_dir[mod_num][1019], (void *) (((uint32) vpdbr) + 4076), 4);
+  physmap_map (pg_dir[mod_num]);
 
   unmap_virtual_page (vpdbr);
 
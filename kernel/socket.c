@@ -18,9 +18,11 @@
 #include "arch/i386.h"
 #include "kernel.h"
 #include "mem/mem.h"
+#include "mem/slab.h"
 #include "fs/filesys.h"
 #include "smp/smp.h"
 #include "smp/apic.h"
+#include "smp/klock.h"
 #include "sched/sched.h"
 #include "util/printf.h"
 #include "util/screen.h"
@@ -34,7 +36,9 @@
 #include "lwip/inet.h"
 #include "linux_socket.h"
 #include "select.h"
+#include "poll.h"
 #include "arch/i386-div64.h"
+#include "arch/i386-vdso.h"
 #include "interrupt_handler.h"
 #include "fcntl.h"
 #include "vm/fault_detection.h"
@@ -54,6 +58,215 @@
 
 typedef void (*sys_call_ptr_t) (void);
 
+extern bool sleepqueue_detach (quest_tss *);
+
+/* Receive rings of a socket are allocated together from an object
+ * cache and kept initialised while free.  Each ring has one producer,
+ * the lwIP callbacks, and one consumer, the socket's reader, so they
+ * are the lock-free kind.  The first ring is at the
+ * start of the object, so the descriptor's ring pointer is also the
+ * pointer to free. */
+struct udp_sock_bufs
+{
+  circular recv_circ;
+  udp_recv_buf_t recv[UDP_RECV_BUF_LEN];
+};
+
+struct tcp_sock_bufs
+{
+  circular recv_circ;
+  circular accept_circ;
+  tcp_recv_buf_t recv[TCP_RECV_BUF_LEN];
+  int accept[TCP_ACCEPT_LEN];
+};
+
+static void
+udp_sock_bufs_ctor (void *obj)
+{
+  struct udp_sock_bufs *b = obj;
+  circular_init_spsc (&b->recv_circ, (void *) b->recv, UDP_RECV_BUF_LEN,
+                      sizeof (udp_recv_buf_t));
+}
+
+static void
+tcp_sock_bufs_ctor (void *obj)
+{
+  struct tcp_sock_bufs *b = obj;
+  circular_init_spsc (&b->recv_circ, (void *) b->recv, TCP_RECV_BUF_LEN,
+                      sizeof (tcp_recv_buf_t));
+  circular_init_spsc (&b->accept_circ, (void *) b->accept, TCP_ACCEPT_LEN,
+                      sizeof (int));
+}
+
+static kmem_cache udp_sock_cache =
+  KMEM_CACHE_INIT ("udp_sock", sizeof (struct udp_sock_bufs), 0,
+                   udp_sock_bufs_ctor);
+static kmem_cache tcp_sock_cache =
+  KMEM_CACHE_INIT ("tcp_sock", sizeof (struct tcp_sock_bufs), 0,
+                   tcp_sock_bufs_ctor);
+
+static bool
+udp_sock_bufs_alloc (fd_table_entry_t *fd_ent)
+{
+  struct udp_sock_bufs *b = kmem_cache_alloc (&udp_sock_cache);
+
+  if (!b)
+    return FALSE;
+  fd_ent->udp_recv_buf_circ = &b->recv_circ;
+  fd_ent->udp_recv_buf = b->recv;
+  return TRUE;
+}
+
+static bool
+tcp_sock_bufs_alloc (fd_table_entry_t *fd_ent)
+{
+  struct tcp_sock_bufs *b = kmem_cache_alloc (&tcp_sock_cache);
+
+  if (!b)
+    return FALSE;
+  fd_ent->tcp_recv_buf_circ = &b->recv_circ;
+  fd_ent->tcp_recv_buf = b->recv;
+  fd_ent->tcp_accept_circ = &b->accept_circ;
+  fd_ent->tcp_accept_buf = b->accept;
+  return TRUE;
+}
+
+/* Empty a receive ring, dropping the pbufs queued on it.  Entries
+ * are laid out alike for UDP and TCP.  Must hold net_lock. */
+static void
+sock_drain_recv (circular *c)
+{
+  udp_recv_buf_t r;
+
+  while (circular_count (c) > 0) {
+    r.buf = NULL;
+    circular_remove_nowait (c, &r);
+    if (r.buf)
+      pbuf_free (r.buf);
+  }
+}
+
+/* Return the rings of a closed socket, empty, to their cache.  Must
+ * hold net_lock. */
+static void
+udp_sock_bufs_free (fd_table_entry_t *fd_ent)
+{
+  sock_drain_recv (fd_ent->udp_recv_buf_circ);
+  kmem_cache_free (&udp_sock_cache, fd_ent->udp_recv_buf_circ);
+  fd_ent->udp_recv_buf_circ = NULL;
+  fd_ent->udp_recv_buf = NULL;
+}
+
+/* Also aborts the connections still waiting to be accepted.  They
+ * already hold descriptors in the listener's table (see
+ * tcp_accept_callback), which nobody else would release.  Must hold
+ * net_lock and fd_lock. */
+static void
+tcp_sock_bufs_free (fd_table_entry_t *fd_ent)
+{
+  fd_table_entry_t *pending;
+  int fd;
+
+  sock_drain_recv (fd_ent->tcp_recv_buf_circ);
+  while (circular_count (fd_ent->tcp_accept_circ) > 0) {
+    fd = -1;
+    circular_remove_nowait (fd_ent->tcp_accept_circ, &fd);
+    if (fd < 3 || fd >= MAX_FD || !fd_ent->task)
+      continue;
+    pending = (fd_table_entry_t *) fd_ent->task->fd_table + fd;
+    if (pending->type != FD_TYPE_TCP || !pending->entry)
+      continue;
+    DLOG ("abort unaccepted TCP socket %d", fd);
+    tcp_abort ((struct tcp_pcb *) pending->entry);
+    pending->entry = NULL;
+    if (pending->recv_cur.udp.buf) {
+      pbuf_free (pending->recv_cur.udp.buf);
+      pending->recv_cur.udp.buf = NULL;
+    }
+    memset (pending->pollers, 0, sizeof (pending->pollers));
+    if (pending->tcp_recv_buf_circ)
+      tcp_sock_bufs_free (pending);
+  }
+  kmem_cache_free (&tcp_sock_cache, fd_ent->tcp_recv_buf_circ);
+  fd_ent->tcp_recv_buf_circ = NULL;
+  fd_ent->tcp_recv_buf = NULL;
+  fd_ent->tcp_accept_circ = NULL;
+  fd_ent->tcp_accept_buf = NULL;
+}
+
+/* Wake the tasks asleep in poll on this descriptor, unless they have
+ * been woken already.  The lwIP callbacks run from network input,
+ * which holds the scheduler lock. */
+static void
+socket_wake (fd_table_entry_t *fd_ent)
+{
+  quest_tss *t;
+  int i;
+
+  for (i = 0; i < FD_MAX_POLLERS; i++) {
+    t = fd_ent->pollers[i];
+    fd_ent->pollers[i] = NULL;
+    if (t && sleepqueue_detach (t)) {
+      t->time = 0;
+      wakeup (t);
+    }
+  }
+}
+
+/* The entry that the lwIP callbacks for the task's descriptor fd
+ * wake: the one registered with the pcb when the socket was set up.
+ * A forked copy of the descriptor shares the pcb, so its pollers must
+ * wait there. */
+static fd_table_entry_t *
+socket_owner (quest_tss *tss, int fd)
+{
+  fd_table_entry_t *fd_ent = (fd_table_entry_t *) tss->fd_table + fd;
+  void *arg = NULL;
+
+  if (!fd_ent->entry)
+    return fd_ent;
+  klock_lock (&net_lock);
+  if (fd_ent->type == FD_TYPE_UDP)
+    arg = ((struct udp_pcb *) fd_ent->entry)->recv_arg;
+  else if (fd_ent->type == FD_TYPE_TCP)
+    arg = ((struct tcp_pcb *) fd_ent->entry)->callback_arg;
+  klock_unlock (&net_lock);
+  return arg ? (fd_table_entry_t *) arg : fd_ent;
+}
+
+/* Register t as a poller of the socket.  If every slot is taken, t
+ * only notices events when its sleep ends (see do_poll). */
+static void
+poller_add (fd_table_entry_t *fd_ent, quest_tss *t)
+{
+  int i;
+
+  for (i = 0; i < FD_MAX_POLLERS; i++)
+    if (!fd_ent->pollers[i]) {
+      fd_ent->pollers[i] = t;
+      return;
+    }
+}
+
+static void
+poller_remove (fd_table_entry_t *fd_ent, quest_tss *t)
+{
+  int i;
+
+  for (i = 0; i < FD_MAX_POLLERS; i++)
+    if (fd_ent->pollers[i] == t)
+      fd_ent->pollers[i] = NULL;
+}
+
+static void
+socket_init_state (fd_table_entry_t *fd_ent)
+{
+  fd_ent->recv_cur.udp.buf = NULL;
+  fd_ent->recv_cur.udp.bytes_read = 0;
+  fd_ent->rx_closed = FALSE;
+  memset (fd_ent->pollers, 0, sizeof (fd_ent->pollers));
+}
+
 static void
 udp_recv_callback (void *arg, struct udp_pcb *upcb, struct pbuf *p,
                struct ip_addr *addr, uint16 port)
@@ -63,22 +276,27 @@ udp_recv_callback (void *arg, struct udp_pcb *upcb, struct pbuf *p,
   DLOG ("Total length: %d", p->tot_len);
 
   fd_table_entry_t * fd_ent = (fd_table_entry_t *) arg;
-  udp_recv_buf_t b;
+  udp_recv_buf_t *b;
 
   if (p == NULL) {
     DLOG ("udp_recv pbuf is NULL");
     return;
   }
 
-  b.buf = p;
-  b.addr.sin_family = AF_INET;
-  b.addr.sin_port = htons (port);
-  b.addr.sin_addr.s_addr = addr->addr;
-  b.bytes_read = 0;
-  if (circular_insert_nowait (fd_ent->udp_recv_buf_circ, &b) == -1) {
+  /* fill in the ring slot directly */
+  b = circular_insert_reserve (fd_ent->udp_recv_buf_circ);
+  if (b == NULL) {
     DLOG ("udp_recv_buf is full, packet dropped");
     pbuf_free (p);
+    return;
   }
+  b->buf = p;
+  b->addr.sin_family = AF_INET;
+  b->addr.sin_port = htons (port);
+  b->addr.sin_addr.s_addr = addr->addr;
+  b->bytes_read = 0;
+  circular_insert_commit (fd_ent->udp_recv_buf_circ, b);
+  socket_wake (fd_ent);
 
   return;
 }
@@ -87,6 +305,7 @@ static err_t
 tcp_recv_callback (void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t err)
 {
   udp_recv_buf_t b;
+  tcp_recv_buf_t *r;
   fd_table_entry_t * fd_ent = (fd_table_entry_t *) arg;
 
   if (err != ERR_OK) {
@@ -94,21 +313,32 @@ tcp_recv_callback (void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t err)
   } else {
     if (p == NULL) {
       /* Remote side closes connection */
-      /* --??-- What should be done in this case? */
       DLOG ("Connection closed by remote host");
+      fd_ent->rx_closed = TRUE;
+      /* rx_closed is what recv checks.  The empty entry only releases
+       * a reader already blocked in circular_remove, so it does not
+       * matter if it is dropped because the ring is full. */
+      b.buf = NULL;
+      b.bytes_read = 0;
+      circular_insert_nowait (fd_ent->tcp_recv_buf_circ, &b);
+      socket_wake (fd_ent);
       return err;
     }
 
-    b.buf = p;
-    b.addr.sin_family = AF_INET;
-    b.addr.sin_port = htons (tpcb->remote_port);
-    b.addr.sin_addr.s_addr = tpcb->remote_ip.addr;
-    b.bytes_read = 0;
-    if (circular_insert_nowait (fd_ent->tcp_recv_buf_circ, &b) == -1) {
+    r = circular_insert_reserve (fd_ent->tcp_recv_buf_circ);
+    if (r == NULL) {
       DLOG ("tcp_recv_buf is full, packet dropped");
       tcp_recved (tpcb, p->tot_len);
       pbuf_free (p);
+      return err;
     }
+    r->buf = p;
+    r->addr.sin_family = AF_INET;
+    r->addr.sin_port = htons (tpcb->remote_port);
+    r->addr.sin_addr.s_addr = tpcb->remote_ip.addr;
+    r->bytes_read = 0;
+    circular_insert_commit (fd_ent->tcp_recv_buf_circ, r);
+    socket_wake (fd_ent);
   }
 
   return err;
@@ -120,6 +350,9 @@ static err_t
 tcp_sent_callback (void *arg, struct tcp_pcb *tpcb, uint16 len)
 {
   sys_call_tcp_sent_status = len;
+  /* acknowledged data frees room in the send buffer */
+  if (arg)
+    socket_wake ((fd_table_entry_t *) arg);
   return ERR_OK;
 }
 
@@ -139,6 +372,11 @@ sys_call_open_socket (int domain, int type, int protocol)
     return -1;
   }
 
+  /* net_lock covers lwIP; fd_lock covers claiming the descriptor
+   * against tcp_accept_callback, which fills the same table */
+  klock_lock (&net_lock);
+  klock_lock (&fd_lock);
+
   switch (type) {
     case SOCK_DGRAM :
       if ((sockfd = find_fd (tss)) == -1) {
@@ -147,26 +385,21 @@ sys_call_open_socket (int domain, int type, int protocol)
         struct udp_pcb * upcb = udp_new ();
         if (upcb == NULL) {
           DLOG ("Cannot allocate UDP PCB");
-          return -1;
+          sockfd = -1;
+          goto out;
         }
         tss->fd_table[sockfd].task = tss;
         tss->fd_table[sockfd].type = FD_TYPE_UDP;
         tss->fd_table[sockfd].entry = (void *) upcb;
-        tss->fd_table[sockfd].udp_recv_buf_circ = kzalloc (sizeof (circular));
-        tss->fd_table[sockfd].udp_recv_buf = kzalloc (sizeof (udp_recv_buf_t) *
-                                                      UDP_RECV_BUF_LEN);
+        socket_init_state (&tss->fd_table[sockfd]);
+        if (!udp_sock_bufs_alloc (&tss->fd_table[sockfd])) {
+          DLOG ("Cannot allocate receive buffers");
+          sockfd = -1;
+          goto out;
+        }
         udp_recv ((struct udp_pcb *) tss->fd_table[sockfd].entry, udp_recv_callback,
                   (void *) (&tss->fd_table[sockfd]));
-        if ((tss->fd_table[sockfd].udp_recv_buf_circ == 0) ||
-            (tss->fd_table[sockfd].udp_recv_buf == 0)) {
-          DLOG ("kzalloc failed!");
-          return -1;
-        }
-        circular_init (tss->fd_table[sockfd].udp_recv_buf_circ,
-                       (void *) tss->fd_table[sockfd].udp_recv_buf,
-                       UDP_RECV_BUF_LEN,
-                       sizeof (udp_recv_buf_t));
-        
+
         DLOG ("New UDP socket descriptor: %d", sockfd);
       }
       break;
@@ -177,43 +410,32 @@ sys_call_open_socket (int domain, int type, int protocol)
         struct tcp_pcb * tpcb = tcp_new ();
         if (tpcb == NULL) {
           DLOG ("Cannot allocate TCP PCB");
-          return -1;
+          sockfd = -1;
+          goto out;
         }
         tss->fd_table[sockfd].task = tss;
         tss->fd_table[sockfd].type = FD_TYPE_TCP;
         tss->fd_table[sockfd].entry = (void *) tpcb;
-        tss->fd_table[sockfd].tcp_recv_buf_circ = kzalloc (sizeof (circular));
-        tss->fd_table[sockfd].tcp_accept_circ = kzalloc (sizeof (circular));
-        tss->fd_table[sockfd].tcp_recv_buf = kzalloc (sizeof (tcp_recv_buf_t) *
-                                                      TCP_RECV_BUF_LEN);
-        tss->fd_table[sockfd].tcp_accept_buf = kzalloc (sizeof (int) *
-                                                        TCP_ACCEPT_LEN);
-        if ((tss->fd_table[sockfd].tcp_recv_buf_circ == 0) ||
-            (tss->fd_table[sockfd].tcp_recv_buf == 0) ||
-            (tss->fd_table[sockfd].tcp_accept_circ == 0) ||
-            (tss->fd_table[sockfd].tcp_accept_buf == 0)) {
-          DLOG ("kzalloc failed!");
-          return -1;
+        socket_init_state (&tss->fd_table[sockfd]);
+        if (!tcp_sock_bufs_alloc (&tss->fd_table[sockfd])) {
+          DLOG ("Cannot allocate receive buffers");
+          sockfd = -1;
+          goto out;
         }
-        circular_init (tss->fd_table[sockfd].tcp_recv_buf_circ,
-                       (void *) tss->fd_table[sockfd].tcp_recv_buf,
-                       TCP_RECV_BUF_LEN,
-                       sizeof (tcp_recv_buf_t));
-        
-        circular_init (tss->fd_table[sockfd].tcp_accept_circ,
-                       (void *) tss->fd_table[sockfd].tcp_accept_buf,
-                       TCP_ACCEPT_LEN,
-                       sizeof (int));
 
         tcp_arg (tpcb, (void *) (&tss->fd_table[sockfd]));
+        tcp_sent (tpcb, tcp_sent_callback);
         DLOG ("New TCP socket descriptor: %d", sockfd);
       }
       break;
     default :
       logger_printf ("Socket type %d is not supported\n", type);
-      return -1;
+      sockfd = -1;
   }
 
+ out:
+  klock_unlock (&fd_lock);
+  klock_unlock (&net_lock);
   return sockfd;
 }
 
@@ -222,6 +444,7 @@ sys_call_close (int filedes)
 {
   quest_tss * tss;
   err_t err;
+  int ret = 0;
   tss = percpu_read (current_task);
 
   if (!tss) {
@@ -233,25 +456,38 @@ sys_call_close (int filedes)
     return 0;
   }
   
+  klock_lock (&net_lock);
+  klock_lock (&fd_lock);
+
+  switch (tss->fd_table[filedes].type) {
+  case FD_TYPE_UDP :
+  case FD_TYPE_TCP :
+    /* drop the partially read pbuf */
+    if (tss->fd_table[filedes].recv_cur.udp.buf) {
+      pbuf_free (tss->fd_table[filedes].recv_cur.udp.buf);
+      tss->fd_table[filedes].recv_cur.udp.buf = NULL;
+    }
+    memset (tss->fd_table[filedes].pollers, 0,
+            sizeof (tss->fd_table[filedes].pollers));
+    break;
+  }
+
   switch (tss->fd_table[filedes].type) {
   case FD_TYPE_UDP :
     DLOG ("close UDP socket %d", filedes);
     udp_remove ((struct udp_pcb *) tss->fd_table[filedes].entry);
     tss->fd_table[filedes].entry = NULL;
-    kfree (tss->fd_table[filedes].udp_recv_buf);
-    kfree (tss->fd_table[filedes].udp_recv_buf_circ);
+    udp_sock_bufs_free (&tss->fd_table[filedes]);
     break;
   case FD_TYPE_TCP :
     DLOG ("close TCP socket %d", filedes);
     if ((err = tcp_close ((struct tcp_pcb *) tss->fd_table[filedes].entry)) != ERR_OK) {
       DLOG ("TCP PCB close failed: %d", err);
-      return -1;
+      ret = -1;
+      break;
     }
     tss->fd_table[filedes].entry = NULL;
-    kfree (tss->fd_table[filedes].tcp_recv_buf);
-    kfree (tss->fd_table[filedes].tcp_recv_buf_circ);
-    kfree (tss->fd_table[filedes].tcp_accept_buf);
-    kfree (tss->fd_table[filedes].tcp_accept_circ);
+    tcp_sock_bufs_free (&tss->fd_table[filedes]);
     break;
   case FD_TYPE_FILE:
     free_fd_table_file_entry(tss->fd_table[filedes].entry);
@@ -260,10 +496,12 @@ sys_call_close (int filedes)
   default :
     logger_printf ("Socket or file type %d not supported in close\n",
                    tss->fd_table[filedes].type);
-    return -1;
+    ret = -1;
   }
  
-  return 0;
+  klock_unlock (&fd_lock);
+  klock_unlock (&net_lock);
+  return ret;
 }
 
 static int
@@ -271,6 +509,7 @@ sys_call_bind (int sockfd, uint32_t addr, uint16_t port)
 {
   quest_tss * tss;
   err_t err;
+  int ret = 0;
   fd_table_entry_t fd_ent;
   tss = percpu_read (current_task);
 
@@ -281,6 +520,7 @@ sys_call_bind (int sockfd, uint32_t addr, uint16_t port)
 
   fd_ent = tss->fd_table[sockfd];
 
+  klock_lock (&net_lock);
   switch (fd_ent.type) {
     case FD_TYPE_UDP :
       DLOG ("UDP socket %d bind to: %s:%d", sockfd,
@@ -288,7 +528,7 @@ sys_call_bind (int sockfd, uint32_t addr, uint16_t port)
       if ((err = udp_bind ((struct udp_pcb *) fd_ent.entry,
                            (struct ip_addr *) &addr, ntohs (port))) != ERR_OK) {
         DLOG ("UDP bind failed: %d", err);
-        return -1;
+        ret = -1;
       }
       break;
     case FD_TYPE_TCP :
@@ -297,16 +537,17 @@ sys_call_bind (int sockfd, uint32_t addr, uint16_t port)
       if ((err = tcp_bind ((struct tcp_pcb *) fd_ent.entry,
                            (struct ip_addr *) &addr, ntohs (port))) != ERR_OK) {
         DLOG ("TCP bind failed: %d", err);
-        return -1;
+        ret = -1;
       }
       break;
     default :
       logger_printf ("Socket type %d not supported in bind\n",
                      fd_ent.type);
-      return -1;
+      ret = -1;
   }
+  klock_unlock (&net_lock);
 
-  return 0;
+  return ret;
 }
 
 static int sys_call_tcp_connect_status = 0;
@@ -332,6 +573,7 @@ sys_call_connect (int sockfd, uint32_t addr, uint16_t port)
 {
   quest_tss * tss;
   err_t err;
+  int ret = 0;
   fd_table_entry_t fd_ent;
   tss = percpu_read (current_task);
 
@@ -342,12 +584,13 @@ sys_call_connect (int sockfd, uint32_t addr, uint16_t port)
 
   fd_ent = tss->fd_table[sockfd];
 
+  klock_lock (&net_lock);
   switch (fd_ent.type) {
     case FD_TYPE_UDP :
       if ((err = udp_connect ((struct udp_pcb *) fd_ent.entry,
                               (struct ip_addr *) &addr, ntohs (port))) != ERR_OK) {
         DLOG ("UDP connect failed: %d", err);
-        return -1;
+        ret = -1;
       }
       break;
     case FD_TYPE_TCP :
@@ -355,23 +598,29 @@ sys_call_connect (int sockfd, uint32_t addr, uint16_t port)
       if ((err = tcp_connect ((struct tcp_pcb *) fd_ent.entry,
                               (struct ip_addr *) &addr, ntohs (port), tcp_connected)) != ERR_OK) {
         DLOG ("TCP connect failed: %d", err);
-        return -1;
+        ret = -1;
+        break;
       }
       DLOG ("TCP Connecting to: %s:%d ...",
             inet_ntoa (* ((struct in_addr *) &addr)), ntohs (port));
+      /* The connection completes from network input, which needs
+       * net_lock */
+      klock_unlock (&net_lock);
       sti ();
       while (!sys_call_tcp_connect_status);
       cli ();
+      klock_lock (&net_lock);
       if (sys_call_tcp_connect_status == -1)
-        return -1;
+        ret = -1;
       break;
     default :
       logger_printf ("Socket type %d not supported in connect\n",
                      fd_ent.type);
-      return -1;
+      ret = -1;
   }
+  klock_unlock (&net_lock);
 
-  return 0;
+  return ret;
 }
 
 static err_t
@@ -385,7 +634,11 @@ tcp_accept_callback (void *arg, struct tcp_pcb *new_tpcb, err_t err)
     logger_printf ("Accept error returned by Lwip");
     return err;
   } else {
+    /* Runs from network input with net_lock held; claim the slot in
+     * the listener's table under fd_lock */
+    klock_lock (&fd_lock);
     if ((new_sockfd = find_fd (tss)) == -1 ) {
+      klock_unlock (&fd_lock);
       DLOG ("Cannot allocate file descriptor");
       return -1;
     }
@@ -393,38 +646,24 @@ tcp_accept_callback (void *arg, struct tcp_pcb *new_tpcb, err_t err)
     tss->fd_table[new_sockfd].task = tss;
     tss->fd_table[new_sockfd].entry = (void *) new_tpcb;
     tss->fd_table[new_sockfd].type = FD_TYPE_TCP;
-    tss->fd_table[new_sockfd].tcp_recv_buf_circ = kzalloc (sizeof (circular));
-    tss->fd_table[new_sockfd].tcp_accept_circ = kzalloc (sizeof (circular));
-    tss->fd_table[new_sockfd].tcp_recv_buf = kzalloc (sizeof (tcp_recv_buf_t) *
-                                                      TCP_RECV_BUF_LEN);
-    tss->fd_table[new_sockfd].tcp_accept_buf = kzalloc (sizeof (int) *
-                                                        TCP_ACCEPT_LEN);
-    if ((tss->fd_table[new_sockfd].tcp_recv_buf_circ == 0) ||
-        (tss->fd_table[new_sockfd].tcp_recv_buf == 0) ||
-        (tss->fd_table[new_sockfd].tcp_accept_circ == 0) ||
-        (tss->fd_table[new_sockfd].tcp_accept_buf == 0)) {
-      DLOG ("kzalloc failed!");
+    socket_init_state (&tss->fd_table[new_sockfd]);
+    klock_unlock (&fd_lock);
+    if (!tcp_sock_bufs_alloc (&tss->fd_table[new_sockfd])) {
+      DLOG ("Cannot allocate receive buffers");
       return -1;
     }
-    circular_init (tss->fd_table[new_sockfd].tcp_recv_buf_circ,
-                   (void *) tss->fd_table[new_sockfd].tcp_recv_buf,
-                   TCP_RECV_BUF_LEN,
-                   sizeof (tcp_recv_buf_t));
-
-    circular_init (tss->fd_table[new_sockfd].tcp_accept_circ,
-                   (void *) tss->fd_table[new_sockfd].tcp_accept_buf,
-                   TCP_ACCEPT_LEN,
-                   sizeof (int));
 
     tcp_arg (new_tpcb, (void *) (&tss->fd_table[new_sockfd]));
     /* Register receive callback once connection is accepted */
     tcp_recv (new_tpcb, tcp_recv_callback);
+    tcp_sent (new_tpcb, tcp_sent_callback);
 
     if (circular_insert_nowait (fd_ent->tcp_accept_circ, &new_sockfd) == -1) {
       DLOG ("TCP connection accept buffer is full");
       /* Which error code shall we return here? */
       return -1;
     }
+    socket_wake (fd_ent);
 
     DLOG ("New socket %d inserted to accept queue", new_sockfd);
     /* Register receive callback once connection is accepted */
@@ -456,9 +695,12 @@ sys_call_listen (int sockfd, int backlog)
         return -1;
       }
       DLOG ("Listening on socket %d", sockfd);
+      klock_lock (&net_lock);
       new_pcb = tcp_listen ((struct tcp_pcb *) fd_ent.entry);
-      fd_ent.entry = (void *) new_pcb;
+      /* tcp_listen frees the old PCB */
+      tss->fd_table[sockfd].entry = (void *) new_pcb;
       tcp_accept (new_pcb, tcp_accept_callback);
+      klock_unlock (&net_lock);
       break;
     default :
       logger_printf ("Socket type %d not supported in listen\n",
@@ -511,7 +753,9 @@ sys_call_accept (int sockfd, void *addr, void *len)
 
       if (len)
         *((socklen_t *) len) = sizeof (struct sockaddr_in);
+      klock_lock (&net_lock);
       tcp_accepted ((struct tcp_pcb *) fd_ent.entry);
+      klock_unlock (&net_lock);
       break;
     default :
       logger_printf ("Socket type %d not supported in accept\n",
@@ -567,20 +811,21 @@ sys_call_write (int filedes, const void *buf, int nbytes)
 
   fd_ent = tss->fd_table[filedes];
 
+  klock_lock (&net_lock);
   switch (fd_ent.type) {
     case FD_TYPE_UDP :
       p = pbuf_alloc (PBUF_TRANSPORT, nbytes, PBUF_RAM);
       if (p == NULL) {
         DLOG ("pbuf allocation failed");
-        return -1;
+        nbytes_sent = -1;
+        break;
       }
       /* --!!-- Remove memcpy if performance or memory becomes a problem */
       memcpy (p->payload, buf, nbytes);
       DLOG ("Sending %d bytes on UDP socket %d", nbytes, filedes);
       if ((err = udp_send ((struct udp_pcb *) fd_ent.entry, p)) != ERR_OK) {
         DLOG ("UDP sent failed : %d", err);
-        pbuf_free (p);
-        return -1;
+        nbytes_sent = -1;
       }
       pbuf_free (p);
       break;
@@ -605,18 +850,27 @@ TCP_SENDING:
         DLOG ("nbytes_sent=%d", nbytes_sent);
         if (err == ERR_MEM) {
           /* Retry if ERR_MEM returned */
+          klock_unlock (&net_lock);
           tsc_delay_usec (5000);
+          klock_lock (&net_lock);
           if (++count >= 5) {
-            return -1;
+            break;
           }
           continue;
         }
-        return -1;
+        break;
+      }
+      if (err != ERR_OK) {
+        nbytes_sent = -1;
+        break;
       }
       tcp_output ((struct tcp_pcb *) fd_ent.entry);
+      /* ACKs arrive through network input, which needs net_lock */
+      klock_unlock (&net_lock);
       sti ();
       while (!sys_call_tcp_sent_status);
       cli ();
+      klock_lock (&net_lock);
       DLOG ("TCP %d bytes sent", nbytes_sent);
       nbytes_sent += sys_call_tcp_sent_status;
       if (nbytes_sent != nbytes) goto TCP_SENDING;
@@ -624,8 +878,9 @@ TCP_SENDING:
     default :
       logger_printf ("Socket type %d not supported in write\n",
                      fd_ent.type);
-      return -1;
+      nbytes_sent = -1;
   }
+  klock_unlock (&net_lock);
 
   return nbytes_sent;
 }
@@ -648,8 +903,10 @@ sys_call_sendto (int sockfd, const void *buf, int nbytes, uint32 addr, uint16 po
 
   switch (fd_ent.type) {
     case FD_TYPE_UDP :
+      klock_lock (&net_lock);
       p = pbuf_alloc (PBUF_TRANSPORT, nbytes, PBUF_RAM);
       if (p == NULL) {
+        klock_unlock (&net_lock);
         DLOG ("pbuf allocation failed");
         return -1;
       }
@@ -662,11 +919,13 @@ sys_call_sendto (int sockfd, const void *buf, int nbytes, uint32 addr, uint16 po
                              (struct ip_addr *) &addr, ntohs (port))) != ERR_OK) {
         logger_printf ("UDP sendto failed : %d\n", err);
         pbuf_free (p);
+        klock_unlock (&net_lock);
         return -1;
       }
       DLOG ("UDP packet sent to: %s:%d",
             inet_ntoa (* ((struct in_addr *) &addr)), ntohs (port));
       pbuf_free (p);
+      klock_unlock (&net_lock);
       break;
     case FD_TYPE_TCP :
       /* call write directly for connection-based socket */
@@ -680,14 +939,13 @@ sys_call_sendto (int sockfd, const void *buf, int nbytes, uint32 addr, uint16 po
   return nbytes;
 }
 
-static udp_recv_buf_t udpb = {.buf = NULL, .bytes_read = 0};
-static tcp_recv_buf_t tcpb = {.buf = NULL, .bytes_read = 0};
-
 static int
 sys_call_recv (int sockfd, void *buf, int nbytes, void *addr, void *len)
 {
   quest_tss * tss;
-  fd_table_entry_t fd_ent;
+  fd_table_entry_t * fd_ent;
+  udp_recv_buf_t * udpb;
+  tcp_recv_buf_t * tcpb;
   tss = percpu_read (current_task);
   int nbytes_recvd = 0;
   struct pbuf *q = NULL;
@@ -699,46 +957,53 @@ sys_call_recv (int sockfd, void *buf, int nbytes, void *addr, void *len)
     return -1;
   }
 
-  fd_ent = tss->fd_table[sockfd];
+  if (sockfd < 0 || sockfd >= MAX_FD)
+    return -1;
+
+  /* The partially read pbuf is kept per descriptor */
+  fd_ent = &tss->fd_table[sockfd];
 
-  if(!fd_ent.entry) {
+  if(!fd_ent->entry) {
     return -1;
   }
 
-  switch (fd_ent.type) {
+  switch (fd_ent->type) {
     case FD_TYPE_UDP :
       DLOG ("sys_call_recv: Receiving UDP data from socket %d", sockfd);
-      if (udpb.buf == NULL) {
+      udpb = &fd_ent->recv_cur.udp;
+      if (udpb->buf == NULL) {
         lock_kernel ();
-        if(fd_ent.flags & O_NONBLOCK) {
-          circular_remove_nowait (fd_ent.udp_recv_buf_circ, &udpb);
-          if(udpb.buf == NULL) {
+        if(fd_ent->flags & O_NONBLOCK) {
+          circular_remove_nowait (fd_ent->udp_recv_buf_circ, udpb);
+          if(udpb->buf == NULL) {
             unlock_kernel();
             return 0;
           }
         }
         else {
-          circular_remove (fd_ent.udp_recv_buf_circ, &udpb);
+          circular_remove (fd_ent->udp_recv_buf_circ, udpb);
         }
-        
+
         unlock_kernel ();
       }
 
-      q = udpb.buf;
+      q = udpb->buf;
       DLOG ("Data available, Total length: %d, length: %d, User buffer length: %d",
             q->tot_len, q->len, nbytes);
-      DLOG ("Buffer read: %d", udpb.bytes_read);
+      DLOG ("Buffer read: %d", udpb->bytes_read);
       /* Calculate index */
-      buf_index = udpb.bytes_read;
+      buf_index = udpb->bytes_read;
       while (buf_index >= q->len) {
         if (q->next) {
           buf_index -= q->len;
           q = q->next;
         } else {
           DLOG ("Received length greater than pbuf total");
-          pbuf_free (udpb.buf);
-          udpb.buf = NULL;
-          udpb.bytes_read = 0;
+          klock_lock (&net_lock);
+          pbuf_free (udpb->buf);
+          klock_unlock (&net_lock);
+          udpb->buf = NULL;
+          udpb->bytes_read = 0;
           return -1;
         }
       }
@@ -747,7 +1012,7 @@ sys_call_recv (int sockfd, void *buf, int nbytes, void *addr, void *len)
         if ((nbytes_recvd + q->len - buf_index) > nbytes) {
           DLOG ("UDP user buffer smaller than pbuf");
           memcpy (b, ((uint8 *) q->payload) + buf_index, nbytes - nbytes_recvd);
-          udpb.bytes_read += (nbytes - nbytes_recvd);
+          udpb->bytes_read += (nbytes - nbytes_recvd);
           return nbytes;
         }
         memcpy (b, ((uint8 *) q->payload) + buf_index, q->len - buf_index);
@@ -758,48 +1023,64 @@ sys_call_recv (int sockfd, void *buf, int nbytes, void *addr, void *len)
       }
       DLOG ("Bytes received: %d", nbytes_recvd);
       if (addr)
-        memcpy (addr, &(udpb.addr), sizeof (struct sockaddr_in));
+        memcpy (addr, &(udpb->addr), sizeof (struct sockaddr_in));
       if (len)
         *((socklen_t *) len) = sizeof (struct sockaddr_in);
-      pbuf_free (udpb.buf);
-      udpb.buf = NULL;
-      udpb.bytes_read = 0;
+      klock_lock (&net_lock);
+      pbuf_free (udpb->buf);
+      klock_unlock (&net_lock);
+      udpb->buf = NULL;
+      udpb->bytes_read = 0;
       break;
     case FD_TYPE_TCP :
       DLOG ("sys_call_recv: Receiving TCP data from socket %d", sockfd);
-      if (tcpb.buf == NULL) {
+      tcpb = &fd_ent->recv_cur.tcp;
+      if (tcpb->buf == NULL) {
         lock_kernel ();
-        if(fd_ent.flags & O_NONBLOCK) {
-          logger_printf("tcp remove no wait called\n");
-          circular_remove_nowait (fd_ent.tcp_recv_buf_circ, &tcpb);
-          if(tcpb.buf == NULL) {
+        /* Every read after the remote side has closed, and the data
+         * before it has been consumed, sees end-of-stream */
+        if (fd_ent->rx_closed &&
+            circular_count (fd_ent->tcp_recv_buf_circ) == 0) {
+          unlock_kernel ();
+          DLOG ("recv: socket %d closed by remote host", sockfd);
+          return 0;
+        }
+        if(fd_ent->flags & O_NONBLOCK) {
+          circular_remove_nowait (fd_ent->tcp_recv_buf_circ, tcpb);
+          if(tcpb->buf == NULL) {
             unlock_kernel();
             return 0;
           }
         }
         else {
-          logger_printf("tcp remove called\n");
-          circular_remove (fd_ent.tcp_recv_buf_circ, &tcpb);
+          circular_remove (fd_ent->tcp_recv_buf_circ, tcpb);
         }
-        
+
         unlock_kernel ();
+        if (tcpb->buf == NULL) {
+          /* wakeup entry from tcp_recv_callback */
+          DLOG ("recv: socket %d closed by remote host", sockfd);
+          return 0;
+        }
       }
 
-      q = tcpb.buf;
+      q = tcpb->buf;
       DLOG ("Data available, Total length: %d, length: %d, User buffer length: %d",
             q->tot_len, q->len, nbytes);
-      DLOG ("Buffer read: %d", tcpb.bytes_read);
+      DLOG ("Buffer read: %d", tcpb->bytes_read);
       /* Calculate index */
-      buf_index = tcpb.bytes_read;
+      buf_index = tcpb->bytes_read;
       while (buf_index >= q->len) {
         if (q->next) {
           buf_index -= q->len;
           q = q->next;
         } else {
           DLOG ("Received length greater than pbuf total");
-          pbuf_free (tcpb.buf);
-          tcpb.buf = NULL;
-          tcpb.bytes_read = 0;
+          klock_lock (&net_lock);
+          pbuf_free (tcpb->buf);
+          klock_unlock (&net_lock);
+          tcpb->buf = NULL;
+          tcpb->bytes_read = 0;
           return -1;
         }
       }
@@ -808,7 +1089,7 @@ sys_call_recv (int sockfd, void *buf, int nbytes, void *addr, void *len)
         if ((nbytes_recvd + q->len - buf_index) > nbytes) {
           DLOG ("TCP user buffer smaller than pbuf");
           memcpy (b, ((uint8 *) q->payload) + buf_index, nbytes - nbytes_recvd);
-          tcpb.bytes_read += (nbytes - nbytes_recvd);
+          tcpb->bytes_read += (nbytes - nbytes_recvd);
           return nbytes;
         }
         memcpy (b, ((uint8 *) q->payload) + buf_index, q->len - buf_index);
@@ -819,216 +1100,235 @@ sys_call_recv (int sockfd, void *buf, int nbytes, void *addr, void *len)
       }
       DLOG ("Bytes received: %d", nbytes_recvd);
       if (addr)
-        memcpy (addr, &(tcpb.addr), sizeof (struct sockaddr_in));
+        memcpy (addr, &(tcpb->addr), sizeof (struct sockaddr_in));
       if (len)
         *((socklen_t *) len) = sizeof (struct sockaddr_in);
-      tcp_recved ((struct tcp_pcb *) fd_ent.entry, tcpb.buf->tot_len);
-      pbuf_free (tcpb.buf);
-      tcpb.buf = NULL;
-      tcpb.bytes_read = 0;
+      klock_lock (&net_lock);
+      tcp_recved ((struct tcp_pcb *) fd_ent->entry, tcpb->buf->tot_len);
+      pbuf_free (tcpb->buf);
+      klock_unlock (&net_lock);
+      tcpb->buf = NULL;
+      tcpb->bytes_read = 0;
       break;
     default :
       logger_printf ("Socket type %d not supported in recv\n",
-                     fd_ent.type);
+                     fd_ent->type);
       return -1;
   }
 
   return nbytes_recvd;
 }
 
+/* Longest single sleep in poll.  A task waiting with no timeout
+ * re-checks its descriptors this often, which covers events that
+ * have no wake-up of their own (e.g. a TCP error). */
+#define POLL_MAX_SLEEP_USEC 1000000
+
+/* Readiness of one socket descriptor.  Must hold the scheduler lock,
+ * so that the lwIP callbacks cannot run between this check and
+ * going to sleep. */
+static short
+socket_revents (fd_table_entry_t *fd_ent, short events)
+{
+  struct tcp_pcb *tpcb;
+  short revents = 0;
+
+  switch (fd_ent->type) {
+    case FD_TYPE_UDP :
+      if (fd_ent->recv_cur.udp.buf ||
+          circular_count (fd_ent->udp_recv_buf_circ) > 0)
+        revents |= POLLIN;
+      revents |= POLLOUT;
+      break;
+    case FD_TYPE_TCP :
+      tpcb = (struct tcp_pcb *) fd_ent->entry;
+      if (fd_ent->recv_cur.tcp.buf ||
+          circular_count (fd_ent->tcp_recv_buf_circ) > 0 ||
+          circular_count (fd_ent->tcp_accept_circ) > 0)
+        revents |= POLLIN;
+      if (fd_ent->rx_closed)
+        revents |= POLLHUP;
+      klock_lock (&net_lock);
+      if (tpcb && (tpcb->state == ESTABLISHED || tpcb->state == CLOSE_WAIT) &&
+          tcp_sndbuf (tpcb) > 0)
+        revents |= POLLOUT;
+      klock_unlock (&net_lock);
+      break;
+    default :
+      return POLLNVAL;
+  }
+
+  return revents & (events | POLLERR | POLLHUP);
+}
+
+/* Wait until one of fds is ready or timeout milliseconds pass
+ * (negative: no timeout).  Must hold the scheduler lock.  Returns the
+ * number of descriptors with non-zero revents. */
 static int
-sys_call_select (int maxfdp1, fd_set * readfds, fd_set * writefds,
-                 fd_set * exceptfds, struct timeval * tvptr)
+do_poll (quest_tss *tss, struct pollfd *fds, int nfds, int timeout)
 {
-  int i = 0, count = 0;
-  quest_tss * tss = percpu_read (current_task);
-  fd_set read_ready;
-  bool ready = FALSE;
-  int wait_count = 0;
+  extern u32 tsc_freq_msec;
+  int i, count;
+  u64 now, deadline = 0;
+  u32 usec;
+
+  if (timeout > 0) {
+    RDTSC (now);
+    deadline = now + (u64) timeout * tsc_freq_msec;
+  }
 
-  FD_ZERO (&read_ready);
+  for (;;) {
+    count = 0;
+    for (i = 0; i < nfds; i++) {
+      fds[i].revents = 0;
+      if (fds[i].fd < 0)
+        continue;
+      if (fds[i].fd >= MAX_FD)
+        fds[i].revents = POLLNVAL;
+      else
+        fds[i].revents = socket_revents (&tss->fd_table[fds[i].fd],
+                                         fds[i].events);
+      if (fds[i].revents)
+        count++;
+    }
 
-  lock_kernel ();
+    if (count > 0 || timeout == 0)
+      break;
+
+    usec = POLL_MAX_SLEEP_USEC;
+    if (timeout > 0) {
+      RDTSC (now);
+      if (now >= deadline)
+        break;
+      if (deadline - now < (u64) POLL_MAX_SLEEP_USEC / 1000 * tsc_freq_msec)
+        usec = (u32) div64_64 ((deadline - now) * 1000, tsc_freq_msec);
+      if (usec == 0)
+        break;
+    }
+
+    /* Any callback on these sockets now wakes us early */
+    for (i = 0; i < nfds; i++)
+      if (fds[i].fd >= 0 && fds[i].fd < MAX_FD)
+        poller_add (socket_owner (tss, fds[i].fd), tss);
+    sched_usleep (usec);
+    for (i = 0; i < nfds; i++)
+      if (fds[i].fd >= 0 && fds[i].fd < MAX_FD)
+        poller_remove (socket_owner (tss, fds[i].fd), tss);
+  }
+
+  DLOG ("poll return: %d", count);
+  return count;
+}
+
+static int
+sys_call_poll (struct pollfd *fds, int nfds, int timeout)
+{
+  quest_tss * tss = percpu_read (current_task);
+  int count;
 
   if (!tss) {
     logger_printf ("No current task\n");
-    count = 0;
-    goto finish;
+    return -1;
   }
 
-  if (tvptr != NULL)
-    DLOG ("Time out: %d seconds, %d microseconds", tvptr->tv_sec, tvptr->tv_usec);
+  if (nfds < 0 || nfds > MAX_FD)
+    return -1;
 
-  /* If no sets specified, select becomes "sleep" */
-  if ((readfds == NULL) && (writefds == NULL)) {
-    if (tvptr != NULL) {
-      sched_usleep (tvptr->tv_sec * 1000000LL + tvptr->tv_usec);
-      count = 0;
-    }
-    goto finish;
+  lock_kernel ();
+  count = do_poll (tss, fds, nfds, timeout);
+  unlock_kernel ();
+
+  return count;
+}
+
+static int
+sys_call_select (int maxfdp1, fd_set * readfds, fd_set * writefds,
+                 fd_set * exceptfds, struct timeval * tvptr)
+{
+  int i = 0, count = 0, nfds = 0, timeout = -1;
+  quest_tss * tss = percpu_read (current_task);
+  struct pollfd fds[MAX_FD];
+  short events;
+
+  if (!tss) {
+    logger_printf ("No current task\n");
+    return 0;
   }
 
-#ifdef DEBUG_SOCKET
-  /* Debug info */
-  DLOG("maxfdp1 = %d", maxfdp1);
-  DLOG ("Select called on readfds:");
-  logger_printf ("  ");
-  for (i = 0; i < MAX_FD; i++) {
-    if (FD_ISSET (i, readfds)) {
-      logger_printf ("%d ", i);
-    }
+  if (tvptr != NULL) {
+    DLOG ("Time out: %d seconds, %d microseconds", tvptr->tv_sec, tvptr->tv_usec);
+    timeout = tvptr->tv_sec * 1000 + (tvptr->tv_usec + 999) / 1000;
   }
-  logger_printf ("\n");
-#endif
 
-#if 1
-
-check_readfds:
-
-  if (readfds) {
-    for (i = 0; i < maxfdp1; i++) {
-      if (FD_ISSET (i, readfds)) {
-        switch (tss->fd_table[i].type) {
-          case FD_TYPE_UDP :
-            if (udpb.buf) {
-              ready = TRUE;
-              FD_SET(i, &read_ready);
-              count++;
-            } else if (circular_remove_nowait (tss->fd_table[i].udp_recv_buf_circ,
-                                               &udpb) != -1) {
-              ready = TRUE;
-              FD_SET(i, &read_ready);
-              count++;
-            } else {
-              continue;
-            }
-            break;
-          case FD_TYPE_TCP :
-            if (tcpb.buf) {
-              ready = TRUE;
-              FD_SET(i, &read_ready);
-              count++;
-            } else if (circular_remove_nowait (tss->fd_table[i].tcp_recv_buf_circ,
-                                               &tcpb) != -1) {
-              ready = TRUE;
-              FD_SET(i, &read_ready);
-              count++;
-            } else {
-              continue;
-            }
-            break;
-          default:
-            DLOG ("File descriptor type unsupported in select, fd = %d, type = %d\n",
-                  i, tss->fd_table[i].type);
-            return -1;
-        }
-      }
+  if (maxfdp1 > MAX_FD)
+    maxfdp1 = MAX_FD;
+
+  for (i = 0; i < maxfdp1; i++) {
+    events = 0;
+    if (readfds && FD_ISSET (i, readfds))
+      events |= POLLIN;
+    if (writefds && FD_ISSET (i, writefds))
+      events |= POLLOUT;
+    if (events) {
+      fds[nfds].fd = i;
+      fds[nfds].events = events;
+      fds[nfds].revents = 0;
+      nfds++;
     }
   }
 
-  if (tvptr == NULL) goto skip_waiting;
+  lock_kernel ();
 
-  /* I'm lazy, just sleep 16 times here... */
-  if (!ready && (wait_count < 16)) {
-    sched_usleep ((tvptr->tv_sec * 1000000LL + tvptr->tv_usec) >> 4);
-    wait_count++;
-    goto check_readfds;
-  } else {
-    /* Oops! Time out! */
-    if (!ready) {
-      count = 0;
-      DLOG ("Select timeout");
-    } else {
-      /* Something is ready */
-      DLOG ("readfds has fd ready");
-    }
+  /* If no sets specified, select becomes "sleep" */
+  if (nfds == 0) {
+    if (tvptr != NULL)
+      sched_usleep (tvptr->tv_sec * 1000000LL + tvptr->tv_usec);
+    unlock_kernel ();
+    return 0;
   }
 
-skip_waiting:
-  /* Now, some read fds are ready. We can return since we ignore write fds for now. */
-  /* Replace old readfds with read_ready set */
-  memcpy (readfds, &read_ready, sizeof (read_ready));
+  do_poll (tss, fds, nfds, timeout);
 
-#else
+  unlock_kernel ();
 
-  if (readfds) {
-    for (i = 0; i < maxfdp1; i++) {
-      if (FD_ISSET (i, readfds)) {
-        count++;
-      }
+  if (readfds)
+    FD_ZERO (readfds);
+  if (writefds)
+    FD_ZERO (writefds);
+  if (exceptfds)
+    FD_ZERO (exceptfds);
+
+  for (i = 0; i < nfds; i++) {
+    if (fds[i].revents & POLLNVAL) {
+      DLOG ("File descriptor type unsupported in select, fd = %d, type = %d\n",
+            fds[i].fd, tss->fd_table[fds[i].fd].type);
+      return -1;
     }
-  }
-
-#endif
-
-#ifdef DEBUG_SOCKET
-  /* Debug info */
-  DLOG ("Read sockets in readfds:");
-  for (i = 0; i < MAX_FD; i++) {
-    if (FD_ISSET (i, readfds)) {
-      logger_printf ("  Socket %d ready for read\n", i);
+    /* hang-up reads as end-of-file */
+    if (fds[i].revents & (POLLIN | POLLHUP) && fds[i].events & POLLIN) {
+      FD_SET (fds[i].fd, readfds);
+      count++;
     }
-  }
-#endif
-
-  /* For write, assume all ready */
-  if (writefds) {
-    for (i = 0; i < maxfdp1; i++) {
-      if (FD_ISSET (i, writefds)) {
-        count++;
-      }
+    if (fds[i].revents & POLLOUT) {
+      FD_SET (fds[i].fd, writefds);
+      count++;
     }
   }
 
   DLOG ("Select return: %d", count);
-
-finish:
-  unlock_kernel ();
   return count;
 }
 
-extern uint64 tsc_freq;         /* timestamp counter frequency */
-static uint64 last_tsc = 0;
-static struct timeval last_tp = {0, 0};
-
-/* --!!-- This is a very crude implementation that assumes the first time
- * gettimeofday is called will be 1970... Let's read the real time from BIOS
- * during boot and setup an interrupt for the update later.
- *
- * We just want to make netperf work here, so...
- */
+/* Same clock as gettimeofday in libc, which reads the vDSO page
+ * instead of making this syscall */
 static int
 sys_call_get_time (struct timeval *tp)
 {
-  uint64 cur_tsc;
-  uint64 usec;
-  uint64 sec;
-
-  lock_kernel ();
-
-  RDTSC (cur_tsc);
-
-  /*
-  usec = div64_64 (cur_tsc - last_tsc, tsc_freq);
-  if (!usec) goto finish;
-  usec = usec * 1000000LL;
-  sec = div64_64 (usec, 1000000LL);
-  usec = usec - sec * 1000000LL;
-  */
-  
-  uint64 tsc_freq_usec = div64_64 (tsc_freq, 1000000LL);
-  usec = div64_64 (cur_tsc - last_tsc, tsc_freq_usec);
-  sec = div64_64 (usec, 1000000LL);
-  usec = usec - sec * 1000000LL;
-
-  last_tp.tv_sec += (long int) sec;
-  last_tp.tv_usec += (long int) usec;
+  u32 sec, usec;
 
-  last_tsc = cur_tsc;
-finish:
-  memcpy (tp, &last_tp, sizeof (struct timeval));
-  
-  unlock_kernel ();
+  vdso_get_time (&sec, &usec);
+  tp->tv_sec = sec;
+  tp->tv_usec = usec;
   return 0;
 }
 
@@ -1159,40 +1459,41 @@ int sys_call_fcntl(int fd, int cmd, void* extra_arg)
   quest_tss * tss;
   int res;
   
-  lock_kernel();
+  /* descriptor flags are fd-table state */
+  klock_lock (&fd_lock);
 
   tss = percpu_read (current_task);
 
   if (!tss) {
     logger_printf ("No current task\n");
-    unlock_kernel();
+    klock_unlock (&fd_lock);
     return -1;
   }
 
   if(!tss->fd_table[fd].entry) {
-    unlock_kernel();
+    klock_unlock (&fd_lock);
     return -1;
   }
   
   switch(cmd) {
   case F_SETFL:
     tss->fd_table[fd].flags = *((int*)extra_arg);
-    unlock_kernel();
+    klock_unlock (&fd_lock);
     return 0;
     
   case F_GETFL:
     res = tss->fd_table[fd].flags;
-    unlock_kernel();
+    klock_unlock (&fd_lock);
     return res;
     
   default:
     DLOG("Unknown command sent to fcntl");
-    unlock_kernel();
+    klock_unlock (&fd_lock);
     return -1;
   }
 
   DLOG("Reached end of %s unexpectedly", __FUNCTION__);
-  unlock_kernel();
+  klock_unlock (&fd_lock);
   return -1;
 }
 
@@ -1209,6 +1510,45 @@ int syscall_vshm_map(uint vshm_key, uint size, uint sandboxes, uint flags, void*
 #endif
 }
 
+int syscall_vshm_notify(uint sandbox, uint vshm_key)
+{
+#ifdef USE_VMX
+  int res;
+  lock_kernel();
+  res = vshm_notify(sandbox, vshm_key);
+  unlock_kernel();
+  return res;
+#else
+  return -1;
+#endif
+}
+
+int syscall_vshm_wait(uint vshm_key, uint usec)
+{
+#ifdef USE_VMX
+  int res;
+  lock_kernel();
+  res = vshm_wait(vshm_key, usec);
+  unlock_kernel();
+  return res;
+#else
+  return -1;
+#endif
+}
+
+int syscall_vshm_forget(uint vshm_key)
+{
+#ifdef USE_VMX
+  int res;
+  lock_kernel();
+  res = vshm_forget(vshm_key);
+  unlock_kernel();
+  return res;
+#else
+  return -1;
+#endif
+}
+
 int syscall_pololu_send_cmd (uint32_t ssc, uint32_t commands)
 {
   return pololu_send_cmd (ssc, (commands >> 24) & 0xFF, (commands >> 16) & 0xFF,
@@ -1273,6 +1613,10 @@ sys_call_ptr_t _socket_syscall_table [] ALIGNED (0x1000) = {
   (sys_call_ptr_t) syscall_pololu_send_cmd, /* 17 */
   (sys_call_ptr_t) syscall_create_thread,   /* 18 */
   (sys_call_ptr_t) syscall_thread_exit,     /* 19 */
+  (sys_call_ptr_t) sys_call_poll,           /* 20 */
+  (sys_call_ptr_t) syscall_vshm_notify,     /* 21 */
+  (sys_call_ptr_t) syscall_vshm_wait,       /* 22 */
+  (sys_call_ptr_t) syscall_vshm_forget,     /* 23 */
 };
 
 static bool socket_sys_call_initialized = FALSE;
@@ -16,9 +16,22 @@
  */
 
 #include "arch/i386.h"
+#include "kernel.h"
 #include "sched/sched.h"
 #include "util/circular.h"
 
+/* Blocking insert and remove put the caller on a waitqueue and call
+ * schedule, so they need the scheduler lock.  Whoever makes room or
+ * adds an element only wakes the other side if someone is parked,
+ * which it can only see reliably if it holds the scheduler lock too.
+ * Every user of a blocking call does. */
+static inline void
+circular_wake (quest_tss **q)
+{
+  if (*q)
+    wakeup_queue (q);
+}
+
 static inline void
 circular_lock (circular *c)
 {
@@ -31,6 +44,26 @@ circular_unlock (circular *c)
   spinlock_unlock (&c->lock);
 }
 
+/* Order the element's contents before the store that publishes it */
+static inline void
+circular_barrier (void)
+{
+  asm volatile ("":::"memory");
+}
+
+/* Slot of the free-running position pos in a lock-free buffer */
+static inline void *
+circular_slot (circular *c, uint32 pos)
+{
+  return c->buffer + (pos & (c->num_elts - 1)) * c->elt_size;
+}
+
+static inline uint32
+circular_index (circular *c, void *slot)
+{
+  return (slot - c->buffer) / c->elt_size;
+}
+
 /* Insert an element of any size into the circular buffer.  If buffer
  * is full, check if CIRCULAR_FLAG_NOWAIT is set.  If so, return -1,
  * else block. */
@@ -61,7 +94,7 @@ generic_circular_insert (circular *c, void *elt, uint32 flags)
   if (c->insert_ptr >= c->buffer_end)
     c->insert_ptr = c->buffer;
   ret = ++c->cur_count;
-  wakeup_queue (&c->rem_waitq);
+  circular_wake (&c->rem_waitq);
 
  finish:
   circular_unlock (c);
@@ -98,13 +131,287 @@ generic_circular_remove (circular *c, void *out_elt, uint32 flags)
   if (c->remove_ptr >= c->buffer_end)
     c->remove_ptr = c->buffer;
   ret = --c->cur_count;
-  wakeup_queue (&c->ins_waitq);
+  circular_wake (&c->ins_waitq);
 
  finish:
   circular_unlock (c);
   return ret;
 }
 
+/* The lock-free kinds share insert and remove, built on the
+ * zero-copy calls. */
+static sint32
+lockfree_circular_insert (circular *c, void *elt, uint32 flags)
+{
+  void *slot;
+
+  while (!(slot = circular_insert_reserve (c))) {
+    if (flags & CIRCULAR_FLAG_NOWAIT)
+      return -1;
+    queue_append (&c->ins_waitq, str ());
+    schedule ();                /* block */
+  }
+
+  memcpy (slot, elt, c->elt_size);
+  circular_insert_commit (c, slot);
+  return circular_count (c);
+}
+
+static sint32
+lockfree_circular_remove (circular *c, void *out_elt, uint32 flags)
+{
+  void *slot;
+
+  while (!(slot = circular_remove_peek (c))) {
+    if (flags & CIRCULAR_FLAG_NOWAIT)
+      return -1;
+    queue_append (&c->rem_waitq, str ());
+    schedule ();                /* block */
+  }
+
+  memcpy (out_elt, slot, c->elt_size);
+  circular_remove_release (c, slot);
+  return circular_count (c);
+}
+
+void *
+circular_insert_reserve (circular *c)
+{
+  uint32 pos;
+  sint32 d;
+
+  switch (c->type) {
+  case CIRCULAR_SPSC:
+    if (c->head - c->tail == c->num_elts)
+      return NULL;
+    return circular_slot (c, c->head);
+
+  case CIRCULAR_MPSC:
+    /* A slot is free for position pos when its sequence number is
+     * pos; the producer that moves head past pos owns it. */
+    for (;;) {
+      pos = c->head;
+      d = c->seq[pos & (c->num_elts - 1)] - pos;
+      if (d < 0)
+        return NULL;            /* still holds the element from pos - n */
+      if (d == 0 && atomic_cmpxchg_dword (&c->head, pos, pos + 1) == pos)
+        return circular_slot (c, pos);
+    }
+
+  default:
+    circular_lock (c);
+    if (c->cur_count == c->num_elts) {
+      circular_unlock (c);
+      return NULL;
+    }
+    return c->insert_ptr;
+  }
+}
+
+void
+circular_insert_commit (circular *c, void *slot)
+{
+  uint32 i;
+
+  switch (c->type) {
+  case CIRCULAR_SPSC:
+    circular_barrier ();
+    c->head++;
+    break;
+
+  case CIRCULAR_MPSC:
+    i = circular_index (c, slot);
+    circular_barrier ();
+    c->seq[i] = c->seq[i] + 1;
+    break;
+
+  default:
+    c->insert_ptr += c->elt_size;
+    if (c->insert_ptr >= c->buffer_end)
+      c->insert_ptr = c->buffer;
+    c->cur_count++;
+    circular_wake (&c->rem_waitq);
+    circular_unlock (c);
+    return;
+  }
+
+  circular_wake (&c->rem_waitq);
+}
+
+void *
+circular_remove_peek (circular *c)
+{
+  uint32 pos;
+
+  switch (c->type) {
+  case CIRCULAR_SPSC:
+    if (c->tail == c->head)
+      return NULL;
+    return circular_slot (c, c->tail);
+
+  case CIRCULAR_MPSC:
+    pos = c->tail;
+    if (c->seq[pos & (c->num_elts - 1)] != pos + 1)
+      return NULL;              /* empty, or not yet committed */
+    return circular_slot (c, pos);
+
+  default:
+    circular_lock (c);
+    if (c->cur_count == 0) {
+      circular_unlock (c);
+      return NULL;
+    }
+    return c->remove_ptr;
+  }
+}
+
+void
+circular_remove_release (circular *c, void *slot)
+{
+  uint32 i;
+
+  switch (c->type) {
+  case CIRCULAR_SPSC:
+    circular_barrier ();
+    c->tail++;
+    break;
+
+  case CIRCULAR_MPSC:
+    i = circular_index (c, slot);
+    circular_barrier ();
+    /* free for the producer one lap later */
+    c->seq[i] = c->tail + c->num_elts;
+    c->tail++;
+    break;
+
+  default:
+    c->remove_ptr += c->elt_size;
+    if (c->remove_ptr >= c->buffer_end)
+      c->remove_ptr = c->buffer;
+    c->cur_count--;
+    circular_wake (&c->ins_waitq);
+    circular_unlock (c);
+    return;
+  }
+
+  circular_wake (&c->ins_waitq);
+}
+
+sint32
+circular_insert_n (circular *c, void *elts, sint32 n)
+{
+  uint32 pos;
+  sint32 i, k;
+
+  /* the MPSC loop below would never claim anything */
+  if (n <= 0)
+    return 0;
+
+  switch (c->type) {
+  case CIRCULAR_SPSC:
+    pos = c->head;
+    k = c->num_elts - (pos - c->tail);
+    if (k > n)
+      k = n;
+    for (i = 0; i < k; i++)
+      memcpy (circular_slot (c, pos + i), elts + i * c->elt_size, c->elt_size);
+    circular_barrier ();
+    c->head = pos + k;
+    break;
+
+  case CIRCULAR_MPSC:
+    /* claim as many free slots as are wanted with one cmpxchg */
+    for (;;) {
+      pos = c->head;
+      for (k = 0; k < n; k++)
+        if (c->seq[(pos + k) & (c->num_elts - 1)] != pos + k)
+          break;
+      if (k == 0 && (sint32) (c->seq[pos & (c->num_elts - 1)] - pos) < 0)
+        return 0;               /* full */
+      if (k > 0 && atomic_cmpxchg_dword (&c->head, pos, pos + k) == pos)
+        break;
+    }
+    for (i = 0; i < k; i++)
+      memcpy (circular_slot (c, pos + i), elts + i * c->elt_size, c->elt_size);
+    circular_barrier ();
+    for (i = 0; i < k; i++)
+      c->seq[(pos + i) & (c->num_elts - 1)] = pos + i + 1;
+    break;
+
+  default:
+    circular_lock (c);
+    for (k = 0; k < n && c->cur_count < c->num_elts; k++) {
+      memcpy (c->insert_ptr, elts + k * c->elt_size, c->elt_size);
+      c->insert_ptr += c->elt_size;
+      if (c->insert_ptr >= c->buffer_end)
+        c->insert_ptr = c->buffer;
+      c->cur_count++;
+    }
+    if (k > 0)
+      circular_wake (&c->rem_waitq);
+    circular_unlock (c);
+    return k;
+  }
+
+  if (k > 0)
+    circular_wake (&c->rem_waitq);
+  return k;
+}
+
+sint32
+circular_remove_n (circular *c, void *out_elts, sint32 n)
+{
+  uint32 pos;
+  sint32 i, k;
+
+  switch (c->type) {
+  case CIRCULAR_SPSC:
+    pos = c->tail;
+    k = c->head - pos;
+    if (k > n)
+      k = n;
+    for (i = 0; i < k; i++)
+      memcpy (out_elts + i * c->elt_size, circular_slot (c, pos + i),
+              c->elt_size);
+    circular_barrier ();
+    c->tail = pos + k;
+    break;
+
+  case CIRCULAR_MPSC:
+    pos = c->tail;
+    for (k = 0; k < n; k++) {
+      i = (pos + k) & (c->num_elts - 1);
+      if (c->seq[i] != pos + k + 1)
+        break;
+      memcpy (out_elts + k * c->elt_size, circular_slot (c, pos + k),
+              c->elt_size);
+    }
+    circular_barrier ();
+    for (i = 0; i < k; i++)
+      c->seq[(pos + i) & (c->num_elts - 1)] = pos + i + c->num_elts;
+    c->tail = pos + k;
+    break;
+
+  default:
+    circular_lock (c);
+    for (k = 0; k < n && c->cur_count > 0; k++) {
+      memcpy (out_elts + k * c->elt_size, c->remove_ptr, c->elt_size);
+      c->remove_ptr += c->elt_size;
+      if (c->remove_ptr >= c->buffer_end)
+        c->remove_ptr = c->buffer;
+      c->cur_count--;
+    }
+    if (k > 0)
+      circular_wake (&c->ins_waitq);
+    circular_unlock (c);
+    return k;
+  }
+
+  if (k > 0)
+    circular_wake (&c->ins_waitq);
+  return k;
+}
+
 /* Instead of templates, use explicit element size parameter. */
 
 void
@@ -123,6 +430,44 @@ circular_init (circular *c, void *buffer, sint32 num_elts, sint32 elt_size)
   spinlock_init (&c->lock);
   c->ins_waitq  = 0;
   c->rem_waitq  = 0;
+  c->type       = CIRCULAR_LOCKED;
+  c->seq        = NULL;
+  c->head       = 0;
+  c->tail       = 0;
+}
+
+/* Lock-free circular buffer for one producer and one consumer at a
+ * time.  num_elts must be a power of 2. */
+void
+circular_init_spsc (circular *c, void *buffer, sint32 num_elts,
+                    sint32 elt_size)
+{
+  if (num_elts & (num_elts - 1))
+    panic ("circular_init_spsc: size not a power of 2");
+  circular_init (c, buffer, num_elts, elt_size);
+  c->type       = CIRCULAR_SPSC;
+  c->insert     = lockfree_circular_insert;
+  c->remove     = lockfree_circular_remove;
+}
+
+/* Lock-free circular buffer for any number of producers and one
+ * consumer at a time.  seq has num_elts entries, and num_elts must be
+ * a power of 2. */
+void
+circular_init_mpsc (circular *c, void *buffer, uint32 *seq,
+                    sint32 num_elts, sint32 elt_size)
+{
+  sint32 i;
+
+  if (num_elts & (num_elts - 1))
+    panic ("circular_init_mpsc: size not a power of 2");
+  circular_init (c, buffer, num_elts, elt_size);
+  c->type       = CIRCULAR_MPSC;
+  c->insert     = lockfree_circular_insert;
+  c->remove     = lockfree_circular_remove;
+  c->seq        = seq;
+  for (i = 0; i < num_elts; i++)
+    seq[i] = i;
 }
 
 /* 
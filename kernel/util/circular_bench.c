@@ -0,0 +1,266 @@
+/*                    The Quest Operating System
+ *  Copyright (C) 2005-2012  Richard West, Boston University
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Microbenchmark of the circular buffer kinds.  A producer and a
+ * consumer kernel thread, each on a main VCPU of its own CPU, pass
+ * elements through a locked, an SPSC and an MPSC buffer: one at a
+ * time with copying insert/remove, one at a time in place with
+ * reserve/commit, and in batches.  The consumer logs the cycles per
+ * element, which include moving the ring's cache lines between the
+ * two CPUs.  Both sides spin on the non-blocking calls.  Enable by
+ * uncommenting DEF_MODULE below. */
+
+#include "arch/i386.h"
+#include "arch/i386-div64.h"
+#include "kernel.h"
+#include "sched/vcpu.h"
+#include "smp/smp.h"
+#include "util/circular.h"
+#include "util/printf.h"
+
+#define BENCH_ELTS    64        /* power of 2, for the lock-free kinds */
+#define BENCH_BATCH   16
+#define BENCH_ROUNDS  100000
+
+enum { BENCH_COPY, BENCH_INPLACE, BENCH_BATCHED, BENCH_MODES };
+
+struct bench_elt
+{
+  u32 w[4];
+};
+
+static struct bench_elt bench_buf[BENCH_ELTS];
+static uint32 bench_seq[BENCH_ELTS];
+static circular bench_circ;
+
+/* The consumer sets up a run, then bumps bench_go.  The producer
+ * copies bench_go to bench_done once it has inserted every element.
+ * BENCH_END tells the producer to exit. */
+static volatile u32 bench_go = 0, bench_done = 0, bench_mode;
+#define BENCH_END ((u32) -1)
+
+static u32 bench_prod_stack[1024] ALIGNED (0x1000);
+static u32 bench_cons_stack[1024] ALIGNED (0x1000);
+
+static const char *kind_name[] = { "locked", "spsc", "mpsc" };
+
+static inline void
+bench_relax (void)
+{
+  asm volatile ("pause":::"memory");
+}
+
+static void
+bench_init (uint32 kind)
+{
+  switch (kind) {
+  case CIRCULAR_SPSC:
+    circular_init_spsc (&bench_circ, bench_buf, BENCH_ELTS,
+                        sizeof (struct bench_elt));
+    break;
+  case CIRCULAR_MPSC:
+    circular_init_mpsc (&bench_circ, bench_buf, bench_seq, BENCH_ELTS,
+                        sizeof (struct bench_elt));
+    break;
+  default:
+    circular_init (&bench_circ, bench_buf, BENCH_ELTS,
+                   sizeof (struct bench_elt));
+  }
+}
+
+/* Insert elements 0 .. BENCH_ROUNDS-1, spinning while the buffer is
+ * full */
+static void
+bench_produce (u32 mode)
+{
+  struct bench_elt e[BENCH_BATCH], *s;
+  int i = 0, k, n;
+
+  memset (e, 0, sizeof (e));
+  while (i < BENCH_ROUNDS) {
+    switch (mode) {
+    case BENCH_COPY:
+      e[0].w[0] = i;
+      if (circular_insert_nowait (&bench_circ, &e[0]) < 0) {
+        bench_relax ();
+        continue;
+      }
+      i++;
+      break;
+    case BENCH_INPLACE:
+      s = circular_insert_reserve (&bench_circ);
+      if (!s) {
+        bench_relax ();
+        continue;
+      }
+      s->w[0] = i;
+      circular_insert_commit (&bench_circ, s);
+      i++;
+      break;
+    default:
+      n = BENCH_ROUNDS - i < BENCH_BATCH ? BENCH_ROUNDS - i : BENCH_BATCH;
+      for (k = 0; k < n; k++)
+        e[k].w[0] = i + k;
+      k = circular_insert_n (&bench_circ, e, n);
+      if (k == 0)
+        bench_relax ();
+      i += k;
+    }
+  }
+}
+
+/* Remove BENCH_ROUNDS elements, spinning while the buffer is empty,
+ * and return their sum */
+static u64
+bench_consume (u32 mode)
+{
+  struct bench_elt e[BENCH_BATCH], *s;
+  int i = 0, k;
+  u64 sum = 0;
+
+  while (i < BENCH_ROUNDS) {
+    switch (mode) {
+    case BENCH_COPY:
+      if (circular_remove_nowait (&bench_circ, &e[0]) < 0) {
+        bench_relax ();
+        continue;
+      }
+      sum += e[0].w[0];
+      i++;
+      break;
+    case BENCH_INPLACE:
+      s = circular_remove_peek (&bench_circ);
+      if (!s) {
+        bench_relax ();
+        continue;
+      }
+      sum += s->w[0];
+      circular_remove_release (&bench_circ, s);
+      i++;
+      break;
+    default:
+      k = circular_remove_n (&bench_circ, e, BENCH_BATCH);
+      if (k == 0)
+        bench_relax ();
+      for (i += k; k > 0; k--)
+        sum += e[k - 1].w[0];
+    }
+  }
+  return sum;
+}
+
+static void
+circular_bench_producer (void)
+{
+  u32 seen = 0;
+
+  unlock_kernel ();
+  sti ();
+
+  for (;;) {
+    while (bench_go == seen)
+      bench_relax ();
+    seen = bench_go;
+    if (seen == BENCH_END)
+      break;
+    bench_produce (bench_mode);
+    bench_done = seen;
+  }
+
+  exit_kernel_thread ();
+}
+
+static void
+circular_bench_consumer (void)
+{
+  uint32 kind;
+  u32 mode;
+  u64 start, finish, sum, cycles[BENCH_MODES];
+
+  unlock_kernel ();
+  sti ();
+
+  for (kind = CIRCULAR_LOCKED; kind <= CIRCULAR_MPSC; kind++) {
+    bench_init (kind);
+    for (mode = 0; mode < BENCH_MODES; mode++) {
+      bench_mode = mode;
+      RDTSC (start);
+      bench_go++;
+      sum = bench_consume (mode);
+      RDTSC (finish);
+      while (bench_done != bench_go)
+        bench_relax ();
+      cycles[mode] = finish - start;
+      if (sum != (u64) BENCH_ROUNDS * (BENCH_ROUNDS - 1) / 2)
+        logger_printf ("circular bench: %s lost elements\n",
+                       kind_name[kind]);
+    }
+    logger_printf ("circular %s: cycles/elt copy %d in-place %d batch %d\n",
+                   kind_name[kind],
+                   (u32) div64_64 (cycles[BENCH_COPY], BENCH_ROUNDS),
+                   (u32) div64_64 (cycles[BENCH_INPLACE], BENCH_ROUNDS),
+                   (u32) div64_64 (cycles[BENCH_BATCHED], BENCH_ROUNDS));
+  }
+  bench_go = BENCH_END;
+
+  exit_kernel_thread ();
+}
+
+/* Start a thread on a new main VCPU bound to cpu */
+static bool
+bench_thread (void (*func) (void), u32 *stack, const char *name, u16 cpu)
+{
+  vcpu *v;
+  int vcpu_id = create_main_vcpu (50, 100, &v);
+
+  if (vcpu_id < 0)
+    return FALSE;
+  v->cpu = cpu;
+  return create_kernel_thread_vcpu_args ((u32) func, (u32) &stack[1023],
+                                         name, vcpu_id, TRUE, 0) != NULL;
+}
+
+extern bool
+circular_bench_init (void)
+{
+  if (mp_num_cpus < 2) {
+    logger_printf ("circular bench: needs two CPUs\n");
+    return FALSE;
+  }
+  return bench_thread (circular_bench_producer, bench_prod_stack,
+                       "circular producer", 0) &&
+    bench_thread (circular_bench_consumer, bench_cons_stack,
+                  "circular consumer", 1);
+}
+
+#include "module/header.h"
+
+static const struct module_ops mod_ops = {
+  .init = circular_bench_init
+};
+
+//DEF_MODULE (circular_bench, "Circular buffer benchmark", &mod_ops, {});
+/* 
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * mode: C
+ * c-file-style: "gnu"
+ * c-basic-offset: 2
+ * End: 
+ */
+
+/* vi: set et sw=2 sts=2: */
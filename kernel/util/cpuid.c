@@ -131,6 +131,26 @@ cpuid_msr_support (void)
   return !!(edx & (1 << 5));
 }
 
+/* SYSENTER/SYSEXIT.  Early Pentium Pro parts set the bit without
+ * supporting the instructions. */
+bool
+cpuid_sep_support (void)
+{
+  uint eax, edx;
+  cpuid (1, 0, &eax, NULL, NULL, &edx);
+  if (((eax >> 8) & 0xF) == 6 && ((eax >> 4) & 0xF) < 3 && (eax & 0xF) < 3)
+    return FALSE;
+  return !!(edx & (1 << 11));
+}
+
+bool
+cpuid_x2apic_support (void)
+{
+  uint ecx;
+  cpuid (1, 0, NULL, NULL, &ecx, NULL);
+  return !!(ecx & (1 << 21));
+}
+
 bool
 cpuid_vmx_support (void)
 {
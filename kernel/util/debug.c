@@ -71,6 +71,20 @@ com1_puts (char *p)
     com1_putc (*p++);
 }
 
+/* Write n characters.  The port-mapped UART takes them a FIFO-full
+ * at a time. */
+void
+com1_write (const char *p, int n)
+{
+#if !defined(COM1_TO_SCREEN) && !defined(SERIAL_MMIO32) && \
+  !defined(USE_PL2303) && (!defined(ENABLE_GDBSTUB) || defined(GDBSTUB_TCP))
+  serial_write (p, n);
+#else
+  while (n-- > 0)
+    com1_putc (*p++);
+#endif
+}
+
 void
 com1_putx (uint32 l)
 {
@@ -16,32 +16,349 @@
  */
 
 #include "kernel.h"
+#include "mem/mem.h"
+#include "smp/atomic.h"
+#include "smp/smp.h"
+#include "util/cassert.h"
 #include "util/printf.h"
 #include "util/debug.h"
 #include "sched/sched.h"
+#ifdef USE_VMX
+#include "vm/shm.h"
+#endif
 
 #ifndef NO_LOGGER
 static u32 logger_stack[1024] ALIGNED(0x1000);
 
-#define LOGGER_BUF_SIZE 65536   /* power of 2 please */
-#define LOGGER_BUF_MOD_MASK (LOGGER_BUF_SIZE - 1)
+/* Each CPU logs into its own ring of fixed-size records, so writers
+ * on different CPUs never share a cache line.  A writer claims all
+ * the slots of a message with one cmpxchg on the ring's head, which
+ * also makes it safe against interrupt handlers logging on the same
+ * CPU.  It fills them in and then publishes the first slot's seq.
+ * The logger thread is the only reader.  It merges the rings by
+ * timestamp and does all of the formatting.
+ *
+ * A message is either a format pointer with its raw argument words,
+ * formatted by the logger thread, or text that was formatted by the
+ * writer.  Text is used when the format takes a string (it could
+ * change before the logger thread reads it), or too many arguments,
+ * and by logger_putc. */
+
+#define LOGGER_RING_SLOTS 1024  /* per CPU; power of 2 please */
+#define LOGGER_RING_MASK (LOGGER_RING_SLOTS - 1)
+#define LOGGER_REC_ARGS 11
+#define LOGGER_TEXT_LEN 48
+#define LOGGER_LINE_MAX 128     /* longest text a writer formats at once */
+#define LOGGER_OUT_SIZE 512     /* logger thread's output batch */
+#define LOGGER_IDLE_USEC 1000
+
+#define LOGGER_REC_FMT  0
+#define LOGGER_REC_TEXT 1
+
+struct logger_rec
+{
+  volatile u32 seq;             /* ring position + 1 once published */
+  u8 cpu;
+  u8 type;
+  u8 nslots;                    /* slots in this message */
+  u8 len;                       /* bytes of text in this slot */
+  u64 tsc;
+  union {
+    struct {
+      const char *fmt;
+      u32 args[LOGGER_REC_ARGS];
+    };
+    char text[LOGGER_TEXT_LEN];
+  };
+};
+CASSERT (sizeof (struct logger_rec) == 64, logger_rec_size);
+
+struct logger_ring
+{
+  /* writers */
+  volatile u32 head;            /* next position to reserve */
+  atomic_t dropped;             /* messages that did not fit */
+  struct logger_rec *rec;
+  /* logger thread */
+  volatile u32 tail ALIGNED (LOCK_ALIGNMENT); /* next position to read */
+  u32 dropped_seen;
+} ALIGNED (LOCK_ALIGNMENT);
+
+static struct logger_ring logger_rings[MAX_CPUS];
+static u32 logger_cpus;
+static volatile bool logger_running = FALSE;
 
-static volatile bool logger_running = FALSE, dropped = FALSE;
-static char logger_buf[LOGGER_BUF_SIZE] ALIGNED(0x1000);
-static volatile u32 head = 0, tail = LOGGER_BUF_SIZE - 1;
+#if defined(USE_VMX) && defined(LOGGER_SHM)
+/* Copy of this sandbox's output in shared memory, where another
+ * sandbox (e.g. Linux) can read it.  The writer never waits: a
+ * reader keeps its own position and has lost data if head moves more
+ * than size past it. */
+#define LOGGER_SHM_PAGES 4
+#define LOGGER_SHM_MAGIC 0x4C4F4721
 
-static char
-logger_getc (void)
+struct logger_shm
 {
-  u32 newtail = (tail + 1) & LOGGER_BUF_MOD_MASK;
-  if (newtail == head) {
-    /* nothing to get */
-    return 0;
-  } else {
-    char c = logger_buf[newtail];
-    tail = newtail;
-    return c;
+  u32 magic;
+  u32 size;                     /* bytes in buf, a power of 2 */
+  volatile u32 head;            /* bytes ever written */
+  char buf[];
+};
+
+static struct logger_shm *logger_shm = NULL;
+
+static void
+logger_shm_init (void)
+{
+  u32 frame = shm_alloc_phys_frames (LOGGER_SHM_PAGES);
+
+  if (frame == -1)
+    return;
+  logger_shm = map_contiguous_virtual_pages (frame | 3, LOGGER_SHM_PAGES);
+  if (!logger_shm)
+    return;
+  logger_shm->size = 1 << 13;   /* largest power of 2 that fits */
+  logger_shm->head = 0;
+  logger_shm->magic = LOGGER_SHM_MAGIC;
+  shm->logger_buf[get_pcpu_id ()] = frame;
+}
+
+static void
+logger_shm_write (const char *p, int n)
+{
+  u32 h = logger_shm->head;
+
+  while (n-- > 0)
+    logger_shm->buf[h++ & (logger_shm->size - 1)] = *p++;
+  asm volatile ("":::"memory");
+  logger_shm->head = h;
+}
+#endif
+
+/* Claim n consecutive slots of this CPU's ring.  Returns the first
+ * position, or -1 if the ring is full. */
+static u32
+logger_reserve (struct logger_ring *r, u32 n)
+{
+  u32 h;
+
+  do {
+    h = r->head;
+    if (h + n - r->tail > LOGGER_RING_SLOTS) {
+      atomic_inc (&r->dropped);
+      return -1;
+    }
+  } while (atomic_cmpxchg_dword (&r->head, h, h + n) != h);
+
+  return h;
+}
+
+/* Make the message at pos visible to the logger thread, once every
+ * slot of it is written. */
+static inline void
+logger_publish (struct logger_rec *rec, u32 pos)
+{
+  asm volatile ("":::"memory");
+  rec->seq = pos + 1;
+}
+
+static void
+logger_put_text (const char *p, int n)
+{
+  u8 cpu = get_pcpu_id ();
+  struct logger_ring *r = &logger_rings[cpu];
+  u32 nslots = (n + LOGGER_TEXT_LEN - 1) / LOGGER_TEXT_LEN, pos, i;
+  struct logger_rec *rec;
+  u64 now;
+
+  if (n <= 0 || (pos = logger_reserve (r, nslots)) == -1)
+    return;
+
+  RDTSC (now);
+  /* fill the first slot last: publishing it publishes the message */
+  for (i = nslots; i-- > 0;) {
+    rec = &r->rec[(pos + i) & LOGGER_RING_MASK];
+    rec->len = (i == nslots - 1 ? n - i * LOGGER_TEXT_LEN : LOGGER_TEXT_LEN);
+    memcpy (rec->text, p + i * LOGGER_TEXT_LEN, rec->len);
+  }
+  rec->cpu = cpu;
+  rec->type = LOGGER_REC_TEXT;
+  rec->nslots = nslots;
+  rec->tsc = now;
+  logger_publish (rec, pos);
+}
+
+static void
+logger_put_fmt (const char *fmt, va_list args, int words)
+{
+  u8 cpu = get_pcpu_id ();
+  struct logger_ring *r = &logger_rings[cpu];
+  struct logger_rec *rec;
+  u32 pos;
+  u64 now;
+
+  if ((pos = logger_reserve (r, 1)) == -1)
+    return;
+
+  rec = &r->rec[pos & LOGGER_RING_MASK];
+  RDTSC (now);
+  rec->tsc = now;
+  rec->cpu = cpu;
+  rec->type = LOGGER_REC_FMT;
+  rec->nslots = 1;
+  rec->fmt = fmt;
+  /* va_list is a pointer to the argument words */
+  memcpy (rec->args, args, words * sizeof (u32));
+  logger_publish (rec, pos);
+}
+
+/* Number of argument words fmt takes, reading it the way
+ * closure_vprintf does, or -1 if it takes a string. */
+static int
+logger_fmt_words (const char *fmt)
+{
+  int words = 0, ells;
+
+  while (*fmt) {
+    if (*fmt++ != '%')
+      continue;
+    for (ells = 0; *fmt; fmt++) {
+      switch (*fmt) {
+      case 'l':
+        ells++;
+        continue;
+      case 'x':
+      case 'X':
+        words += (ells == 2 ? 2 : 1);
+        break;
+      case 'p':
+      case 'u':
+      case 'd':
+      case 'c':
+        words++;
+        break;
+      case 's':
+        return -1;
+      case '%':
+        break;
+      default:
+        continue;
+      }
+      break;
+    }
+    if (*fmt)
+      fmt++;
   }
+
+  return words;
+}
+
+/* Text formatted by a writer, handed to the ring a line at a time */
+struct logger_line
+{
+  char buf[LOGGER_LINE_MAX];
+  int n;
+};
+
+static void
+logger_line_putc (void *data, char c)
+{
+  struct logger_line *l = data;
+
+  l->buf[l->n++] = c;
+  if (l->n == LOGGER_LINE_MAX) {
+    logger_put_text (l->buf, l->n);
+    l->n = 0;
+  }
+}
+
+/* Logger thread output, batched for com1_write */
+static char logger_out[LOGGER_OUT_SIZE];
+static int logger_out_n = 0;
+
+static void
+logger_flush (void)
+{
+  if (logger_out_n == 0)
+    return;
+  com1_write (logger_out, logger_out_n);
+#if defined(USE_VMX) && defined(LOGGER_SHM)
+  if (logger_shm)
+    logger_shm_write (logger_out, logger_out_n);
+#endif
+  logger_out_n = 0;
+}
+
+static void
+logger_out_putc (void *data, char c)
+{
+  logger_out[logger_out_n++] = c;
+  if (logger_out_n == LOGGER_OUT_SIZE)
+    logger_flush ();
+}
+
+static void
+logger_emit (struct logger_ring *r, struct logger_rec *rec)
+{
+  u32 t = r->tail, i, n = rec->nslots;
+  struct logger_rec *s;
+
+  if (rec->type == LOGGER_REC_FMT)
+    closure_vprintf (logger_out_putc, NULL, rec->fmt, (va_list) rec->args);
+  else
+    for (i = 0; i < n; i++) {
+      s = &r->rec[(t + i) & LOGGER_RING_MASK];
+      if (LOGGER_OUT_SIZE - logger_out_n < s->len)
+        logger_flush ();
+      memcpy (logger_out + logger_out_n, s->text, s->len);
+      logger_out_n += s->len;
+    }
+
+  /* done reading: the slots may be reused */
+  asm volatile ("":::"memory");
+  r->tail = t + n;
+}
+
+/* Write out every published message, oldest first across all CPUs.
+ * Returns the number written. */
+static int
+logger_drain (void)
+{
+  struct logger_ring *r, *oldest;
+  struct logger_rec *rec, *first;
+  u32 cpu, dropped;
+  int count = 0;
+
+  for (;;) {
+    oldest = NULL;
+    first = NULL;
+    for (cpu = 0; cpu < logger_cpus; cpu++) {
+      r = &logger_rings[cpu];
+      rec = &r->rec[r->tail & LOGGER_RING_MASK];
+      if (rec->seq != r->tail + 1)
+        continue;
+      if (!first || (s64) (rec->tsc - first->tsc) < 0) {
+        oldest = r;
+        first = rec;
+      }
+    }
+    if (!oldest)
+      break;
+    logger_emit (oldest, first);
+    count++;
+  }
+  logger_flush ();
+
+  for (cpu = 0; cpu < logger_cpus; cpu++) {
+    r = &logger_rings[cpu];
+    dropped = r->dropped.counter;
+    if (dropped != r->dropped_seen) {
+      fun_printf (com1_putc, "***logger dropped %d messages on cpu %d***\n",
+                  dropped - r->dropped_seen, cpu);
+      r->dropped_seen = dropped;
+    }
+  }
+
+  return count;
 }
 
 static void
@@ -56,14 +373,13 @@ logger_thread (void)
 
   com1_printf ("logger: hello from 0x%x\n", str ()->tid);
   for (;;) {
-    char c = logger_getc ();
-    if (c == 0)
-      asm volatile ("pause");
-    else
-      com1_putc (c);
-    if (dropped) {
-      printf ("***logger dropped char (h=%d,t=%d)***\n", head, tail);
-      dropped = FALSE;
+    if (logger_drain () == 0) {
+      /* nothing to write: sleep rather than spin */
+      cli ();
+      lock_kernel ();
+      sched_usleep (LOGGER_IDLE_USEC);
+      unlock_kernel ();
+      sti ();
     }
   }
 }
@@ -73,6 +389,23 @@ extern bool
 logger_init (void)
 {
 #ifndef NO_LOGGER
+  u32 pages = LOGGER_RING_SLOTS * sizeof (struct logger_rec) >> 12;
+  u32 cpu, frame;
+
+  logger_cpus = mp_num_cpus;
+  for (cpu = 0; cpu < logger_cpus; cpu++) {
+    frame = alloc_phys_frames (pages);
+    if (frame == -1)
+      return FALSE;
+    logger_rings[cpu].rec = map_contiguous_virtual_pages (frame | 3, pages);
+    if (!logger_rings[cpu].rec)
+      return FALSE;
+    memset (logger_rings[cpu].rec, 0, pages << 12);
+  }
+#if defined(USE_VMX) && defined(LOGGER_SHM)
+  logger_shm_init ();
+#endif
+
   //task_id id =
     create_kernel_thread_args ((u32) logger_thread, (u32) &logger_stack[1023],
                                     "logger", TRUE, 0);
@@ -84,22 +417,37 @@ logger_init (void)
   return TRUE;
 }
 
+extern void
+logger_vprintf (const char *fmt, va_list args)
+{
+#ifndef NO_LOGGER
+  struct logger_line line;
+  int words;
+
+  if (logger_running) {
+    words = logger_fmt_words (fmt);
+    if (words >= 0 && words <= LOGGER_REC_ARGS) {
+      logger_put_fmt (fmt, args, words);
+    } else {
+      line.n = 0;
+      closure_vprintf (logger_line_putc, &line, fmt, args);
+      logger_put_text (line.buf, line.n);
+    }
+    return;
+  }
+#endif
+  fun_vprintf (com1_putc, fmt, args);
+}
+
 extern void
 logger_putc (char c)
 {
 #ifdef NO_LOGGER
   com1_putc (c);
 #else
-  if (logger_running) {
-    u32 newhead = (head + 1) & LOGGER_BUF_MOD_MASK;
-    if (newhead == tail) {
-      /* drop char */
-      dropped = TRUE;
-    } else {
-      logger_buf[head] = c;
-      head = newhead;
-    }
-  } else
+  if (logger_running)
+    logger_put_text (&c, 1);
+  else
     com1_putc (c);
 #endif
 }
@@ -23,6 +23,7 @@
 #include "lwip/netif.h"
 #include "lwip/udp.h"
 #include "util/debug.h"
+#include "util/printf.h"
 
 #ifdef USE_VMX
 #include "vm/shm.h"
@@ -351,7 +352,7 @@ logger_printf (const char *fmt, ...)
 {
   va_list args;
   va_start (args, fmt);
-  fun_vprintf (logger_putc, fmt, args);
+  logger_vprintf (fmt, args);
   va_end (args);
 }
 #endif
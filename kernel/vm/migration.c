@@ -22,6 +22,9 @@
 #include "kernel.h"
 #include "mem/physical.h"
 #include "mem/virtual.h"
+#include "mem/pagecache.h"
+#include "mem/cow.h"
+#include "smp/klock.h"
 #include "util/printf.h"
 #include "smp/apic.h"
 #include "arch/i386.h"
@@ -105,31 +108,44 @@ destroy_task (quest_tss *tss)
   int i, j;
   if (!tss) return;
 
+  /* One round of IPIs, only to the CPUs still running on this page
+   * directory, before any of it is freed */
+  tlb_release_cr3 (tss->CR3);
+
   /* Reclaim resources */
   virt_addr = map_virtual_page (tss->CR3 | 3);
   if (!virt_addr) goto abort;
 
   /* Free user-level virtual address space */
   for (i = 0; i < 1023; i++) {
+    if (PDE_USER_BIGPAGE (virt_addr[i])) {
+      cow_free_bigpage (virt_addr[i]);
+      continue;
+    }
     if (virt_addr[i]            /* Free page directory entry */
         &&!(virt_addr[i] & 0x80)) {     /* and not 4MB page */
-      tmp_page = map_virtual_page (virt_addr[i] | 3);
+      tmp_page = kmap_atomic (virt_addr[i] | 3);
       for (j = 0; j < 1024; j++) {
         if (tmp_page[j]) {      /* Free frame */
+          if (tmp_page[j] & PTE_PCACHE)
+            continue;           /* Shared page cache frame */
           if ((j < 0x200) || (j > 0x20F) || i) {        /* --??-- Skip releasing
                                                            video memory */
-            BITMAP_SET (mm_table, tmp_page[j] >> 12);
+            cow_free_frame (tmp_page[j]);
           }
         }
       }
-      unmap_virtual_page (tmp_page);
-      BITMAP_SET (mm_table, virt_addr[i] >> 12);
+      kunmap_atomic (tmp_page);
+      free_phys_frame (virt_addr[i]);
     }
   }
 
-  BITMAP_SET (mm_table, (uint32) tss->CR3 >> 12);    /* Free up page for page directory */
+  pcache_exec_release (tss->CR3);
+
+  free_phys_frame ((uint32) tss->CR3);    /* Free up page for page directory */
   unmap_virtual_page (virt_addr);
 
+  klock_lock (&net_lock);
   for (i = 3; i < MAX_FD; i++) {
     if (tss->fd_table[i].entry) {
       switch (tss->fd_table[i].type) {
@@ -146,6 +162,7 @@ destroy_task (quest_tss *tss)
       }
     }
   }
+  klock_unlock (&net_lock);
 
   /* All tasks waiting for us now belong on the runqueue. */
   while ((waiter = queue_remove_head (&tss->waitqueue)))
@@ -167,7 +184,7 @@ destroy_task (quest_tss *tss)
 static void
 backup_vcpu_replenishment (quest_tss * tss)
 {
-  int i = 0;
+  int i;
   repl_queue * rq;
   replenishment * r;
   vcpu * v = vcpu_lookup (tss->cpu);
@@ -176,15 +193,13 @@ backup_vcpu_replenishment (quest_tss * tss)
   memset (tss->vcpu_backup, 0, sizeof(struct _replenishment) * MAX_REPL);
   /* Go through the VCPU replenishment queue */
   rq = &v->main.Q;
-  r = rq->head;
   DLOG ("VCPU %d Replenishment Queue (b=0x%llX, usage=0x%llX):",
         tss->cpu, v->b, v->usage);
-  while (r) {
+  for (i = 0; i < rq->size; i++) {
+    r = &rq->array[i];
     DLOG ("  (%d) b=0x%llX, t=0x%llX", i, r->b, r->t);
     tss->vcpu_backup[i].t = r->t;
     tss->vcpu_backup[i].b = r->b;
-    r = r->next;
-    i++;
   }
   /* Backup common VCPU scheduling parameters */
   tss->C_bak = v->C;
@@ -270,8 +285,12 @@ pull_quest_tss (void * phy_tss)
 {
   int cpu = get_pcpu_id ();
   quest_tss * new_tss = NULL;
-  quest_tss * target_tss = map_virtual_page (((uint32) phy_tss) | 3);
-  if (!target_tss) return NULL;
+  quest_tss * target_tss = NULL;
+  /* A quest_tss can straddle a page boundary within its (physically
+   * contiguous) slab, so map the page after it as well */
+  u8 * pages = map_contiguous_virtual_pages (((uint32) phy_tss & ~0xFFF) | 3, 2);
+  if (!pages) return NULL;
+  target_tss = (quest_tss *) (pages + ((uint32) phy_tss & 0xFFF));
 
   DLOG ("Duplicating quest_tss:");
   DLOG ("  name: %s, task_id: 0x%X, affinity: %d, CR3: 0x%X",
@@ -299,11 +318,11 @@ pull_quest_tss (void * phy_tss)
   DLOG ("  name: %s, task_id: 0x%X, affinity: %d, CR3: 0x%X",
         new_tss->name, new_tss->tid, new_tss->sandbox_affinity, new_tss->CR3);
 
-  unmap_virtual_page (target_tss);
+  unmap_virtual_pages (pages, 2);
   return new_tss;
 
 abort:
-  unmap_virtual_page (target_tss);
+  unmap_virtual_pages (pages, 2);
   return NULL;
 }
 
@@ -330,6 +349,10 @@ remote_clone_page_directory (pgdir_t dir, u64 deadline)
   shell_dir.dir_va = map_virtual_page (shell_dir.dir_pa | 3);
   if (!shell_dir.dir_va) goto abort;
 
+  /* The destination has no copy of the page cache: fault in the
+   * whole executable image so that it gets copied below. */
+  pcache_populate (dir.dir_pa);
+
   new_pgd_pa = alloc_phys_frame ();
 
   if (new_pgd_pa == -1)
@@ -368,9 +391,19 @@ for_loop:
         /* To make things easier, let's use local shell's kernel mappings directly. */
         /* This is what fork does anyway:-) */
         new_dir.dir_va[i].raw = shell_dir.dir_va[i].raw;
+      } else if (PDE_USER_BIGPAGE (dir.dir_va[i].raw)) {
+        /* Anonymous 4 MiB page: relocate it into this sandbox */
+        u32 pde = dir.dir_va[i].raw;
+        frame_t big = copy_bigpage (pde & ~(BIGPAGE_SIZE - 1));
+        if (big == -1)
+          goto abort_pgd_va;
+        /* the copy is private, so writable again */
+        if (pde & PTE_COW)
+          pde |= 2;
+        new_dir.dir_va[i].raw = big | (pde & (BIGPAGE_SIZE - 1) & ~PTE_COW);
       } else if (dir.dir_va[i].flags.page_size) {
         /* clone 4 MiB page */
-        /* --??-- Assume 4 MiB page is always for shared memory, no relocation */
+        /* Other 4 MiB pages are shared memory, no relocation */
         //panic ("userspace 4 MiB pages not supported");
         new_dir.dir_va[i].raw = (dir.dir_va[i].framenum << 22) + 0x83;
       } else {
@@ -385,7 +418,7 @@ for_loop:
           goto abort_pgd_va;
         tbl.starting_va = (uint8 *) (i << 22);
 
-        new_tbl = clone_page_table (tbl);
+        new_tbl = clone_page_table (tbl, FALSE);
 
         unmap_virtual_page (tbl.table_va);
 
@@ -443,10 +476,9 @@ request_migration (int sandbox)
   /* TODO: Also add IPI overhead into the tsc? */
   RDTSC (now);
   shm->remote_tsc[sandbox] = now;
-  return LAPIC_send_ipi (get_logical_dest_addr (sandbox),
-                         LAPIC_ICR_LEVELASSERT
-                         | LAPIC_ICR_DM_LOGICAL
-                         | MIGRATION_RECV_REQ_VECTOR);
+  return LAPIC_send_ipi_cpus (1 << sandbox,
+                              LAPIC_ICR_LEVELASSERT
+                              | MIGRATION_RECV_REQ_VECTOR);
 }
 
 #ifndef QUESTV_NO_VMX
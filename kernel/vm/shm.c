@@ -27,6 +27,7 @@
 #include "smp/apic.h"
 #include "sched/vcpu.h"
 #include "sched/sched.h"
+#include "arch/i386-div64.h"
 
 #define DEBUG_SHM    0
 #if DEBUG_SHM > 0
@@ -35,6 +36,8 @@
 #define DLOG(fmt,...) ;
 #endif
 
+extern bool sleepqueue_detach (quest_tss *);
+
 shm_info *shm = NULL;
 
 shm_comm_t shm_comm;
@@ -166,13 +169,106 @@ shm_init (uint32 cpu)
 }
 
 
-void process_isbm(isb_msg_type_t* msg_start, uint src_sandbox)
+/* vshm keys with a waiting task or an unclaimed notification */
+static struct {
+  uint key;
+  quest_tss* task;
+  bool pending;
+} vshm_waiters[VSHM_MAX_WAITERS];
+
+static void isbm_wake(quest_tss* t);
+
+/* Must hold the kernel lock */
+static int
+vshm_waiter_find(uint vshm_key, bool alloc)
+{
+  int i, free = -1;
+
+  for(i = 0; i < VSHM_MAX_WAITERS; ++i) {
+    if(vshm_waiters[i].key == vshm_key) return i;
+    if(free < 0 && vshm_waiters[i].key == 0) free = i;
+  }
+  if(alloc && free >= 0) {
+    vshm_waiters[free].key = vshm_key;
+    vshm_waiters[free].task = NULL;
+    vshm_waiters[free].pending = FALSE;
+  }
+  return alloc ? free : -1;
+}
+
+static void
+vshm_notify_arrived(uint vshm_key)
+{
+  int i = vshm_waiter_find(vshm_key, TRUE);
+
+  /* With the table full the waiter finds out at its timeout */
+  if(i < 0) return;
+  vshm_waiters[i].pending = TRUE;
+  isbm_wake(vshm_waiters[i].task);
+}
+
+/* Must hold the kernel lock */
+int
+vshm_notify(uint sandbox, uint vshm_key)
+{
+  if(vshm_key == 0) return -1;
+  /* A lost notification only delays the waiter until its timeout,
+   * so never block the sender here. */
+  return isbm_send(ISBM_VSHM_NOTIFY, sandbox, &vshm_key, sizeof(vshm_key),
+                   ISBM_NOWAIT) ? 0 : -1;
+}
+
+/* Wait up to usec for a vshm_notify on vshm_key.  Returns 0 if
+ * notified and -1 on timeout.  Must hold the kernel lock. */
+int
+vshm_wait(uint vshm_key, uint usec)
+{
+  int i;
+  int res = -1;
+
+  if(vshm_key == 0) return -1;
+  i = vshm_waiter_find(vshm_key, TRUE);
+  if(i < 0 || vshm_waiters[i].task) {
+    /* No room, or someone else is waiting on this key: just sleep */
+    sched_usleep(usec);
+    return -1;
+  }
+  if(!vshm_waiters[i].pending) {
+    vshm_waiters[i].task = str();
+    sched_usleep(usec);
+    vshm_waiters[i].task = NULL;
+  }
+  if(vshm_waiters[i].pending) res = 0;
+  vshm_waiters[i].key = 0;
+  vshm_waiters[i].pending = FALSE;
+  return res;
+}
+
+/* Free the slot of vshm_key, dropping any unclaimed notification.
+ * Returns -1 if a task is still waiting on the key.  Must hold the
+ * kernel lock. */
+int
+vshm_forget(uint vshm_key)
+{
+  int i;
+
+  if(vshm_key == 0) return -1;
+  i = vshm_waiter_find(vshm_key, FALSE);
+  if(i < 0) return 0;
+  if(vshm_waiters[i].task) return -1;
+  vshm_waiters[i].key = 0;
+  vshm_waiters[i].pending = FALSE;
+  return 0;
+}
+
+static void
+process_isbm(isb_msg_type_t type, void* msg_start, uint src_sandbox)
 {
-  switch(*msg_start) {
+  switch(type) {
   case ISBM_NEW_SHARED_MEMORY_ARENA:
     {
       int i;
-      new_shared_memory_arena_msg_t* nsma_msg = (new_shared_memory_arena_msg_t*)(msg_start+1);
+      new_shared_memory_arena_msg_t* nsma_msg = (new_shared_memory_arena_msg_t*)msg_start;
       shm_pool_t *pool = &shm_comm.pools[src_sandbox][nsma_msg->pool_id];
       int count = popcount(nsma_msg->bitmap);
       if(nsma_msg->new_pool) {
@@ -218,25 +314,180 @@ void process_isbm(isb_msg_type_t* msg_start, uint src_sandbox)
     
   case ISBM_TEST:
     {
-      char* msg = (char*)(msg_start+1);
+      char* msg = (char*)msg_start;
       msg[30] = 0;              /* Force the string to have an end */
       logger_printf("Got msg from sandbox %u: %s\n", src_sandbox, msg);
     }
     break;
     
+  case ISBM_VSHM_NOTIFY:
+    vshm_notify_arrived(*(uint*)msg_start);
+    break;
+
   case ISBM_NO_MESSAGE:
     break;
   }
 }
 
+/* Order the ring stores before the parked-flag load that follows;
+ * sender and receiver each store then check the other's flag. */
+static inline void
+isbm_mfence(void)
+{
+  asm volatile ("mfence":::"memory");
+}
+
+static inline isbm_ring_t*
+isbm_read_ring(uint sandbox)
+{
+  return (isbm_ring_t*)shm_comm.priv_read_regions[sandbox];
+}
+
+static inline isbm_ring_t*
+isbm_write_ring(uint sandbox)
+{
+  return (isbm_ring_t*)shm_comm.priv_write_regions[sandbox];
+}
+
+static void
+isbm_ring_doorbell(uint sandbox)
+{
+  LAPIC_send_ipi_cpus(1 << sandbox, LAPIC_ICR_LEVELASSERT | ISBM_DOORBELL_VECTOR);
+}
+
+static quest_tss* isbm_thread = NULL;
+
+/* Wake t early from sched_usleep.  Must hold the kernel lock. */
+static void
+isbm_wake(quest_tss* t)
+{
+  if(t && sleepqueue_detach(t)) {
+    t->time = 0;
+    wakeup(t);
+  }
+}
+
+static void
+isbm_record_latency(uint64 sent)
+{
+  extern u32 tsc_freq_msec;
+  uint64 now;
+  uint32 usec = 0;
+  int b = 0;
+
+  RDTSC(now);
+  /* Sandboxes share the TSC, so this is only off by its skew */
+  if(now > sent && tsc_freq_msec)
+    usec = (uint32)div64_64((now - sent) * 1000, tsc_freq_msec);
+  while(usec && b < ISBM_LATENCY_BUCKETS - 1) {
+    usec >>= 1;
+    b++;
+  }
+  shm_comm.latency[b]++;
+}
+
+int
+isbm_latency_histogram(uint32* buckets, int max)
+{
+  int i;
+
+  if(max > ISBM_LATENCY_BUCKETS) max = ISBM_LATENCY_BUCKETS;
+  for(i = 0; i < max; ++i)
+    buckets[i] = shm_comm.latency[i];
+  return max;
+}
+
+void
+isbm_print_latency(void)
+{
+  int i;
+
+  logger_printf("ISBM latency (usec): <1: %d", shm_comm.latency[0]);
+  for(i = 1; i < ISBM_LATENCY_BUCKETS; ++i)
+    if(shm_comm.latency[i])
+      logger_printf(" <%d: %d", 1 << i, shm_comm.latency[i]);
+  logger_printf("\n");
+}
+
+/* Doorbell IPI from another sandbox: it has sent us messages, or
+ * freed room in one of our write rings. */
+static uint32
+isbm_doorbell(uint8 vector)
+{
+  int i;
+  isbm_ring_t* ring;
+
+  lock_kernel();
+  isbm_wake(isbm_thread);
+  for(i = 0; i < SHM_MAX_SANDBOX; ++i) {
+    ring = isbm_write_ring(i);
+    if(shm_comm.send_waiter[i] && ring->head - ring->tail < ISBM_RING_SLOTS)
+      isbm_wake(shm_comm.send_waiter[i]);
+  }
+  unlock_kernel();
+  return 0;
+}
+
+/* Process every message waiting from src_sandbox.  Must hold the
+ * kernel lock.  Returns the number processed. */
+static int
+isbm_drain(uint src_sandbox)
+{
+  isbm_ring_t* ring = isbm_read_ring(src_sandbox);
+  uint32 tail = ring->tail, head = ring->head;
+  isbm_slot_t* slot;
+  int n = 0;
+
+  /* Read slots only after seeing head */
+  asm volatile ("":::"memory");
+  for(; tail != head; ++tail, ++n) {
+    slot = &ring->slot[tail % ISBM_RING_SLOTS];
+    isbm_record_latency(slot->tsc);
+    process_isbm(slot->type, slot->data, src_sandbox);
+  }
+  if(n == 0) return 0;
+
+  asm volatile ("":::"memory");
+  ring->tail = tail;
+  isbm_mfence();
+  /* The sender clears producer_parked itself once it has room */
+  if(ring->producer_parked)
+    isbm_ring_doorbell(src_sandbox);
+  return n;
+}
+
+static bool
+isbm_pending(void)
+{
+  int i;
+  isbm_ring_t* ring;
+
+  for(i = 0; i < SHM_MAX_SANDBOX; ++i) {
+    if(i == get_pcpu_id()) continue;
+    ring = isbm_read_ring(i);
+    if(ring->head != ring->tail) return TRUE;
+  }
+  return FALSE;
+}
+
+static void
+isbm_set_parked(uint32 parked)
+{
+  int i;
+
+  for(i = 0; i < SHM_MAX_SANDBOX; ++i)
+    if(i != get_pcpu_id())
+      isbm_read_ring(i)->consumer_parked = parked;
+}
+
 int isbm_communcation_thread_stack[1024] ALIGNED(0x1000);
 
 void isbm_communcation_thread(void)
 {
-  #define ISBM_COMM_THREAD_SLEEP_INTERVAL 50000
+  /* Longest sleep without a doorbell, in case one was lost */
+  #define ISBM_COMM_THREAD_IDLE_TIMEOUT 1000000
   int i;
   uint pcpu_id = get_pcpu_id();
-  isb_msg_type_t* reading_arena;
 
   unlock_kernel();
   sti();
@@ -245,21 +496,23 @@ void isbm_communcation_thread(void)
     
     for(i = 0; i < SHM_MAX_SANDBOX; ++i) {
       if(i != pcpu_id) {
-        reading_arena = shm_comm.priv_read_regions[i];
-        
-	if(*reading_arena != ISBM_NO_MESSAGE) {
-	  cli();
-	  lock_kernel();
-	  process_isbm(reading_arena, i);
-          *reading_arena = ISBM_NO_MESSAGE;
-	  unlock_kernel();
-	  sti();
-	}
+        cli();
+        lock_kernel();
+        isbm_drain(i);
+        unlock_kernel();
+        sti();
       }
     }
+
+    /* Park, then look again so that a message sent just before the
+     * flag became visible is not left waiting for the timeout. */
     cli();
     lock_kernel();
-    sched_usleep(ISBM_COMM_THREAD_SLEEP_INTERVAL);
+    isbm_set_parked(1);
+    isbm_mfence();
+    if(!isbm_pending())
+      sched_usleep(ISBM_COMM_THREAD_IDLE_TIMEOUT);
+    isbm_set_parked(0);
     unlock_kernel();
     sti();
   }
@@ -303,9 +556,17 @@ void init_shared_memory_pools(void)
     }
   }
 
-  create_kernel_thread_vcpu_args ((u32) isbm_communcation_thread,
-				  (u32) &isbm_communcation_thread_stack[1023],
-                                  "ISBM Communication Thread", vcpu_id, TRUE, 0);
+  if(vector_used(ISBM_DOORBELL_VECTOR)) {
+    DLOG("Interrupt vector %d already in use, ISBM doorbell disabled",
+         ISBM_DOORBELL_VECTOR);
+  } else {
+    set_vector_handler(ISBM_DOORBELL_VECTOR, &isbm_doorbell);
+  }
+
+  isbm_thread =
+    create_kernel_thread_vcpu_args ((u32) isbm_communcation_thread,
+				    (u32) &isbm_communcation_thread_stack[1023],
+                                    "ISBM Communication Thread", vcpu_id, TRUE, 0);
 
   return;
 }
@@ -451,36 +712,79 @@ shm_free_phys_frames (uint32 frame, uint32 count)
   }
 }
 
-//#define ISBM_USE_IPI
+/* Free slots in the ring to target_sandbox */
+int
+isbm_send_space(uint target_sandbox)
+{
+  isbm_ring_t* ring;
 
-bool send_intersandbox_msg(isb_msg_type_t msg_type, uint target_sandbox,
-			   void* msg, size_t size)
+  if(target_sandbox >= SHM_MAX_SANDBOX || target_sandbox == get_pcpu_id())
+    return 0;
+  ring = isbm_write_ring(target_sandbox);
+  return ISBM_RING_SLOTS - (ring->head - ring->tail);
+}
+
+/* Queue a message for target_sandbox and ring its doorbell if its
+ * ISBM thread is asleep.  While the ring is full the caller sleeps
+ * until the receiver frees a slot, for at most ISBM_SEND_TIMEOUT
+ * usec, unless flags has ISBM_NOWAIT.  Must hold the kernel lock,
+ * which also serialises senders to the same sandbox. */
+bool isbm_send(isb_msg_type_t msg_type, uint target_sandbox,
+               void* msg, size_t size, uint flags)
 {
-#ifdef ISBM_USE_IPI
-  return FALSE;
-#else
-  int attempt_count = 20;
+  #define ISBM_SEND_TIMEOUT 1000000
+  #define ISBM_SEND_RETRY   50000
   uint sender_sandbox = get_pcpu_id();
-  isb_msg_type_t* arena;
+  isbm_ring_t* ring;
+  isbm_slot_t* slot;
+  uint64 now;
+  int waited = 0;
+
   if( (sender_sandbox == target_sandbox) ||
-      (size + sizeof(isb_msg_type_t) > 0x1000 / 2) ) return FALSE;
+      (target_sandbox >= SHM_MAX_SANDBOX) ||
+      (size > ISBM_MSG_MAX) ) return FALSE;
   
-  arena = shm_comm.priv_write_regions[target_sandbox];
+  ring = isbm_write_ring(target_sandbox);
   
-  while(attempt_count--) {
-    if(*arena == ISBM_NO_MESSAGE) {
-      *arena = msg_type;
-      memcpy(arena+1, msg, size);
-      break;
-    }
-    else {
-      sched_usleep(1000 * 50);
+  while(ring->head - ring->tail == ISBM_RING_SLOTS) {
+    if((flags & ISBM_NOWAIT) || waited >= ISBM_SEND_TIMEOUT) {
+      ring->producer_parked = 0;
+      return FALSE;
     }
+    ring->producer_parked = 1;
+    isbm_mfence();
+    if(ring->head - ring->tail < ISBM_RING_SLOTS) break;
+    /* Only one waiter per ring gets the early wakeup, the rest
+     * poll. */
+    if(!shm_comm.send_waiter[target_sandbox])
+      shm_comm.send_waiter[target_sandbox] = str();
+    sched_usleep(ISBM_SEND_RETRY);
+    if(shm_comm.send_waiter[target_sandbox] == str())
+      shm_comm.send_waiter[target_sandbox] = NULL;
+    waited += ISBM_SEND_RETRY;
   }
+  ring->producer_parked = 0;
+
+  slot = &ring->slot[ring->head % ISBM_RING_SLOTS];
+  slot->type = msg_type;
+  slot->size = size;
+  memcpy(slot->data, msg, size);
+  RDTSC(now);
+  slot->tsc = now;
+  /* Publish the slot, then check whether the receiver is asleep */
+  asm volatile ("":::"memory");
+  ring->head++;
+  isbm_mfence();
+  if(ring->consumer_parked)
+    isbm_ring_doorbell(target_sandbox);
+
+  return TRUE;
+}
 
-  return attempt_count >= 0;
-  
-#endif
+bool send_intersandbox_msg(isb_msg_type_t msg_type, uint target_sandbox,
+			   void* msg, size_t size)
+{
+  return isbm_send(msg_type, target_sandbox, msg, size, 0);
 }
 
 int virtual_shared_mem_map(uint vshm_key, uint size, uint sandboxes,
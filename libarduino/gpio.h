@@ -18,6 +18,8 @@
 #ifndef _GPIO_H_
 #define _GPIO_H_
 
+#include <vdso.h>
+
 #define PIN_MODE  0
 #define DIG_WRITE 1
 #define DIG_READ  2
@@ -38,10 +40,7 @@
 int
 gpio_syscall(int operation, int arg1, int arg2, int arg3)
 {
-  int ret;
-  asm volatile ("int $0x30\n":"=a" (ret) : "a" (12L),
-      "b"(operation), "c" (arg1), "d" (arg2), "S" (arg3) : CLOBBERS7);
-  return ret;
+  return __syscall30 (12, operation, arg1, arg2, arg3);
 }
 
 #endif
@@ -0,0 +1,47 @@
+/*                    The Quest Operating System
+ *  Copyright (C) 2005-2012  Richard West, Boston University
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _BIGPAGE_H_
+#define _BIGPAGE_H_
+
+/* Make sure these match the kernel's mem/virtual.h */
+#define BIGPAGE_SIZE  0x400000
+#define BIGPAGE_MAP   0
+#define BIGPAGE_UNMAP 1
+
+/* Map count zeroed 4 MiB pages of anonymous memory, each of which
+   takes a single TLB entry.  Returns their address, or NULL.  They
+   are inherited copy-on-write by fork. */
+void *bigpage_alloc (unsigned int count);
+
+/* Unmap count 4 MiB pages at addr, as returned by bigpage_alloc.
+   Returns 0, or -1 on error. */
+int bigpage_free (void *addr, unsigned int count);
+
+#endif
+
+
+
+/*
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * mode: C
+ * c-file-style: "gnu"
+ * c-basic-offset: 2
+ * End:
+ */
+
+/* vi: set et sw=2 sts=2: */
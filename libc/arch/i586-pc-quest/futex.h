@@ -0,0 +1,42 @@
+/*                    The Quest Operating System
+ *  Copyright (C) 2005-2012  Richard West, Boston University
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _FUTEX_H_
+#define _FUTEX_H_
+
+/* Make sure these match the kernel's sched/futex.h */
+#define FUTEX_WAIT 0            /* block while *uaddr == val */
+#define FUTEX_WAKE 1            /* wake up to val tasks blocked on uaddr */
+
+/* FUTEX_WAIT returns 0 once woken, or -1 if *uaddr != val.
+   FUTEX_WAKE returns the number of tasks woken. */
+int futex (volatile int *uaddr, int op, int val);
+
+#endif
+
+
+
+/*
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * mode: C
+ * c-file-style: "gnu"
+ * c-basic-offset: 2
+ * End:
+ */
+
+/* vi: set et sw=2 sts=2: */
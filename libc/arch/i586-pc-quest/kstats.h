@@ -0,0 +1,108 @@
+/*                    The Quest Operating System
+ *  Copyright (C) 2005-2012  Richard West, Boston University
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _KSTATS_H_
+#define _KSTATS_H_
+
+/* Kernel statistics, all read through the one kstats syscall.  Make
+   sure these match the kernel's kernel.h and the structs named
+   below. */
+
+#define KSTATS_LOCK   0         /* struct lock_stat, one per lock */
+#define KSTATS_BCACHE 1         /* struct bcache_stat, one per device */
+#define KSTATS_SCHED  2         /* struct sched_stat, one per CPU */
+#define KSTATS_KMEM   3         /* struct kmem_stat, one per cache */
+#define KSTATS_COW    4         /* a single struct cow_stat */
+
+/* smp/klock.h */
+#define LOCK_STAT_NAME_LEN 16
+
+struct lock_stat
+{
+  char name[LOCK_STAT_NAME_LEN];
+  unsigned long long acquired;  /* total acquisitions */
+  unsigned long long contended; /* acquisitions that had to wait */
+};
+
+/* fs/bcache.h */
+#define BCACHE_STAT_NAME_LEN 16
+
+struct bcache_stat
+{
+  char name[BCACHE_STAT_NAME_LEN];
+  unsigned int hits, misses;    /* block lookups */
+  unsigned int readaheads;      /* blocks prefetched */
+  unsigned int evictions;
+  unsigned int name_hits, name_misses;  /* path lookups */
+};
+
+/* sched/vcpu.h.  There is one record per CPU, and at most the
+   kernel's MAX_CPUS. */
+#define KSTATS_MAX_CPUS 32
+
+struct sched_stat
+{
+  unsigned long long calls;     /* vcpu_schedule invocations */
+  unsigned long long cycles;    /* TSC cycles spent in vcpu_schedule */
+  unsigned long long overruns;  /* timeslices that overran their budget */
+  unsigned long long overhead;  /* total overrun, in TSC cycles */
+  unsigned int runnable;        /* VCPUs on the runqueue now */
+  unsigned int runnable_max;    /* most VCPUs ever on the runqueue */
+};
+
+/* mem/slab.h */
+#define KMEM_NAME_LEN 16
+
+struct kmem_stat
+{
+  char name[KMEM_NAME_LEN];
+  unsigned int size;            /* object size */
+  unsigned int slabs;           /* slabs created */
+  unsigned int objs;            /* objects in those slabs */
+  unsigned int in_use;          /* objects allocated now */
+  unsigned long long allocs, frees;
+  unsigned long long hits;      /* allocations that took no lock */
+};
+
+/* mem/cow.h */
+struct cow_stat
+{
+  unsigned long long forks;
+  unsigned long long fork_cycles;      /* spent cloning address spaces */
+  unsigned long long shared;           /* frames shared by fork */
+  unsigned long long copied;           /* frames fork had to copy */
+  unsigned long long fault_copies;     /* write faults that copied */
+  unsigned long long fault_reuses;     /* write faults on the last user */
+  unsigned int frames;                 /* frames shared right now */
+};
+
+/* Fill buf with up to max records of the kind selected by which,
+   returning how many were written or -1 on error. */
+int kstats (int which, void *buf, int max);
+
+#endif
+
+/* 
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * mode: C
+ * c-file-style: "gnu"
+ * c-basic-offset: 2
+ * End: 
+ */
+
+/* vi: set et sw=2 sts=2: */
@@ -17,7 +17,117 @@
 
 #include <pthread.h>
 #include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/wait.h>
 #include <sys/errno.h>
+#include <futex.h>
+
+extern int syscall_create_thread (int *, void *, uint32_t, void *);
+extern void syscall_thread_exit (void *) __attribute__ ((noreturn));
+
+static inline int
+atomic_xchg (volatile int *addr, int x)
+{
+  asm volatile ("xchgl %0, %1":"+r" (x), "+m" (*addr)::"memory");
+  return x;
+}
+
+/* Returns the old value; the swap happened if that equals old */
+static inline int
+atomic_cmpxchg (volatile int *addr, int old, int new)
+{
+  int prev;
+  asm volatile ("lock cmpxchgl %2, %1"
+                :"=a" (prev), "+m" (*addr)
+                :"r" (new), "0" (old)
+                :"memory", "cc");
+  return prev;
+}
+
+static inline void
+atomic_add (volatile int *addr, int x)
+{
+  asm volatile ("lock addl %1, %0":"+m" (*addr):"ir" (x):"memory", "cc");
+}
+
+/* ************************************************* */
+/* Thread records for pthread_join
+ *
+ * A thread started by pthread_create runs _pthread_start, which calls
+ * the start routine and leaves its return value in the thread's
+ * record.  pthread_join sleeps on the record's state word until then.
+ * If the table is full, the thread is started without a record and
+ * pthread_join falls back to waitpid, which cannot return a value. */
+
+#define PTHREAD_RECORDS 64
+
+enum {
+  REC_FREE = 0,
+  REC_RESERVED,                 /* being set up by pthread_create */
+  REC_RUNNING,
+  REC_DONE,                     /* exited, waiting to be joined */
+  REC_DETACHED,                 /* running, nobody will join */
+};
+
+struct pthread_record {
+  volatile int state;
+  pthread_t tid;
+  void *(*start_routine) (void *);
+  void *arg;
+  void *retval;
+};
+
+static struct pthread_record records[PTHREAD_RECORDS];
+
+static struct pthread_record *
+record_alloc (void)
+{
+  int i;
+
+  for (i = 0; i < PTHREAD_RECORDS; i++)
+    if (atomic_cmpxchg (&records[i].state, REC_FREE, REC_RESERVED) == REC_FREE)
+      return &records[i];
+  return NULL;
+}
+
+/* Find the record of a thread that is still running (live) or that
+   can still be joined or detached */
+static struct pthread_record *
+record_lookup (pthread_t tid, int live)
+{
+  int i, state;
+
+  for (i = 0; i < PTHREAD_RECORDS; i++) {
+    state = records[i].state;
+    if (records[i].tid != tid || state < REC_RUNNING)
+      continue;
+    if (!live || state != REC_DONE)
+      return &records[i];
+  }
+  return NULL;
+}
+
+/* Called by the exiting thread.  It must not touch rec afterwards:
+   a joiner may already be reusing it. */
+static void
+record_finish (struct pthread_record *rec, void *retval)
+{
+  rec->retval = retval;
+  if (atomic_cmpxchg (&rec->state, REC_RUNNING, REC_DONE) == REC_RUNNING)
+    futex (&rec->state, FUTEX_WAKE, INT_MAX);
+  else
+    rec->state = REC_FREE;      /* detached */
+}
+
+static void *
+_pthread_start (void *arg)
+{
+  struct pthread_record *rec = arg;
+
+  pthread_exit (rec->start_routine (rec->arg));
+  return NULL;
+}
 
 int
 pthread_create (pthread_t * thread, pthread_attr_t * attr,
@@ -25,17 +135,40 @@ pthread_create (pthread_t * thread, pthread_attr_t * attr,
 {
   int res = 0;
   pthread_attr_t tmp_attr;
+  struct pthread_record *rec;
   if (!attr) attr = &tmp_attr;
   attr->exit_func = _pthread_exit;
-    
-  res = syscall_create_thread (thread, attr, (uint32_t) start_routine, arg);
+
+  rec = record_alloc ();
+  if (!rec) {
+    res = syscall_create_thread (thread, attr, (uint32_t) start_routine, arg);
+    return res < 0 ? EAGAIN : 0;
+  }
+
+  rec->start_routine = start_routine;
+  rec->arg = arg;
+  rec->retval = NULL;
+  rec->tid = -1;
+  rec->state = REC_RUNNING;
+  /* The kernel fills in rec->tid before the thread first runs */
+  res = syscall_create_thread (&rec->tid, attr, (uint32_t) _pthread_start,
+                               rec);
+  if (res < 0) {
+    rec->state = REC_FREE;
+    return EAGAIN;
+  }
+  *thread = rec->tid;
   return 0;  /* Success */
 }
 
 void
 pthread_exit (void * value_ptr)
 {
-  syscall_thread_exit (value_ptr);
+  struct pthread_record *rec = record_lookup (getpid (), 1);
+
+  if (rec)
+    record_finish (rec, value_ptr);
+  syscall_thread_exit (NULL);
 }
 
 void
@@ -44,6 +177,156 @@ _pthread_exit ()
   syscall_thread_exit (NULL);
 }
 
+int
+pthread_join (pthread_t thread, void ** value_ptr)
+{
+  struct pthread_record *rec = record_lookup (thread, 0);
+  int state;
+
+  if (thread == pthread_self ())
+    return EDEADLK;
+
+  if (!rec) {
+    /* Started without a record, or already joined */
+    if (waitpid (thread, NULL, 0) < 0)
+      return ESRCH;
+    if (value_ptr)
+      *value_ptr = NULL;
+    return 0;
+  }
+  if (rec->state == REC_DETACHED)
+    return EINVAL;
+
+  while ((state = rec->state) == REC_RUNNING)
+    futex (&rec->state, FUTEX_WAIT, state);
+
+  if (value_ptr)
+    *value_ptr = rec->retval;
+  rec->state = REC_FREE;
+  return 0;
+}
+
+int
+pthread_detach (pthread_t thread)
+{
+  struct pthread_record *rec = record_lookup (thread, 0);
+
+  if (!rec)
+    return ESRCH;
+  if (atomic_cmpxchg (&rec->state, REC_RUNNING, REC_DETACHED) == REC_DONE)
+    rec->state = REC_FREE;      /* already exited */
+  return 0;
+}
+
+pthread_t
+pthread_self (void)
+{
+  return getpid ();
+}
+
+/* ************************************************* */
+/* Mutexes (see "Futexes Are Tricky", Drepper) */
+
+int
+pthread_mutex_init (pthread_mutex_t *mutex, const pthread_mutexattr_t *attr)
+{
+  mutex->lock = 0;
+  return 0;
+}
+
+int
+pthread_mutex_destroy (pthread_mutex_t *mutex)
+{
+  return mutex->lock ? EBUSY : 0;
+}
+
+int
+pthread_mutex_lock (pthread_mutex_t *mutex)
+{
+  int c = atomic_cmpxchg (&mutex->lock, 0, 1);
+
+  if (c == 0)
+    return 0;                   /* uncontended: no syscall */
+  /* Mark the mutex contended, so the holder wakes us on unlock */
+  if (c != 2)
+    c = atomic_xchg (&mutex->lock, 2);
+  while (c != 0) {
+    futex (&mutex->lock, FUTEX_WAIT, 2);
+    c = atomic_xchg (&mutex->lock, 2);
+  }
+  return 0;
+}
+
+int
+pthread_mutex_trylock (pthread_mutex_t *mutex)
+{
+  return atomic_cmpxchg (&mutex->lock, 0, 1) == 0 ? 0 : EBUSY;
+}
+
+int
+pthread_mutex_unlock (pthread_mutex_t *mutex)
+{
+  if (atomic_xchg (&mutex->lock, 0) == 2)
+    futex (&mutex->lock, FUTEX_WAKE, 1);
+  return 0;
+}
+
+/* ************************************************* */
+/* Condition variables
+ *
+ * A waiter samples seq before dropping the mutex and sleeps only while
+ * seq still holds that value, so a signal sent in between is not
+ * lost.  waiters lets signal skip the syscall when nobody waits. */
+
+int
+pthread_cond_init (pthread_cond_t *cond, const pthread_condattr_t *attr)
+{
+  cond->seq = 0;
+  cond->waiters = 0;
+  return 0;
+}
+
+int
+pthread_cond_destroy (pthread_cond_t *cond)
+{
+  return cond->waiters ? EBUSY : 0;
+}
+
+int
+pthread_cond_wait (pthread_cond_t *cond, pthread_mutex_t *mutex)
+{
+  int seq;
+
+  atomic_add (&cond->waiters, 1);
+  seq = cond->seq;
+  pthread_mutex_unlock (mutex);
+  futex (&cond->seq, FUTEX_WAIT, seq);
+  atomic_add (&cond->waiters, -1);
+
+  /* Others may be blocked on the mutex too, so take it as contended */
+  while (atomic_xchg (&mutex->lock, 2) != 0)
+    futex (&mutex->lock, FUTEX_WAIT, 2);
+  return 0;
+}
+
+int
+pthread_cond_signal (pthread_cond_t *cond)
+{
+  atomic_add (&cond->seq, 1);
+  if (cond->waiters)
+    futex (&cond->seq, FUTEX_WAKE, 1);
+  return 0;
+}
+
+int
+pthread_cond_broadcast (pthread_cond_t *cond)
+{
+  atomic_add (&cond->seq, 1);
+  if (cond->waiters)
+    futex (&cond->seq, FUTEX_WAKE, INT_MAX);
+  return 0;
+}
+
 void pthread_spin_init(pthread_spinlock_t *lock)
 {
   lock->lock = 0;
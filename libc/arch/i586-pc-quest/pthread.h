@@ -15,8 +15,8 @@
  *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#ifndef _VSHM_H_
-#define _VSHM_H_
+#ifndef _PTHREAD_H_
+#define _PTHREAD_H_
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -33,6 +33,48 @@ int pthread_create (pthread_t * thread, pthread_attr_t * attr,
 
 void pthread_exit (void * value_ptr);
 void _pthread_exit (void);
+int pthread_join (pthread_t thread, void ** value_ptr);
+int pthread_detach (pthread_t thread);
+pthread_t pthread_self (void);
+
+/* ************************************************* */
+/* pthread mutex and condition variable
+ *
+ * Both are a single word that is normally changed with atomic
+ * instructions at user level.  A thread only enters the kernel (see
+ * futex.h) to block when the mutex is held or to wake a blocked
+ * thread, so a waiting thread uses no VCPU budget. */
+typedef struct _pthread_mutex_t {
+  volatile int lock;            /* 0 free, 1 held, 2 held with waiters */
+} pthread_mutex_t;
+typedef struct _pthread_mutexattr_t {
+  int unused;
+} pthread_mutexattr_t;
+
+#define PTHREAD_MUTEX_INITIALIZER { 0 }
+
+typedef struct _pthread_cond_t {
+  volatile int seq;             /* bumped by every signal */
+  volatile int waiters;
+} pthread_cond_t;
+typedef struct _pthread_condattr_t {
+  int unused;
+} pthread_condattr_t;
+
+#define PTHREAD_COND_INITIALIZER { 0, 0 }
+
+int pthread_mutex_init (pthread_mutex_t *mutex,
+                        const pthread_mutexattr_t *attr);
+int pthread_mutex_destroy (pthread_mutex_t *mutex);
+int pthread_mutex_lock (pthread_mutex_t *mutex);
+int pthread_mutex_trylock (pthread_mutex_t *mutex);
+int pthread_mutex_unlock (pthread_mutex_t *mutex);
+
+int pthread_cond_init (pthread_cond_t *cond, const pthread_condattr_t *attr);
+int pthread_cond_destroy (pthread_cond_t *cond);
+int pthread_cond_wait (pthread_cond_t *cond, pthread_mutex_t *mutex);
+int pthread_cond_signal (pthread_cond_t *cond);
+int pthread_cond_broadcast (pthread_cond_t *cond);
 
 /* ************************************************* */
 /* pthread spinlock */
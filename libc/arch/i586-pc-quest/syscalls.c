@@ -11,6 +11,11 @@
 /* Quest specific headers */
 #include <vcpu.h>
 #include <video.h>
+#include <kstats.h>
+#include <bigpage.h>
+#include <futex.h>
+#include <vdso.h>
+#include <poll.h>
 
 #define CLOBBERS1 "memory","cc","%ebx","%ecx","%edx","%esi","%edi"
 #define CLOBBERS2 "memory","cc","%ecx","%edx","%esi","%edi"
@@ -30,10 +35,7 @@ void _exit (int status)
 int close(int file)
 {
   int ret;
-  asm volatile ("int $0x3D\n"
-                :"=a" (ret)
-                :"a" (1), "b" (file), "c" (0), "d" (0), "S" (0), "D" (0)
-                :"memory", "cc");
+  ret = __syscall3d (1, (unsigned int) file, 0, 0, 0, 0);
   return ret;
 
 }
@@ -80,10 +82,8 @@ int open(const char *name, int flags, ...)
 int write(int file, char *ptr, int len)
 {
   int ret;
-  asm volatile ("int $0x3D\n"
-                :"=a" (ret)
-                :"a" (6), "b" (file), "c" (ptr), "d" (len), "S" (0), "D" (0)
-                :"memory", "cc");
+  ret = __syscall3d (6, (unsigned int) file, (unsigned int) ptr,
+                     (unsigned int) len, 0, 0);
   return ret;
 }
 
@@ -114,9 +114,21 @@ int waitpid(int pid, int *status, int options)
   return ret;
 }
 
+/* Reads the clock from the vDSO page, without entering the kernel */
 int gettimeofday (struct timeval *tp, void *tzp)
 {
-  return get_time (tp);
+  unsigned long long t, freq, sec;
+
+  freq = __vdso->tsc_freq;
+  if (freq == 0)
+    return get_time (tp);
+
+  asm volatile ("rdtsc":"=A" (t));
+  t -= __vdso->tsc_base;
+  sec = t / freq;
+  tp->tv_sec = __vdso->boot_sec + sec;
+  tp->tv_usec = (t - sec * freq) * 1000000ULL / freq;
+  return 0;
 }
 
 /* The following are no-ops */
@@ -150,42 +162,43 @@ int fstat(int file, struct stat *st)
 int getpid()
 {
   int pid;
-  asm volatile ("int $0x30\n":"=a"(pid):"a" (3L):CLOBBERS1);
+  pid = __syscall30 (3, 0, 0, 0, 0);
   return pid;
 }
 
 vcpu_id_t vcpu_create(struct sched_param* sched_param)
 {
   vcpu_id_t res;
-  asm volatile ("int $0x30\n":"=a"(res):"a" (4L), "b"(sched_param):CLOBBERS2);
+  res = __syscall30 (4, (unsigned int) sched_param, 0, 0, 0);
   return res;
 }
 
 int vcpu_bind_task(vcpu_id_t vcpu_id)
 {
   int res;
-  asm volatile ("int $0x30\n":"=a"(res):"a" (5L), "b"(vcpu_id):CLOBBERS2);
+  res = __syscall30 (5, (unsigned int) vcpu_id, 0, 0, 0);
   return res;
 }
 
 int vcpu_destroy(vcpu_id_t vcpu_id, uint force)
 {
   int res;
-  asm volatile ("int $0x30\n":"=a"(res):"a" (6L), "b"(vcpu_id), "c"(force):CLOBBERS5);
+  res = __syscall30 (6, (unsigned int) vcpu_id, (unsigned int) force, 0, 0);
   return res;
 }
 
 int vcpu_getparams(struct sched_param* sched_param)
 {
   int res;
-  asm volatile ("int $0x30\n":"=a"(res):"a" (7L), "b"(sched_param):CLOBBERS2);
+  res = __syscall30 (7, (unsigned int) sched_param, 0, 0, 0);
   return res;
 }
 
 int vcpu_setparams(vcpu_id_t vcpu_id, struct sched_param* sched_param)
 {
   int res;
-  asm volatile ("int $0x30\n":"=a"(res):"a" (8L), "b"(vcpu_id), "c"(sched_param):CLOBBERS5);
+  res = __syscall30 (8, (unsigned int) vcpu_id,
+                     (unsigned int) sched_param, 0, 0);
   return res;
 }
 
@@ -208,7 +221,8 @@ int link(char *old, char *new)
 int lseek(int file, int ptr, int dir)
 {
   int res;
-  asm volatile ("int $0x30\n":"=a"(res):"a" (10L), "b"(file), "c"(ptr), "d"(dir):CLOBBERS6);
+  res = __syscall30 (10, (unsigned int) file, (unsigned int) ptr,
+                     (unsigned int) dir, 0);
   return res;
 }
 
@@ -281,7 +295,7 @@ inline void
 usleep (unsigned usec)
 {
 
-  asm volatile ("int $0x30\n"::"a" (1L), "b" (usec):CLOBBERS2);
+  __syscall30 (1, (unsigned int) usec, 0, 0, 0);
 
 }
 
@@ -291,7 +305,7 @@ nanosleep (const struct timespec *req, struct timespec *rem)
 	if (!req || req->tv_nsec > 999999999 || req->tv_nsec < 0)
 		return -1;
 
-  asm volatile ("int $0x30\n"::"a" (14L), "b" (req):CLOBBERS2);
+  __syscall30 (14, (unsigned int) req, 0, 0, 0);
 	/* 
 	 * No signal in Quest. nanosleep will not be interrupted.
 	 * So remaining time is always 0
@@ -307,8 +321,8 @@ inline int
 usb_syscall(int device_id, int operation, void* buf, int data_len)
 {
   int ret;
-  asm volatile ("int $0x30\n":"=a" (ret) : "a" (2L), "b"(device_id), "c" (operation),
-                "d" (buf), "S" (data_len) : CLOBBERS7);
+  ret = __syscall30 (2, (unsigned int) device_id, (unsigned int) operation,
+                     (unsigned int) buf, (unsigned int) data_len);
   return ret;
 }
 
@@ -316,9 +330,42 @@ inline int
 enable_video(int enable, unsigned char** video_memory, unsigned int flags)
 {
   int res;
-  asm volatile ("int $0x30\n":"=a"(res):"a" (9L), "b"(enable), "c"(video_memory), "d"(flags): CLOBBERS6);
+  res = __syscall30 (9, (unsigned int) enable, (unsigned int) video_memory,
+                     (unsigned int) flags, 0);
+  return res;
+
+}
+
+int
+kstats (int which, void *buf, int max)
+{
+  int res;
+  res = __syscall30 (15, (unsigned int) which, (unsigned int) buf,
+                     (unsigned int) max, 0);
   return res;
+}
 
+int
+futex (volatile int *uaddr, int op, int val)
+{
+  int res;
+  res = __syscall30 (16, (unsigned int) uaddr, (unsigned int) op,
+                     (unsigned int) val, 0);
+  return res;
+}
+
+void *
+bigpage_alloc (unsigned int count)
+{
+  return (void *) __syscall30 (17, BIGPAGE_MAP, 0, count, 0);
+}
+
+int
+bigpage_free (void *addr, unsigned int count)
+{
+  int res;
+  res = __syscall30 (17, BIGPAGE_UNMAP, (unsigned int) addr, count, 0);
+  return res;
 }
 
 inline int
@@ -353,7 +400,8 @@ pressed_keys (uint* buf, uint max)
 inline int get_keyboard_events(int blocking, uint* codes, uint max)
 {
   int res;
-  asm volatile ("int $0x30\n":"=a"(res):"a" (11L), "b"(blocking), "c"(codes), "d"(max):CLOBBERS6);
+  res = __syscall30 (11, (unsigned int) blocking, (unsigned int) codes,
+                     (unsigned int) max, 0);
   return res;
 }
 
@@ -435,10 +483,8 @@ open_socket (int domain, int type, int protocol)
 {
   int ret;
 
-  asm volatile ("int $0x3D\n"
-                :"=a" (ret)
-                :"a" (0), "b" (domain), "c" (type), "d" (protocol), "S" (0), "D" (0)
-                :"memory", "cc");
+  ret = __syscall3d (0, (unsigned int) domain, (unsigned int) type,
+                     (unsigned int) protocol, 0, 0);
 
   return ret;
 }
@@ -449,10 +495,8 @@ socket_bind (int sockfd, uint32_t addr, uint16_t port)
 {
   int ret;
 
-  asm volatile ("int $0x3D\n"
-                :"=a" (ret)
-                :"a" (2), "b" (sockfd), "c" (addr), "d" (port), "S" (0), "D" (0)
-                :"memory", "cc");
+  ret = __syscall3d (2, (unsigned int) sockfd, (unsigned int) addr,
+                     (unsigned int) port, 0, 0);
 
   return ret;
 }
@@ -462,10 +506,8 @@ socket_connect (int sockfd, uint32_t addr, uint16_t port)
 {
   int ret;
 
-  asm volatile ("int $0x3D\n"
-                :"=a" (ret)
-                :"a" (3), "b" (sockfd), "c" (addr), "d" (port), "S" (0), "D" (0)
-                :"memory", "cc");
+  ret = __syscall3d (3, (unsigned int) sockfd, (unsigned int) addr,
+                     (unsigned int) port, 0, 0);
 
   return ret;
 }
@@ -475,10 +517,7 @@ socket_listen (int sockfd, int backlog)
 {
   int ret;
 
-  asm volatile ("int $0x3D\n"
-                :"=a" (ret)
-                :"a" (4), "b" (sockfd), "c" (backlog), "d" (0), "S" (0), "D" (0)
-                :"memory", "cc");
+  ret = __syscall3d (4, (unsigned int) sockfd, (unsigned int) backlog, 0, 0, 0);
 
   return ret;
 }
@@ -488,10 +527,8 @@ socket_accept (int sockfd, void *addr, void *len)
 {
   int ret;
 
-  asm volatile ("int $0x3D\n"
-                :"=a" (ret)
-                :"a" (5), "b" (sockfd), "c" (addr), "d" (len), "S" (0), "D" (0)
-                :"memory", "cc");
+  ret = __syscall3d (5, (unsigned int) sockfd, (unsigned int) addr,
+                     (unsigned int) len, 0, 0);
 
   return ret;
 }
@@ -501,10 +538,9 @@ socket_sendto (int sockfd, const void *buf, size_t nbytes, uint32_t destaddr, ui
 {
   ssize_t ret;
 
-  asm volatile ("int $0x3D\n"
-                :"=a" (ret)
-                :"a" (7), "b" (sockfd), "c" (buf), "d" (nbytes), "S" (destaddr), "D" (port)
-                :"memory", "cc");
+  ret = __syscall3d (7, (unsigned int) sockfd, (unsigned int) buf,
+                     (unsigned int) nbytes, (unsigned int) destaddr,
+                     (unsigned int) port);
 
   return ret;
 }
@@ -514,10 +550,9 @@ socket_recv (int sockfd, void *buf, size_t nbytes, void *addr, void *addrlen)
 {
   int ret;
 
-  asm volatile ("int $0x3D\n"
-                :"=a" (ret)
-                :"a" (8), "b" (sockfd), "c" (buf), "d" (nbytes), "S" (addr), "D" (addrlen)
-                :"memory", "cc");
+  ret = __syscall3d (8, (unsigned int) sockfd, (unsigned int) buf,
+                     (unsigned int) nbytes, (unsigned int) addr,
+                     (unsigned int) addrlen);
 
   return ret;
 }
@@ -528,10 +563,20 @@ socket_select (int maxfdp1, fd_set * readfds, fd_set * writefds,
 {
   int ret;
 
-  asm volatile ("int $0x3D\n"
-                :"=a" (ret)
-                :"a" (9), "b" (maxfdp1), "c" (readfds), "d" (writefds), "S" (exceptfds), "D" (tvptr)
-                :"memory", "cc");
+  ret = __syscall3d (9, (unsigned int) maxfdp1, (unsigned int) readfds,
+                     (unsigned int) writefds, (unsigned int) exceptfds,
+                     (unsigned int) tvptr);
+
+  return ret;
+}
+
+inline int
+socket_poll (struct pollfd *fds, nfds_t nfds, int timeout)
+{
+  int ret;
+
+  ret = __syscall3d (20, (unsigned int) fds, (unsigned int) nfds,
+                     (unsigned int) timeout, 0, 0);
 
   return ret;
 }
@@ -541,10 +586,7 @@ socket_get_sb_id ()
 {
   int ret;
 
-  asm volatile ("int $0x3D\n"
-                :"=a" (ret)
-                :"a" (11), "b" (0), "c" (0), "d" (0), "S" (0), "D" (0)
-                :"memory", "cc");
+  ret = __syscall3d (11, 0, 0, 0, 0, 0);
 
   return ret;
 }
@@ -554,10 +596,8 @@ socket_getsockname (int sockfd, void *addr, void *len)
 {
   int ret;
 
-  asm volatile ("int $0x3D\n"
-                :"=a" (ret)
-                :"a" (12), "b" (sockfd), "c" (addr), "d" (len), "S" (0), "D" (0)
-                :"memory", "cc");
+  ret = __syscall3d (12, (unsigned int) sockfd, (unsigned int) addr,
+                     (unsigned int) len, 0, 0);
 
   return ret;
 }
@@ -580,10 +620,8 @@ inline int syscall_fcntl(int fd, int cmd, void* extra_arg)
 {
   int ret;
 
-  asm volatile ("int $0x3D\n"
-                :"=a" (ret)
-                :"a" (14), "b" (fd), "c" (cmd), "d" (extra_arg)
-                :"memory", "cc");
+  ret = __syscall3d (14, (unsigned int) fd, (unsigned int) cmd,
+                     (unsigned int) extra_arg, 0, 0);
 
   return ret;
 }
@@ -601,8 +639,32 @@ switch_screen (int dir)
 inline int vshm_map(uint vshm_key, uint size, uint sandboxes, uint flags, void** addr)
 {
   int res;
-  asm volatile ("int $0x3D\n":"=a"(res):"a" (15L), "b"(vshm_key), "c"(size),
-		"d"(sandboxes), "S"(flags), "D"(addr) : "memory", "cc");
+  res = __syscall3d (15, (unsigned int) vshm_key, (unsigned int) size,
+                     (unsigned int) sandboxes, (unsigned int) flags,
+                     (unsigned int) addr);
+  return res;
+}
+
+inline int vshm_notify(uint sandbox, uint vshm_key)
+{
+  int res;
+  res = __syscall3d (21, (unsigned int) sandbox, (unsigned int) vshm_key,
+                     0, 0, 0);
+  return res;
+}
+
+inline int vshm_wait(uint vshm_key, uint usec)
+{
+  int res;
+  res = __syscall3d (22, (unsigned int) vshm_key, (unsigned int) usec,
+                     0, 0, 0);
+  return res;
+}
+
+inline int vshm_forget(uint vshm_key)
+{
+  int res;
+  res = __syscall3d (23, (unsigned int) vshm_key, 0, 0, 0, 0);
   return res;
 }
 
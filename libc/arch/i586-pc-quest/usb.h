@@ -18,6 +18,8 @@
 #ifndef _USER_USB_H_
 #define _USER_USB_H_
 
+#include <vdso.h>
+
 #define USB_USER_READ  0
 #define USB_USER_WRITE 1
 #define USB_USER_OPEN  2
@@ -34,10 +36,7 @@
 static inline int
 usb_syscall(int fd, int operation, void* buf, int data_len)
 {
-  int ret;
-  asm volatile ("int $0x30\n":"=a" (ret) : "a" (2L), "b"(fd), "c" (operation),
-                "d" (buf), "S" (data_len) : CLOBBERS7);
-  return ret;
+  return __syscall30 (2, fd, operation, (unsigned int) buf, data_len);
 }
 
 static inline int usb_read(int fd, void* buf, int data_len)
@@ -0,0 +1,111 @@
+/*                    The Quest Operating System
+ *  Copyright (C) 2005-2012  Richard West, Boston University
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _VDSO_H_
+#define _VDSO_H_
+
+/* The vDSO page, mapped read-only at VDSO_ADDR in every process.
+   Make sure this matches struct vdso_data in the kernel's
+   arch/i386-vdso.h */
+
+#define VDSO_ADDR 0xBFFFF000
+
+struct vdso_data
+{
+  unsigned int sysenter;        /* SYSENTER entry available */
+  unsigned int boot_sec;        /* seconds since the epoch at tsc_base */
+  unsigned long long tsc_freq;  /* TSC ticks per second */
+  unsigned long long tsc_base;  /* TSC at boot_sec */
+};
+
+#define __vdso ((const volatile struct vdso_data *) VDSO_ADDR)
+
+/* Set in the syscall number to reach the int $0x3D (socket) table
+   through SYSENTER */
+#define SYSENTER_SOCKET 0x80000000
+
+/* Enter the kernel through SYSENTER.  SYSEXIT returns to the address
+   and stack in %edx and %ecx, so those two arguments go on the stack
+   below the return address, with %ebp pointing at them (see the
+   kernel's arch/i386-sysenter.h). */
+static inline int
+__sysenter (unsigned int nr, unsigned int b, unsigned int c,
+            unsigned int d, unsigned int S, unsigned int D)
+{
+  int ret;
+
+  asm volatile ("pushl %%ebp\n"
+                "pushl %%ecx\n"
+                "pushl %%edx\n"
+                "pushl $1f\n"
+                "movl %%esp, %%ebp\n"
+                "sysenter\n"
+                "1:\n"
+                "addl $12, %%esp\n"
+                "popl %%ebp\n"
+                :"=a" (ret), "+c" (c), "+d" (d)
+                :"0" (nr), "b" (b), "S" (S), "D" (D)
+                :"memory", "cc");
+  return ret;
+}
+
+/* A call into the int $0x30 syscall table */
+static inline int
+__syscall30 (unsigned int nr, unsigned int b, unsigned int c,
+             unsigned int d, unsigned int S)
+{
+  int ret;
+
+  if (__vdso->sysenter)
+    return __sysenter (nr, b, c, d, S, 0);
+  asm volatile ("int $0x30\n"
+                :"=a" (ret), "+c" (c), "+d" (d)
+                :"0" (nr), "b" (b), "S" (S)
+                :"memory", "cc", "%edi");
+  return ret;
+}
+
+/* A call into the int $0x3D (socket) syscall table */
+static inline int
+__syscall3d (unsigned int nr, unsigned int b, unsigned int c,
+             unsigned int d, unsigned int S, unsigned int D)
+{
+  int ret;
+
+  if (__vdso->sysenter)
+    return __sysenter (nr | SYSENTER_SOCKET, b, c, d, S, D);
+  asm volatile ("int $0x3D\n"
+                :"=a" (ret), "+c" (c), "+d" (d)
+                :"0" (nr), "b" (b), "S" (S), "D" (D)
+                :"memory", "cc");
+  return ret;
+}
+
+#endif
+
+
+
+/* 
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * mode: C
+ * c-file-style: "gnu"
+ * c-basic-offset: 2
+ * End: 
+ */
+
+/* vi: set et sw=2 sts=2: */
@@ -110,6 +110,168 @@ int vshm_circular_buffer_remove(vshm_circular_buffer_t* vcb, void* item)
   return 0;
 }
 
+#define vch_slot_addr(ch, pos)                                          \
+  (&(ch)->shared->data[(ch)->slot_size * ((pos) & ((ch)->num_slots - 1))])
+
+/* Order slot contents before the index store that publishes them */
+#define vch_barrier() asm volatile ("":::"memory")
+
+int mk_vshm_channel(vshm_channel_t* ch, unsigned int vshm_key,
+                    unsigned int num_slots, size_t slot_size,
+                    unsigned int sandboxes, unsigned int flags)
+{
+  int res;
+  unsigned int peer = 0;
+
+  if(num_slots == 0 || (num_slots & (num_slots - 1))) return -1;
+
+  res = vshm_map(vshm_key, sizeof(vshm_channel_shared_t) + (slot_size * num_slots),
+                 sandboxes, flags & (VSHM_CREATE | VSHM_ALL_ACCESS),
+                 (void**)&ch->shared);
+  if(res < 0) return res;
+
+  while(peer < 32 && !((1 << peer) & sandboxes)) peer++;
+
+  if(flags & VSHM_CREATE) {
+    /* The kernel zeroes a new region, so head and tail start at 0 */
+    ch->shared->num_slots = num_slots;
+    ch->shared->slot_size = slot_size;
+  }
+  else if(ch->shared->num_slots &&
+          (ch->shared->num_slots != num_slots ||
+           ch->shared->slot_size != slot_size)) {
+    return -1;
+  }
+
+  ch->vshm_key  = vshm_key;
+  ch->peer      = peer;
+  ch->num_slots = num_slots;
+  ch->slot_size = slot_size;
+  ch->flags     = flags & VSHM_CHANNEL_BLOCK;
+  return 0;
+}
+
+/* Sleep until the other side makes progress.  Set our waiting flag,
+ * then look at the ring again: the other side stores its index before
+ * reading the flag, so one of us sees the other. */
+static int vch_wait(vshm_channel_t* ch, volatile unsigned int* waiting,
+                    int (*ready)(vshm_channel_t*))
+{
+  if(!(ch->flags & VSHM_CHANNEL_BLOCK)) return -1;
+  *waiting = 1;
+  __sync_synchronize();
+  if(!ready(ch)) vshm_wait(ch->vshm_key, VSHM_CHANNEL_WAIT_USEC);
+  *waiting = 0;
+  return 0;
+}
+
+static void vch_kick(vshm_channel_t* ch, volatile unsigned int* waiting)
+{
+  __sync_synchronize();
+  /* Only read the flag: the waiter clears it itself once awake */
+  if(*waiting) vshm_notify(ch->peer, ch->vshm_key);
+}
+
+static int vch_space(vshm_channel_t* ch)
+{
+  return ch->num_slots - (ch->shared->head - ch->shared->tail);
+}
+
+static int vch_count(vshm_channel_t* ch)
+{
+  return ch->shared->head - ch->shared->tail;
+}
+
+void* vshm_channel_reserve(vshm_channel_t* ch)
+{
+  while(!vch_space(ch))
+    if(vch_wait(ch, &ch->shared->producer_waiting, vch_space) < 0) return NULL;
+  return vch_slot_addr(ch, ch->shared->head);
+}
+
+void vshm_channel_commit(vshm_channel_t* ch)
+{
+  vch_barrier();
+  ch->shared->head++;
+  vch_kick(ch, &ch->shared->consumer_waiting);
+}
+
+void* vshm_channel_peek(vshm_channel_t* ch)
+{
+  while(!vch_count(ch))
+    if(vch_wait(ch, &ch->shared->consumer_waiting, vch_count) < 0) return NULL;
+  vch_barrier();
+  return vch_slot_addr(ch, ch->shared->tail);
+}
+
+void vshm_channel_release(vshm_channel_t* ch)
+{
+  vch_barrier();
+  ch->shared->tail++;
+  vch_kick(ch, &ch->shared->producer_waiting);
+}
+
+int vshm_channel_send(vshm_channel_t* ch, const void* item)
+{
+  void* slot = vshm_channel_reserve(ch);
+
+  if(!slot) return -1;
+  memcpy(slot, item, ch->slot_size);
+  vshm_channel_commit(ch);
+  return 0;
+}
+
+int vshm_channel_recv(vshm_channel_t* ch, void* item)
+{
+  void* slot = vshm_channel_peek(ch);
+
+  if(!slot) return -1;
+  memcpy(item, slot, ch->slot_size);
+  vshm_channel_release(ch);
+  return 0;
+}
+
+int vshm_channel_send_n(vshm_channel_t* ch, const void* items, int n)
+{
+  unsigned int head = ch->shared->head;
+  int i, k;
+
+  while(!(k = vch_space(ch)))
+    if(vch_wait(ch, &ch->shared->producer_waiting, vch_space) < 0) return 0;
+  if(k > n) k = n;
+  for(i = 0; i < k; ++i)
+    memcpy(vch_slot_addr(ch, head + i), (const char*)items + i * ch->slot_size,
+           ch->slot_size);
+  vch_barrier();
+  ch->shared->head = head + k;
+  vch_kick(ch, &ch->shared->consumer_waiting);
+  return k;
+}
+
+int vshm_channel_recv_n(vshm_channel_t* ch, void* items, int n)
+{
+  unsigned int tail = ch->shared->tail;
+  int i, k;
+
+  while(!(k = vch_count(ch)))
+    if(vch_wait(ch, &ch->shared->consumer_waiting, vch_count) < 0) return 0;
+  if(k > n) k = n;
+  vch_barrier();
+  for(i = 0; i < k; ++i)
+    memcpy((char*)items + i * ch->slot_size, vch_slot_addr(ch, tail + i),
+           ch->slot_size);
+  vch_barrier();
+  ch->shared->tail = tail + k;
+  vch_kick(ch, &ch->shared->producer_waiting);
+  return k;
+}
+
+void vshm_channel_close(vshm_channel_t* ch)
+{
+  if(ch->flags & VSHM_CHANNEL_BLOCK) vshm_forget(ch->vshm_key);
+  ch->flags = 0;
+}
+
 /* 
  * Local Variables:
  * indent-tabs-mode: nil
@@ -77,9 +77,87 @@ int vshm_circular_buffer_insert(vshm_circular_buffer_t* vcb, void* item);
 
 int vshm_circular_buffer_remove(vshm_circular_buffer_t* vcb, void* item);
 
+/* Channel: a single-producer, single-consumer ring of fixed-size
+ * slots in a vshm region.  The producer and consumer indices live on
+ * separate cache lines and count slots forever, wrapping at 2^32;
+ * num_slots must be a power of 2.  The whole ring must fit in one
+ * vshm region (POOL_SIZE_IN_PAGES pages in the kernel).
+ *
+ * With VSHM_CHANNEL_BLOCK a sender finding the ring full, or a
+ * receiver finding it empty, sleeps in vshm_wait until the other side
+ * calls vshm_notify.  Leave it out when the peer cannot send
+ * notifications, e.g. the Linux sandbox; calls then return at once. */
+#define VSHM_CHANNEL_CACHE_LINE 64
+#define VSHM_CHANNEL_BLOCK    0x100
+/* Longest sleep before looking at the ring again, in usec */
+#define VSHM_CHANNEL_WAIT_USEC 10000
+
+typedef struct {
+  /* Written by the producer */
+  volatile unsigned int head;
+  volatile unsigned int producer_waiting;
+  char _pad0[VSHM_CHANNEL_CACHE_LINE - 2 * sizeof (unsigned int)];
+  /* Written by the consumer */
+  volatile unsigned int tail;
+  volatile unsigned int consumer_waiting;
+  char _pad1[VSHM_CHANNEL_CACHE_LINE - 2 * sizeof (unsigned int)];
+  /* Set by the creator */
+  unsigned int num_slots;
+  unsigned int slot_size;
+  char _pad2[VSHM_CHANNEL_CACHE_LINE - 2 * sizeof (unsigned int)];
+  char data[];
+} vshm_channel_shared_t;
+
+typedef struct {
+  vshm_channel_shared_t* shared;
+  unsigned int vshm_key;
+  unsigned int peer;            /* sandbox at the other end */
+  unsigned int num_slots;
+  size_t slot_size;
+  unsigned int flags;
+} vshm_channel_t;
+
+int mk_vshm_channel(vshm_channel_t* ch, unsigned int vshm_key,
+                    unsigned int num_slots, size_t slot_size,
+                    unsigned int sandboxes, unsigned int flags);
+
+/* Copy one item in or out.  Return 0, or -1 if the ring is full
+ * (send) or empty (recv) and the channel does not block. */
+int vshm_channel_send(vshm_channel_t* ch, const void* item);
+int vshm_channel_recv(vshm_channel_t* ch, void* item);
+
+/* Copy up to n items in or out, blocking only until at least one
+ * moves.  Return the number moved. */
+int vshm_channel_send_n(vshm_channel_t* ch, const void* items, int n);
+int vshm_channel_recv_n(vshm_channel_t* ch, void* items, int n);
+
+/* Zero-copy use for large payloads: vshm_channel_reserve returns the
+ * next free slot, to be filled in place and handed over with
+ * vshm_channel_commit; vshm_channel_peek and vshm_channel_release do
+ * the same for the receiver.  reserve and peek return NULL where
+ * send and recv would return -1. */
+void* vshm_channel_reserve(vshm_channel_t* ch);
+void vshm_channel_commit(vshm_channel_t* ch);
+void* vshm_channel_peek(vshm_channel_t* ch);
+void vshm_channel_release(vshm_channel_t* ch);
+
+/* Stop using a channel.  Drops any notification for it still held by
+ * the kernel; the vshm region itself stays mapped. */
+void vshm_channel_close(vshm_channel_t* ch);
+
 inline int vshm_map(unsigned int vshm_key, unsigned int size,
                     unsigned int sandboxes, unsigned int flags, void** addr);
 
+/* Wake a task of sandbox waiting in vshm_wait on vshm_key */
+inline int vshm_notify(unsigned int sandbox, unsigned int vshm_key);
+
+/* Wait up to usec for a vshm_notify on vshm_key.  Returns 0 if
+ * notified, -1 on timeout. */
+inline int vshm_wait(unsigned int vshm_key, unsigned int usec);
+
+/* Drop an unclaimed notification on vshm_key */
+inline int vshm_forget(unsigned int vshm_key);
+
 
 #endif
 
@@ -1,5 +1,6 @@
 #include <sys/socket.h>
 #include <sys/select.h>
+#include <poll.h>
 #include <sys/types.h>
 #include <netinet/in.h>
 #include <netdb.h>
@@ -20,6 +21,12 @@ select (int maxfdp1, fd_set * readfds, fd_set * writefds,
   return socket_select (maxfdp1, readfds, writefds, exceptfds, tvptr);
 }
 
+int
+poll (struct pollfd *fds, nfds_t nfds, int timeout)
+{
+  return socket_poll (fds, nfds, timeout);
+}
+
 uint32_t
 htonl (uint32_t hostint32)
 {
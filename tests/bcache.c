@@ -0,0 +1,107 @@
+/*                    The Quest Operating System
+ *  Copyright (C) 2005-2012  Richard West, Boston University
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Block cache test: open and read the same files repeatedly and
+ * print the per-device cache counters before and after.  The second
+ * and later passes should be served from the block cache and the name
+ * cache, without touching the disk.
+ *
+ * usage: bcache [file ...] */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/time.h>
+#include <kstats.h>
+
+#define PASSES 4
+#define BUFFER_SIZE 4096
+#define MAX_DEVS 4
+
+static void
+print_stats (void)
+{
+  struct bcache_stat stats[MAX_DEVS];
+  int i, n = kstats (KSTATS_BCACHE, stats, MAX_DEVS);
+
+  printf ("%-8s %8s %8s %8s %8s %8s %8s\n", "dev", "hits", "misses",
+          "ahead", "evict", "n_hits", "n_miss");
+  for (i = 0; i < n; i++)
+    printf ("%-8s %8u %8u %8u %8u %8u %8u\n", stats[i].name,
+            stats[i].hits, stats[i].misses, stats[i].readaheads,
+            stats[i].evictions, stats[i].name_hits, stats[i].name_misses);
+}
+
+static long
+read_file (const char *path)
+{
+  static char buffer[BUFFER_SIZE];
+  FILE *f = fopen (path, "r");
+  long total = 0;
+  size_t n;
+
+  if (!f) {
+    printf ("Failed to open %s\n", path);
+    return -1;
+  }
+  while ((n = fread (buffer, 1, BUFFER_SIZE, f)) > 0)
+    total += n;
+  fclose (f);
+  return total;
+}
+
+int
+main (int argc, char *argv[])
+{
+  char *defaults[] = { "/boot/sample.txt", "/boot/exec" };
+  char **files = defaults;
+  int nfiles = 2, i, p;
+  struct timeval start, end;
+  long usec, bytes;
+
+  if (argc > 1) {
+    files = argv + 1;
+    nfiles = argc - 1;
+  }
+
+  print_stats ();
+
+  for (p = 0; p < PASSES; p++) {
+    bytes = 0;
+    gettimeofday (&start, NULL);
+    for (i = 0; i < nfiles; i++)
+      bytes += read_file (files[i]);
+    gettimeofday (&end, NULL);
+    usec = (end.tv_sec - start.tv_sec) * 1000000L +
+      (end.tv_usec - start.tv_usec);
+    printf ("pass %d: %ld bytes in %ld usec\n", p, bytes, usec);
+  }
+
+  print_stats ();
+  return 0;
+}
+
+
+/* 
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * mode: C
+ * c-file-style: "gnu"
+ * c-basic-offset: 2
+ * End: 
+ */
+
+/* vi: set et sw=2 sts=2: */
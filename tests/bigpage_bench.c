@@ -0,0 +1,188 @@
+/*                    The Quest Operating System
+ *  Copyright (C) 2005-2012  Richard West, Boston University
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/* 4 MiB page test: walk a working set one word per 4 KiB page, in a
+ * scattered order, first in the program's own memory (4 KiB pages)
+ * and then in memory from bigpage_alloc (4 MiB pages).  Once the
+ * working set outgrows the 4 KiB TLB reach, the first walk misses on
+ * nearly every access and the second does not.  Fails unless the
+ * 4 MiB pages come zeroed, read back what was written to them, and
+ * are copied on write after fork.
+ *
+ * usage: bigpage_bench [mib] [passes] */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <bigpage.h>
+
+#define MAX_MIB 8
+#define PASSES 16
+#define PAGE 4096
+#define STEP 1031               /* prime, so the walk visits every page */
+
+static char small_pages[MAX_MIB << 20];
+
+static inline unsigned long long
+rdtsc (void)
+{
+  unsigned long long t;
+  asm volatile ("rdtsc":"=A" (t));
+  return t;
+}
+
+/* Average cycles per access of a scattered walk over size bytes */
+static unsigned long long
+walk (volatile char *mem, int size, int passes)
+{
+  unsigned long long start;
+  int pages = size / PAGE, i, p, n = 0;
+
+  /* fault everything in first */
+  for (i = 0; i < size; i += PAGE)
+    mem[i] = 1;
+
+  start = rdtsc ();
+  for (p = 0; p < passes; p++)
+    for (i = 0; i < pages; i++) {
+      mem[(int) (((long long) i * STEP) % pages) * PAGE]++;
+      n++;
+    }
+  return (rdtsc () - start) / n;
+}
+
+/* Check that size bytes at mem are zero, then fill them with a
+ * pattern and read it back */
+static int
+check_pattern (unsigned *mem, int size)
+{
+  int i, n = size / sizeof (unsigned);
+
+  for (i = 0; i < n; i++)
+    if (mem[i] != 0) {
+      printf ("FAIL: word %d of a new 4 MiB page is %x\n", i, mem[i]);
+      return -1;
+    }
+  for (i = 0; i < n; i++)
+    mem[i] = i * 2654435761u;
+  for (i = 0; i < n; i++)
+    if (mem[i] != i * 2654435761u) {
+      printf ("FAIL: word %d reads back %x\n", i, mem[i]);
+      return -1;
+    }
+  return 0;
+}
+
+/* Fork with a 4 MiB page written by both sides.  The child reports
+ * through a zeroed shared page whether it saw the parent's contents
+ * and its own write. */
+static int
+check_fork (char *big)
+{
+  unsigned long long start;
+  int pid, id, ok, *child_ok;
+
+  id = shared_mem_alloc ();
+  if (id < 0)
+    return -1;
+  memset (big, 'p', BIGPAGE_SIZE);
+  pid = fork ();
+  if (pid == 0) {
+    start = rdtsc ();
+    big[0] = 'c';               /* copies the whole page */
+    printf ("child: first write %llu cycles\n", rdtsc () - start);
+    child_ok = shared_mem_attach (id);
+    if ((unsigned) child_ok != -1)
+      *child_ok = big[0] == 'c' && big[1] == 'p' &&
+        big[BIGPAGE_SIZE - 1] == 'p';
+    exit (0);
+  }
+  ok = 0;
+  if (pid > 0) {
+    waitpid (pid, NULL, 0);
+    child_ok = shared_mem_attach (id);
+    if ((unsigned) child_ok != -1) {
+      ok = *child_ok;
+      shared_mem_detach (child_ok);
+    }
+  }
+  shared_mem_free (id);
+  if (!ok) {
+    printf ("FAIL: child lost the 4 MiB page contents\n");
+    return -1;
+  }
+  if (big[0] != 'p' || big[BIGPAGE_SIZE - 1] != 'p') {
+    printf ("FAIL: 4 MiB page not copied on write\n");
+    return -1;
+  }
+  return 0;
+}
+
+int
+main (int argc, char *argv[])
+{
+  int mib = MAX_MIB, passes = PASSES, count;
+  unsigned before;
+  char *big;
+
+  if (argc > 1)
+    mib = atoi (argv[1]);
+  if (argc > 2)
+    passes = atoi (argv[2]);
+  if (mib < 1 || mib > MAX_MIB)
+    mib = MAX_MIB;
+  if (passes < 1)
+    passes = PASSES;
+  count = (mib + 3) / 4;
+
+  before = meminfo ();
+  big = bigpage_alloc (count);
+  if (!big) {
+    printf ("bigpage_alloc (%d) failed\n", count);
+    return 1;
+  }
+
+  if (check_pattern ((unsigned *) big, count * BIGPAGE_SIZE) < 0)
+    return 1;
+
+  printf ("%d MiB, %d passes\n", mib, passes);
+  printf ("4 KiB pages: %llu cycles per access\n",
+          walk (small_pages, mib << 20, passes));
+  printf ("4 MiB pages: %llu cycles per access\n",
+          walk (big, mib << 20, passes));
+
+  if (check_fork (big) < 0)
+    return 1;
+  if (bigpage_free (big, count) < 0) {
+    printf ("bigpage_free failed\n");
+    return 1;
+  }
+  printf ("memory = %u (%u before)\n", meminfo (), before);
+  printf ("PASS\n");
+  return 0;
+}
+
+/* 
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * mode: C
+ * c-file-style: "gnu"
+ * c-basic-offset: 2
+ * End: 
+ */
+
+/* vi: set et sw=2 sts=2: */
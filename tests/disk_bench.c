@@ -0,0 +1,139 @@
+/*                    The Quest Operating System
+ *  Copyright (C) 2005-2012  Richard West, Boston University
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Disk read benchmark: read a file sequentially in large chunks, then
+ * read 4KiB pieces of it at random offsets, and print the throughput
+ * with the block cache counters for each phase.  Use a file larger
+ * than the 1MiB block cache, on the IDE disk, so that the random
+ * phase mostly misses.
+ *
+ * usage: disk_bench [file [random_reads]] */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <kstats.h>
+
+#define SEQ_CHUNK 65536
+#define RAND_CHUNK 4096
+#define DEFAULT_READS 256
+#define MAX_DEVS 4
+
+static char buf[SEQ_CHUNK];
+
+static long
+elapsed (struct timeval *a, struct timeval *b)
+{
+  return (b->tv_sec - a->tv_sec) * 1000000L + (b->tv_usec - a->tv_usec);
+}
+
+/* Sum the counters of all devices */
+static void
+totals (unsigned *misses, unsigned *ahead)
+{
+  struct bcache_stat stats[MAX_DEVS];
+  int i, n = kstats (KSTATS_BCACHE, stats, MAX_DEVS);
+
+  *misses = *ahead = 0;
+  for (i = 0; i < n; i++) {
+    *misses += stats[i].misses;
+    *ahead += stats[i].readaheads;
+  }
+}
+
+static void
+report (const char *phase, long bytes, long usec, unsigned misses,
+        unsigned ahead)
+{
+  printf ("%-10s %8ld KiB %8ld usec %6ld KiB/s  misses %u ahead %u\n",
+          phase, bytes / 1024, usec,
+          usec > 0 ? (long) ((long long) bytes * 1000000 / 1024 / usec) : 0,
+          misses, ahead);
+}
+
+int
+main (int argc, char *argv[])
+{
+  char *path = "/boot/quest";
+  int fd, n, i, reads = DEFAULT_READS;
+  long size, total = 0, blocks;
+  unsigned seed = 12345, m0, a0, m1, a1;
+  struct timeval start, end;
+
+  if (argc > 1)
+    path = argv[1];
+  if (argc > 2)
+    reads = atoi (argv[2]);
+  if (reads < 1)
+    reads = DEFAULT_READS;
+
+  if ((fd = open (path, O_RDONLY)) < 0) {
+    printf ("Failed to open %s\n", path);
+    return EXIT_FAILURE;
+  }
+  size = lseek (fd, 0, SEEK_END);
+  lseek (fd, 0, SEEK_SET);
+  blocks = size / RAND_CHUNK;
+  printf ("%s: %ld bytes\n", path, size);
+  if (blocks < 1) {
+    printf ("File too small\n");
+    close (fd);
+    return EXIT_FAILURE;
+  }
+
+  /* Sequential: readahead batches become multi-sector commands */
+  totals (&m0, &a0);
+  gettimeofday (&start, NULL);
+  while ((n = read (fd, buf, SEQ_CHUNK)) > 0)
+    total += n;
+  gettimeofday (&end, NULL);
+  totals (&m1, &a1);
+  report ("sequential", total, elapsed (&start, &end), m1 - m0, a1 - a0);
+
+  /* Random: one 4KiB block per request, in no particular order */
+  total = 0;
+  totals (&m0, &a0);
+  gettimeofday (&start, NULL);
+  for (i = 0; i < reads; i++) {
+    seed = seed * 1103515245 + 12345;
+    lseek (fd, (long) ((seed >> 8) % blocks) * RAND_CHUNK, SEEK_SET);
+    if ((n = read (fd, buf, RAND_CHUNK)) <= 0) {
+      printf ("Read failed at pass %d\n", i);
+      close (fd);
+      return EXIT_FAILURE;
+    }
+    total += n;
+  }
+  gettimeofday (&end, NULL);
+  totals (&m1, &a1);
+  report ("random", total, elapsed (&start, &end), m1 - m0, a1 - a0);
+
+  close (fd);
+  return EXIT_SUCCESS;
+}
+/* 
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * mode: C
+ * c-file-style: "gnu"
+ * c-basic-offset: 2
+ * End: 
+ */
+
+/* vi: set et sw=2 sts=2: */
@@ -0,0 +1,82 @@
+/*                    The Quest Operating System
+ *  Copyright (C) 2005-2012  Richard West, Boston University
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Process startup test: fork and exec a program repeatedly and print
+ * the average time until it has exited.  The first launch fills the
+ * executable page cache; the rest should hit it and only fault in the
+ * pages they touch.
+ *
+ * usage: exec_time [program] [runs] */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/time.h>
+
+#define DEFAULT_RUNS 10
+
+int
+main (int argc, char *argv[])
+{
+  char *prog = "/boot/exec";
+  char *args[2];
+  struct timeval start, end;
+  int runs = DEFAULT_RUNS, i, pid;
+  long usec, first = 0, rest = 0;
+
+  if (argc > 1)
+    prog = argv[1];
+  if (argc > 2)
+    runs = atoi (argv[2]);
+  if (runs < 2)
+    runs = DEFAULT_RUNS;
+
+  args[0] = prog;
+  args[1] = NULL;
+
+  for (i = 0; i < runs; i++) {
+    gettimeofday (&start, NULL);
+    if ((pid = fork ()) == 0) {
+      exec (prog, args);
+      printf ("exec %s failed\n", prog);
+      exit (1);
+    }
+    waitpid (pid, NULL, 0);
+    gettimeofday (&end, NULL);
+    usec = (end.tv_sec - start.tv_sec) * 1000000
+      + (end.tv_usec - start.tv_usec);
+    if (i == 0)
+      first = usec;
+    else
+      rest += usec;
+  }
+
+  printf ("%s: first run %ld us, later runs %ld us on average\n",
+          prog, first, rest / (runs - 1));
+  printf ("memory = %u\n", meminfo ());
+  return 0;
+}
+
+/* 
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * mode: C
+ * c-file-style: "gnu"
+ * c-basic-offset: 2
+ * End: 
+ */
+
+/* vi: set et sw=2 sts=2: */
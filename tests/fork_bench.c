@@ -0,0 +1,222 @@
+/*                    The Quest Operating System
+ *  Copyright (C) 2005-2012  Richard West, Boston University
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/* Fork cost test: time fork () and count the frames it takes, first
+ * with this small program as it starts, then after touching a large
+ * heap.  With copy-on-write fork both should cost about the same; the
+ * large heap is paid for only by the pages that are written later.
+ * Also times fork+exec, which should copy next to nothing, and prints
+ * the kernel's copy-on-write counters.  Fails if a child's writes to
+ * the shared heap show up in the parent, or not in the child.
+ *
+ * usage: fork_bench [heap_kib] [runs] */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <kstats.h>
+
+#define HEAP_KIB 4096
+#define RUNS 8
+#define PAGE 4096
+#define CHILD_SLEEP_USEC 100000
+
+static inline unsigned long long
+rdtsc (void)
+{
+  unsigned long long t;
+  asm volatile ("rdtsc":"=A" (t));
+  return t;
+}
+
+/* Fork runs times, the child staying alive until the parent has read
+ * the free memory.  Prints average cycles and frames per fork. */
+static void
+time_fork (const char *what, int runs)
+{
+  unsigned long long start, cycles = 0;
+  unsigned before, frames = 0;
+  int i, pid;
+
+  for (i = 0; i < runs; i++) {
+    before = meminfo ();
+    start = rdtsc ();
+    pid = fork ();
+    if (pid == 0) {
+      usleep (CHILD_SLEEP_USEC);
+      exit (0);
+    }
+    cycles += rdtsc () - start;
+    frames += (before - meminfo ()) / PAGE;
+    waitpid (pid, NULL, 0);
+  }
+  printf ("%-8s fork: %llu cycles, %u frames\n", what, cycles / runs,
+          frames / runs);
+}
+
+/* Fork, then write every page of heap in the parent, as if the
+ * parent carried on working while the child exists */
+static void
+time_touch (char *heap, int size)
+{
+  unsigned long long start, cycles;
+  int pid, i;
+
+  pid = fork ();
+  if (pid == 0) {
+    usleep (CHILD_SLEEP_USEC);
+    exit (0);
+  }
+  start = rdtsc ();
+  for (i = 0; i < size; i += PAGE)
+    heap[i]++;
+  cycles = rdtsc () - start;
+  waitpid (pid, NULL, 0);
+  printf ("write after fork: %llu cycles per page\n",
+          cycles / (size / PAGE));
+}
+
+/* Fork, then overwrite every page of heap in the child.  The child
+ * must read back its own writes and the parent must still see the
+ * values it left there.  Returns 0 if both hold. */
+static int
+check_cow (char *heap, int size)
+{
+  int pid, i, id, ok = 0, *child_ok;
+
+  /* The child reports through a zeroed shared page, attached after
+   * fork as in test3 */
+  id = shared_mem_alloc ();
+  if (id < 0)
+    return -1;
+
+  for (i = 0; i < size; i += PAGE)
+    heap[i] = (char) (i / PAGE);
+  pid = fork ();
+  if (pid == 0) {
+    for (i = 0; i < size; i += PAGE)
+      heap[i] = (char) ~(i / PAGE);
+    for (i = 0; i < size; i += PAGE)
+      if (heap[i] != (char) ~(i / PAGE))
+        exit (1);
+    child_ok = shared_mem_attach (id);
+    if ((unsigned) child_ok != -1)
+      *child_ok = 1;
+    exit (0);
+  }
+  if (pid < 0)
+    goto out;
+  waitpid (pid, NULL, 0);
+
+  child_ok = shared_mem_attach (id);
+  if ((unsigned) child_ok == -1)
+    goto out;
+  ok = *child_ok;
+  shared_mem_detach (child_ok);
+  if (!ok)
+    printf ("FAIL: child did not read back its writes\n");
+  for (i = 0; i < size; i += PAGE)
+    if (heap[i] != (char) (i / PAGE)) {
+      printf ("FAIL: child write to page %d seen by the parent\n",
+              i / PAGE);
+      ok = 0;
+      break;
+    }
+ out:
+  shared_mem_free (id);
+  return ok ? 0 : -1;
+}
+
+static void
+time_exec (int runs)
+{
+  char *args[2] = { "/boot/exec", NULL };
+  unsigned long long start, cycles = 0;
+  int i, pid;
+
+  for (i = 0; i < runs; i++) {
+    start = rdtsc ();
+    pid = fork ();
+    if (pid == 0) {
+      exec (args[0], args);
+      exit (1);
+    }
+    waitpid (pid, NULL, 0);
+    cycles += rdtsc () - start;
+  }
+  printf ("fork+exec+exit: %llu cycles\n", cycles / runs);
+}
+
+static void
+print_stats (void)
+{
+  struct cow_stat s;
+
+  if (kstats (KSTATS_COW, &s, 1) < 0)
+    return;
+  printf ("forks %llu (%llu cycles avg), frames shared %llu, copied %llu\n",
+          s.forks, s.forks ? s.fork_cycles / s.forks : 0, s.shared,
+          s.copied);
+  printf ("write faults: %llu copied, %llu reused; %u frames shared now\n",
+          s.fault_copies, s.fault_reuses, s.frames);
+}
+
+int
+main (int argc, char *argv[])
+{
+  int size = HEAP_KIB * 1024, runs = RUNS;
+  char *heap;
+
+  if (argc > 1)
+    size = atoi (argv[1]) * 1024;
+  if (argc > 2)
+    runs = atoi (argv[2]);
+  if (size < PAGE)
+    size = HEAP_KIB * 1024;
+  if (runs < 1)
+    runs = RUNS;
+
+  time_fork ("small", runs);
+
+  heap = malloc (size);
+  if (!heap) {
+    printf ("no memory for a %d KiB heap\n", size / 1024);
+    return 1;
+  }
+  memset (heap, 1, size);
+  time_fork ("large", runs);
+  time_touch (heap, size);
+  time_exec (runs);
+  if (check_cow (heap, size) < 0)
+    return 1;
+
+  print_stats ();
+  printf ("memory = %u\n", meminfo ());
+  printf ("PASS\n");
+  return 0;
+}
+
+/* 
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * mode: C
+ * c-file-style: "gnu"
+ * c-basic-offset: 2
+ * End: 
+ */
+
+/* vi: set et sw=2 sts=2: */
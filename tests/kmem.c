@@ -0,0 +1,150 @@
+/*                    The Quest Operating System
+ *  Copyright (C) 2005-2012  Richard West, Boston University
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Kernel object cache test: churn through tasks, open files and
+ * sockets, which all come from per-CPU object caches, and print the
+ * cache counters before and after.  Nearly every allocation should be
+ * a magazine hit, and in_use should return to where it started.
+ *
+ * usage: kmem [rounds] */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <kstats.h>
+
+#define ROUNDS 100
+#define BATCH 8
+#define MAX_CACHES 16
+
+static const char *churn[] = { "udp_sock", "tcp_sock", "quest_tss",
+  "fd_file", NULL };
+
+static int
+churned (const char *name)
+{
+  int i;
+
+  for (i = 0; churn[i]; i++)
+    if (strcmp (churn[i], name) == 0)
+      return 1;
+  return 0;
+}
+
+/* Print the cache counters into stats and return how many there
+ * are, or -1 if any of them are inconsistent */
+static int
+print_stats (struct kmem_stat *stats)
+{
+  int i, n = kstats (KSTATS_KMEM, stats, MAX_CACHES);
+
+  if (n <= 0) {
+    printf ("no object caches\n");
+    return -1;
+  }
+  printf ("%-10s %6s %6s %6s %6s %10s %10s %10s\n", "cache", "size",
+          "slabs", "objs", "in_use", "allocs", "frees", "hits");
+  for (i = 0; i < n; i++) {
+    printf ("%-10s %6u %6u %6u %6u %10llu %10llu %10llu\n",
+            stats[i].name, stats[i].size, stats[i].slabs, stats[i].objs,
+            stats[i].in_use, stats[i].allocs, stats[i].frees,
+            stats[i].hits);
+    if (stats[i].frees > stats[i].allocs ||
+        stats[i].hits > stats[i].allocs ||
+        stats[i].in_use > stats[i].objs) {
+      printf ("%s: inconsistent counters\n", stats[i].name);
+      return -1;
+    }
+  }
+  return n;
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct kmem_stat before[MAX_CACHES], after[MAX_CACHES];
+  int fds[BATCH], pids[BATCH];
+  int rounds = ROUNDS, r, i, j, n, m, fail = 0;
+  FILE *f;
+
+  if (argc > 1)
+    rounds = atoi (argv[1]);
+  if (rounds < 1)
+    rounds = ROUNDS;
+
+  n = print_stats (before);
+  if (n < 0)
+    return EXIT_FAILURE;
+
+  for (r = 0; r < rounds; r++) {
+    for (i = 0; i < BATCH; i++)
+      fds[i] = socket (AF_INET, (i & 1) ? SOCK_STREAM : SOCK_DGRAM, 0);
+    for (i = 0; i < BATCH; i++)
+      if (fds[i] >= 0)
+        close (fds[i]);
+
+    f = fopen ("/boot/sample.txt", "r");
+    if (f)
+      fclose (f);
+
+    for (i = 0; i < BATCH; i++) {
+      pids[i] = fork ();
+      if (pids[i] == 0)
+        exit (0);
+    }
+    for (i = 0; i < BATCH; i++)
+      if (pids[i] > 0)
+        waitpid (pids[i], NULL, 0);
+  }
+
+  m = print_stats (after);
+  if (m < 0)
+    return EXIT_FAILURE;
+
+  /* The caches churned above must be back where they started.  They
+   * are matched by name, since the churn may have set them up. */
+  for (j = 0; j < m; j++) {
+    unsigned start = 0;
+    if (!churned (after[j].name))
+      continue;
+    for (i = 0; i < n; i++)
+      if (strcmp (before[i].name, after[j].name) == 0)
+        start = before[i].in_use;
+    if (after[j].in_use != start) {
+      printf ("FAIL: %s in_use went from %u to %u\n", after[j].name,
+              start, after[j].in_use);
+      fail = 1;
+    }
+  }
+  if (fail)
+    return EXIT_FAILURE;
+  printf ("PASS\n");
+  return 0;
+}
+
+/* 
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * mode: C
+ * c-file-style: "gnu"
+ * c-basic-offset: 2
+ * End: 
+ */
+
+/* vi: set et sw=2 sts=2: */
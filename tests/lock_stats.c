@@ -0,0 +1,135 @@
+/*                    The Quest Operating System
+ *  Copyright (C) 2005-2012  Richard West, Boston University
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Syscall scaling test: fork one worker per VCPU, hammer syscalls
+ * that now run under different kernel locks, then print throughput
+ * and the per-lock contention counters.  Fails unless every lock was
+ * contended at most as often as it was taken, and the fd lock was
+ * taken at least once per worker lseek.
+ *
+ * usage: lock_stats [workers] */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <vcpu.h>
+#include <kstats.h>
+
+#define MAX_WORKERS 8
+#define ITERATIONS 100000
+#define MAX_LOCKS 8
+
+static void
+worker (void)
+{
+  int i;
+
+  for (i = 0; i < ITERATIONS; i++) {
+    getpid ();                  /* no lock */
+    lseek (0, 0, 0);            /* fd lock */
+    shared_mem_free (shared_mem_alloc ());      /* frame lock */
+  }
+  exit (0);
+}
+
+/* Print the lock counters and return how often the fd lock has been
+ * taken, or -1 if the counters are inconsistent */
+static long long
+print_stats (void)
+{
+  struct lock_stat stats[MAX_LOCKS];
+  int i, n = kstats (KSTATS_LOCK, stats, MAX_LOCKS);
+  long long fd = -1;
+
+  if (n <= 0) {
+    printf ("no lock counters\n");
+    return -1;
+  }
+  printf ("%-8s %12s %12s\n", "lock", "acquired", "contended");
+  for (i = 0; i < n; i++) {
+    printf ("%-8s %12llu %12llu\n", stats[i].name,
+            stats[i].acquired, stats[i].contended);
+    if (stats[i].contended > stats[i].acquired) {
+      printf ("%s: contended more often than acquired\n", stats[i].name);
+      return -1;
+    }
+    if (strcmp (stats[i].name, "fd") == 0)
+      fd = stats[i].acquired;
+  }
+  if (fd < 0)
+    printf ("no fd lock\n");
+  return fd;
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct sched_param sp = { .type = MAIN_VCPU, .C = 20, .T = 100 };
+  struct timeval start, end;
+  int pids[MAX_WORKERS];
+  int workers = 4, i;
+  long long fd_before, fd_after;
+  long usec;
+
+  if (argc > 1)
+    workers = atoi (argv[1]);
+  if (workers < 1 || workers > MAX_WORKERS)
+    workers = 4;
+
+  fd_before = print_stats ();
+  if (fd_before < 0)
+    return EXIT_FAILURE;
+
+  gettimeofday (&start, NULL);
+  for (i = 0; i < workers; i++) {
+    int v = vcpu_create (&sp);
+    pids[i] = vcpu_fork (v < 0 ? BEST_EFFORT_VCPU : v);
+    if (pids[i] == 0)
+      worker ();
+  }
+  for (i = 0; i < workers; i++)
+    waitpid (pids[i], NULL, 0);
+  gettimeofday (&end, NULL);
+
+  usec = (end.tv_sec - start.tv_sec) * 1000000L +
+    (end.tv_usec - start.tv_usec);
+  printf ("%d workers: %d syscalls in %ld usec\n",
+          workers, workers * ITERATIONS * 3, usec);
+
+  fd_after = print_stats ();
+  if (fd_after < 0)
+    return EXIT_FAILURE;
+  if (fd_after - fd_before < (long long) workers * ITERATIONS) {
+    printf ("FAIL: fd lock taken %lld times for %d lseeks\n",
+            fd_after - fd_before, workers * ITERATIONS);
+    return EXIT_FAILURE;
+  }
+  printf ("PASS\n");
+  return 0;
+}
+
+/* 
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * mode: C
+ * c-file-style: "gnu"
+ * c-basic-offset: 2
+ * End: 
+ */
+
+/* vi: set et sw=2 sts=2: */
@@ -0,0 +1,66 @@
+#!/bin/sh
+#                    The Quest Operating System
+#  Copyright (C) 2005-2012  Richard West, Boston University
+#
+#  This program is free software: you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation, either version 3 of the License, or
+#  (at your option) any later version.
+#
+#  This program is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+#
+#  You should have received a copy of the GNU General Public License
+#  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+# Host-side check of the zero-copy receive path: frames of
+# NET_RX_COPYBREAK (256) bytes or more reach lwIP in the driver's own
+# buffer, and replies are built in place.  Ping Quest with payloads on
+# both sides of that size, then send a large UDP datagram to a closed
+# port and expect ICMP port unreachable back.
+#
+# usage: ping_large.sh quest-address [closed-udp-port]
+
+HOST=$1
+PORT=${2:-4999}
+FAIL=0
+
+if [ -z "$HOST" ]; then
+  echo "usage: $0 quest-address [closed-udp-port]"
+  exit 2
+fi
+
+for SIZE in 56 200 256 1000 1472; do
+  if ping -c 3 -W 2 -s $SIZE $HOST > /dev/null 2>&1; then
+    echo "ping $SIZE bytes: ok"
+  else
+    echo "ping $SIZE bytes: FAILED"
+    FAIL=1
+  fi
+done
+
+# A connected UDP socket reports ICMP port unreachable as ECONNREFUSED
+if python3 - "$HOST" "$PORT" <<'PY'
+import socket, sys
+s = socket.socket (socket.AF_INET, socket.SOCK_DGRAM)
+s.settimeout (2)
+s.connect ((sys.argv[1], int (sys.argv[2])))
+s.send (b"x" * 1000)
+try:
+    s.recv (2048)
+except ConnectionRefusedError:
+    sys.exit (0)
+except socket.timeout:
+    pass
+sys.exit (1)
+PY
+then
+  echo "udp 1000 bytes to closed port: unreachable ok"
+else
+  echo "udp 1000 bytes to closed port: FAILED"
+  FAIL=1
+fi
+
+exit $FAIL
@@ -0,0 +1,143 @@
+/*                    The Quest Operating System
+ *  Copyright (C) 2005-2012  Richard West, Boston University
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* poll test: first check that an idle poll sleeps for its timeout,
+ * then serve UDP and TCP echo from one task, waiting in poll rather
+ * than spinning in select.
+ *
+ * usage: poll_echo [port [seconds]] */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define MAX_CLIENTS 8
+
+static char buf[1500];
+
+static long
+elapsed (struct timeval *a, struct timeval *b)
+{
+  return (b->tv_sec - a->tv_sec) * 1000000L + (b->tv_usec - a->tv_usec);
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct pollfd fds[2 + MAX_CLIENTS];
+  struct sockaddr_in addr, from;
+  socklen_t len;
+  struct timeval start, now;
+  int port = 5000, seconds = 30, nfds, i, n, fd, udp, tcp, wakeups = 0;
+
+  if (argc > 1)
+    port = atoi (argv[1]);
+  if (argc > 2)
+    seconds = atoi (argv[2]);
+
+  udp = socket (AF_INET, SOCK_DGRAM, 0);
+  tcp = socket (AF_INET, SOCK_STREAM, 0);
+  if (udp < 0 || tcp < 0) {
+    printf ("socket failed\n");
+    return EXIT_FAILURE;
+  }
+
+  memset (&addr, 0, sizeof (addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = INADDR_ANY;
+  addr.sin_port = htons (port);
+  if (bind (udp, (struct sockaddr *) &addr, sizeof (addr)) < 0 ||
+      bind (tcp, (struct sockaddr *) &addr, sizeof (addr)) < 0 ||
+      listen (tcp, MAX_CLIENTS) < 0) {
+    printf ("bind/listen on port %d failed\n", port);
+    return EXIT_FAILURE;
+  }
+
+  fds[0].fd = udp;
+  fds[0].events = POLLIN;
+  fds[1].fd = tcp;
+  fds[1].events = POLLIN;
+  nfds = 2;
+
+  /* Nothing is connected yet, so this should time out */
+  gettimeofday (&start, NULL);
+  n = poll (fds, nfds, 100);
+  gettimeofday (&now, NULL);
+  printf ("idle poll: %d ready after %ld usec (timeout 100000)\n",
+          n, elapsed (&start, &now));
+
+  printf ("echoing on port %d for %d seconds\n", port, seconds);
+  gettimeofday (&start, NULL);
+  for (;;) {
+    gettimeofday (&now, NULL);
+    if (elapsed (&start, &now) >= seconds * 1000000L)
+      break;
+    if ((n = poll (fds, nfds, 1000)) <= 0)
+      continue;
+    wakeups++;
+
+    if (fds[0].revents & POLLIN) {
+      len = sizeof (from);
+      n = recvfrom (udp, buf, sizeof (buf), 0, (struct sockaddr *) &from, &len);
+      if (n > 0)
+        sendto (udp, buf, n, 0, (struct sockaddr *) &from, len);
+    }
+
+    if ((fds[1].revents & POLLIN) && nfds < 2 + MAX_CLIENTS) {
+      if ((fd = accept (tcp, NULL, NULL)) >= 0) {
+        fds[nfds].fd = fd;
+        fds[nfds].events = POLLIN;
+        nfds++;
+      }
+    }
+
+    for (i = 2; i < nfds; i++) {
+      if (!(fds[i].revents & (POLLIN | POLLHUP)))
+        continue;
+      n = recv (fds[i].fd, buf, sizeof (buf), 0);
+      if (n > 0) {
+        send (fds[i].fd, buf, n, 0);
+        continue;
+      }
+      /* closed by the client */
+      close (fds[i].fd);
+      fds[i--] = fds[--nfds];
+    }
+  }
+
+  printf ("%d poll wake-ups, %d clients still open\n", wakeups, nfds - 2);
+  for (i = 0; i < nfds; i++)
+    close (fds[i].fd);
+  return EXIT_SUCCESS;
+}
+
+/* 
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * mode: C
+ * c-file-style: "gnu"
+ * c-basic-offset: 2
+ * End: 
+ */
+
+/* vi: set et sw=2 sts=2: */
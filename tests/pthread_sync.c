@@ -0,0 +1,128 @@
+/*                    The Quest Operating System
+ *  Copyright (C) 2005-2012  Richard West, Boston University
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Mutex, condition variable and join test: producer threads hand
+ * items to consumer threads through a small bounded buffer.  Each
+ * consumer returns how many items it took, and main checks that the
+ * totals add up once it has joined every thread.
+ *
+ * usage: pthread_sync [items_per_producer] */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#define PRODUCERS 2
+#define CONSUMERS 2
+#define ITEMS 1000
+#define SLOTS 4
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t not_empty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t not_full = PTHREAD_COND_INITIALIZER;
+static int buf[SLOTS], head, count, done_producers;
+static int items = ITEMS;
+
+static void *
+producer (void *arg)
+{
+  int i;
+
+  for (i = 0; i < items; i++) {
+    pthread_mutex_lock (&lock);
+    while (count == SLOTS)
+      pthread_cond_wait (&not_full, &lock);
+    buf[(head + count) % SLOTS] = i;
+    count++;
+    pthread_cond_signal (&not_empty);
+    pthread_mutex_unlock (&lock);
+  }
+
+  pthread_mutex_lock (&lock);
+  done_producers++;
+  pthread_cond_broadcast (&not_empty);
+  pthread_mutex_unlock (&lock);
+  return NULL;
+}
+
+static void *
+consumer (void *arg)
+{
+  int taken = 0;
+
+  pthread_mutex_lock (&lock);
+  for (;;) {
+    while (count == 0 && done_producers < PRODUCERS)
+      pthread_cond_wait (&not_empty, &lock);
+    if (count == 0)
+      break;
+    head = (head + 1) % SLOTS;
+    count--;
+    taken++;
+    pthread_cond_signal (&not_full);
+  }
+  pthread_mutex_unlock (&lock);
+  return (void *) taken;
+}
+
+int
+main (int argc, char *argv[])
+{
+  pthread_t p[PRODUCERS], c[CONSUMERS];
+  void *ret;
+  int i, total = 0;
+
+  if (argc > 1)
+    items = atoi (argv[1]);
+  if (items < 1)
+    items = ITEMS;
+
+  for (i = 0; i < CONSUMERS; i++)
+    if (pthread_create (&c[i], NULL, consumer, NULL)) {
+      printf ("pthread_create failed\n");
+      exit (1);
+    }
+  for (i = 0; i < PRODUCERS; i++)
+    if (pthread_create (&p[i], NULL, producer, NULL)) {
+      printf ("pthread_create failed\n");
+      exit (1);
+    }
+
+  for (i = 0; i < PRODUCERS; i++)
+    pthread_join (p[i], NULL);
+  for (i = 0; i < CONSUMERS; i++) {
+    pthread_join (c[i], &ret);
+    printf ("consumer %d took %d items\n", i, (int) ret);
+    total += (int) ret;
+  }
+
+  printf ("%s: %d of %d items consumed\n",
+          total == PRODUCERS * items ? "PASS" : "FAIL",
+          total, PRODUCERS * items);
+  return 0;
+}
+
+/*
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * mode: C
+ * c-file-style: "gnu"
+ * c-basic-offset: 2
+ * End:
+ */
+
+/* vi: set et sw=2 sts=2: */
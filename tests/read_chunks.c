@@ -0,0 +1,102 @@
+/*                    The Quest Operating System
+ *  Copyright (C) 2005-2012  Richard West, Boston University
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Streaming read test: read a file in small chunks, timing each
+ * quarter, then seek back into the middle and check the bytes match.
+ * With offset-based reads each chunk costs the same, however far
+ * into the file it is.
+ *
+ * usage: read_chunks [file [chunk]] */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#define DEFAULT_CHUNK 4096
+#define MAX_CHUNK 65536
+
+static char buf[MAX_CHUNK], check[MAX_CHUNK];
+
+static long
+elapsed (struct timeval *a, struct timeval *b)
+{
+  return (b->tv_sec - a->tv_sec) * 1000000L + (b->tv_usec - a->tv_usec);
+}
+
+int
+main (int argc, char *argv[])
+{
+  char *path = "/boot/exec";
+  int chunk = DEFAULT_CHUNK, fd, n, mid;
+  long size, total = 0, quarter = 1;
+  struct timeval start, now;
+
+  if (argc > 1)
+    path = argv[1];
+  if (argc > 2)
+    chunk = atoi (argv[2]);
+  if (chunk < 1 || chunk > MAX_CHUNK)
+    chunk = DEFAULT_CHUNK;
+
+  if ((fd = open (path, O_RDONLY)) < 0) {
+    printf ("Failed to open %s\n", path);
+    return EXIT_FAILURE;
+  }
+  size = lseek (fd, 0, SEEK_END);
+  lseek (fd, 0, SEEK_SET);
+  printf ("%s: %ld bytes, %d byte chunks\n", path, size, chunk);
+
+  gettimeofday (&start, NULL);
+  while ((n = read (fd, buf, chunk)) > 0) {
+    total += n;
+    if (total * 4 >= size * quarter) {
+      gettimeofday (&now, NULL);
+      printf ("  %ld bytes after %ld usec\n", total, elapsed (&start, &now));
+      quarter++;
+    }
+  }
+
+  /* Re-read the chunk in the middle and compare */
+  mid = (size / 2 / chunk) * chunk;
+  lseek (fd, mid, SEEK_SET);
+  n = read (fd, buf, chunk);
+  lseek (fd, 0, SEEK_SET);
+  lseek (fd, mid, SEEK_CUR);
+  if (n < 0 || read (fd, check, chunk) != n || memcmp (buf, check, n) != 0) {
+    printf ("mismatch at offset %d\n", mid);
+    return EXIT_FAILURE;
+  }
+
+  close (fd);
+  printf ("read %ld of %ld bytes\n", total, size);
+  return total == size ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+
+/* 
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * mode: C
+ * c-file-style: "gnu"
+ * c-basic-offset: 2
+ * End: 
+ */
+
+/* vi: set et sw=2 sts=2: */
@@ -0,0 +1,140 @@
+/*                    The Quest Operating System
+ *  Copyright (C) 2005-2012  Richard West, Boston University
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Scheduler overhead as the number of VCPUs grows: for each step,
+ * create n main VCPUs with one worker apiece that repeatedly runs
+ * briefly and sleeps, then print how many times the scheduler ran,
+ * its average cost and the average budget overrun (sched_overhead).
+ *
+ * usage: sched_overhead [max_vcpus] */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/time.h>
+#include <vcpu.h>
+#include <kstats.h>
+
+#define MAX_VCPUS 256
+#define RUN_USEC 2000000L
+#define SPIN 10000
+
+static long
+elapsed (struct timeval *start)
+{
+  struct timeval now;
+
+  gettimeofday (&now, NULL);
+  return (now.tv_sec - start->tv_sec) * 1000000L +
+    (now.tv_usec - start->tv_usec);
+}
+
+static void
+worker (void)
+{
+  struct timeval start;
+  volatile int i;
+
+  gettimeofday (&start, NULL);
+  while (elapsed (&start) < RUN_USEC) {
+    for (i = 0; i < SPIN; i++);
+    usleep (1000);
+  }
+  exit (0);
+}
+
+/* Sum the counters of all CPUs into *total */
+static void
+read_stats (struct sched_stat *total)
+{
+  struct sched_stat stats[KSTATS_MAX_CPUS];
+  int i, n = kstats (KSTATS_SCHED, stats, KSTATS_MAX_CPUS);
+
+  total->calls = total->cycles = 0;
+  total->overruns = total->overhead = 0;
+  total->runnable_max = 0;
+  for (i = 0; i < n; i++) {
+    total->calls += stats[i].calls;
+    total->cycles += stats[i].cycles;
+    total->overruns += stats[i].overruns;
+    total->overhead += stats[i].overhead;
+    if (stats[i].runnable_max > total->runnable_max)
+      total->runnable_max = stats[i].runnable_max;
+  }
+}
+
+static void
+run (int n)
+{
+  static int vcpus[MAX_VCPUS], pids[MAX_VCPUS];
+  struct sched_param sp = { .type = MAIN_VCPU, .C = 1, .T = 4 * n };
+  struct sched_stat before, after;
+  unsigned long long calls, overruns;
+  int i, created = 0;
+
+  read_stats (&before);
+  for (i = 0; i < n; i++) {
+    vcpus[i] = vcpu_create (&sp);
+    if (vcpus[i] < 0)
+      break;
+    created++;
+    pids[i] = vcpu_fork (vcpus[i]);
+    if (pids[i] == 0)
+      worker ();
+  }
+  for (i = 0; i < created; i++)
+    waitpid (pids[i], NULL, 0);
+  read_stats (&after);
+
+  calls = after.calls - before.calls;
+  overruns = after.overruns - before.overruns;
+  printf ("%5d %10llu %12llu %10llu %12llu %6u\n", created, calls,
+          calls ? (after.cycles - before.cycles) / calls : 0,
+          overruns,
+          overruns ? (after.overhead - before.overhead) / overruns : 0,
+          after.runnable_max);
+
+  for (i = 0; i < created; i++)
+    vcpu_destroy (vcpus[i], 0);
+}
+
+int
+main (int argc, char *argv[])
+{
+  int max = MAX_VCPUS, n;
+
+  if (argc > 1)
+    max = atoi (argv[1]);
+  if (max < 4 || max > MAX_VCPUS)
+    max = MAX_VCPUS;
+
+  printf ("%5s %10s %12s %10s %12s %6s\n", "vcpus", "schedules",
+          "cycles/call", "overruns", "overhead", "maxq");
+  for (n = 4; n <= max; n <<= 1)
+    run (n);
+  return 0;
+}
+
+/* 
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * mode: C
+ * c-file-style: "gnu"
+ * c-basic-offset: 2
+ * End: 
+ */
+
+/* vi: set et sw=2 sts=2: */
@@ -98,32 +98,32 @@ extern unsigned long axis_steps_per_sqr_second[NUM_AXIS];
 extern block_t block_buffer[BLOCK_BUFFER_SIZE];            // A ring buffer for motion instfructions
 extern volatile unsigned char block_buffer_head;           // Index of the next block to be pushed
 extern volatile unsigned char block_buffer_tail;
-extern pthread_spinlock_t block_spinlock;
+extern pthread_mutex_t block_mutex;
 
 // Called when the current block is no longer needed. Discards the block and makes the memory
 // availible for new blocks.    
 static FORCE_INLINE void plan_discard_current_block()  
 {
-  pthread_spin_lock(&block_spinlock);
+  pthread_mutex_lock(&block_mutex);
   if (block_buffer_head != block_buffer_tail) {
     block_buffer_tail = (block_buffer_tail + 1) & (BLOCK_BUFFER_SIZE - 1);  
   }
-  pthread_spin_unlock(&block_spinlock);
+  pthread_mutex_unlock(&block_mutex);
 }
 
 // Gets the current block. Returns NULL if buffer empty
 static FORCE_INLINE block_t *plan_get_current_block() 
 {
-  pthread_spin_lock(&block_spinlock);
+  pthread_mutex_lock(&block_mutex);
   if (block_buffer_head == block_buffer_tail) { 
-    pthread_spin_unlock(&block_spinlock);
+    pthread_mutex_unlock(&block_mutex);
     return(NULL); 
   }
   block_t *block = &block_buffer[block_buffer_tail];
   //once busy is set to true, we can release the lock 
   //coz a busy block won't be modified by the planner
   block->busy = true;
-  pthread_spin_unlock(&block_spinlock);
+  pthread_mutex_unlock(&block_mutex);
 
   //DEBUG_PRINT("STEPPER fetching block %u\n", block_buffer_tail);
   return(block);
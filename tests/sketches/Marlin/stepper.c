@@ -47,7 +47,7 @@ static block_t *current_block;  // A pointer to the block currently being traced
 //#define ENABLE_STEPPER_DRIVER_INTERRUPT()   enable_timer(timerid)
 //#define DISABLE_STEPPER_DRIVER_INTERRUPT()  disable_timer(timerid)
 //static pthread_mutex_t stp_mtx;
-static pthread_spinlock_t count_spinlock;
+static pthread_mutex_t count_mutex;
 
 #if 0
 #define ENABLE_STEPPER_DRIVER_INTERRUPT()         \
@@ -444,7 +444,7 @@ void loop(3, 4, 10)
         counter_z += current_block->steps_z;
         counter_e += current_block->steps_e;
 
-        pthread_spin_lock(&count_spinlock);
+        pthread_mutex_lock(&count_mutex);
         if (counter_x > 0)
           count_position[X_AXIS]+=count_direction[X_AXIS];   
         if (counter_y > 0)
@@ -453,7 +453,7 @@ void loop(3, 4, 10)
           count_position[Z_AXIS]+=count_direction[Z_AXIS];
         if (counter_e > 0) 
           count_position[E_AXIS]+=count_direction[E_AXIS];
-        pthread_spin_unlock(&count_spinlock);
+        pthread_mutex_unlock(&count_mutex);
 
         if (counter_x > 0) {
           WRITE(X_STEP_PIN, !INVERT_X_STEP_PIN);
@@ -666,8 +666,8 @@ void st_init()
   //pthread_mutex_init(&stp_mtx, NULL);
   //pthread_mutex_lock(&stp_mtx);
 
-  //init count_position spinlock
-  pthread_spin_init(&count_spinlock);
+  //init count_position mutex
+  pthread_mutex_init(&count_mutex, NULL);
 
   //timerid = create_timer(handler);
   //if (pthread_create(&stp_thread, NULL, &handler, NULL)) {
@@ -698,32 +698,32 @@ void st_synchronize()
 void st_set_position(const long x, const long y, const long z, const long e)
 {
   //CRITICAL_SECTION_START;
-  pthread_spin_lock(&count_spinlock);
+  pthread_mutex_lock(&count_mutex);
   count_position[X_AXIS] = x;
   count_position[Y_AXIS] = y;
   count_position[Z_AXIS] = z;
   count_position[E_AXIS] = e;
   //CRITICAL_SECTION_END;
-  pthread_spin_unlock(&count_spinlock);
+  pthread_mutex_unlock(&count_mutex);
 }
 
 void st_set_e_position(const long e)
 {
   //CRITICAL_SECTION_START;
-  pthread_spin_lock(&count_spinlock);
+  pthread_mutex_lock(&count_mutex);
   count_position[E_AXIS] = e;
   //CRITICAL_SECTION_END;
-  pthread_spin_unlock(&count_spinlock);
+  pthread_mutex_unlock(&count_mutex);
 }
 
 long st_get_position(uint8_t axis)
 {
   long count_pos;
   //CRITICAL_SECTION_START;
-  pthread_spin_lock(&count_spinlock);
+  pthread_mutex_lock(&count_mutex);
   count_pos = count_position[axis];
   //CRITICAL_SECTION_END;
-  pthread_spin_unlock(&count_spinlock);
+  pthread_mutex_unlock(&count_mutex);
   return count_pos;
 }
 
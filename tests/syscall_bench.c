@@ -0,0 +1,85 @@
+/*                    The Quest Operating System
+ *  Copyright (C) 2005-2012  Richard West, Boston University
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* System call entry test: time getpid () and gettimeofday () and
+ * report the average cost of each in TSC cycles.  getpid () goes
+ * through SYSENTER when the CPU has it, and gettimeofday () reads the
+ * vDSO page without entering the kernel.
+ *
+ * usage: syscall_bench [iterations] */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#define ITERATIONS 100000
+
+static inline unsigned long long
+rdtsc (void)
+{
+  unsigned long long t;
+  asm volatile ("rdtsc":"=A" (t));
+  return t;
+}
+
+int
+main (int argc, char *argv[])
+{
+  int n = ITERATIONS, i;
+  unsigned long long start, pid_cycles, time_cycles;
+  struct timeval tv, prev;
+
+  if (argc > 1)
+    n = atoi (argv[1]);
+  if (n < 1)
+    n = ITERATIONS;
+
+  start = rdtsc ();
+  for (i = 0; i < n; i++)
+    getpid ();
+  pid_cycles = rdtsc () - start;
+
+  gettimeofday (&prev, NULL);
+  start = rdtsc ();
+  for (i = 0; i < n; i++) {
+    gettimeofday (&tv, NULL);
+    if (tv.tv_sec < prev.tv_sec ||
+        (tv.tv_sec == prev.tv_sec && tv.tv_usec < prev.tv_usec))
+      printf ("gettimeofday went backwards: %ld.%06ld -> %ld.%06ld\n",
+              (long) prev.tv_sec, (long) prev.tv_usec,
+              (long) tv.tv_sec, (long) tv.tv_usec);
+    prev = tv;
+  }
+  time_cycles = rdtsc () - start;
+
+  printf ("getpid:       %llu cycles/call\n", pid_cycles / n);
+  printf ("gettimeofday: %llu cycles/call\n", time_cycles / n);
+  printf ("time now:     %ld.%06ld\n", (long) tv.tv_sec, (long) tv.tv_usec);
+  return 0;
+}
+
+/*
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * mode: C
+ * c-file-style: "gnu"
+ * c-basic-offset: 2
+ * End:
+ */
+
+/* vi: set et sw=2 sts=2: */
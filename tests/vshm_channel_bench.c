@@ -0,0 +1,226 @@
+/*                    The Quest Operating System
+ *  Copyright (C) 2005-2012  Richard West, Boston University
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* vshm channel benchmark: round-trip latency, batched throughput and
+ * zero-copy throughput between sandbox 0 and a peer sandbox.
+ *
+ * usage: vshm_channel_bench [peer] [block]
+ *
+ * Run it in sandbox 0 and in the peer, both Quest sandboxes.  With
+ * block set, both sides sleep in the kernel instead of spinning when
+ * a ring is empty or full.
+ *
+ * A Linux sandbox peer would have to play server () below on the
+ * vshm_channel_shared_t layout from vshm.h.  No such program exists
+ * yet: the Linux side of vshm_linux is not in this tree either. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <vshm.h>
+
+#define PING_KEY      4321      /* sandbox 0 -> peer */
+#define PONG_KEY      4322      /* peer -> sandbox 0 */
+#define BULK_KEY      4323      /* sandbox 0 -> peer, zero-copy */
+#define MSG_SLOTS     64
+#define MSG_SIZE      64
+#define BULK_SLOTS    4
+#define BULK_SIZE     4096
+#define ROUND_TRIPS   10000
+#define MESSAGES      100000
+#define BATCH         16
+#define BULK_MESSAGES 10000
+
+struct msg
+{
+  unsigned long long tsc;
+  unsigned int seq;
+  char pad[MSG_SIZE - sizeof (unsigned long long) - sizeof (unsigned int)];
+};
+
+static inline unsigned long long
+rdtsc (void)
+{
+  unsigned long long t;
+  asm volatile ("rdtsc":"=A" (t));
+  return t;
+}
+
+static void
+must_recv (vshm_channel_t * ch, void *item)
+{
+  while (vshm_channel_recv (ch, item) < 0);
+}
+
+static void
+must_send (vshm_channel_t * ch, const void *item)
+{
+  while (vshm_channel_send (ch, item) < 0);
+}
+
+static int
+client (unsigned int peer, unsigned int block)
+{
+  vshm_channel_t ping, pong, bulk;
+  struct msg m[BATCH];
+  unsigned long long start, cycles, worst = 0;
+  char *slot;
+  int i, k, sent;
+
+  if (mk_vshm_channel (&ping, PING_KEY, MSG_SLOTS, MSG_SIZE, 1 << peer,
+                       VSHM_CREATE | VSHM_ALL_ACCESS | block) < 0 ||
+      mk_vshm_channel (&bulk, BULK_KEY, BULK_SLOTS, BULK_SIZE, 1 << peer,
+                       VSHM_CREATE | VSHM_ALL_ACCESS | block) < 0) {
+    printf ("client: cannot create channels\n");
+    return EXIT_FAILURE;
+  }
+  usleep (4000000);
+  if (mk_vshm_channel (&pong, PONG_KEY, MSG_SLOTS, MSG_SIZE, 1 << peer,
+                       VSHM_ALL_ACCESS | block) < 0) {
+    printf ("client: cannot open pong channel\n");
+    return EXIT_FAILURE;
+  }
+
+  /* Latency: one message in flight */
+  memset (m, 0, sizeof (m));
+  for (i = 0; i < ROUND_TRIPS; i++) {
+    m[0].seq = i;
+    m[0].tsc = rdtsc ();
+    must_send (&ping, &m[0]);
+    must_recv (&pong, &m[1]);
+    cycles = rdtsc () - m[1].tsc;
+    if (cycles > worst)
+      worst = cycles;
+    if (m[1].seq != i)
+      printf ("client: expected echo %d, got %u\n", i, m[1].seq);
+  }
+  start = rdtsc ();
+  for (i = 0; i < ROUND_TRIPS; i++) {
+    m[0].seq = i;
+    must_send (&ping, &m[0]);
+    must_recv (&pong, &m[1]);
+  }
+  cycles = rdtsc () - start;
+  printf ("round trip:  %llu cycles avg, %llu worst\n",
+          cycles / ROUND_TRIPS, worst);
+
+  /* Throughput: batches of BATCH, then wait for one acknowledgement */
+  start = rdtsc ();
+  for (sent = 0; sent < MESSAGES; sent += k) {
+    k = MESSAGES - sent < BATCH ? MESSAGES - sent : BATCH;
+    for (i = 0; i < k; i++)
+      m[i].seq = sent + i;
+    k = vshm_channel_send_n (&ping, m, k);
+  }
+  must_recv (&pong, &m[0]);
+  cycles = rdtsc () - start;
+  printf ("batched:     %llu cycles/msg (%d bytes, batch %d)\n",
+          cycles / MESSAGES, MSG_SIZE, BATCH);
+
+  /* Zero-copy: fill each slot in place */
+  start = rdtsc ();
+  for (i = 0; i < BULK_MESSAGES; i++) {
+    while (!(slot = vshm_channel_reserve (&bulk)));
+    memset (slot, i, BULK_SIZE);
+    vshm_channel_commit (&bulk);
+  }
+  must_recv (&pong, &m[0]);
+  cycles = rdtsc () - start;
+  printf ("zero-copy:   %llu cycles/msg (%d bytes)\n",
+          cycles / BULK_MESSAGES, BULK_SIZE);
+  vshm_channel_close (&ping);
+  vshm_channel_close (&pong);
+  vshm_channel_close (&bulk);
+  return EXIT_SUCCESS;
+}
+
+static int
+server (unsigned int block)
+{
+  vshm_channel_t ping, pong, bulk;
+  struct msg m[BATCH];
+  char *slot;
+  int i, n;
+
+  if (mk_vshm_channel (&pong, PONG_KEY, MSG_SLOTS, MSG_SIZE, 1 << 0,
+                       VSHM_CREATE | VSHM_ALL_ACCESS | block) < 0) {
+    printf ("server: cannot create pong channel\n");
+    return EXIT_FAILURE;
+  }
+  usleep (4000000);
+  if (mk_vshm_channel (&ping, PING_KEY, MSG_SLOTS, MSG_SIZE, 1 << 0,
+                       VSHM_ALL_ACCESS | block) < 0 ||
+      mk_vshm_channel (&bulk, BULK_KEY, BULK_SLOTS, BULK_SIZE, 1 << 0,
+                       VSHM_ALL_ACCESS | block) < 0) {
+    printf ("server: cannot open channels\n");
+    return EXIT_FAILURE;
+  }
+
+  for (i = 0; i < 2 * ROUND_TRIPS; i++) {
+    must_recv (&ping, &m[0]);
+    must_send (&pong, &m[0]);
+  }
+
+  for (n = 0; n < MESSAGES; )
+    n += vshm_channel_recv_n (&ping, m, BATCH);
+  must_send (&pong, &m[0]);
+
+  for (i = 0; i < BULK_MESSAGES; i++) {
+    while (!(slot = vshm_channel_peek (&bulk)));
+    if (slot[0] != (char) i || slot[BULK_SIZE - 1] != (char) i)
+      printf ("server: bad bulk message %d\n", i);
+    vshm_channel_release (&bulk);
+  }
+  must_send (&pong, &m[0]);
+  vshm_channel_close (&ping);
+  vshm_channel_close (&pong);
+  vshm_channel_close (&bulk);
+  return EXIT_SUCCESS;
+}
+
+int
+main (int argc, char *argv[])
+{
+  unsigned int sandbox = socket_get_sb_id ();
+  unsigned int peer = 1, block = 0;
+
+  if (argc > 1)
+    peer = atoi (argv[1]);
+  if (argc > 2 && atoi (argv[2]))
+    block = VSHM_CHANNEL_BLOCK;
+
+  printf ("In %s sandbox %u, peer %u%s\n", __FILE__, sandbox, peer,
+          block ? ", blocking" : "");
+  if (peer == 0 || peer >= 32)
+    exit (EXIT_FAILURE);
+  if (sandbox == 0)
+    exit (client (peer, block));
+  else if (sandbox == peer)
+    exit (server (block));
+  exit (EXIT_FAILURE);
+}
+
+/*
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * mode: C
+ * c-file-style: "gnu"
+ * c-basic-offset: 2
+ * End:
+ */
+
+/* vi: set et sw=2 sts=2: */